@@ -7,6 +7,7 @@ const char *examples[] = {
     "first",
     "hello_world",
     "loop",
+    "return_bool",
     "simple",
     "skip_if",
     "sub",
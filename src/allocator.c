@@ -1,8 +1,23 @@
+// Free list i holds blocks of at least 2^i bytes, the smallest block has to fit the link.
+#define ALLOCATOR_MIN_SIZE_CLASS 4
+#define ALLOCATOR_SIZE_CLASS_COUNT 48
+
+typedef struct AllocatorFreeBlock
+{
+    struct AllocatorFreeBlock *next;
+} AllocatorFreeBlock;
+
 typedef struct
 {
     u64 capacity;
     u64 occupied;
     u8 *memory;
+
+    // size of the memory requested from the system at once, 0 is 64 KiB
+    u64 chunk_size;
+
+    // the blocks that reallocate moved away from, reallocate reuses them
+    AllocatorFreeBlock *free_lists[ALLOCATOR_SIZE_CLASS_COUNT];
 } Allocator;
 
 typedef struct
@@ -27,6 +42,53 @@ get_alignment_offset(Allocator *allocator, u64 alignment)
     return alignment_offset;
 }
 
+// dst and src must not overlap.
+static void
+copy_memory(void *dst, void *src, u64 size)
+{
+    u8 *dst8 = (u8 *) dst;
+    u8 *src8 = (u8 *) src;
+
+    if (!(((u64) dst8 | (u64) src8) & 7))
+    {
+        u64 *dst64 = (u64 *) dst8;
+        u64 *src64 = (u64 *) src8;
+
+        for (; size >= 8; size -= 8)
+        {
+            *dst64++ = *src64++;
+        }
+
+        dst8 = (u8 *) dst64;
+        src8 = (u8 *) src64;
+    }
+
+    while (size--) *dst8++ = *src8++;
+}
+
+static void
+clear_memory(void *dst, u64 size)
+{
+    u8 *dst8 = (u8 *) dst;
+
+    while (size && ((u64) dst8 & 7))
+    {
+        *dst8++ = 0;
+        size -= 1;
+    }
+
+    u64 *dst64 = (u64 *) dst8;
+
+    for (; size >= 8; size -= 8)
+    {
+        *dst64++ = 0;
+    }
+
+    dst8 = (u8 *) dst64;
+
+    while (size--) *dst8++ = 0;
+}
+
 #define alloc_type(allocator, type, alignment, clear) (type *) alloc(allocator, sizeof(type), alignment, clear)
 #define alloc_array(allocator, type, count, alignment, clear) (type *) alloc(allocator, (count) * sizeof(type), alignment, clear)
 
@@ -37,7 +99,7 @@ alloc(Allocator *allocator, u64 size, u64 alignment, bool clear)
 
     if ((allocator->occupied + alignment_offset + size) > allocator->capacity)
     {
-        u64 allocate_size = 64 * 1024;
+        u64 allocate_size = allocator->chunk_size ? allocator->chunk_size : 64 * 1024;
         u64 required_size = Align(size + sizeof(AllocatorFooter), 16 * 1024);
 
         if (required_size > allocate_size)
@@ -67,26 +129,103 @@ alloc(Allocator *allocator, u64 size, u64 alignment, bool clear)
 
     if (clear)
     {
-        u8 *dst = (u8 *) result;
-        while (size--) *dst++ = 0;
+        clear_memory(result, size);
     }
 
     return result;
 }
 
+// The largest class whose blocks fit into size bytes.
+static inline s32
+get_size_class_of_block(u64 size)
+{
+    s32 size_class = 0;
+
+    while ((size >> (size_class + 1)) && ((size_class + 1) < ALLOCATOR_SIZE_CLASS_COUNT))
+    {
+        size_class += 1;
+    }
+
+    return size_class;
+}
+
+// The smallest class whose blocks all hold size bytes.
+static inline s32
+get_size_class_of_request(u64 size)
+{
+    s32 size_class = ALLOCATOR_MIN_SIZE_CLASS;
+
+    while (((u64) 1 << size_class) < size)
+    {
+        size_class += 1;
+    }
+
+    return size_class;
+}
+
+// Gives back memory that nobody points to anymore. The most recent allocation just lowers the
+// top of the current chunk, everything else goes to a free list.
+static void
+free_block(Allocator *allocator, void *ptr, u64 size)
+{
+    if (((u8 *) ptr + size) == (allocator->memory + allocator->occupied))
+    {
+        allocator->occupied -= size;
+    }
+    else if (size >= ((u64) 1 << ALLOCATOR_MIN_SIZE_CLASS))
+    {
+        s32 size_class = get_size_class_of_block(size);
+        AllocatorFreeBlock *block = (AllocatorFreeBlock *) ptr;
+
+        block->next = allocator->free_lists[size_class];
+        allocator->free_lists[size_class] = block;
+    }
+}
+
+// Arrays grow in place if they are the most recent allocation, otherwise they move to a block
+// from the free lists or to a new one and leave the old one behind for the next array.
 static void *
 reallocate(Allocator *allocator, void *old_ptr, u64 old_size, u64 new_size, u64 alignment, bool clear)
 {
-    void *result = alloc(allocator, new_size, alignment, clear);
+    if (!old_ptr)
+    {
+        old_size = 0;
+    }
+
+    void *result = 0;
 
-    if (old_ptr)
+    if (old_ptr && (new_size >= old_size) &&
+        (((u8 *) old_ptr + old_size) == (allocator->memory + allocator->occupied)) &&
+        (((u8 *) old_ptr + new_size) <= (allocator->memory + allocator->capacity)))
+    {
+        allocator->occupied += new_size - old_size;
+        result = old_ptr;
+    }
+    else
     {
-        u64 size = old_size;
+        s32 size_class = get_size_class_of_request(new_size);
+        AllocatorFreeBlock *block = (size_class < ALLOCATOR_SIZE_CLASS_COUNT) ? allocator->free_lists[size_class] : 0;
 
-        u8 *dst = (u8 *) result;
-        u8 *src = (u8 *) old_ptr;
+        if (block && !((u64) block & (alignment - 1)))
+        {
+            allocator->free_lists[size_class] = block->next;
+            result = block;
+        }
+        else
+        {
+            result = alloc(allocator, new_size, alignment, false);
+        }
 
-        while (size--) *dst++ = *src++;
+        if (old_ptr)
+        {
+            copy_memory(result, old_ptr, (old_size < new_size) ? old_size : new_size);
+            free_block(allocator, old_ptr, old_size);
+        }
+    }
+
+    if (clear && (new_size > old_size))
+    {
+        clear_memory((u8 *) result + old_size, new_size - old_size);
     }
 
     return result;
@@ -108,4 +247,9 @@ free_all(Allocator *allocator)
 
         deallocate(memory, size);
     }
+
+    for (s32 i = 0; i < ALLOCATOR_SIZE_CLASS_COUNT; i += 1)
+    {
+        allocator->free_lists[i] = 0;
+    }
 }
@@ -34,6 +34,20 @@ typedef enum
     ARM64_SP  = 31,
 } Arm64Register;
 
+typedef enum
+{
+    ARM64_CONDITION_EQ = 0x0,
+    ARM64_CONDITION_NE = 0x1,
+    ARM64_CONDITION_HS = 0x2,
+    ARM64_CONDITION_LO = 0x3,
+    ARM64_CONDITION_HI = 0x8,
+    ARM64_CONDITION_LS = 0x9,
+    ARM64_CONDITION_GE = 0xA,
+    ARM64_CONDITION_LT = 0xB,
+    ARM64_CONDITION_GT = 0xC,
+    ARM64_CONDITION_LE = 0xD,
+} Arm64Condition;
+
 static inline void
 arm64_svc(StringBuilder *builder, u16 arg)
 {
@@ -41,10 +55,11 @@ arm64_svc(StringBuilder *builder, u16 arg)
     string_builder_append_u32le(builder, inst);
 }
 
+// BL, or B without the link
 static inline void
-arm64_bl(StringBuilder *builder, s32 offset)
+arm64_bl(StringBuilder *builder, s32 offset, bool link)
 {
-    u32 inst = 0x94000000 | ((u32) offset & 0x3FFFFFF);
+    u32 inst = (link ? 0x94000000 : 0x14000000) | ((u32) offset & 0x3FFFFFF);
     string_builder_append_u32le(builder, inst);
 }
 
@@ -117,161 +132,116 @@ arm64_subtract_immediate12(StringBuilder *builder, Arm64Register dst_reg, Arm64R
 }
 
 static inline void
-arm64_add_registers(StringBuilder *builder, Arm64Register dst_reg, Arm64Register src_reg, u64 size)
+arm64_move_registers(StringBuilder *builder, Arm64Register dst_reg, Arm64Register src_reg)
 {
-    switch (size)
-    {
-        case 1:
-        {
-            u32 inst;
-
-            if (false /* is_signed */)
-            {
-                // ADD (extended register)
-                inst = 0x0B208000 | ((u32) src_reg << 16) | ((u32) dst_reg << 5) | dst_reg;
-            }
-            else
-            {
-                // ADD (extended register)
-                inst = 0x0B200000 | ((u32) src_reg << 16) | ((u32) dst_reg << 5) | dst_reg;
-            }
-
-            string_builder_append_u32le(builder, inst);
-        } break;
-
-        case 2:
-        {
-            u32 inst;
-
-            if (false /* is_signed */)
-            {
-                // ADD (extended register)
-                inst = 0x0B208000 | ((u32) src_reg << 16) | (0x1 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
-            else
-            {
-                // ADD (extended register)
-                inst = 0x0B200000 | ((u32) src_reg << 16) | (0x1 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
+    // MOV (register) / ORR (shifted register)
+    u32 inst = 0xAA0003E0 | ((u32) src_reg << 16) | dst_reg;
+    string_builder_append_u32le(builder, inst);
+}
 
-            string_builder_append_u32le(builder, inst);
-        } break;
+static void
+arm64_move_immediate(StringBuilder *builder, Arm64Register reg, u64 value)
+{
+    if (value <= 0xFFFF)
+    {
+        arm64_move_immediate16(builder, reg, (u16) value);
+    }
+    else if (~value <= 0xFFFF)
+    {
+        arm64_move_inverted_immediate16(builder, reg, (u16) ~value);
+    }
+    else
+    {
+        arm64_move_immediate16(builder, reg, (u16) value);
 
-        case 4:
+        for (u8 shift = 1; shift < 4; shift += 1)
         {
-            u32 inst;
+            u16 part = (u16) (value >> (16 * shift));
 
-            if (false /* is_signed */)
-            {
-                // ADD (extended register)
-                inst = 0x0B208000 | ((u32) src_reg << 16) | (0x2 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
-            else
+            if (part)
             {
-                // ADD (extended register)
-                inst = 0x0B200000 | ((u32) src_reg << 16) | (0x2 << 13) | ((u32) dst_reg << 5) | dst_reg;
+                arm64_move_keep_immediate16(builder, reg, part, shift);
             }
+        }
+    }
+}
 
-            string_builder_append_u32le(builder, inst);
-        } break;
-
-        case 8:
-        {
-            u32 inst;
-
-            if (false /* is_signed */)
-            {
-                // ADD (extended register)
-                inst = 0x8B208000 | ((u32) src_reg << 16) | (0x3 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
-            else
-            {
-                // ADD (extended register)
-                inst = 0x8B200000 | ((u32) src_reg << 16) | (0x3 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
+static inline void
+arm64_add_registers(StringBuilder *builder, Arm64Register dst_reg, Arm64Register a_reg, Arm64Register b_reg)
+{
+    // ADD (shifted register)
+    u32 inst = 0x8B000000 | ((u32) b_reg << 16) | ((u32) a_reg << 5) | dst_reg;
+    string_builder_append_u32le(builder, inst);
+}
 
-            string_builder_append_u32le(builder, inst);
-        } break;
-    }
+static inline void
+arm64_subtract_registers(StringBuilder *builder, Arm64Register dst_reg, Arm64Register a_reg, Arm64Register b_reg)
+{
+    // SUB (shifted register)
+    u32 inst = 0xCB000000 | ((u32) b_reg << 16) | ((u32) a_reg << 5) | dst_reg;
+    string_builder_append_u32le(builder, inst);
 }
 
+// Sign or zero extends the lower size bytes of src_reg into dst_reg.
 static inline void
-arm64_subtract_registers(StringBuilder *builder, Arm64Register dst_reg, Arm64Register src_reg, u64 size)
+arm64_extend_register(StringBuilder *builder, Arm64Register dst_reg, Arm64Register src_reg, u64 size, bool is_signed)
 {
+    u32 inst;
+
     switch (size)
     {
-        case 1:
-        {
-            u32 inst;
-
-            if (false /* is_signed */)
-            {
-                // SUB (extended register)
-                inst = 0x4B208000 | ((u32) src_reg << 16) | ((u32) dst_reg << 5) | dst_reg;
-            }
-            else
-            {
-                // SUB (extended register)
-                inst = 0x4B200000 | ((u32) src_reg << 16) | ((u32) dst_reg << 5) | dst_reg;
-            }
-
-            string_builder_append_u32le(builder, inst);
-        } break;
+        case 1: inst = is_signed ? 0x93401C00 : 0x53001C00; break; // SXTB / UXTB
+        case 2: inst = is_signed ? 0x93403C00 : 0x53003C00; break; // SXTH / UXTH
+        case 4: inst = is_signed ? 0x93407C00 : 0x53007C00; break; // SXTW / UBFM (32 bit mov)
 
-        case 2:
+        default:
         {
-            u32 inst;
-
-            if (false /* is_signed */)
+            if (dst_reg != src_reg)
             {
-                // SUB (extended register)
-                inst = 0x4B208000 | ((u32) src_reg << 16) | (0x1 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
-            else
-            {
-                // SUB (extended register)
-                inst = 0x4B200000 | ((u32) src_reg << 16) | (0x1 << 13) | ((u32) dst_reg << 5) | dst_reg;
+                arm64_move_registers(builder, dst_reg, src_reg);
             }
 
-            string_builder_append_u32le(builder, inst);
+            return;
         } break;
+    }
 
-        case 4:
-        {
-            u32 inst;
+    inst |= ((u32) src_reg << 5) | dst_reg;
+    string_builder_append_u32le(builder, inst);
+}
 
-            if (false /* is_signed */)
-            {
-                // SUB (extended register)
-                inst = 0x44208000 | ((u32) src_reg << 16) | (0x2 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
-            else
-            {
-                // SUB (extended register)
-                inst = 0x4B200000 | ((u32) src_reg << 16) | (0x2 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
+// Compares the lower size bytes, a_reg and b_reg have to be extended already if size is less than 4.
+static inline void
+arm64_compare_registers(StringBuilder *builder, Arm64Register a_reg, Arm64Register b_reg, u64 size)
+{
+    // CMP (shifted register) / SUBS
+    u32 inst = ((size == 8) ? 0xEB00001F : 0x6B00001F) | ((u32) b_reg << 16) | ((u32) a_reg << 5);
+    string_builder_append_u32le(builder, inst);
+}
 
-            string_builder_append_u32le(builder, inst);
-        } break;
+static inline void
+arm64_compare_immediate12(StringBuilder *builder, Arm64Register reg, u16 value, u64 size)
+{
+    assert(value <= 0xFFF);
 
-        case 8:
-        {
-            u32 inst;
+    // CMP (immediate) / SUBS
+    u32 inst = ((size == 8) ? 0xF100001F : 0x7100001F) | ((u32) value << 10) | ((u32) reg << 5);
+    string_builder_append_u32le(builder, inst);
+}
 
-            if (false /* is_signed */)
-            {
-                // SUB (extended register)
-                inst = 0xCB208000 | ((u32) src_reg << 16) | (0x3 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
-            else
-            {
-                // SUB (extended register)
-                inst = 0xCB200000 | ((u32) src_reg << 16) | (0x3 << 13) | ((u32) dst_reg << 5) | dst_reg;
-            }
+static inline void
+arm64_set_if(StringBuilder *builder, Arm64Register dst_reg, Arm64Condition condition)
+{
+    // CSET / CSINC with the inverted condition
+    u32 inst = 0x9A9F07E0 | ((u32) (condition ^ 1) << 12) | dst_reg;
+    string_builder_append_u32le(builder, inst);
+}
 
-            string_builder_append_u32le(builder, inst);
-        } break;
-    }
+static inline void
+arm64_test_byte_register(StringBuilder *builder, Arm64Register reg)
+{
+    // TST (immediate) / ANDS with 0xFF
+    u32 inst = 0x72001C1F | ((u32) reg << 5);
+    string_builder_append_u32le(builder, inst);
 }
 
 static inline void
@@ -360,980 +330,863 @@ arm64_copy_from_register_to_stack(StringBuilder *builder, u64 dst_stack_offset,
     }
 }
 
-static inline void
-arm64_copy_from_stack_to_stack(StringBuilder *builder, u64 dst_stack_offset, u64 src_stack_offset, u64 size)
-{
-    assert(!(dst_stack_offset & 7));
-    assert(!(src_stack_offset & 7));
-
-    assert(dst_stack_offset <= 0x7FFF);
-    assert(src_stack_offset <= 0x7FFF);
-
-    switch (size)
-    {
-        case 1:
-        {
-            // LDRB (immediate)
-            u32 inst = 0x39400000 | (((u32) src_stack_offset & 0xFFF) << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
-
-            // STRB (immediate)
-            inst = 0x39000000 | (((u32) dst_stack_offset & 0xFFF) << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
-        } break;
-
-        case 2:
-        {
-            // LDRH (immediate)
-            u32 inst = 0x79400000 | (((u32) (src_stack_offset >> 1) & 0xFFF) << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
-
-            // STRH (immediate)
-            inst = 0x79000000 | (((u32) (dst_stack_offset >> 1) & 0xFFF) << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
-        } break;
 
-        case 4:
-        {
-            // LDR (immediate)
-            u32 inst = 0xB9400000 | (((u32) (src_stack_offset >> 2) & 0xFFF) << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
+// x16 and x17 are never allocated, they are the scratch registers for values that live
+// on the stack and for immediates. x8 holds the syscall number on linux, x18 is reserved
+// by the platform and x29 is the frame pointer.
+static const Arm64Register arm64_caller_saved_registers[] =
+{
+    ARM64_R0, ARM64_R1, ARM64_R2, ARM64_R3, ARM64_R4, ARM64_R5, ARM64_R6, ARM64_R7,
+    ARM64_R9, ARM64_R10, ARM64_R11, ARM64_R12, ARM64_R13, ARM64_R14, ARM64_R15,
+};
 
-            // STR (immediate)
-            inst = 0xB9000000 | (((u32) (dst_stack_offset >> 2) & 0xFFF) << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
-        } break;
+static const Arm64Register arm64_callee_saved_registers[] =
+{
+    ARM64_R19, ARM64_R20, ARM64_R21, ARM64_R22, ARM64_R23, ARM64_R24, ARM64_R25, ARM64_R26, ARM64_R27, ARM64_R28,
+};
 
-        case 8:
-        {
-            // LDR (immediate)
-            u32 inst = 0xF9400000 | (((u32) (src_stack_offset >> 3) & 0xFFF) << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
+// Arguments of calls between juls functions, the result is returned in x0 (and x1).
+static const Arm64Register arm64_argument_registers[] =
+{
+    ARM64_R0, ARM64_R1, ARM64_R2, ARM64_R3, ARM64_R4, ARM64_R5, ARM64_R6, ARM64_R7,
+};
 
-            // STR (immediate)
-            inst = 0xF9000000 | (((u32) (dst_stack_offset >> 3) & 0xFFF) << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
-        } break;
+static const Arm64Register arm64_return_registers[] =
+{
+    ARM64_R0, ARM64_R1,
+};
 
-        case 16:
+static void
+arm64_encode_machine_instruction(StringBuilder *builder, MachineInstruction *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case MACHINE_NOP:
         {
-            assert(dst_stack_offset <= 0x3FF);
-            assert(src_stack_offset <= 0x3FF);
-
-            // LDP
-            u32 inst = 0xA9400000 | (((u32) (src_stack_offset >> 3) & 0x7F) << 15) | ((u32) ARM64_R1 << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
-
-            // STP
-            inst = 0xA9000000 | (((u32) (dst_stack_offset >> 3) & 0x7F) << 15) | ((u32) ARM64_R1 << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(builder, inst);
         } break;
 
-        default:
+        case MACHINE_MOVE:
         {
-            assert(!"not implemented");
+            arm64_move_registers(builder, (Arm64Register) instruction->dst, (Arm64Register) instruction->src);
         } break;
-    }
-}
 
-static inline void
-arm64_compare_registers(StringBuilder *builder, Arm64Register a_reg, Arm64Register b_reg, u64 size)
-{
-    switch (size)
-    {
-        case 1:
+        case MACHINE_MOVE_IMMEDIATE:
+        case MACHINE_ZERO:
         {
-            u32 inst;
-
-            if (false /* is_signed */)
-            {
-                // SUBS/CMP (extended register)
-                inst = 0x6B208000 | ((u32) b_reg << 16) | ((u32) a_reg << 5) | a_reg;
-            }
-            else
-            {
-                // SUBS/CMP (extended register)
-                inst = 0x6B200000 | ((u32) b_reg << 16) | ((u32) a_reg << 5) | a_reg;
-            }
-
-            string_builder_append_u32le(builder, inst);
+            arm64_move_immediate(builder, (Arm64Register) instruction->dst, (u64) instruction->immediate);
         } break;
 
-        case 2:
+        case MACHINE_LOAD:
         {
-            u32 inst;
-
-            if (false /* is_signed */)
-            {
-                // SUBS/CMP (extended register)
-                inst = 0x6B208000 | ((u32) b_reg << 16) | (0x1 << 13) | ((u32) a_reg << 5) | a_reg;
-            }
-            else
-            {
-                // SUBS/CMP (extended register)
-                inst = 0x6B200000 | ((u32) b_reg << 16) | (0x1 << 13) | ((u32) a_reg << 5) | a_reg;
-            }
-
-            string_builder_append_u32le(builder, inst);
+            arm64_copy_from_stack_to_register(builder, (Arm64Register) instruction->dst, (u64) instruction->offset, instruction->size);
         } break;
 
-        case 4:
+        case MACHINE_STORE:
         {
-            u32 inst;
-
-            if (false /* is_signed */)
-            {
-                // SUBS/CMP (extended register)
-                inst = 0x64208000 | ((u32) b_reg << 16) | (0x2 << 13) | ((u32) a_reg << 5) | a_reg;
-            }
-            else
-            {
-                // SUBS/CMP (extended register)
-                inst = 0x6B200000 | ((u32) b_reg << 16) | (0x2 << 13) | ((u32) a_reg << 5) | a_reg;
-            }
-
-            string_builder_append_u32le(builder, inst);
+            arm64_copy_from_register_to_stack(builder, (u64) instruction->offset, (Arm64Register) instruction->src, instruction->size);
         } break;
 
-        case 8:
+        case MACHINE_ADJUST_STACK:
         {
-            u32 inst;
-
-            if (false /* is_signed */)
+            if (instruction->immediate > 0)
             {
-                // SUBS/CMP (extended register)
-                inst = 0xEB208000 | ((u32) b_reg << 16) | (0x3 << 13) | ((u32) a_reg << 5) | a_reg;
+                arm64_add_immediate12(builder, ARM64_SP, ARM64_SP, (u16) instruction->immediate);
             }
             else
             {
-                // SUBS/CMP (extended register)
-                inst = 0xEB200000 | ((u32) b_reg << 16) | (0x3 << 13) | ((u32) a_reg << 5) | a_reg;
+                arm64_subtract_immediate12(builder, ARM64_SP, ARM64_SP, (u16) -instruction->immediate);
             }
-
-            string_builder_append_u32le(builder, inst);
         } break;
     }
 }
 
+// A zero immediate is a single MOVZ already, so there is no rule for it.
+static PeepholeRule arm64_peephole_rules[] =
+{
+    { .name = "remove self move",           .apply = peephole_remove_self_move },
+    { .name = "forward store to load",      .apply = peephole_forward_store },
+    { .name = "remove dead store",          .apply = peephole_remove_dead_store },
+    { .name = "merge stack adjustments",    .apply = peephole_merge_stack_adjustments },
+};
+
 static inline void
-arm64_commit_stack(Codegen *codegen, StringBuilder *builder)
+arm64_buffer_instruction(Codegen *codegen, MachineInstruction instruction)
 {
-    if (codegen->stack_allocated < codegen->stack_committed)
+    if (!codegen->buffered_instructions.count)
     {
-        s64 size = codegen->stack_committed - codegen->stack_allocated;
-        assert(size <= 0xFFFF);
-        arm64_add_immediate12(&codegen->section_text, ARM64_SP, ARM64_SP, (u16) size);
-        codegen->stack_committed = codegen->stack_allocated;
-    }
-    else if (codegen->stack_allocated > codegen->stack_committed)
-    {
-        s64 size = codegen->stack_allocated - codegen->stack_committed;
-        assert(size <= 0xFFFF);
-        arm64_subtract_immediate12(&codegen->section_text, ARM64_SP, ARM64_SP, (u16) size);
-        codegen->stack_committed = codegen->stack_allocated;
+        codegen->buffered_text_size = string_builder_get_size(&codegen->section_text);
     }
+
+    array_append(&codegen->buffered_instructions, instruction);
 }
 
+// Has to be called before anything gets written to section_text directly.
 static void
-arm64_emit_cast(Compiler *compiler, Codegen *codegen, DatatypeId from_type_id, DatatypeId to_type_id)
+arm64_flush(Codegen *codegen)
 {
-    if (from_type_id == to_type_id)
+    MachineInstructionArray *instructions = &codegen->buffered_instructions;
+
+    if (!instructions->count)
     {
         return;
     }
 
-    Datatype *from_type = get_datatype(&compiler->datatypes, from_type_id);
-    Datatype *to_type   = get_datatype(&compiler->datatypes, to_type_id);
+    assert(string_builder_get_size(&codegen->section_text) == codegen->buffered_text_size);
 
-    u64 from_type_stack_size = Align(from_type->size, 16);
-    u64 to_type_stack_size = Align(to_type->size, 16);
+    peephole_optimize(instructions, arm64_peephole_rules, ArrayCount(arm64_peephole_rules));
 
-    if ((from_type->kind == DATATYPE_INTEGER) && (to_type->kind == DATATYPE_INTEGER))
+    for (s32 i = 0; i < instructions->count; i += 1)
     {
-        if (from_type->size > to_type->size)
-        {
-            if (from_type_stack_size != to_type_stack_size)
-            {
-                s64 from_type_stack_offset = codegen->stack_allocated;
+        arm64_encode_machine_instruction(&codegen->section_text, instructions->items + i);
+    }
+
+    instructions->count = 0;
+}
 
-                arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed - from_type_stack_offset, from_type->size);
+static inline void
+arm64_buffer_move(Codegen *codegen, Arm64Register dst_reg, Arm64Register src_reg)
+{
+    arm64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_MOVE, .dst = dst_reg, .src = src_reg });
+}
 
-                pop_stack(codegen, from_type_stack_size);
-                s64 to_type_stack_offset = push_stack(codegen, to_type_stack_size);
-                arm64_commit_stack(codegen, &codegen->section_text);
+static inline void
+arm64_buffer_move_immediate(Codegen *codegen, Arm64Register dst_reg, u64 value)
+{
+    arm64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_MOVE_IMMEDIATE, .dst = dst_reg, .immediate = (s64) value });
+}
 
-                arm64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - to_type_stack_offset, ARM64_R0, to_type->size);
-            }
-        }
-        else if (from_type->size < to_type->size)
-        {
-            assert(!"not implemented");
-        }
-    }
-    else
-    {
-        assert(!"not implemented");
-    }
+static inline void
+arm64_buffer_load(Codegen *codegen, Arm64Register dst_reg, s64 stack_offset)
+{
+    arm64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_LOAD, .dst = dst_reg, .offset = stack_offset, .size = 8 });
+}
+
+static inline void
+arm64_buffer_store(Codegen *codegen, s64 stack_offset, Arm64Register src_reg)
+{
+    arm64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_STORE, .src = src_reg, .offset = stack_offset, .size = 8 });
+}
+
+static inline void
+arm64_buffer_adjust_stack(Codegen *codegen, s64 value)
+{
+    assert((value >= -0xFFF) && (value <= 0xFFF));
+    arm64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_ADJUST_STACK, .immediate = value });
 }
 
+// Moves src_regs[i] into dst_regs[i] for all i, as if all moves happened at the same time.
 static void
-arm64_emit_expression(Compiler *compiler, Codegen *codegen, Ast *expr, JulsPlatform target_platform)
+arm64_parallel_move(Codegen *codegen, const Arm64Register *dst_regs, const Arm64Register *src_regs, s32 count)
 {
-    switch (expr->kind)
-    {
-        case AST_KIND_LITERAL_BOOLEAN:
-        {
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+    Arm64Register sources[16];
+    bool done[16];
 
-            u64 stack_size = Align(datatype->size, 16);
+    assert(count <= ArrayCount(sources));
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+    s32 remaining = 0;
 
-            arm64_move_immediate16(&codegen->section_text, ARM64_R0, expr->_bool ? 1 : 0);
-            arm64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, ARM64_R0, datatype->size);
-        } break;
+    for (s32 i = 0; i < count; i += 1)
+    {
+        sources[i] = src_regs[i];
+        done[i] = (dst_regs[i] == src_regs[i]);
 
-        case AST_KIND_LITERAL_INTEGER:
+        if (!done[i])
         {
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+            remaining += 1;
+        }
+    }
 
-            u64 value = expr->_u64;
+    while (remaining > 0)
+    {
+        bool progress = false;
 
-            u16 val0 = (u16) (value >>  0);
-            u16 val1 = (u16) (value >> 16);
-            u16 val2 = (u16) (value >> 32);
-            u16 val3 = (u16) (value >> 48);
-
-            if (value >= 0xFFFF000000000000)
-            {
-                arm64_move_inverted_immediate16(&codegen->section_text, ARM64_R0, ~val0);
+        for (s32 i = 0; i < count; i += 1)
+        {
+            if (done[i]) continue;
 
-                if (val1 != 0xFFFF)
-                {
-                    arm64_move_keep_immediate16(&codegen->section_text, ARM64_R0, val1, 1);
-                }
+            bool blocked = false;
 
-                if (val2 != 0xFFFF)
+            for (s32 j = 0; j < count; j += 1)
+            {
+                if (!done[j] && (j != i) && (sources[j] == dst_regs[i]))
                 {
-                    arm64_move_keep_immediate16(&codegen->section_text, ARM64_R0, val2, 2);
+                    blocked = true;
+                    break;
                 }
+            }
 
-                if (val3 != 0xFFFF)
-                {
-                    arm64_move_keep_immediate16(&codegen->section_text, ARM64_R0, val3, 3);
-                }
+            if (!blocked)
+            {
+                arm64_buffer_move(codegen, dst_regs[i], sources[i]);
+                done[i] = true;
+                remaining -= 1;
+                progress = true;
             }
-            else
+        }
+
+        if (!progress)
+        {
+            // only cycles are left, save one destination to x16 to break the cycle
+            for (s32 i = 0; i < count; i += 1)
             {
-                arm64_move_immediate16(&codegen->section_text, ARM64_R0, val0);
+                if (done[i]) continue;
 
-                if (val1 != 0)
-                {
-                    arm64_move_keep_immediate16(&codegen->section_text, ARM64_R0, val1, 1);
-                }
+                arm64_buffer_move(codegen, ARM64_R16, dst_regs[i]);
 
-                if (val2 != 0)
+                for (s32 j = 0; j < count; j += 1)
                 {
-                    arm64_move_keep_immediate16(&codegen->section_text, ARM64_R0, val2, 2);
+                    if (!done[j] && (sources[j] == dst_regs[i]))
+                    {
+                        sources[j] = ARM64_R16;
+                    }
                 }
 
-                if (val3 != 0)
-                {
-                    arm64_move_keep_immediate16(&codegen->section_text, ARM64_R0, val3, 3);
-                }
+                break;
             }
+        }
+    }
+}
 
-            u64 stack_size = Align(datatype->size, 16);
+// Emits a call or, for tail calls, a jump to a function. Calls to functions that are not emitted
+// yet get the whole instruction written at the end, it might not be in memory anymore.
+static inline void
+arm64_call(Codegen *codegen, Ast *function_decl, bool is_jump)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+    arm64_flush(codegen);
 
-            arm64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, ARM64_R0, datatype->size);
-        } break;
+    if (ast_get_function(function_decl)->address == S64MAX)
+    {
+        u64 instruction_offset = string_builder_get_size(builder);
 
-        case AST_KIND_LITERAL_STRING:
-        {
-            u64 string_offset = string_builder_get_size(&codegen->section_cstring);
-            string_builder_append_string(&codegen->section_cstring, expr->name);
+        string_builder_append_u32le(builder, is_jump ? 0x14000000 : 0x94000000);
 
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+        array_append(&codegen->function_call_patches,
+                     ((FunctionCallPatch) { .patch_offset = instruction_offset,
+                                            .instruction_offset = instruction_offset,
+                                            .function_decl = function_decl,
+                                            .is_jump = is_jump }));
+    }
+    else
+    {
+        s64 jump_offset = string_builder_get_size(builder);
+        arm64_bl(builder, (s32) ((ast_get_function(function_decl)->address - jump_offset) >> 2), !is_jump);
+    }
+}
 
-            u64 stack_size = Align(datatype->size, 16);
+static inline u32
+arm64_encode_branch(u32 inst, s64 offset)
+{
+    assert(!(offset & 3));
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+    if ((inst & 0xFC000000) == 0x14000000)
+    {
+        // B
+        return inst | ((u32) (offset >> 2) & 0x3FFFFFF);
+    }
+    else
+    {
+        // B.cond, CBZ and CBNZ
+        return inst | (((u32) (offset >> 2) & 0x7FFFF) << 5);
+    }
+}
 
-            // TODO: STP takes an imm7, a 7-bit signed immediate offset
-            // if the distance between stack_allocated and stack_commited is too big,
-            // we have to commit the stack
+// Emits a branch (b, b.cond, cbz or cbnz without the offset) to a label of the current function.
+// Labels behind us are resolved right away, the others get patched at the end of the function.
+static void
+arm64_branch_to_label(Codegen *codegen, u32 inst, s32 label)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            arm64_move_immediate16(&codegen->section_text, ARM64_R0, expr->name.count);
+    arm64_flush(codegen);
 
-            u64 instruction_offset = string_builder_get_size(&codegen->section_text);
-            void *patch_addr = string_builder_append_size(&codegen->section_text, 8);
+    s64 label_offset = codegen->label_offsets.items[label];
+    u64 instruction_offset = string_builder_get_size(builder);
 
-            s64 dst_stack_offset = codegen->stack_committed - expr->stack_offset;
+    if (label_offset >= 0)
+    {
+        string_builder_append_u32le(builder, arm64_encode_branch(inst, label_offset - (s64) instruction_offset));
+    }
+    else
+    {
+        string_builder_append_u32le(builder, inst);
 
-            assert(!(dst_stack_offset & 7));
+        array_append(&codegen->label_patches, ((LabelPatch) { .patch_offset = instruction_offset,
+                                                              .instruction_offset = instruction_offset,
+                                                              .label = label }));
+    }
+}
 
-            // STP
-            u32 inst = 0xA9000000 | (((u32) (dst_stack_offset >> 3) & 0x7F) << 15) | ((u32) ARM64_R1 << 10) | ((u32) ARM64_SP << 5) | ARM64_R0;
-            string_builder_append_u32le(&codegen->section_text, inst);
+static Arm64Condition
+arm64_get_condition(IrCondition condition, bool is_signed)
+{
+    Arm64Condition result = ARM64_CONDITION_EQ;
 
-            array_append(&codegen->patches, ((Patch) { .patch = patch_addr,
-                                                       .instruction_offset = instruction_offset,
-                                                       .string_offset = string_offset }));
-        } break;
+    switch (condition)
+    {
+        case IR_CONDITION_EQUAL:         result = ARM64_CONDITION_EQ;                                  break;
+        case IR_CONDITION_NOT_EQUAL:     result = ARM64_CONDITION_NE;                                  break;
+        case IR_CONDITION_LESS:          result = is_signed ? ARM64_CONDITION_LT : ARM64_CONDITION_LO; break;
+        case IR_CONDITION_GREATER:       result = is_signed ? ARM64_CONDITION_GT : ARM64_CONDITION_HI; break;
+        case IR_CONDITION_LESS_EQUAL:    result = is_signed ? ARM64_CONDITION_LE : ARM64_CONDITION_LS; break;
+        case IR_CONDITION_GREATER_EQUAL: result = is_signed ? ARM64_CONDITION_GE : ARM64_CONDITION_HS; break;
+    }
 
-        case AST_KIND_IDENTIFIER:
-        {
-            assert(expr->decl);
+    return result;
+}
 
-            Ast *decl = expr->decl;
+// Frame layout, from sp upwards: the stack arguments of outgoing calls, the spill slots,
+// the saved callee-saved registers, the link register and the stack arguments of this function.
+static inline s64
+arm64_spill_offset(Codegen *codegen, IrValue *value)
+{
+    assert(value->location == IR_LOCATION_STACK);
+    return codegen->spill_area_offset + 8 * value->spill_slot;
+}
 
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+// Returns the register that holds the value, a value on the stack gets loaded into scratch_reg.
+static Arm64Register
+arm64_get_value(Codegen *codegen, IrFunction *function, s32 index, Arm64Register scratch_reg)
+{
+    IrValue *value = function->values.items + index;
 
-            u64 stack_size = Align(datatype->size, 16);
+    if (value->location == IR_LOCATION_REGISTER)
+    {
+        return (Arm64Register) value->reg;
+    }
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+    arm64_buffer_load(codegen, scratch_reg, arm64_spill_offset(codegen, value));
 
-            arm64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset,
-                                           codegen->stack_committed - decl->stack_offset, datatype->size);
-        } break;
+    return scratch_reg;
+}
 
-        case AST_KIND_EXPRESSION_EQUAL:
-        case AST_KIND_EXPRESSION_NOT_EQUAL:
-        case AST_KIND_EXPRESSION_COMPARE_LESS:
-        case AST_KIND_EXPRESSION_COMPARE_GREATER:
-        case AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL:
-        case AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL:
-        {
-            arm64_emit_expression(compiler, codegen, expr->left_expr, target_platform);
-            arm64_emit_expression(compiler, codegen, expr->right_expr, target_platform);
+// Returns the register a result should be computed into.
+static inline Arm64Register
+arm64_get_result_register(IrFunction *function, s32 index, Arm64Register scratch_reg)
+{
+    IrValue *value = function->values.items + index;
+    return (value->location == IR_LOCATION_REGISTER) ? (Arm64Register) value->reg : scratch_reg;
+}
 
-            Datatype *left_datatype  = get_datatype(&compiler->datatypes, expr->left_expr->type_id);
-            Datatype *right_datatype = get_datatype(&compiler->datatypes, expr->right_expr->type_id);
+static void
+arm64_set_value(Codegen *codegen, IrFunction *function, s32 index, Arm64Register reg)
+{
+    IrValue *value = function->values.items + index;
 
-            u64 max_datatype_size = left_datatype->size;
+    if (value->location == IR_LOCATION_STACK)
+    {
+        arm64_buffer_store(codegen, arm64_spill_offset(codegen, value), reg);
+    }
+    else if (value->location == IR_LOCATION_REGISTER)
+    {
+        assert(value->reg == reg);
+    }
+}
 
-            if (right_datatype->size > max_datatype_size)
-            {
-                max_datatype_size = right_datatype->size;
-            }
+// Moves the values into the given registers, values on the stack are loaded after
+// the register moves so that they don't clobber any source.
+static void
+arm64_move_values_to_registers(Codegen *codegen, IrFunction *function, s32 *values, const Arm64Register *dst_regs, s32 count)
+{
+    Arm64Register move_dst_regs[16];
+    Arm64Register move_src_regs[16];
+    s32 move_count = 0;
 
-            u64 left_stack_size = Align(left_datatype->size, 16);
-            u64 right_stack_size = Align(right_datatype->size, 16);
+    for (s32 i = 0; i < count; i += 1)
+    {
+        IrValue *value = function->values.items + values[i];
 
-            assert(expr->type_id == compiler->basetype_bool);
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+        if (value->location == IR_LOCATION_REGISTER)
+        {
+            move_dst_regs[move_count] = dst_regs[i];
+            move_src_regs[move_count] = (Arm64Register) value->reg;
+            move_count += 1;
+        }
+    }
 
-            u64 stack_size = Align(datatype->size, 16);
+    arm64_parallel_move(codegen, move_dst_regs, move_src_regs, move_count);
 
-            arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R1, codegen->stack_committed - expr->right_expr->stack_offset, right_datatype->size);
-            arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed - expr->left_expr->stack_offset, left_datatype->size);
+    for (s32 i = 0; i < count; i += 1)
+    {
+        IrValue *value = function->values.items + values[i];
 
-            pop_stack(codegen, right_stack_size);
-            pop_stack(codegen, left_stack_size);
+        if (value->location == IR_LOCATION_STACK)
+        {
+            arm64_buffer_load(codegen, dst_regs[i], arm64_spill_offset(codegen, value));
+        }
+    }
+}
 
-            // TODO: maybe sign extend arguments
+// The opposite of arm64_move_values_to_registers, values on the stack are stored first.
+static void
+arm64_move_registers_to_values(Codegen *codegen, IrFunction *function, s32 *values, const Arm64Register *src_regs, s32 count)
+{
+    Arm64Register move_dst_regs[16];
+    Arm64Register move_src_regs[16];
+    s32 move_count = 0;
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+    for (s32 i = 0; i < count; i += 1)
+    {
+        IrValue *value = function->values.items + values[i];
 
-            arm64_compare_registers(&codegen->section_text, ARM64_R0, ARM64_R1, max_datatype_size);
+        if (value->location == IR_LOCATION_STACK)
+        {
+            arm64_buffer_store(codegen, arm64_spill_offset(codegen, value), src_regs[i]);
+        }
+        else if (value->location == IR_LOCATION_REGISTER)
+        {
+            move_dst_regs[move_count] = (Arm64Register) value->reg;
+            move_src_regs[move_count] = src_regs[i];
+            move_count += 1;
+        }
+    }
 
-            u32 cond = 0;
+    arm64_parallel_move(codegen, move_dst_regs, move_src_regs, move_count);
+}
+
+// Stores (or loads) the used callee-saved registers and the link register, they sit right above the spill slots.
+static void
+arm64_emit_saved_registers(Codegen *codegen, IrFunction *function, bool store)
+{
+    s64 offset = codegen->spill_area_offset + 8 * function->spill_slot_count;
 
-            bool is_signed = true; // TODO:
+    for (s32 i = 0; i < ArrayCount(arm64_callee_saved_registers); i += 1)
+    {
+        Arm64Register reg = arm64_callee_saved_registers[i];
 
-            if (is_signed)
+        if (function->used_callee_saved_registers & ((u64) 1 << reg))
+        {
+            if (store)
             {
-                if (expr->kind == AST_KIND_EXPRESSION_EQUAL)
-                {
-                    cond = 0x0;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_NOT_EQUAL)
-                {
-                    cond = 0x1;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_LESS)
-                {
-                    cond = 0xB;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_GREATER)
-                {
-                    cond = 0xC;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL)
-                {
-                    cond = 0xD;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL)
-                {
-                    cond = 0xA;
-                }
+                arm64_buffer_store(codegen, offset, reg);
             }
             else
             {
-                if (expr->kind == AST_KIND_EXPRESSION_EQUAL)
-                {
-                    cond = 0x0;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_NOT_EQUAL)
-                {
-                    cond = 0x1;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_LESS)
-                {
-                    cond = 0x4;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_GREATER)
-                {
-                    cond = 0x8;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL)
-                {
-                    cond = 0x9;
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL)
-                {
-                    cond = 0x5;
-                }
+                arm64_buffer_load(codegen, reg, offset);
             }
 
-            cond ^= 0x1;
+            offset += 8;
+        }
+    }
 
-            // CSET/CSINC
-            u32 inst = 0x9A9F07E0 | ((cond & 0xF) << 12) | ARM64_R0;
-            string_builder_append_u32le(&codegen->section_text, inst);
+    if (function->has_calls)
+    {
+        if (store)
+        {
+            arm64_buffer_store(codegen, offset, ARM64_R30);
+        }
+        else
+        {
+            arm64_buffer_load(codegen, ARM64_R30, offset);
+        }
+    }
+}
 
-            arm64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, ARM64_R0, datatype->size);
-        } break;
+// Restores the saved registers and frees the frame.
+static void
+arm64_emit_epilogue(Codegen *codegen, IrFunction *function)
+{
+    arm64_emit_saved_registers(codegen, function, false);
 
-        case AST_KIND_EXPRESSION_BINOP_ADD:
-        case AST_KIND_EXPRESSION_BINOP_MINUS:
-        {
-            arm64_emit_expression(compiler, codegen, expr->left_expr, target_platform);
-            arm64_emit_expression(compiler, codegen, expr->right_expr, target_platform);
+    if (codegen->frame_size > 0)
+    {
+        arm64_buffer_adjust_stack(codegen, codegen->frame_size);
+    }
 
-            Datatype *left_datatype  = get_datatype(&compiler->datatypes, expr->left_expr->type_id);
-            Datatype *right_datatype = get_datatype(&compiler->datatypes, expr->right_expr->type_id);
+    arm64_flush(codegen);
+}
 
-            u64 left_stack_size  = Align(left_datatype->size, 16);
-            u64 right_stack_size = Align(right_datatype->size, 16);
+// Loads the operand b of an instruction, immediates get moved into x17.
+static Arm64Register
+arm64_get_second_operand(Codegen *codegen, IrFunction *function, IrInstruction *instruction)
+{
+    if (instruction->has_immediate)
+    {
+        arm64_buffer_move_immediate(codegen, ARM64_R17, (u64) instruction->immediate);
+        return ARM64_R17;
+    }
 
-            assert(expr->type_id);
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+    return arm64_get_value(codegen, function, instruction->b, ARM64_R17);
+}
 
-            u64 stack_size = Align(datatype->size, 16);
+// Sets the flags for the condition of a compare or a branch instruction.
+static void
+arm64_emit_compare(Codegen *codegen, IrFunction *function, IrInstruction *instruction)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R1, codegen->stack_committed - expr->right_expr->stack_offset, right_datatype->size);
-            arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed - expr->left_expr->stack_offset, left_datatype->size);
+    Arm64Register a_reg = arm64_get_value(codegen, function, instruction->a, ARM64_R16);
 
-            pop_stack(codegen, right_stack_size);
-            pop_stack(codegen, left_stack_size);
+    if ((instruction->size == 1) && instruction->has_immediate && (instruction->immediate == 0) &&
+        ((instruction->condition == IR_CONDITION_EQUAL) || (instruction->condition == IR_CONDITION_NOT_EQUAL)))
+    {
+        arm64_flush(codegen);
+        arm64_test_byte_register(builder, a_reg);
+    }
+    else if (instruction->size < 4)
+    {
+        Arm64Register b_reg = arm64_get_second_operand(codegen, function, instruction);
 
-            // TODO: maybe sign extend arguments
+        arm64_flush(codegen);
+        arm64_extend_register(builder, ARM64_R16, a_reg, instruction->size, instruction->is_signed);
+        arm64_extend_register(builder, ARM64_R17, b_reg, instruction->size, instruction->is_signed);
+        arm64_compare_registers(builder, ARM64_R16, ARM64_R17, 4);
+    }
+    else if (instruction->has_immediate && (instruction->immediate >= 0) && (instruction->immediate <= 0xFFF))
+    {
+        arm64_flush(codegen);
+        arm64_compare_immediate12(builder, a_reg, (u16) instruction->immediate, instruction->size);
+    }
+    else
+    {
+        Arm64Register b_reg = arm64_get_second_operand(codegen, function, instruction);
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+        arm64_flush(codegen);
+        arm64_compare_registers(builder, a_reg, b_reg, instruction->size);
+    }
+}
 
-            if (expr->kind == AST_KIND_EXPRESSION_BINOP_ADD)
-            {
-                arm64_add_registers(&codegen->section_text, ARM64_R0, ARM64_R1, datatype->size);
-            }
-            else
-            {
-                assert(expr->kind == AST_KIND_EXPRESSION_BINOP_MINUS);
-                arm64_subtract_registers(&codegen->section_text, ARM64_R0, ARM64_R1, datatype->size);
-            }
+static void
+arm64_emit_instruction(Codegen *codegen, IrFunction *function, IrInstruction *instruction, JulsPlatform target_platform)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            arm64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, ARM64_R0, datatype->size);
+    switch (instruction->opcode)
+    {
+        case IR_OP_NOP:
+        {
         } break;
 
-        case AST_KIND_FUNCTION_CALL:
+        case IR_OP_CONSTANT:
         {
-            assert(expr->left_expr);
+            Arm64Register dst_reg = arm64_get_result_register(function, instruction->dst, ARM64_R16);
+            arm64_buffer_move_immediate(codegen, dst_reg, (u64) instruction->immediate);
+            arm64_set_value(codegen, function, instruction->dst, dst_reg);
+        } break;
 
-            Ast *left = expr->left_expr;
+        case IR_OP_STRING_ADDRESS:
+        {
+            u64 string_offset = string_builder_get_size(&codegen->section_cstring);
+            string_builder_append_string(&codegen->section_cstring, instruction->string);
 
-            if (left->kind == AST_KIND_IDENTIFIER)
-            {
-                assert(expr->decl);
+            Arm64Register dst_reg = arm64_get_result_register(function, instruction->dst, ARM64_R16);
 
-                Datatype *return_type = get_datatype(&compiler->datatypes, expr->decl->type_id);
-                u64 return_type_stack_size = Align(return_type->size, 16);
+            arm64_flush(codegen);
 
-                expr->stack_offset = push_stack(codegen, return_type_stack_size);
-            }
-            else
-            {
-                assert(!"not implemented");
-            }
+            // ADRP and ADD (immediate), the file generation fills in the address and keeps the register
+            u64 instruction_offset = string_builder_get_size(builder);
 
-            u64 arguments_stack_size = 0;
+            string_builder_append_u32le(builder, 0x90000000 | dst_reg);
+            string_builder_append_u32le(builder, 0x91000000 | ((u32) dst_reg << 5) | dst_reg);
 
-            For(argument, expr->children.first)
-            {
-                // TODO: does the size match the expression?
-                arm64_emit_expression(compiler, codegen, argument, target_platform);
+            array_append(&codegen->patches, ((Patch) { .patch_offset = instruction_offset,
+                                                       .instruction_offset = instruction_offset,
+                                                       .string_offset = string_offset }));
 
-                Datatype *datatype = get_datatype(&compiler->datatypes, argument->type_id);
+            arm64_set_value(codegen, function, instruction->dst, dst_reg);
+        } break;
 
-                u64 stack_size = Align(datatype->size, 16);
-                arguments_stack_size += stack_size;
-            }
+        case IR_OP_COPY:
+        case IR_OP_EXTEND:
+        {
+            Arm64Register dst_reg = arm64_get_result_register(function, instruction->dst, ARM64_R16);
+            Arm64Register a_reg = arm64_get_value(codegen, function, instruction->a, dst_reg);
 
-            if (left->kind == AST_KIND_IDENTIFIER)
+            if (instruction->opcode == IR_OP_EXTEND)
             {
-                if (strings_are_equal(left->name, S("exit")))
-                {
-                    assert(ast_list_count(&expr->children) == 1);
-
-                    Ast *first_argument = expr->children.first;
-
-                    if ((target_platform == JulsPlatformAndroid) ||
-                        (target_platform == JulsPlatformLinux))
-                    {
-                        arm64_move_immediate16(&codegen->section_text, ARM64_R8, 93);
-                        arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed - first_argument->stack_offset, 8);
-                        arm64_svc(&codegen->section_text, 0);
-                    }
-                    else if (target_platform == JulsPlatformMacOs)
-                    {
-                        arm64_move_immediate16(&codegen->section_text, ARM64_R16, 1);
-                        arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed - first_argument->stack_offset, 8);
-                        arm64_svc(&codegen->section_text, 0x80);
-                    }
-                }
-                else if (strings_are_equal(left->name, S("write")))
-                {
-                    assert(ast_list_count(&expr->children) == 3);
-
-                    Ast *first_argument  = expr->children.first;
-                    Ast *second_argument = first_argument->next;
-                    Ast *third_argument  = second_argument->next;
-
-                    if ((target_platform == JulsPlatformAndroid) ||
-                        (target_platform == JulsPlatformLinux))
-                    {
-                        arm64_move_immediate16(&codegen->section_text, ARM64_R8, 64);
-                        arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed -  first_argument->stack_offset, 4);
-                        arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R1, codegen->stack_committed - second_argument->stack_offset, 8);
-                        arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R2, codegen->stack_committed -  third_argument->stack_offset, 8);
-                        arm64_svc(&codegen->section_text, 0);
-                    }
-                    else if (target_platform == JulsPlatformMacOs)
-                    {
-                        arm64_move_immediate16(&codegen->section_text, ARM64_R16, 4);
-                        arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed -  first_argument->stack_offset, 4);
-                        arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R1, codegen->stack_committed - second_argument->stack_offset, 8);
-                        arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R2, codegen->stack_committed -  third_argument->stack_offset, 8);
-                        arm64_svc(&codegen->section_text, 0x80);
-                    }
-                }
-                else
-                {
-                    assert(expr->decl);
-
-                    if (expr->decl->address == S64MAX)
-                    {
-                        u64 instruction_offset = string_builder_get_size(&codegen->section_text);
-                        void *patch_addr = string_builder_append_size(&codegen->section_text, 4);
-
-                        array_append(&codegen->function_call_patches,
-                                     ((FunctionCallPatch) { .patch = patch_addr,
-                                                            .instruction_offset = instruction_offset,
-                                                            .function_decl = expr->decl }));
-                    }
-                    else
-                    {
-                        s64 jump_offset = string_builder_get_size(&codegen->section_text);
-                        // BL
-                        u32 inst = 0x94000000 | (((u32) (expr->decl->address - jump_offset) >> 2) & 0x3FFFFFF);
-                        string_builder_append_u32le(&codegen->section_text, inst);
-                    }
-                }
+                arm64_flush(codegen);
+                arm64_extend_register(builder, dst_reg, a_reg, instruction->size, instruction->is_signed);
             }
-            else
+            else if (a_reg != dst_reg)
             {
-                assert(!"not implemented");
+                arm64_buffer_move(codegen, dst_reg, a_reg);
             }
 
-            pop_stack(codegen, arguments_stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+            arm64_set_value(codegen, function, instruction->dst, dst_reg);
         } break;
 
-        case AST_KIND_ASSIGN:
-        case AST_KIND_PLUS_ASSIGN:
-        case AST_KIND_MINUS_ASSIGN:
-        // case AST_KIND_MUL_ASSIGN:
-        // case AST_KIND_DIV_ASSIGN:
-        // case AST_KIND_OR_ASSIGN:
-        // case AST_KIND_AND_ASSIGN:
-        // case AST_KIND_XOR_ASSIGN:
+        case IR_OP_ADD:
+        case IR_OP_SUB:
         {
-            assert(expr->decl);
-
-            Ast *decl = expr->decl;
+            // only the lower bytes matter, so all additions are done with 64 bits
+            Arm64Register dst_reg = arm64_get_result_register(function, instruction->dst, ARM64_R16);
+            Arm64Register a_reg = arm64_get_value(codegen, function, instruction->a, ARM64_R16);
 
-            assert(decl->stack_offset > 0);
+            bool is_add = (instruction->opcode == IR_OP_ADD);
+            s64 immediate = instruction->immediate;
 
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
-            Datatype *right_datatype = get_datatype(&compiler->datatypes, expr->right_expr->type_id);
-
-            if (expr->kind == AST_KIND_ASSIGN)
+            if (instruction->has_immediate && (immediate < 0) && (immediate > -0x1000))
             {
-                arm64_emit_expression(compiler, codegen, expr->right_expr, target_platform);
-                arm64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - decl->stack_offset,
-                                               codegen->stack_committed - expr->right_expr->stack_offset, datatype->size);
-
-                expr->stack_offset = expr->right_expr->stack_offset;
+                is_add = !is_add;
+                immediate = -immediate;
             }
-            else
-            {
-                arm64_emit_expression(compiler, codegen, expr->right_expr, target_platform);
-                arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R1, codegen->stack_committed - expr->right_expr->stack_offset, right_datatype->size);
-                arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed - decl->stack_offset, datatype->size);
-
-                expr->stack_offset = expr->right_expr->stack_offset;
 
-                // TODO: maybe sign extend arguments
+            if (instruction->has_immediate && (immediate >= 0) && (immediate <= 0xFFF))
+            {
+                arm64_flush(codegen);
 
-                if (expr->kind == AST_KIND_PLUS_ASSIGN)
+                if (is_add)
                 {
-                    arm64_add_registers(&codegen->section_text, ARM64_R0, ARM64_R1, datatype->size);
+                    arm64_add_immediate12(builder, dst_reg, a_reg, (u16) immediate);
                 }
                 else
                 {
-                    assert(expr->kind == AST_KIND_MINUS_ASSIGN);
-                    arm64_subtract_registers(&codegen->section_text, ARM64_R0, ARM64_R1, datatype->size);
+                    arm64_subtract_immediate12(builder, dst_reg, a_reg, (u16) immediate);
                 }
-
-                arm64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - decl->stack_offset, ARM64_R0, datatype->size);
-                arm64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, ARM64_R0, datatype->size);
             }
-        } break;
-
-        case AST_KIND_MEMBER:
-        {
-            if (expr->left_expr->type_id == compiler->basetype_string)
+            else
             {
-                if (strings_are_equal(expr->name, S("count")) ||
-                    strings_are_equal(expr->name, S("data")))
-                {
-                    Datatype *left_datatype = get_datatype(&compiler->datatypes, expr->left_expr->type_id);
-                    Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+                Arm64Register b_reg = arm64_get_second_operand(codegen, function, instruction);
 
-                    u64 left_stack_size = Align(left_datatype->size, 16);
-                    u64 stack_size = Align(datatype->size, 16);
-
-                    expr->stack_offset = push_stack(codegen, stack_size);
-                    arm64_commit_stack(codegen, &codegen->section_text);
-
-                    arm64_emit_expression(compiler, codegen, expr->left_expr, target_platform);
-
-                    if (strings_are_equal(expr->name, S("count")))
-                    {
-                        arm64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset,
-                                                       (codegen->stack_committed - expr->left_expr->stack_offset) + 0, datatype->size);
-                    }
-                    else if (strings_are_equal(expr->name, S("data")))
-                    {
-                        arm64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset,
-                                                       (codegen->stack_committed - expr->left_expr->stack_offset) + 8, datatype->size);
-                    }
+                arm64_flush(codegen);
 
-                    pop_stack(codegen, left_stack_size);
-                    arm64_commit_stack(codegen, &codegen->section_text);
+                if (is_add)
+                {
+                    arm64_add_registers(builder, dst_reg, a_reg, b_reg);
                 }
                 else
                 {
-                    assert(!"not supported");
+                    arm64_subtract_registers(builder, dst_reg, a_reg, b_reg);
                 }
             }
-            else
-            {
-                assert(!"not supported");
-            }
+
+            arm64_set_value(codegen, function, instruction->dst, dst_reg);
         } break;
 
-        case AST_KIND_CAST:
+        case IR_OP_COMPARE:
         {
-            arm64_emit_expression(compiler, codegen, expr->left_expr, target_platform);
-            arm64_emit_cast(compiler, codegen, expr->left_expr->type_id, expr->type_id);
+            arm64_emit_compare(codegen, function, instruction);
 
-            // TODO: hack
-            expr->stack_offset = codegen->stack_allocated;
+            Arm64Register dst_reg = arm64_get_result_register(function, instruction->dst, ARM64_R16);
+            arm64_set_if(builder, dst_reg, arm64_get_condition(instruction->condition, instruction->is_signed));
+            arm64_set_value(codegen, function, instruction->dst, dst_reg);
         } break;
 
-        default:
+        case IR_OP_LABEL:
         {
-            printf("kind = %u\n", expr->kind);
-            assert(!"expression not supported");
+            arm64_flush(codegen);
+            codegen->label_offsets.items[instruction->label] = string_builder_get_size(builder);
         } break;
-    }
-}
 
-static void
-arm64_emit_statement(Compiler *compiler, Codegen *codegen, Ast *statement, JulsPlatform target_platform,
-                     Datatype *return_type, s64 return_value_stack_offset)
-{
-    switch (statement->kind)
-    {
-        case AST_KIND_VARIABLE_DECLARATION:
+        case IR_OP_JUMP:
         {
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->type_id);
-
-            u64 stack_size = Align(datatype->size, 16);
-
-            statement->stack_offset = allocate_stack(codegen, stack_size);
+            // B
+            arm64_branch_to_label(codegen, 0x14000000, instruction->label);
+        } break;
 
-            if (statement->right_expr)
+        case IR_OP_BRANCH:
+        {
+            if ((instruction->size >= 4) && instruction->has_immediate && (instruction->immediate == 0) &&
+                ((instruction->condition == IR_CONDITION_EQUAL) || (instruction->condition == IR_CONDITION_NOT_EQUAL)))
             {
-                Datatype *right_datatype = get_datatype(&compiler->datatypes, statement->right_expr->type_id);
+                Arm64Register a_reg = arm64_get_value(codegen, function, instruction->a, ARM64_R16);
 
-                u64 right_stack_size = Align(right_datatype->size, 16);
+                // CBZ / CBNZ
+                u32 inst = (instruction->condition == IR_CONDITION_EQUAL) ? 0x34000000 : 0x35000000;
 
-                arm64_emit_expression(compiler, codegen, statement->right_expr, target_platform);
+                if (instruction->size == 8)
+                {
+                    inst |= 0x80000000;
+                }
 
-                // TODO: does the size match the expression?
-                arm64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - statement->stack_offset,
-                                               codegen->stack_committed - statement->right_expr->stack_offset, datatype->size);
+                arm64_branch_to_label(codegen, inst | a_reg, instruction->label);
+            }
+            else
+            {
+                arm64_emit_compare(codegen, function, instruction);
 
-                pop_stack(codegen, right_stack_size);
-                arm64_commit_stack(codegen, &codegen->section_text);
+                // B.cond
+                arm64_branch_to_label(codegen, 0x54000000 | arm64_get_condition(instruction->condition, instruction->is_signed), instruction->label);
             }
         } break;
 
-        case AST_KIND_IF:
+        case IR_OP_CALL:
         {
-            arm64_emit_expression(compiler, codegen, statement->left_expr, target_platform);
-
-            assert(statement->left_expr->type_id == compiler->basetype_bool);
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->left_expr->type_id);
-
-            u64 stack_size = Align(datatype->size, 16);
-
-            arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed - statement->left_expr->stack_offset, datatype->size);
-
-            pop_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+            s32 *results = function->operands.items + instruction->first_operand;
+            s32 *arguments = results + instruction->result_count;
 
-            // SUBS (immediate)
-            u32 inst = 0xF1000000 | ((u32) ARM64_R0 << 5) | ARM64_R0;
-            string_builder_append_u32le(&codegen->section_text, inst);
+            s32 register_count = instruction->argument_count;
 
-            // JZ
-            s64 else_offset = string_builder_get_size(&codegen->section_text);
-            u32 *else_patch = string_builder_append_size(&codegen->section_text, 4);
-
-            Ast *if_code = statement->children.first;
-            Ast *else_code = 0;
-
-            if (statement->children.first != statement->children.last)
+            if (register_count > ArrayCount(arm64_argument_registers))
             {
-                else_code = statement->children.last;
+                register_count = ArrayCount(arm64_argument_registers);
             }
 
-            push_scope(codegen);
-
-            arm64_emit_statement(compiler, codegen, if_code, target_platform, return_type, return_value_stack_offset);
-
-            pop_scope(codegen);
-            arm64_commit_stack(codegen, &codegen->section_text);
-
-            s64 end_offset = string_builder_get_size(&codegen->section_text);
-            u32 *end_patch = 0;
-
-            if (else_code)
+            for (s32 i = register_count; i < instruction->argument_count; i += 1)
             {
-                // B
-                end_patch = string_builder_append_size(&codegen->section_text, 4);
+                Arm64Register reg = arm64_get_value(codegen, function, arguments[i], ARM64_R16);
+                arm64_buffer_store(codegen, 8 * (i - register_count), reg);
             }
 
-            s64 else_target = string_builder_get_size(&codegen->section_text);
-            *else_patch = 0x54000000 | ((((u32) (else_target - else_offset) >> 2) & 0x7FFFF) << 5);
-
-            if (else_code)
-            {
-                push_scope(codegen);
+            arm64_move_values_to_registers(codegen, function, arguments, arm64_argument_registers, register_count);
 
-                arm64_emit_statement(compiler, codegen, else_code, target_platform, return_type, return_value_stack_offset);
+            arm64_call(codegen, instruction->function, false);
 
-                pop_scope(codegen);
-                arm64_commit_stack(codegen, &codegen->section_text);
-
-                s64 end_target = string_builder_get_size(&codegen->section_text);
-                *end_patch = 0x14000000 | (((u32) (end_target - end_offset) >> 2) & 0x3FFFFFF);
-            }
+            arm64_move_registers_to_values(codegen, function, results, arm64_return_registers, instruction->result_count);
         } break;
 
-        case AST_KIND_FOR:
+        case IR_OP_INTRINSIC:
         {
-            push_scope(codegen);
-
-            arm64_emit_statement(compiler, codegen, statement->decl, target_platform, return_type, return_value_stack_offset);
-
-            s64 start_target = string_builder_get_size(&codegen->section_text);
-
-            arm64_emit_expression(compiler, codegen, statement->left_expr, target_platform);
-
-            assert(statement->left_expr->type_id == compiler->basetype_bool);
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->left_expr->type_id);
-
-            u64 stack_size = Align(datatype->size, 16);
+            s32 *results = function->operands.items + instruction->first_operand;
+            s32 *arguments = results + instruction->result_count;
 
-            arm64_copy_from_stack_to_register(&codegen->section_text, ARM64_R0, codegen->stack_committed - statement->left_expr->stack_offset, datatype->size);
+            assert(instruction->argument_count <= 3);
 
-            pop_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
-
-            // SUBS (immediate)
-            u32 inst = 0xF1000000 | ((u32) ARM64_R0 << 5) | ARM64_R0;
-            string_builder_append_u32le(&codegen->section_text, inst);
-
-            // JZ
-            s64 end_offset = string_builder_get_size(&codegen->section_text);
-            u32 *end_patch = string_builder_append_size(&codegen->section_text, 4);
-
-            arm64_emit_statement(compiler, codegen, statement->children.first, target_platform, return_type, return_value_stack_offset);
-            arm64_emit_expression(compiler, codegen, statement->right_expr, target_platform);
-
-            Datatype *right_datatype = get_datatype(&compiler->datatypes, statement->right_expr->type_id);
-
-            u64 right_stack_size = Align(right_datatype->size, 16);
-
-            pop_stack(codegen, right_stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
-
-            s64 start_offset = string_builder_get_size(&codegen->section_text);
-            inst = 0x14000000 | (((u32) (start_target - start_offset) >> 2) & 0x3FFFFFF);
-            string_builder_append_u32le(&codegen->section_text, inst);
+            if ((target_platform == JulsPlatformAndroid) ||
+                (target_platform == JulsPlatformLinux))
+            {
+                arm64_move_values_to_registers(codegen, function, arguments, arm64_argument_registers, instruction->argument_count);
+                arm64_buffer_move_immediate(codegen, ARM64_R8, (instruction->intrinsic == IR_INTRINSIC_EXIT) ? 93 : 64);
+                arm64_flush(codegen);
+                arm64_svc(builder, 0);
 
-            s64 end_target = string_builder_get_size(&codegen->section_text);
-            *end_patch = 0x54000000 | ((((u32) (end_target - end_offset) >> 2) & 0x7FFFF) << 5);
+                arm64_move_registers_to_values(codegen, function, results, arm64_return_registers, instruction->result_count);
+            }
+            else if (target_platform == JulsPlatformMacOs)
+            {
+                arm64_move_values_to_registers(codegen, function, arguments, arm64_argument_registers, instruction->argument_count);
+                arm64_buffer_move_immediate(codegen, ARM64_R16, (instruction->intrinsic == IR_INTRINSIC_EXIT) ? 1 : 4);
+                arm64_flush(codegen);
+                arm64_svc(builder, 0x80);
 
-            pop_scope(codegen);
-            arm64_commit_stack(codegen, &codegen->section_text);
+                arm64_move_registers_to_values(codegen, function, results, arm64_return_registers, instruction->result_count);
+            }
         } break;
 
-        case AST_KIND_RETURN:
+        case IR_OP_RETURN:
         {
-            assert(statement->left_expr);
+            s32 *values = function->operands.items + instruction->first_operand;
 
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->left_expr->type_id);
+            assert(instruction->argument_count <= ArrayCount(arm64_return_registers));
 
-            u64 stack_size = Align(datatype->size, 16);
+            arm64_move_values_to_registers(codegen, function, values, arm64_return_registers, instruction->argument_count);
+            arm64_emit_epilogue(codegen, function);
+            arm64_ret(builder);
+        } break;
 
-            arm64_emit_expression(compiler, codegen, statement->left_expr, target_platform);
+        case IR_OP_TAIL_CALL:
+        {
+            s32 *arguments = function->operands.items + instruction->first_operand;
 
-            arm64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - return_value_stack_offset,
-                                           codegen->stack_committed - statement->left_expr->stack_offset, return_type->size);
+            assert(instruction->argument_count <= ArrayCount(arm64_argument_registers));
 
-            pop_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
+            // the argument registers are caller-saved, so the epilogue leaves them alone
+            arm64_move_values_to_registers(codegen, function, arguments, arm64_argument_registers, instruction->argument_count);
+            arm64_emit_epilogue(codegen, function);
+            arm64_call(codegen, instruction->function, true);
+        } break;
+    }
+}
 
-            assert(codegen->stack_scope_index > 0);
-            assert(codegen->stack_allocated == codegen->stack_scopes[codegen->stack_scope_index]);
+static void
+arm64_get_register_info(IrRegisterInfo *info)
+{
+    info->caller_saved_count = ArrayCount(arm64_caller_saved_registers);
+    info->callee_saved_count = ArrayCount(arm64_callee_saved_registers);
+    info->argument_register_count = ArrayCount(arm64_argument_registers);
+    info->return_register_count = ArrayCount(arm64_return_registers);
+
+    for (s32 i = 0; i < info->caller_saved_count; i += 1)     info->caller_saved[i] = arm64_caller_saved_registers[i];
+    for (s32 i = 0; i < info->callee_saved_count; i += 1)     info->callee_saved[i] = arm64_callee_saved_registers[i];
+    for (s32 i = 0; i < info->argument_register_count; i += 1) info->argument_registers[i] = arm64_argument_registers[i];
+    for (s32 i = 0; i < info->return_register_count; i += 1)   info->return_registers[i] = arm64_return_registers[i];
+}
 
-            if (codegen->stack_committed > 0)
-            {
-                assert(codegen->stack_committed <= 0xFFFF);
-                arm64_add_immediate12(&codegen->section_text, ARM64_SP, ARM64_SP, (u16) codegen->stack_committed);
-            }
+static void
+arm64_emit_function(Codegen *codegen, IrFunction *function, JulsPlatform target_platform)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            arm64_pop_register(&codegen->section_text, ARM64_R30); // restore link register
-            arm64_ret(&codegen->section_text);
-        } break;
+    Ast *func = function->decl;
+    ast_get_function(func)->address = string_builder_get_size(builder);
 
-        case AST_KIND_BLOCK:
-        {
-            push_scope(codegen);
+    IrRegisterInfo register_info;
+    arm64_get_register_info(&register_info);
 
-            For(stmt, statement->children.first)
-            {
-                arm64_emit_statement(compiler, codegen, stmt, target_platform, return_type, return_value_stack_offset);
-            }
+    ir_allocate_registers(function, &register_info);
 
-            pop_scope(codegen);
-            arm64_commit_stack(codegen, &codegen->section_text);
-        } break;
+    s64 saved_register_count = function->has_calls ? 1 : 0;
 
-        default:
+    for (s32 i = 0; i < ArrayCount(arm64_callee_saved_registers); i += 1)
+    {
+        if (function->used_callee_saved_registers & ((u64) 1 << arm64_callee_saved_registers[i]))
         {
-            arm64_emit_expression(compiler, codegen, statement, target_platform);
+            saved_register_count += 1;
+        }
+    }
 
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->type_id);
+    s64 frame_size = 8 * (function->stack_argument_count + function->spill_slot_count + saved_register_count);
+    frame_size = Align(frame_size, 16);
 
-            u64 stack_size = Align(datatype->size, 16);
+    codegen->frame_size = frame_size;
+    codegen->spill_area_offset = 8 * function->stack_argument_count;
 
-            pop_stack(codegen, stack_size);
-            arm64_commit_stack(codegen, &codegen->section_text);
-        } break;
+    if (frame_size > 0)
+    {
+        arm64_buffer_adjust_stack(codegen, -frame_size);
     }
-}
 
-static void
-arm64_emit_function(Compiler *compiler, Codegen *codegen, Ast *func, JulsPlatform target_platform)
-{
-    assert(func->kind == AST_KIND_FUNCTION_DECLARATION);
-
-    func->address = string_builder_get_size(&codegen->section_text);
+    arm64_emit_saved_registers(codegen, function, true);
 
-    codegen->stack_allocated = 0;
-    codegen->stack_committed = 0;
-    codegen->stack_scopes[0] = 0;
-    codegen->stack_scope_index = 0;
+    // move the parameters from the argument registers and the stack to where they were allocated
+    s32 register_count = function->parameters.count;
 
-    s64 stack_offset = 0;
+    if (register_count > ArrayCount(arm64_argument_registers))
+    {
+        register_count = ArrayCount(arm64_argument_registers);
+    }
 
-    // that's the return address
-    stack_offset -= 16;
+    arm64_move_registers_to_values(codegen, function, function->parameters.items, arm64_argument_registers, register_count);
 
-    ForReversed(parameter, func->parameters.last)
+    for (s32 i = register_count; i < function->parameters.count; i += 1)
     {
-        Datatype *datatype = get_datatype(&compiler->datatypes, parameter->type_id);
+        IrValue *value = function->values.items + function->parameters.items[i];
 
-        u64 stack_size = Align(datatype->size, 16);
+        if (value->location != IR_LOCATION_NONE)
+        {
+            s64 stack_offset = frame_size + 8 * (i - register_count);
 
-        parameter->stack_offset = stack_offset;
-        stack_offset -= stack_size;
+            Arm64Register reg = arm64_get_result_register(function, function->parameters.items[i], ARM64_R16);
+            arm64_buffer_load(codegen, reg, stack_offset);
+            arm64_set_value(codegen, function, function->parameters.items[i], reg);
+        }
     }
 
-    Datatype *return_type = get_datatype(&compiler->datatypes, func->type_id);
-
-    s64 return_value_stack_offset = stack_offset;
+    codegen->label_offsets.count = 0;
+    codegen->label_patches.count = 0;
 
-    arm64_push_register(&codegen->section_text, ARM64_R30); // save link register
-
-    push_scope(codegen);
+    for (s32 i = 0; i < function->label_count; i += 1)
+    {
+        array_append(&codegen->label_offsets, -1);
+    }
 
-    For(statement, func->children.first)
+    for (s32 i = 0; i < function->instructions.count; i += 1)
     {
-        arm64_emit_statement(compiler, codegen, statement, target_platform, return_type, return_value_stack_offset);
+        arm64_emit_instruction(codegen, function, function->instructions.items + i, target_platform);
     }
 
-    pop_scope(codegen);
-    assert(codegen->stack_scope_index == 0);
+    arm64_flush(codegen);
 
-    if (!func->type_def)
+    for (s32 i = 0; i < codegen->label_patches.count; i += 1)
     {
-        arm64_commit_stack(codegen, &codegen->section_text);
-        arm64_pop_register(&codegen->section_text, ARM64_R30); // restore link register
-        arm64_ret(&codegen->section_text);
+        LabelPatch *patch = codegen->label_patches.items + i;
+        s64 label_offset = codegen->label_offsets.items[patch->label];
+
+        assert(label_offset >= 0);
+
+        u32 *inst = string_builder_get_pointer(&codegen->section_text, patch->patch_offset);
+        *inst = arm64_encode_branch(*inst, label_offset - (s64) patch->instruction_offset);
     }
 }
 
 static void
-generate_arm64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table, JulsPlatform target_platform)
+generate_arm64(IrProgram *program, Codegen *codegen, SymbolTable *symbol_table, JulsPlatform target_platform)
 {
     String entry_point_name = S("main");
 
     u64 jump_location = string_builder_get_size(&codegen->section_text);
-    u32 *jump_patch = 0;
+    u64 jump_patch_offset = 0;
 
     u64 _start_offset = string_builder_get_size(&codegen->section_text);
 
@@ -1341,7 +1194,8 @@ generate_arm64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table,
         (target_platform == JulsPlatformLinux))
     {
         // bl main
-        jump_patch = string_builder_append_size(&codegen->section_text, 4);
+        jump_patch_offset = string_builder_get_size(&codegen->section_text);
+        string_builder_append_u32le(&codegen->section_text, 0);
 
         // mov r8, #94
         arm64_move_immediate16(&codegen->section_text, ARM64_R8, 94);
@@ -1355,7 +1209,8 @@ generate_arm64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table,
     else if (target_platform == JulsPlatformWindows)
     {
         // bl main
-        jump_patch = string_builder_append_size(&codegen->section_text, 4);
+        jump_patch_offset = string_builder_get_size(&codegen->section_text);
+        string_builder_append_u32le(&codegen->section_text, 0);
 
         // TODO: implement
         // where to put the exit code?
@@ -1364,7 +1219,8 @@ generate_arm64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table,
     else if (target_platform == JulsPlatformMacOs)
     {
         // bl main
-        jump_patch = string_builder_append_size(&codegen->section_text, 4);
+        jump_patch_offset = string_builder_get_size(&codegen->section_text);
+        string_builder_append_u32le(&codegen->section_text, 0);
 
         // mov r8, #1
         arm64_move_immediate16(&codegen->section_text, ARM64_R16, 1);
@@ -1382,28 +1238,35 @@ generate_arm64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table,
 
     u64 jump_target = 0;
 
-    For(decl, compiler->global_declarations.children.first)
+    for (s32 i = 0; i < program->count; i += 1)
     {
-        if (decl->kind == AST_KIND_FUNCTION_DECLARATION)
+        IrFunction *function = program->items + i;
+        Ast *decl = function->decl;
+
+        u64 offset = string_builder_get_size(&codegen->section_text);
+
+        if (strings_are_equal(entry_point_name, ast_get_name(decl)))
         {
-            u64 offset = string_builder_get_size(&codegen->section_text);
+            jump_target = offset;
+        }
 
-            if (strings_are_equal(entry_point_name, decl->name))
-            {
-                jump_target = offset;
-            }
+        arm64_emit_function(codegen, function, target_platform);
 
-            arm64_emit_function(compiler, codegen, decl, target_platform);
+        u64 size = string_builder_get_size(&codegen->section_text) - offset;
 
-            u64 size = string_builder_get_size(&codegen->section_text) - offset;
+        array_append(symbol_table, ((SymbolEntry) { .name = ast_get_name(decl), .offset = offset, .size = size }));
 
-            array_append(symbol_table, ((SymbolEntry) { .name = decl->name, .offset = offset, .size = size }));
-        }
+        codegen_flush_text(codegen, JulsArchitectureArm64);
+    }
+
+    if (codegen->print_peephole_stats)
+    {
+        peephole_print_stats(arm64_peephole_rules, ArrayCount(arm64_peephole_rules));
     }
 
     if (jump_target > 0)
     {
-        *jump_patch = 0x94000000 | (((u32) (jump_target - jump_location) >> 2) & 0x3FFFFFF);
+        codegen_patch_text_u32(codegen, jump_patch_offset, 0x94000000 | (((u32) (jump_target - jump_location) >> 2) & 0x3FFFFFF));
     }
     else
     {
@@ -1415,8 +1278,12 @@ generate_arm64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table,
         FunctionCallPatch *patch = codegen->function_call_patches.items + i;
         Ast *function_decl = patch->function_decl;
 
-        assert(function_decl->address != S64MAX);
+        assert(ast_get_function(function_decl)->address != S64MAX);
 
-        *(u32 *) patch->patch = 0x94000000 | (((u32) (function_decl->address - patch->instruction_offset) >> 2) & 0x3FFFFFF);
+        u32 inst = patch->is_jump ? 0x14000000 : 0x94000000;
+
+        codegen_patch_text_u32(codegen, patch->patch_offset, inst | (((u32) (ast_get_function(function_decl)->address - patch->instruction_offset) >> 2) & 0x3FFFFFF));
     }
+
+    codegen_flush_text(codegen, JulsArchitectureArm64);
 }
@@ -13,7 +13,7 @@ typedef enum
     DATATYPE_FLAG_UNSIGNED = (1 << 0),
 } DatatypeFlag;
 
-typedef u16 DatatypeId;
+typedef u32 DatatypeId;
 
 typedef struct
 {
@@ -23,14 +23,24 @@ typedef struct
     DatatypeId ref;
 
     String name;
+    Atom name_atom;
+
     u64 size;
 } Datatype;
 
+// Every datatype exists only once. Named types are found by the atom of their name, the
+// unnamed ones (pointers) by their kind and the type they refer to.
 typedef struct
 {
+    // indexed by DatatypeId, index 0 is the invalid datatype
     s32 count;
     s32 allocated;
     Datatype *items;
+
+    // open addressing with linear probing, 0 is an empty slot, slot_count is a power of two
+    u32 slot_count;
+    DatatypeId *name_slots;
+    DatatypeId *structure_slots;
 } DatatypeTable;
 
 typedef enum
@@ -76,42 +86,74 @@ typedef enum
     AST_KIND_MEMBER                             = 38,
     AST_KIND_POINTER                            = 39,
     AST_KIND_CAST                               = 40,
+    AST_KIND_EXPRESSION_BINOP_MOD               = 41,
+    AST_KIND_EXPRESSION_BINOP_AND               = 42,
+    AST_KIND_EXPRESSION_BINOP_OR                = 43,
+    AST_KIND_EXPRESSION_BINOP_XOR               = 44,
+    AST_KIND_EXPRESSION_SHIFT_LEFT              = 45,
+    AST_KIND_EXPRESSION_SHIFT_RIGHT             = 46,
 } AstKind;
 
+typedef enum
+{
+    AST_INLINE_AUTOMATIC    = 0,
+    AST_INLINE_ALWAYS       = 1,
+    AST_INLINE_NEVER        = 2,
+} AstInline;
+
 typedef struct Ast Ast;
 
+// Nodes refer to each other by id, 0 is no node.
+typedef u32 AstId;
+
 typedef struct
 {
-    Ast *first;
-    Ast *last;
+    AstId first;
+    AstId last;
 } AstList;
 
+// Only what every walk over the tree needs is stored in the node itself. Function declarations
+// keep the rest in the function table and string literals their value in the string table, the
+// names are the atoms.
 struct Ast
 {
-    AstKind kind;
-    DatatypeId type_id;
+    // AstKind
+    u8 kind;
 
-    Ast *next;
-    Ast *prev;
-    Ast *parent;
+    // start of the node in the source, see ast_get_source_location
+    u16 file_index;
+    u32 source_index;
 
-    String name;
-    SourceLocation source_location;
+    DatatypeId type_id;
+    Atom name_atom;
 
-    Ast *decl;
-    Ast *type_def;
-    Ast *left_expr;
-    Ast *right_expr;
+    AstId id;
+    AstId next;
 
-    AstList children;
-    AstList parameters;
+    union
+    {
+        // resolved declaration of identifiers, assignments and calls, the variable of for
+        AstId decl;
 
-    s64 size;
-    s64 stack_offset;
-    s64 address;
+        // function declarations, index into the function table
+        u32 function_index;
+    };
+
+    AstId type_def;
+    AstId left_expr;
+    AstId right_expr;
 
     union
     {
+        // statements of blocks, if, for and function declarations, arguments of calls
+        AstList children;
+
+        // first IR value of a variable or parameter, strings take two consecutive values
+        s32 ir_value;
+
+        // string literals, index into the string table
+        u32 string_index;
+
         bool _bool;
 
         u8  _u8;
@@ -126,30 +168,118 @@ struct Ast
     };
 };
 
-#define For(iter, first) for (Ast *iter = (first); iter; iter = iter->next)
-#define ForReversed(iter, last) for (Ast *iter = (last); iter; iter = iter->prev)
+typedef struct
+{
+    AstList parameters;
+
+    s64 address;
+
+    // set on function declarations that are called from the entry point
+    bool is_reachable;
 
-typedef struct AstBucket AstBucket;
+    // #inline or #no_inline
+    AstInline inlining;
 
-struct AstBucket
+    // the body starts at token body_first_token of the file, when parsing lazily it is only
+    // parsed once the function is reachable
+    bool body_is_parsed;
+    u16 file_index;
+    s32 body_first_token;
+
+    // index of the function in the IrProgram, -1 for intrinsics and functions without ir
+    s32 ir_index;
+} AstFunction;
+
+typedef struct
 {
     s32 count;
-    AstBucket *next;
-    Ast nodes[64];
-};
+    s32 allocated;
+    AstFunction *items;
+} AstFunctionArray;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    Ast **items;
+} AstArray;
+
+#define AST_BUCKET_SHIFT 12
+#define AST_BUCKET_SIZE (1 << AST_BUCKET_SHIFT)
+
+#ifndef AST_ARENA_CHUNK_SIZE
+#  define AST_ARENA_CHUNK_SIZE (8 * 1024 * 1024)
+#endif
 
+// The nodes live in buckets of AST_BUCKET_SIZE nodes that never move. The upper bits of an id
+// select the bucket, the lower bits the node in it. The buckets are carved from an arena of
+// AST_ARENA_CHUNK_SIZE chunks that is only released as a whole, so the nodes always start out
+// as fresh zeroed pages from the system.
 typedef struct
 {
-    AstBucket *first_bucket;
-    AstBucket *last_bucket;
-} AstBucketArray;
+    Allocator arena;
+
+    u32 node_count;
+    AstArray buckets;
+
+    AstFunctionArray functions;
+    StringArray strings;
+} AstStorage;
+
+static AstStorage ast_storage;
+
+static inline Ast *
+ast_get(AstId id)
+{
+    Ast *result = 0;
+
+    if (id)
+    {
+        result = ast_storage.buckets.items[id >> AST_BUCKET_SHIFT] + (id & (AST_BUCKET_SIZE - 1));
+    }
+
+    return result;
+}
+
+static inline AstFunction *
+ast_get_function(Ast *decl)
+{
+    assert(decl->kind == AST_KIND_FUNCTION_DECLARATION);
+    return ast_storage.functions.items + decl->function_index;
+}
+
+static inline SourceLocation
+ast_get_source_location(Ast *ast)
+{
+    SourceLocation result;
+
+    result.index = ast->source_index;
+    result.file_index = ast->file_index;
+
+    return result;
+}
+
+static inline String
+ast_get_name(Ast *ast)
+{
+    return atom_table.items[ast->name_atom].string;
+}
+
+static inline String
+ast_get_string(Ast *ast)
+{
+    assert(ast->kind == AST_KIND_LITERAL_STRING);
+    return ast_storage.strings.items[ast->string_index];
+}
+
+#define For(iter, first) for (Ast *iter = ast_get(first); iter; iter = ast_get(iter->next))
 
 static inline Datatype *
 get_datatype(DatatypeTable *table, DatatypeId id)
 {
     Datatype *result = 0;
 
-    if ((id > 0) && (id < table->count))
+    if ((id > 0) && (id < (u32) table->count))
     {
         result = table->items + id;
     }
@@ -157,16 +287,35 @@ get_datatype(DatatypeTable *table, DatatypeId id)
     return result;
 }
 
+static inline u32
+hash_datatype_name(Atom name_atom)
+{
+    return name_atom * 2654435761u;
+}
+
+static inline u32
+hash_datatype_structure(DatatypeKind kind, DatatypeId ref_id)
+{
+    return ((u32) kind * 2246822519u) ^ (ref_id * 2654435761u);
+}
+
 static inline DatatypeId
-find_datatype_by_name(DatatypeTable *table, String name)
+find_datatype_by_name(DatatypeTable *table, Atom name_atom)
 {
-    for (s32 i = 1; i < table->count; i += 1)
+    if (table->slot_count && name_atom)
     {
-        Datatype *datatype = table->items + i;
+        u32 index = hash_datatype_name(name_atom) & (table->slot_count - 1);
 
-        if (strings_are_equal(datatype->name, name))
+        while (table->name_slots[index])
         {
-            return i;
+            DatatypeId id = table->name_slots[index];
+
+            if (table->items[id].name_atom == name_atom)
+            {
+                return id;
+            }
+
+            index = (index + 1) & (table->slot_count - 1);
         }
     }
 
@@ -176,34 +325,125 @@ find_datatype_by_name(DatatypeTable *table, String name)
 static inline DatatypeId
 find_datatype_by_kind_and_reference(DatatypeTable *table, DatatypeKind kind, DatatypeId ref_id)
 {
-    for (s32 i = 1; i < table->count; i += 1)
+    if (table->slot_count)
     {
-        Datatype *datatype = table->items + i;
+        u32 index = hash_datatype_structure(kind, ref_id) & (table->slot_count - 1);
 
-        if ((datatype->kind == kind) && (datatype->ref == ref_id))
+        while (table->structure_slots[index])
         {
-            return i;
+            Datatype *datatype = table->items + table->structure_slots[index];
+
+            if ((datatype->kind == kind) && (datatype->ref == ref_id))
+            {
+                return table->structure_slots[index];
+            }
+
+            index = (index + 1) & (table->slot_count - 1);
         }
     }
 
     return 0;
 }
 
+static void
+datatype_table_insert(DatatypeTable *table, DatatypeId id)
+{
+    Datatype *datatype = table->items + id;
+    DatatypeId *slots;
+    u32 index;
+
+    if (datatype->name_atom)
+    {
+        slots = table->name_slots;
+        index = hash_datatype_name(datatype->name_atom);
+    }
+    else
+    {
+        slots = table->structure_slots;
+        index = hash_datatype_structure(datatype->kind, datatype->ref);
+    }
+
+    index &= table->slot_count - 1;
+
+    while (slots[index])
+    {
+        index = (index + 1) & (table->slot_count - 1);
+    }
+
+    slots[index] = id;
+}
+
+// The caller makes sure that the datatype isn't in the table yet.
+static DatatypeId
+add_datatype(DatatypeTable *table, Datatype datatype)
+{
+    if (table->count == 0)
+    {
+        array_append(table, ((Datatype) { 0 }));
+    }
+
+    assert(datatype.name_atom ? !find_datatype_by_name(table, datatype.name_atom)
+                              : !find_datatype_by_kind_and_reference(table, datatype.kind, datatype.ref));
+
+    // keep the load factor below 3/4
+    if ((4 * (u32) table->count) >= (3 * table->slot_count))
+    {
+        if (table->slot_count > 0)
+        {
+            free_block(&default_allocator, table->structure_slots, table->slot_count * sizeof(DatatypeId));
+            free_block(&default_allocator, table->name_slots, table->slot_count * sizeof(DatatypeId));
+        }
+
+        table->slot_count = (table->slot_count == 0) ? 64 : 2 * table->slot_count;
+        table->name_slots = alloc_array(&default_allocator, DatatypeId, table->slot_count, 8, true);
+        table->structure_slots = alloc_array(&default_allocator, DatatypeId, table->slot_count, 8, true);
+
+        for (s32 i = 1; i < table->count; i += 1)
+        {
+            datatype_table_insert(table, (DatatypeId) i);
+        }
+    }
+
+    DatatypeId id = (DatatypeId) table->count;
+
+    array_append(table, datatype);
+    datatype_table_insert(table, id);
+
+    return id;
+}
+
+static DatatypeId
+get_pointer_datatype(DatatypeTable *table, DatatypeId ref_id)
+{
+    DatatypeId id = find_datatype_by_kind_and_reference(table, DATATYPE_POINTER, ref_id);
+
+    if (!id)
+    {
+        id = add_datatype(table, (Datatype) { .kind = DATATYPE_POINTER, .flags = 0, .ref = ref_id, .name = S("*"), .size = 8 });
+    }
+
+    return id;
+}
+
+static inline AstId
+ast_get_id(Ast *ast)
+{
+    return ast ? ast->id : 0;
+}
+
 static inline void
 ast_list_append(AstList *list, Ast *ast)
 {
     if (list->last)
     {
-        ast->prev = list->last;
-        list->last->next = ast;
+        ast_get(list->last)->next = ast->id;
     }
     else
     {
-        ast->prev = 0;
-        list->first = ast;
+        list->first = ast->id;
     }
 
-    list->last = ast;
+    list->last = ast->id;
     ast->next = 0;
 }
 
@@ -221,68 +461,85 @@ ast_list_count(AstList *list)
 }
 
 static Ast *
-append_ast(AstBucketArray *array, AstKind ast_kind, SourceLocation source_location)
+append_ast(AstKind ast_kind, SourceLocation source_location)
 {
-    if (!array->last_bucket || (array->last_bucket->count >= ArrayCount(array->last_bucket->nodes)))
-    {
-        AstBucket *new_bucket = (AstBucket *) allocate(sizeof(AstBucket));
+    AstStorage *storage = &ast_storage;
 
-        new_bucket->count = 0;
-        new_bucket->next = 0;
-
-        if (array->last_bucket)
-        {
-            array->last_bucket->next = new_bucket;
-        }
-        else
-        {
-            array->first_bucket = new_bucket;
-        }
-
-        array->last_bucket = new_bucket;
+    // id 0 is no node
+    if (storage->node_count == 0)
+    {
+        storage->node_count = 1;
     }
 
-    Ast *node = array->last_bucket->nodes + array->last_bucket->count;
-    array->last_bucket->count += 1;
-
+    if ((storage->node_count >> AST_BUCKET_SHIFT) >= (u32) storage->buckets.count)
     {
-        u8 *ptr = (u8 *) node;
-        s64 size = sizeof(*node);
-        while (size--) *ptr++ = 0;
+        storage->arena.chunk_size = AST_ARENA_CHUNK_SIZE;
+        array_append(&storage->buckets, alloc_array(&storage->arena, Ast, AST_BUCKET_SIZE, 64, false));
     }
 
-    node->kind = ast_kind;
-    node->source_location = source_location;
+    AstId id = storage->node_count;
+    storage->node_count += 1;
+
+    Ast *node = ast_get(id);
+
+    node->kind = (u8) ast_kind;
+    node->file_index = source_location.file_index;
+    node->source_index = source_location.index;
+    node->id = id;
 
     return node;
 }
 
+// Every node, id and pointer into the tree is invalid afterwards.
+static void
+free_ast_storage(void)
+{
+    free_all(&ast_storage.arena);
+
+    ast_storage.node_count = 0;
+    ast_storage.buckets.count = 0;
+    ast_storage.functions.count = 0;
+    ast_storage.strings.count = 0;
+}
+
+static u32
+append_ast_function(void)
+{
+    u32 index = ast_storage.functions.count;
+    array_append(&ast_storage.functions, ((AstFunction) { .address = S64MAX, .ir_index = -1 }));
+    return index;
+}
+
+static u32
+append_ast_string(String str)
+{
+    u32 index = ast_storage.strings.count;
+    array_append(&ast_storage.strings, str);
+    return index;
+}
+
 static inline void
 ast_set_decl(Ast *ast, Ast *decl)
 {
-    decl->parent = ast;
-    ast->decl = decl;
+    ast->decl = ast_get_id(decl);
 }
 
 static inline void
 ast_set_type_def(Ast *ast, Ast *type_def)
 {
-    type_def->parent = ast;
-    ast->type_def = type_def;
+    ast->type_def = ast_get_id(type_def);
 }
 
 static inline void
 ast_set_left_expr(Ast *ast, Ast *expr)
 {
-    expr->parent = ast;
-    ast->left_expr = expr;
+    ast->left_expr = ast_get_id(expr);
 }
 
 static inline void
 ast_set_right_expr(Ast *ast, Ast *expr)
 {
-    expr->parent = ast;
-    ast->right_expr = expr;
+    ast->right_expr = ast_get_id(expr);
 }
 
 static void
@@ -292,11 +549,11 @@ print_ast(Ast *ast, s32 indent)
     {
         case AST_KIND_FUNCTION_DECLARATION:
         {
-            fprintf(stderr, "%*sFunctionDeclaration '%.*s'\n", indent, "", (int) ast->name.count, ast->name.data);
+            fprintf(stderr, "%*sFunctionDeclaration '%.*s'\n", indent, "", (int) ast_get_name(ast).count, ast_get_name(ast).data);
 
             fprintf(stderr, "%*s(\n", indent, "");
 
-            For(elem, ast->parameters.first)
+            For(elem, ast_get_function(ast)->parameters.first)
             {
                 print_ast(elem, indent + 2);
             }
@@ -315,11 +572,11 @@ print_ast(Ast *ast, s32 indent)
 
         case AST_KIND_VARIABLE_DECLARATION:
         {
-            fprintf(stderr, "%*sVariableDeclaration '%.*s' (type_id = %u)\n", indent, "", (int) ast->name.count, ast->name.data, ast->type_id);
+            fprintf(stderr, "%*sVariableDeclaration '%.*s' (type_id = %u)\n", indent, "", (int) ast_get_name(ast).count, ast_get_name(ast).data, ast->type_id);
 
             if (ast->right_expr)
             {
-                print_ast(ast->right_expr, indent + 2);
+                print_ast(ast_get(ast->right_expr), indent + 2);
             }
         } break;
 
@@ -327,55 +584,55 @@ print_ast(Ast *ast, s32 indent)
         {
             fprintf(stderr, "%*sCompareLess\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
-            print_ast(ast->right_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
+            print_ast(ast_get(ast->right_expr), indent + 2);
         } break;
 
         case AST_KIND_EXPRESSION_COMPARE_GREATER:
         {
             fprintf(stderr, "%*sCompareGreater\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
-            print_ast(ast->right_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
+            print_ast(ast_get(ast->right_expr), indent + 2);
         } break;
 
         case AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL:
         {
             fprintf(stderr, "%*sCompareLessEqual\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
-            print_ast(ast->right_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
+            print_ast(ast_get(ast->right_expr), indent + 2);
         } break;
 
         case AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL:
         {
             fprintf(stderr, "%*sCompareGreaterEqual\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
-            print_ast(ast->right_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
+            print_ast(ast_get(ast->right_expr), indent + 2);
         } break;
 
         case AST_KIND_EXPRESSION_BINOP_ADD:
         {
             fprintf(stderr, "%*sBinopAdd\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
-            print_ast(ast->right_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
+            print_ast(ast_get(ast->right_expr), indent + 2);
         } break;
 
         case AST_KIND_EXPRESSION_BINOP_MINUS:
         {
             fprintf(stderr, "%*sBinopMinus\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
-            print_ast(ast->right_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
+            print_ast(ast_get(ast->right_expr), indent + 2);
         } break;
 
         case AST_KIND_EXPRESSION_UNARY_MINUS:
         {
             fprintf(stderr, "%*sUnaryMinus\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
         } break;
 
         case AST_KIND_LITERAL_BOOLEAN:
@@ -395,31 +652,31 @@ print_ast(Ast *ast, s32 indent)
 
         case AST_KIND_LITERAL_STRING:
         {
-            fprintf(stderr, "%*sLiteralString(type_id = %u) '%.*s'\n", indent, "", ast->type_id, (int) ast->name.count, ast->name.data);
+            fprintf(stderr, "%*sLiteralString(type_id = %u) '%.*s'\n", indent, "", ast->type_id, (int) ast_get_string(ast).count, ast_get_string(ast).data);
         } break;
 
         case AST_KIND_IDENTIFIER:
         {
-            fprintf(stderr, "%*sIdentifier '%.*s'\n", indent, "", (int) ast->name.count, ast->name.data);
+            fprintf(stderr, "%*sIdentifier '%.*s'\n", indent, "", (int) ast_get_name(ast).count, ast_get_name(ast).data);
         } break;
 
         case AST_KIND_QUERY_SIZE_OF:
         {
             fprintf(stderr, "%*sSizeOf\n", indent, "");
-            print_ast(ast->type_def, indent + 2);
+            print_ast(ast_get(ast->type_def), indent + 2);
         } break;
 
         case AST_KIND_QUERY_TYPE_OF:
         {
             fprintf(stderr, "%*sTypeOf\n", indent, "");
-            print_ast(ast->left_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
         } break;
 
         case AST_KIND_FUNCTION_CALL:
         {
             fprintf(stderr, "%*sFunctionCall\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
 
             fprintf(stderr, "%*s(\n", indent, "");
 
@@ -437,7 +694,7 @@ print_ast(Ast *ast, s32 indent)
 
             fprintf(stderr, "%*s(\n", indent, "");
 
-            print_ast(ast->left_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
 
             fprintf(stderr, "%*s)\n", indent, "");
 
@@ -454,7 +711,7 @@ print_ast(Ast *ast, s32 indent)
         case AST_KIND_RETURN:
         {
             fprintf(stderr, "%*sReturn\n", indent, "");
-            print_ast(ast->left_expr, indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
         } break;
 
         case AST_KIND_FOR:
@@ -463,9 +720,9 @@ print_ast(Ast *ast, s32 indent)
 
             fprintf(stderr, "%*s(\n", indent, "");
 
-            print_ast(ast->decl, indent + 2);
-            print_ast(ast->left_expr, indent + 2);
-            print_ast(ast->right_expr, indent + 2);
+            print_ast(ast_get(ast->decl), indent + 2);
+            print_ast(ast_get(ast->left_expr), indent + 2);
+            print_ast(ast_get(ast->right_expr), indent + 2);
 
             fprintf(stderr, "%*s)\n", indent, "");
 
@@ -481,14 +738,14 @@ print_ast(Ast *ast, s32 indent)
 
         case AST_KIND_ASSIGN:
         {
-            fprintf(stderr, "%*sAssign '%.*s'\n", indent, "", (int) ast->name.count, ast->name.data);
-            print_ast(ast->right_expr, indent + 2);
+            fprintf(stderr, "%*sAssign '%.*s'\n", indent, "", (int) ast_get_name(ast).count, ast_get_name(ast).data);
+            print_ast(ast_get(ast->right_expr), indent + 2);
         } break;
 
         case AST_KIND_PLUS_ASSIGN:
         {
-            fprintf(stderr, "%*sPlusAssign '%.*s'\n", indent, "", (int) ast->name.count, ast->name.data);
-            print_ast(ast->right_expr, indent + 2);
+            fprintf(stderr, "%*sPlusAssign '%.*s'\n", indent, "", (int) ast_get_name(ast).count, ast_get_name(ast).data);
+            print_ast(ast_get(ast->right_expr), indent + 2);
         } break;
 
         case AST_KIND_BLOCK:
@@ -510,112 +767,114 @@ print_ast(Ast *ast, s32 indent)
     }
 }
 
-static Ast *
-find_declaration_by_name(Ast *ast, String name)
+// Declarations that are visible at the current point of the type checking. Every declaration
+// is a binding that hides the previous binding of the same name until its scope ends, so a
+// lookup is a single array access indexed by the atom of the name. The functions are bound in
+// the outermost scope and stay visible for the whole checking.
+typedef struct
 {
-    Ast *result = 0;
+    Ast *decl;
+
+    // binding of the same name that this one hides, -1 if there is none
+    s32 shadowed;
+} ScopeBinding;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    ScopeBinding *items;
+} ScopeBindingArray;
+
+typedef struct
+{
+    ScopeBindingArray bindings;
+
+    // innermost binding of every atom, -1 if there is none
+    s32 head_count;
+    s32 *heads;
+} ScopeTable;
+
+static inline s32
+scope_begin(ScopeTable *scopes)
+{
+    return scopes->bindings.count;
+}
+
+// Removes the bindings made since scope_begin returned mark.
+static void
+scope_end(ScopeTable *scopes, s32 mark)
+{
+    while (scopes->bindings.count > mark)
+    {
+        ScopeBinding *binding = scopes->bindings.items + scopes->bindings.count - 1;
+
+        scopes->heads[binding->decl->name_atom] = binding->shadowed;
+        scopes->bindings.count -= 1;
+    }
+}
+
+static void
+scope_declare(ScopeTable *scopes, Ast *decl)
+{
+    Atom atom = decl->name_atom;
 
-    while (ast->parent)
+    if (atom >= (u32) scopes->head_count)
     {
-        Ast *before = ast;
-        ast = ast->parent;
+        s32 head_count = (scopes->head_count == 0) ? 256 : scopes->head_count;
 
-        switch (ast->kind)
+        while ((u32) head_count <= atom)
         {
-            case AST_KIND_FUNCTION_DECLARATION:
-            {
-                For(statement, ast->children.first)
-                {
-                    if (statement == before) break;
-
-                    if ((statement->kind == AST_KIND_VARIABLE_DECLARATION) &&
-                        strings_are_equal(statement->name, name))
-                    {
-                        result = statement;
-                        break;
-                    }
-                }
-
-                if (!result)
-                {
-                    For(parameter, ast->parameters.first)
-                    {
-                        assert(parameter->kind == AST_KIND_VARIABLE_DECLARATION);
-
-                        if (strings_are_equal(parameter->name, name))
-                        {
-                            result = parameter;
-                            break;
-                        }
-                    }
-                }
-            } break;
-
-            case AST_KIND_GLOBAL_SCOPE:
-            {
-                For(statement, ast->children.first)
-                {
-                    if (((statement->kind == AST_KIND_VARIABLE_DECLARATION) ||
-                         (statement->kind == AST_KIND_VARIABLE_DECLARATION)) &&
-                        strings_are_equal(statement->name, name))
-                    {
-                        result = statement;
-                        break;
-                    }
-                }
-            } break;
-
-            case AST_KIND_FOR:
-            {
-                Ast *declaration = ast->decl;
+            head_count *= 2;
+        }
 
-                if ((declaration->kind == AST_KIND_VARIABLE_DECLARATION) &&
-                    strings_are_equal(declaration->name, name))
-                {
-                    result = declaration;
-                }
-            } break;
+        scopes->heads = reallocate(&default_allocator, scopes->heads, scopes->head_count * sizeof(s32), head_count * sizeof(s32), 8, false);
 
-            case AST_KIND_BLOCK:
-            {
-                For(statement, ast->children.first)
-                {
-                    if (statement == before) break;
-
-                    if ((statement->kind == AST_KIND_VARIABLE_DECLARATION) &&
-                        strings_are_equal(statement->name, name))
-                    {
-                        result = statement;
-                        break;
-                    }
-                }
-            } break;
-
-            default:
-            {
-            } break;
+        for (s32 i = scopes->head_count; i < head_count; i += 1)
+        {
+            scopes->heads[i] = -1;
         }
 
-        if (result) break;
+        scopes->head_count = head_count;
     }
 
-    return result;
+    array_append(&scopes->bindings, ((ScopeBinding) { .decl = decl, .shadowed = scopes->heads[atom] }));
+    scopes->heads[atom] = scopes->bindings.count - 1;
 }
 
 static Ast *
-find_function_declaration_by_name(Ast *first, String name)
+find_declaration_by_name(ScopeTable *scopes, Atom name_atom)
 {
-    Ast *result = 0;
+    if ((name_atom < (u32) scopes->head_count) && (scopes->heads[name_atom] >= 0))
+    {
+        Ast *decl = scopes->bindings.items[scopes->heads[name_atom]].decl;
+
+        if (decl->kind == AST_KIND_VARIABLE_DECLARATION)
+        {
+            return decl;
+        }
+    }
+
+    return 0;
+}
+
+// Skips the variables that hide the function.
+static Ast *
+find_function_declaration_by_name(ScopeTable *scopes, Atom name_atom)
+{
+    s32 index = (name_atom < (u32) scopes->head_count) ? scopes->heads[name_atom] : -1;
 
-    For(decl, first)
+    while (index >= 0)
     {
-        if ((decl->kind == AST_KIND_FUNCTION_DECLARATION) &&
-            strings_are_equal(decl->name, name))
+        ScopeBinding *binding = scopes->bindings.items + index;
+
+        if (binding->decl->kind == AST_KIND_FUNCTION_DECLARATION)
         {
-            result = decl;
-            break;
+            return binding->decl;
         }
+
+        index = binding->shadowed;
     }
 
-    return result;
+    return 0;
 }
@@ -1,8 +1,62 @@
+// When the text section gets streamed into the output file, it starts right after the headers
+// and .rodata goes behind it. The code needs the address of .rodata before the size of the text
+// is known, so it is put at a fixed address, which limits the text to a bit less than 1 GiB.
+#define ELF_BASE_VADDR 0x200000
+#define ELF_STREAMED_TEXT_OFFSET 0x1000
+#define ELF_STREAMED_CSTRING_VADDR 0x40000000
+
 static void
-generate_elf(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table, JulsArchitecture target_architecture)
+elf_append_section_header(StringBuilder *builder, u32 name, u32 type, u64 flags, u64 addr, u64 offset, u64 size,
+                          u32 link, u32 info, u64 addralign, u64 entsize)
 {
-    u64 page_size = 1 << 12; // 4096
+    string_builder_append_u32le(builder, name); // sh_name
+    string_builder_append_u32le(builder, type); // sh_type
+    string_builder_append_u64le(builder, flags); // sh_flags
+    string_builder_append_u64le(builder, addr); // sh_addr
+    string_builder_append_u64le(builder, offset); // sh_offset
+    string_builder_append_u64le(builder, size); // sh_size
+    string_builder_append_u32le(builder, link); // sh_link
+    string_builder_append_u32le(builder, info); // sh_info
+    string_builder_append_u64le(builder, addralign); // sh_addralign
+    string_builder_append_u64le(builder, entsize); // sh_entsize
+}
+
+// Appends the names to builder, which has to be at the start of .strtab, and the entries to symbol_table_section.
+static void
+elf_append_symbols(StringBuilder *builder, StringBuilder *symbol_table_section, SymbolTable symbol_table, u64 text_vaddr)
+{
+    string_builder_append_u32le(symbol_table_section, 0); // st_name
+    string_builder_append_u8(symbol_table_section, 0);    // st_info
+    string_builder_append_u8(symbol_table_section, 0);    // st_other
+    string_builder_append_u16le(symbol_table_section, 0); // st_shndx
+    string_builder_append_u64le(symbol_table_section, 0); // st_value
+    string_builder_append_u64le(symbol_table_section, 0); // st_size
 
+    u64 strtab_offset = string_builder_get_size(builder);
+
+    string_builder_append_u8(builder, 0);
+
+    for (s32 i = 0; i < symbol_table.count; i += 1)
+    {
+        SymbolEntry *entry = symbol_table.items + i;
+        u32 name_offset = (u32) (string_builder_get_size(builder) - strtab_offset);
+
+        string_builder_append_u32le(symbol_table_section, name_offset); // st_name
+        string_builder_append_u8(symbol_table_section, 0x12);    // st_info
+        string_builder_append_u8(symbol_table_section, 0);    // st_other
+        string_builder_append_u16le(symbol_table_section, 2); // st_shndx
+        string_builder_append_u64le(symbol_table_section, text_vaddr + entry->offset); // st_value
+        string_builder_append_u64le(symbol_table_section, entry->size); // st_size
+
+        string_builder_append_string(builder, entry->name);
+        string_builder_append_u8(builder, 0);
+    }
+}
+
+// Everything of the file header up to e_entry.
+static void
+elf_append_identification(StringBuilder *builder, JulsArchitecture target_architecture)
+{
     string_builder_append_string(builder, S("\x7F""ELF"));
 
     string_builder_append_u8(builder, 2); // 1 - 32bit, 2 - 64bit
@@ -30,6 +84,14 @@ generate_elf(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table,
     }
 
     string_builder_append_u32le(builder, 1); // version
+}
+
+static void
+generate_elf(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table, JulsArchitecture target_architecture)
+{
+    u64 page_size = 1 << 12; // 4096
+
+    elf_append_identification(builder, target_architecture);
 
     u64 *e_entry = string_builder_append_size(builder, 8); // e_entry
     u64 *e_phoff = string_builder_append_size(builder, 8); // e_phoff
@@ -73,7 +135,7 @@ generate_elf(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table,
 
     *program_header_count = program_header_index;
 
-    u64 vaddr = 0x200000;
+    u64 vaddr = ELF_BASE_VADDR;
 
     // .rodata
 
@@ -119,26 +181,13 @@ generate_elf(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table,
         {
             Patch *patch = codegen.patches.items + i;
 
+            // the text section got copied into the file already
+            void *patch_addr = string_builder_get_pointer(builder, text_offset + patch->patch_offset);
+
             u64 instruction_address = text_vaddr + patch->instruction_offset;
             u64 string_address = cstring_vaddr + cstring_offset + patch->string_offset;
 
-            if (target_architecture == JulsArchitectureArm64)
-            {
-                u64 string_page = string_address / 4096;
-                u64 instruction_page = instruction_address / 4096;
-
-                s64 page_count = string_page - instruction_page;
-                u64 offset = string_address & 0xFFF;
-
-                // ADRP
-                *((u32 *) patch->patch + 0) = 0x90000000 | ((page_count & 0x3) << 29) | ((page_count & 0x1FFFFC) << 3) | ARM64_R1;
-                // ADD (immediate)
-                *((u32 *) patch->patch + 1) = 0x91000000 | ((u32) offset << 10) | (ARM64_R1 << 5) | ARM64_R1;
-            }
-            else if (target_architecture == JulsArchitectureX86_64)
-            {
-                *(s32 *) patch->patch = (s32) ((s64) string_address - (s64) instruction_address);
-            }
+            codegen_patch_string_reference(patch_addr, instruction_address, string_address, target_architecture);
         }
     }
 
@@ -153,34 +202,11 @@ generate_elf(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table,
     // .strtab
 
     StringBuilder symbol_table_section;
-    initialize_string_builder(&symbol_table_section, &default_allocator);
-
-    string_builder_append_u32le(&symbol_table_section, 0); // st_name
-    string_builder_append_u8(&symbol_table_section, 0);    // st_info
-    string_builder_append_u8(&symbol_table_section, 0);    // st_other
-    string_builder_append_u16le(&symbol_table_section, 0); // st_shndx
-    string_builder_append_u64le(&symbol_table_section, 0); // st_value
-    string_builder_append_u64le(&symbol_table_section, 0); // st_size
+    initialize_string_builder(&symbol_table_section);
 
     u64 strtab_offset = string_builder_get_size(builder);
 
-    string_builder_append_u8(builder, 0);
-
-    for (s32 i = 0; i < symbol_table.count; i += 1)
-    {
-        SymbolEntry *entry = symbol_table.items + i;
-        u32 name_offset = (u32) (string_builder_get_size(builder) - strtab_offset);
-
-        string_builder_append_u32le(&symbol_table_section, name_offset); // st_name
-        string_builder_append_u8(&symbol_table_section, 0x12);    // st_info
-        string_builder_append_u8(&symbol_table_section, 0);    // st_other
-        string_builder_append_u16le(&symbol_table_section, 2); // st_shndx
-        string_builder_append_u64le(&symbol_table_section, text_vaddr + entry->offset); // st_value
-        string_builder_append_u64le(&symbol_table_section, entry->size); // st_size
-
-        string_builder_append_string(builder, entry->name);
-        string_builder_append_u8(builder, 0);
-    }
+    elf_append_symbols(builder, &symbol_table_section, symbol_table, text_vaddr);
 
     u64 strtab_size = string_builder_get_size(builder) - strtab_offset;
 
@@ -200,93 +226,173 @@ generate_elf(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table,
 
     // NULL section
 
-    string_builder_append_u32le(builder, 0); // sh_name
-    string_builder_append_u32le(builder, 0); // sh_type
-    string_builder_append_u64le(builder, 0); // sh_flags
-    string_builder_append_u64le(builder, 0); // sh_addr
-    string_builder_append_u64le(builder, 0); // sh_offset
-    string_builder_append_u64le(builder, 0); // sh_size
-    string_builder_append_u32le(builder, 0); // sh_link
-    string_builder_append_u32le(builder, 0); // sh_info
-    string_builder_append_u64le(builder, 0); // sh_addralign
-    string_builder_append_u64le(builder, 0); // sh_entsize
+    elf_append_section_header(builder, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
     section_header_index += 1;
 
     // .rodata
 
-    string_builder_append_u32le(builder, 17); // sh_name
-    string_builder_append_u32le(builder, 1); // sh_type
-    string_builder_append_u64le(builder, 2); // sh_flags
-    string_builder_append_u64le(builder, cstring_vaddr + cstring_offset); // sh_addr
-    string_builder_append_u64le(builder, cstring_offset); // sh_offset
-    string_builder_append_u64le(builder, cstring_end - cstring_offset); // sh_size
-    string_builder_append_u32le(builder, 0); // sh_link
-    string_builder_append_u32le(builder, 0); // sh_info
-    string_builder_append_u64le(builder, 1); // sh_addralign
-    string_builder_append_u64le(builder, 0); // sh_entsize
+    elf_append_section_header(builder, 17, 1, 2, cstring_vaddr + cstring_offset, cstring_offset, cstring_end - cstring_offset, 0, 0, 1, 0);
     section_header_index += 1;
 
     // .text
 
     assert(section_header_index == 2);
 
-    string_builder_append_u32le(builder, 11); // sh_name
-    string_builder_append_u32le(builder, 1); // sh_type
-    string_builder_append_u64le(builder, 6); // sh_flags
-    string_builder_append_u64le(builder, text_vaddr); // sh_addr
-    string_builder_append_u64le(builder, text_offset); // sh_offset
-    string_builder_append_u64le(builder, text_size); // sh_size
-    string_builder_append_u32le(builder, 0); // sh_link
-    string_builder_append_u32le(builder, 0); // sh_info
-    string_builder_append_u64le(builder, 1); // sh_addralign
-    string_builder_append_u64le(builder, 0); // sh_entsize
+    elf_append_section_header(builder, 11, 1, 6, text_vaddr, text_offset, text_size, 0, 0, 1, 0);
     section_header_index += 1;
 
     // .shstrtab
 
     *string_table_index = section_header_index;
 
-    string_builder_append_u32le(builder, 1); // sh_name
-    string_builder_append_u32le(builder, 3); // sh_type
-    string_builder_append_u64le(builder, 0); // sh_flags
-    string_builder_append_u64le(builder, 0); // sh_addr
-    string_builder_append_u64le(builder, shstrtab_offset); // sh_offset
-    string_builder_append_u64le(builder, shstrtab_size); // sh_size
-    string_builder_append_u32le(builder, 0); // sh_link
-    string_builder_append_u32le(builder, 0); // sh_info
-    string_builder_append_u64le(builder, 1); // sh_addralign
-    string_builder_append_u64le(builder, 0); // sh_entsize
+    elf_append_section_header(builder, 1, 3, 0, 0, shstrtab_offset, shstrtab_size, 0, 0, 1, 0);
     section_header_index += 1;
 
     // .strtab
 
     u16 strtab_index = section_header_index;
 
-    string_builder_append_u32le(builder, 33); // sh_name
-    string_builder_append_u32le(builder, 3); // sh_type
-    string_builder_append_u64le(builder, 0); // sh_flags
-    string_builder_append_u64le(builder, 0); // sh_addr
-    string_builder_append_u64le(builder, strtab_offset); // sh_offset
-    string_builder_append_u64le(builder, strtab_size); // sh_size
-    string_builder_append_u32le(builder, 0); // sh_link
-    string_builder_append_u32le(builder, 0); // sh_info
-    string_builder_append_u64le(builder, 1); // sh_addralign
-    string_builder_append_u64le(builder, 0); // sh_entsize
+    elf_append_section_header(builder, 33, 3, 0, 0, strtab_offset, strtab_size, 0, 0, 1, 0);
     section_header_index += 1;
 
     // .symtab
 
-    string_builder_append_u32le(builder, 25); // sh_name
-    string_builder_append_u32le(builder, 2); // sh_type
-    string_builder_append_u64le(builder, 0); // sh_flags
-    string_builder_append_u64le(builder, 0); // sh_addr
-    string_builder_append_u64le(builder, symtab_offset); // sh_offset
-    string_builder_append_u64le(builder, symtab_size); // sh_size
-    string_builder_append_u32le(builder, strtab_index); // sh_link // NOTE: this links to the .strtab section above
-    string_builder_append_u32le(builder, 1); // sh_info
-    string_builder_append_u64le(builder, 1); // sh_addralign
-    string_builder_append_u64le(builder, 24); // sh_entsize
+    // sh_link links to the .strtab section above
+    elf_append_section_header(builder, 25, 2, 0, 0, symtab_offset, symtab_size, strtab_index, 1, 1, 24);
     section_header_index += 1;
 
     *section_header_count = section_header_index;
 }
+
+static void
+elf_begin_streaming(Codegen *codegen, File *file)
+{
+    codegen->output_file = file;
+    codegen->text_file_offset = ELF_STREAMED_TEXT_OFFSET;
+    codegen->text_vaddr = ELF_BASE_VADDR + ELF_STREAMED_TEXT_OFFSET;
+    codegen->cstring_vaddr = ELF_STREAMED_CSTRING_VADDR;
+}
+
+// The counterpart of generate_elf when the text already got written to file by the code
+// generation. Writes the headers in front of the text and everything else behind it.
+static bool
+generate_elf_streamed(Codegen codegen, SymbolTable symbol_table, JulsArchitecture target_architecture, File *file)
+{
+    u64 page_size = 1 << 12; // 4096
+
+    assert(codegen.output_file == file);
+    assert(!codegen.section_text.size);
+
+    u64 text_offset = ELF_STREAMED_TEXT_OFFSET;
+    u64 text_vaddr = codegen.text_vaddr;
+    u64 text_size = string_builder_get_size(&codegen.section_text);
+
+    if ((text_vaddr + text_size) > ELF_STREAMED_CSTRING_VADDR)
+    {
+        fprintf(stderr, "error: the code is too big for --stream-output.\n");
+        return false;
+    }
+
+    // offset 0 of the builder is at cstring_offset in the file
+
+    StringBuilder builder;
+    initialize_string_builder(&builder);
+
+    u64 cstring_offset = Align(text_offset + text_size, page_size);
+    u64 cstring_vaddr = codegen.cstring_vaddr;
+
+    // .rodata
+
+    string_builder_append_builder(&builder, codegen.section_cstring);
+
+    u64 cstring_size = string_builder_get_size(&builder);
+
+    string_builder_align(&builder, 4, 0);
+
+    // .shstrtab
+
+    u64 shstrtab_offset = string_builder_get_size(&builder);
+
+    string_builder_append_string(&builder, S("\0.shstrtab\0.text\0.rodata\0.symtab\0.strtab\0"));
+
+    u64 shstrtab_size = string_builder_get_size(&builder) - shstrtab_offset;
+
+    // .strtab
+
+    StringBuilder symbol_table_section;
+    initialize_string_builder(&symbol_table_section);
+
+    u64 strtab_offset = string_builder_get_size(&builder);
+
+    elf_append_symbols(&builder, &symbol_table_section, symbol_table, text_vaddr);
+
+    u64 strtab_size = string_builder_get_size(&builder) - strtab_offset;
+
+    // .symtab
+
+    u64 symtab_offset = string_builder_get_size(&builder);
+
+    string_builder_append_builder(&builder, symbol_table_section);
+
+    u64 symtab_size = string_builder_get_size(&builder) - symtab_offset;
+
+    // section header, in the same order as generate_elf
+
+    u64 section_header_offset = string_builder_get_size(&builder);
+
+    elf_append_section_header(&builder, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    elf_append_section_header(&builder, 17, 1, 2, cstring_vaddr, cstring_offset, cstring_size, 0, 0, 1, 0);
+    elf_append_section_header(&builder, 11, 1, 6, text_vaddr, text_offset, text_size, 0, 0, 1, 0);
+    elf_append_section_header(&builder, 1, 3, 0, 0, cstring_offset + shstrtab_offset, shstrtab_size, 0, 0, 1, 0);
+    elf_append_section_header(&builder, 33, 3, 0, 0, cstring_offset + strtab_offset, strtab_size, 0, 0, 1, 0);
+    // sh_link links to the .strtab section above
+    elf_append_section_header(&builder, 25, 2, 0, 0, cstring_offset + symtab_offset, symtab_size, 4, 1, 1, 24);
+
+    u16 section_header_count = 6;
+    u16 string_table_index = 3;
+
+    // file header
+
+    StringBuilder header;
+    initialize_string_builder(&header);
+
+    elf_append_identification(&header, target_architecture);
+
+    string_builder_append_u64le(&header, text_vaddr); // e_entry
+    string_builder_append_u64le(&header, 64); // e_phoff
+    string_builder_append_u64le(&header, cstring_offset + section_header_offset); // e_shoff
+
+    string_builder_append_u32le(&header, 0); // flags
+    string_builder_append_u16le(&header, 64); // size of this file header
+
+    string_builder_append_u16le(&header, 56); // e_phentsize
+    string_builder_append_u16le(&header, 2); // e_phnum
+    string_builder_append_u16le(&header, 64); // e_shentsize
+    string_builder_append_u16le(&header, section_header_count); // e_shnum
+    string_builder_append_u16le(&header, string_table_index); // e_shstrndx
+
+    // program header, the first segment maps the headers and the text
+
+    string_builder_append_u32le(&header, 1); // type
+    string_builder_append_u32le(&header, 5); // flags
+    string_builder_append_u64le(&header, 0); // p_offset
+    string_builder_append_u64le(&header, ELF_BASE_VADDR); // p_vaddr
+    string_builder_append_u64le(&header, ELF_BASE_VADDR); // p_paddr
+    string_builder_append_u64le(&header, text_offset + text_size); // p_filesz
+    string_builder_append_u64le(&header, text_offset + text_size); // p_memsz
+    string_builder_append_u64le(&header, page_size); // p_align
+
+    string_builder_append_u32le(&header, 1); // type
+    string_builder_append_u32le(&header, 4); // flags
+    string_builder_append_u64le(&header, cstring_offset); // p_offset
+    string_builder_append_u64le(&header, cstring_vaddr); // p_vaddr
+    string_builder_append_u64le(&header, cstring_vaddr); // p_paddr
+    string_builder_append_u64le(&header, cstring_size); // p_filesz
+    string_builder_append_u64le(&header, cstring_size); // p_memsz
+    string_builder_append_u64le(&header, page_size); // p_align
+
+    assert(string_builder_get_size(&header) <= text_offset);
+
+    return write_file(file, builder.data, cstring_offset, builder.size) &&
+           write_file(file, header.data, 0, header.size);
+}
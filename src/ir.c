@@ -0,0 +1,1623 @@
+// A linear three-address IR that sits between the type checker and the backends.
+//
+// Every function is a list of instructions over virtual registers (values). Locals and
+// parameters are mutable values, strings are split into two values (count and data),
+// so there is no memory in the IR at all. Control flow uses labels and jumps.
+
+typedef enum
+{
+    IR_OP_NOP               =  0,
+    IR_OP_CONSTANT          =  1,
+    IR_OP_STRING_ADDRESS    =  2,
+    IR_OP_COPY              =  3,
+    IR_OP_EXTEND            =  4,
+    IR_OP_ADD               =  5,
+    IR_OP_SUB               =  6,
+    IR_OP_COMPARE           =  7,
+    IR_OP_LABEL             =  8,
+    IR_OP_JUMP              =  9,
+    IR_OP_BRANCH            = 10,
+    IR_OP_CALL              = 11,
+    IR_OP_INTRINSIC         = 12,
+    IR_OP_RETURN            = 13,
+    IR_OP_TAIL_CALL         = 14,
+} IrOpcode;
+
+typedef enum
+{
+    IR_CONDITION_EQUAL          = 0,
+    IR_CONDITION_NOT_EQUAL      = 1,
+    IR_CONDITION_LESS           = 2,
+    IR_CONDITION_GREATER        = 3,
+    IR_CONDITION_LESS_EQUAL     = 4,
+    IR_CONDITION_GREATER_EQUAL  = 5,
+} IrCondition;
+
+typedef enum
+{
+    IR_INTRINSIC_EXIT   = 0,
+    IR_INTRINSIC_WRITE  = 1,
+} IrIntrinsic;
+
+//  CONSTANT        dst = immediate
+//  STRING_ADDRESS  dst = address of string
+//  COPY            dst = a
+//  EXTEND          dst = a extended from size bytes to 8 bytes
+//  ADD, SUB        dst = a op (b or immediate)
+//  COMPARE         dst = a condition (b or immediate), the result is 0 or 1
+//  LABEL           label:
+//  JUMP            goto label
+//  BRANCH          if (a condition (b or immediate)) goto label
+//  CALL            results = function(arguments)
+//  INTRINSIC       results = intrinsic(arguments)
+//  RETURN          return arguments
+//  TAIL_CALL       return function(arguments), the caller's frame is gone before the jump
+typedef struct
+{
+    IrOpcode opcode;
+    IrCondition condition;
+    IrIntrinsic intrinsic;
+
+    // operand size in bytes, values of a smaller size have undefined upper bytes
+    u8 size;
+    bool is_signed;
+    bool has_immediate;
+
+    s32 dst;
+    s32 a;
+    s32 b;
+    s64 immediate;
+
+    s32 label;
+    String string;
+    Ast *function;
+
+    // calls, intrinsics and returns keep their values in the operand list of the function, results first
+    s32 first_operand;
+    s32 result_count;
+    s32 argument_count;
+} IrInstruction;
+
+typedef enum
+{
+    IR_LOCATION_NONE        = 0,
+    IR_LOCATION_REGISTER    = 1,
+    IR_LOCATION_STACK       = 2,
+} IrLocation;
+
+typedef struct
+{
+    u8 size;
+
+    // live interval in instruction positions, every instruction i uses its operands at 2 * i
+    // and defines its results at 2 * i + 1
+    s32 start;
+    s32 end;
+
+    bool crosses_call;
+
+    // register preferences for the allocator
+    s32 hint_register;
+    s32 hint_value;
+
+    IrLocation location;
+    s32 reg;
+    s32 spill_slot;
+} IrValue;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    IrInstruction *items;
+} IrInstructionArray;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    IrValue *items;
+} IrValueArray;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    s32 *items;
+} IrValueList;
+
+typedef struct
+{
+    Ast *decl;
+
+    IrInstructionArray instructions;
+
+    // index 0 is the invalid value
+    IrValueArray values;
+    IrValueList operands;
+
+    // one value per argument word, strings take two
+    IrValueList parameters;
+
+    s32 label_count;
+
+    // filled in by the register allocator, has_calls is false for leaf functions
+    bool has_calls;
+    u64 used_callee_saved_registers;
+    s32 spill_slot_count;
+    s32 stack_argument_count;
+} IrFunction;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    IrFunction *items;
+} IrProgram;
+
+// The registers a backend hands to the allocator. Argument and return registers are only hints,
+// values get moved into place at calls and returns.
+// Tail calls can't pass arguments on the stack, the incoming stack arguments of the caller
+// may not have room for them. Six is the smaller argument register count of the backends.
+#define IR_MAX_TAIL_CALL_ARGUMENTS 6
+
+typedef struct
+{
+    s32 caller_saved[16];
+    s32 caller_saved_count;
+    s32 callee_saved[16];
+    s32 callee_saved_count;
+    s32 argument_registers[8];
+    s32 argument_register_count;
+    s32 return_registers[2];
+    s32 return_register_count;
+} IrRegisterInfo;
+
+static inline s32
+ir_new_value(IrFunction *function, u8 size)
+{
+    s32 value = function->values.count;
+
+    array_append(&function->values, ((IrValue) { .size = size, .hint_register = -1 }));
+
+    return value;
+}
+
+static inline s32
+ir_new_label(IrFunction *function)
+{
+    s32 label = function->label_count;
+    function->label_count += 1;
+    return label;
+}
+
+static inline void
+ir_emit(IrFunction *function, IrInstruction instruction)
+{
+    array_append(&function->instructions, instruction);
+}
+
+// Number of values a value of the datatype occupies.
+static inline s32
+ir_value_count(Datatype *datatype)
+{
+    s32 result = 0;
+
+    if (datatype->kind == DATATYPE_STRING)
+    {
+        result = 2;
+    }
+    else if (datatype->size > 0)
+    {
+        result = 1;
+    }
+
+    return result;
+}
+
+static inline bool
+ir_is_signed(Datatype *datatype)
+{
+    return (datatype->kind == DATATYPE_INTEGER) && !(datatype->flags & DATATYPE_FLAG_UNSIGNED);
+}
+
+// Allocates the values for a datatype, strings get two consecutive values.
+static s32
+ir_new_values(IrFunction *function, Datatype *datatype)
+{
+    if (datatype->kind == DATATYPE_STRING)
+    {
+        s32 value = ir_new_value(function, 8);
+        ir_new_value(function, 8);
+        return value;
+    }
+    else if (datatype->size > 0)
+    {
+        return ir_new_value(function, (u8) datatype->size);
+    }
+
+    return 0;
+}
+
+static void
+ir_emit_copy(IrFunction *function, s32 dst, s32 src, s32 count)
+{
+    for (s32 i = 0; i < count; i += 1)
+    {
+        if ((dst + i) != (src + i))
+        {
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_COPY, .size = 8, .dst = dst + i, .a = src + i });
+        }
+    }
+}
+
+// Truncation is free, all operations only look at the lower bytes of a value.
+static s32
+ir_emit_cast(Compiler *compiler, IrFunction *function, s32 value, DatatypeId from_type_id, DatatypeId to_type_id)
+{
+    if (from_type_id == to_type_id)
+    {
+        return value;
+    }
+
+    Datatype *from_type = get_datatype(&compiler->datatypes, from_type_id);
+    Datatype *to_type   = get_datatype(&compiler->datatypes, to_type_id);
+
+    if ((from_type->kind == DATATYPE_INTEGER) && (to_type->kind == DATATYPE_INTEGER))
+    {
+        if (from_type->size < to_type->size)
+        {
+            s32 dst = ir_new_value(function, (u8) to_type->size);
+
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_EXTEND, .size = (u8) from_type->size,
+                                                .is_signed = ir_is_signed(from_type), .dst = dst, .a = value });
+
+            value = dst;
+        }
+    }
+    else if ((from_type->kind == DATATYPE_BOOLEAN) && (to_type->kind == DATATYPE_INTEGER))
+    {
+        // the type checker lets bools through where integers are expected, true is 1
+        if (from_type->size < to_type->size)
+        {
+            s32 dst = ir_new_value(function, (u8) to_type->size);
+
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_EXTEND, .size = (u8) from_type->size,
+                                                .is_signed = false, .dst = dst, .a = value });
+
+            value = dst;
+        }
+    }
+    else if ((from_type->kind == DATATYPE_POINTER) && (to_type->kind == DATATYPE_POINTER))
+    {
+    }
+    else
+    {
+        assert(!"not implemented");
+    }
+
+    return value;
+}
+
+static s32 ir_emit_expression(Compiler *compiler, IrFunction *function, Ast *expr);
+
+static IrCondition
+ir_get_condition(AstKind kind)
+{
+    IrCondition condition = IR_CONDITION_EQUAL;
+
+    switch (kind)
+    {
+        case AST_KIND_EXPRESSION_EQUAL:                 condition = IR_CONDITION_EQUAL;         break;
+        case AST_KIND_EXPRESSION_NOT_EQUAL:             condition = IR_CONDITION_NOT_EQUAL;     break;
+        case AST_KIND_EXPRESSION_COMPARE_LESS:          condition = IR_CONDITION_LESS;          break;
+        case AST_KIND_EXPRESSION_COMPARE_GREATER:       condition = IR_CONDITION_GREATER;       break;
+        case AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL:    condition = IR_CONDITION_LESS_EQUAL;    break;
+        case AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL: condition = IR_CONDITION_GREATER_EQUAL; break;
+        default: assert(!"not allowed"); break;
+    }
+
+    return condition;
+}
+
+static inline IrCondition
+ir_negate_condition(IrCondition condition)
+{
+    IrCondition result = IR_CONDITION_EQUAL;
+
+    switch (condition)
+    {
+        case IR_CONDITION_EQUAL:         result = IR_CONDITION_NOT_EQUAL;     break;
+        case IR_CONDITION_NOT_EQUAL:     result = IR_CONDITION_EQUAL;         break;
+        case IR_CONDITION_LESS:          result = IR_CONDITION_GREATER_EQUAL; break;
+        case IR_CONDITION_GREATER:       result = IR_CONDITION_LESS_EQUAL;    break;
+        case IR_CONDITION_LESS_EQUAL:    result = IR_CONDITION_GREATER;       break;
+        case IR_CONDITION_GREATER_EQUAL: result = IR_CONDITION_LESS;          break;
+    }
+
+    return result;
+}
+
+// Fills in the operands of left <op> right. Both operands get extended to the larger of the
+// two datatypes and an integer literal on the right becomes an immediate.
+static IrInstruction
+ir_emit_operands(Compiler *compiler, IrFunction *function, IrOpcode opcode, IrCondition condition, Ast *left, Ast *right)
+{
+    Datatype *left_type  = get_datatype(&compiler->datatypes, left->type_id);
+    Datatype *right_type = get_datatype(&compiler->datatypes, right->type_id);
+
+    DatatypeId type_id = (right_type->size > left_type->size) ? right->type_id : left->type_id;
+    Datatype *datatype = get_datatype(&compiler->datatypes, type_id);
+
+    IrInstruction instruction = { .opcode = opcode, .condition = condition,
+                                  .size = (u8) datatype->size, .is_signed = ir_is_signed(datatype) };
+
+    instruction.a = ir_emit_expression(compiler, function, left);
+    instruction.a = ir_emit_cast(compiler, function, instruction.a, left->type_id, type_id);
+
+    if (right->kind == AST_KIND_LITERAL_INTEGER)
+    {
+        instruction.has_immediate = true;
+        instruction.immediate = right->_s64;
+    }
+    else
+    {
+        instruction.b = ir_emit_expression(compiler, function, right);
+        instruction.b = ir_emit_cast(compiler, function, instruction.b, right->type_id, type_id);
+    }
+
+    return instruction;
+}
+
+static s32
+ir_emit_binary_operation(Compiler *compiler, IrFunction *function, IrOpcode opcode, IrCondition condition,
+                         Ast *left, Ast *right, DatatypeId result_type_id)
+{
+    IrInstruction instruction = ir_emit_operands(compiler, function, opcode, condition, left, right);
+
+    Datatype *result_type = get_datatype(&compiler->datatypes, result_type_id);
+
+    instruction.dst = ir_new_value(function, (u8) result_type->size);
+    ir_emit(function, instruction);
+
+    return instruction.dst;
+}
+
+// Jumps to label if the condition evaluates to jump_if. Comparisons become a single branch
+// and && and || become chains of branches that skip the right side.
+static void
+ir_emit_branch(Compiler *compiler, IrFunction *function, Ast *expr, bool jump_if, s32 label)
+{
+    switch (expr->kind)
+    {
+        case AST_KIND_LITERAL_BOOLEAN:
+        {
+            if (expr->_bool == jump_if)
+            {
+                ir_emit(function, (IrInstruction) { .opcode = IR_OP_JUMP, .label = label });
+            }
+        } break;
+
+        case AST_KIND_EXPRESSION_EQUAL:
+        case AST_KIND_EXPRESSION_NOT_EQUAL:
+        case AST_KIND_EXPRESSION_COMPARE_LESS:
+        case AST_KIND_EXPRESSION_COMPARE_GREATER:
+        case AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL:
+        case AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL:
+        {
+            IrCondition condition = ir_get_condition(expr->kind);
+
+            if (!jump_if)
+            {
+                condition = ir_negate_condition(condition);
+            }
+
+            IrInstruction instruction = ir_emit_operands(compiler, function, IR_OP_BRANCH, condition, ast_get(expr->left_expr), ast_get(expr->right_expr));
+            instruction.label = label;
+            ir_emit(function, instruction);
+        } break;
+
+        case AST_KIND_EXPRESSION_LOGIC_AND:
+        case AST_KIND_EXPRESSION_LOGIC_OR:
+        {
+            // a && b jumps away as soon as a is false, a || b as soon as a is true
+            bool short_circuit_on = (expr->kind == AST_KIND_EXPRESSION_LOGIC_OR);
+
+            if (jump_if == short_circuit_on)
+            {
+                ir_emit_branch(compiler, function, ast_get(expr->left_expr), jump_if, label);
+                ir_emit_branch(compiler, function, ast_get(expr->right_expr), jump_if, label);
+            }
+            else
+            {
+                s32 skip_label = ir_new_label(function);
+
+                ir_emit_branch(compiler, function, ast_get(expr->left_expr), short_circuit_on, skip_label);
+                ir_emit_branch(compiler, function, ast_get(expr->right_expr), jump_if, label);
+
+                ir_emit(function, (IrInstruction) { .opcode = IR_OP_LABEL, .label = skip_label });
+            }
+        } break;
+
+        default:
+        {
+            s32 value = ir_emit_expression(compiler, function, expr);
+
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_BRANCH, .condition = jump_if ? IR_CONDITION_NOT_EQUAL : IR_CONDITION_EQUAL,
+                                                .size = 1, .a = value, .has_immediate = true, .immediate = 0, .label = label });
+        } break;
+    }
+}
+
+// Calls to these functions get replaced by the backend, their declarations have no body.
+static bool
+ir_find_intrinsic(Ast *decl, IrIntrinsic *intrinsic)
+{
+    bool result = true;
+
+    if (strings_are_equal(ast_get_name(decl), S("exit")))
+    {
+        assert(ast_list_count(&ast_get_function(decl)->parameters) == 1);
+        *intrinsic = IR_INTRINSIC_EXIT;
+    }
+    else if (strings_are_equal(ast_get_name(decl), S("write")))
+    {
+        assert(ast_list_count(&ast_get_function(decl)->parameters) == 3);
+        *intrinsic = IR_INTRINSIC_WRITE;
+    }
+    else
+    {
+        result = false;
+    }
+
+    return result;
+}
+
+static s32
+ir_emit_call(Compiler *compiler, IrFunction *function, Ast *expr)
+{
+    assert(expr->left_expr);
+
+    Ast *left = ast_get(expr->left_expr);
+
+    if (left->kind != AST_KIND_IDENTIFIER)
+    {
+        assert(!"not implemented");
+    }
+
+    assert(expr->decl);
+
+    // nested calls append their operands while the arguments get evaluated
+    IrValueList arguments = { 0 };
+
+    Ast *parameter = ast_get(ast_get_function(ast_get(expr->decl))->parameters.first);
+
+    For(argument, expr->children.first)
+    {
+        Datatype *parameter_type = get_datatype(&compiler->datatypes, parameter->type_id);
+
+        s32 value = ir_emit_expression(compiler, function, argument);
+        value = ir_emit_cast(compiler, function, value, argument->type_id, parameter->type_id);
+
+        s32 count = ir_value_count(parameter_type);
+
+        for (s32 i = 0; i < count; i += 1)
+        {
+            array_append(&arguments, value + i);
+        }
+
+        parameter = ast_get(parameter->next);
+    }
+
+    Datatype *return_type = get_datatype(&compiler->datatypes, ast_get(expr->decl)->type_id);
+
+    IrInstruction instruction = { .opcode = IR_OP_CALL, .function = ast_get(expr->decl) };
+
+    if (ir_find_intrinsic(ast_get(expr->decl), &instruction.intrinsic))
+    {
+        instruction.opcode = IR_OP_INTRINSIC;
+    }
+
+    s32 result = ir_new_values(function, return_type);
+
+    instruction.first_operand = function->operands.count;
+    instruction.result_count = ir_value_count(return_type);
+    instruction.argument_count = arguments.count;
+
+    for (s32 i = 0; i < instruction.result_count; i += 1)
+    {
+        array_append(&function->operands, result + i);
+    }
+
+    for (s32 i = 0; i < arguments.count; i += 1)
+    {
+        array_append(&function->operands, arguments.items[i]);
+    }
+
+    if (arguments.items)
+    {
+        free_block(&default_allocator, arguments.items, arguments.allocated * sizeof(s32));
+    }
+
+    ir_emit(function, instruction);
+
+    return result;
+}
+
+static s32
+ir_emit_assignment(Compiler *compiler, IrFunction *function, Ast *expr)
+{
+    assert(expr->decl);
+
+    Ast *decl = ast_get(expr->decl);
+    Datatype *datatype = get_datatype(&compiler->datatypes, decl->type_id);
+
+    s32 value;
+
+    if ((expr->kind != AST_KIND_ASSIGN) && (ast_get(expr->right_expr)->kind == AST_KIND_LITERAL_INTEGER))
+    {
+        value = 0;
+    }
+    else
+    {
+        value = ir_emit_expression(compiler, function, ast_get(expr->right_expr));
+        value = ir_emit_cast(compiler, function, value, ast_get(expr->right_expr)->type_id, decl->type_id);
+    }
+
+    switch (expr->kind)
+    {
+        case AST_KIND_ASSIGN:
+        {
+            ir_emit_copy(function, decl->ir_value, value, ir_value_count(datatype));
+        } break;
+
+        case AST_KIND_PLUS_ASSIGN:
+        case AST_KIND_MINUS_ASSIGN:
+        {
+            IrInstruction instruction = { .opcode = (expr->kind == AST_KIND_PLUS_ASSIGN) ? IR_OP_ADD : IR_OP_SUB,
+                                          .size = (u8) datatype->size, .is_signed = ir_is_signed(datatype),
+                                          .dst = decl->ir_value, .a = decl->ir_value, .b = value };
+
+            if (!value)
+            {
+                instruction.has_immediate = true;
+                instruction.immediate = ast_get(expr->right_expr)->_s64;
+            }
+
+            ir_emit(function, instruction);
+        } break;
+
+        default:
+        {
+            assert(!"not implemented");
+        } break;
+    }
+
+    return decl->ir_value;
+}
+
+// Returns the first value of the result, 0 if the expression has no value.
+static s32
+ir_emit_expression(Compiler *compiler, IrFunction *function, Ast *expr)
+{
+    s32 result = 0;
+
+    switch (expr->kind)
+    {
+        case AST_KIND_LITERAL_BOOLEAN:
+        {
+            result = ir_new_value(function, 1);
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_CONSTANT, .size = 1, .dst = result, .immediate = expr->_bool ? 1 : 0 });
+        } break;
+
+        case AST_KIND_LITERAL_INTEGER:
+        {
+            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+
+            result = ir_new_value(function, (u8) datatype->size);
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_CONSTANT, .size = (u8) datatype->size, .dst = result, .immediate = expr->_s64 });
+        } break;
+
+        case AST_KIND_LITERAL_STRING:
+        {
+            result = ir_new_value(function, 8);
+            ir_new_value(function, 8);
+
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_CONSTANT, .size = 8, .dst = result, .immediate = ast_get_string(expr).count });
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_STRING_ADDRESS, .size = 8, .dst = result + 1, .string = ast_get_string(expr) });
+        } break;
+
+        case AST_KIND_IDENTIFIER:
+        {
+            assert(expr->decl);
+            result = ast_get(expr->decl)->ir_value;
+        } break;
+
+        case AST_KIND_EXPRESSION_EQUAL:
+        case AST_KIND_EXPRESSION_NOT_EQUAL:
+        case AST_KIND_EXPRESSION_COMPARE_LESS:
+        case AST_KIND_EXPRESSION_COMPARE_GREATER:
+        case AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL:
+        case AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL:
+        {
+            result = ir_emit_binary_operation(compiler, function, IR_OP_COMPARE, ir_get_condition(expr->kind),
+                                              ast_get(expr->left_expr), ast_get(expr->right_expr), expr->type_id);
+        } break;
+
+        case AST_KIND_EXPRESSION_LOGIC_AND:
+        case AST_KIND_EXPRESSION_LOGIC_OR:
+        {
+            s32 end_label = ir_new_label(function);
+
+            result = ir_new_value(function, 1);
+
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_CONSTANT, .size = 1, .dst = result, .immediate = 0 });
+            ir_emit_branch(compiler, function, expr, false, end_label);
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_CONSTANT, .size = 1, .dst = result, .immediate = 1 });
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_LABEL, .label = end_label });
+        } break;
+
+        case AST_KIND_EXPRESSION_BINOP_ADD:
+        case AST_KIND_EXPRESSION_BINOP_MINUS:
+        {
+            IrOpcode opcode = (expr->kind == AST_KIND_EXPRESSION_BINOP_ADD) ? IR_OP_ADD : IR_OP_SUB;
+
+            result = ir_emit_binary_operation(compiler, function, opcode, IR_CONDITION_EQUAL,
+                                              ast_get(expr->left_expr), ast_get(expr->right_expr), expr->type_id);
+        } break;
+
+        case AST_KIND_EXPRESSION_UNARY_MINUS:
+        {
+            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+
+            s32 zero = ir_new_value(function, (u8) datatype->size);
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_CONSTANT, .size = (u8) datatype->size, .dst = zero, .immediate = 0 });
+
+            s32 value = ir_emit_expression(compiler, function, ast_get(expr->left_expr));
+            value = ir_emit_cast(compiler, function, value, ast_get(expr->left_expr)->type_id, expr->type_id);
+
+            result = ir_new_value(function, (u8) datatype->size);
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_SUB, .size = (u8) datatype->size, .is_signed = true,
+                                                .dst = result, .a = zero, .b = value });
+        } break;
+
+        case AST_KIND_FUNCTION_CALL:
+        {
+            result = ir_emit_call(compiler, function, expr);
+        } break;
+
+        case AST_KIND_ASSIGN:
+        case AST_KIND_PLUS_ASSIGN:
+        case AST_KIND_MINUS_ASSIGN:
+        // case AST_KIND_MUL_ASSIGN:
+        // case AST_KIND_DIV_ASSIGN:
+        // case AST_KIND_OR_ASSIGN:
+        // case AST_KIND_AND_ASSIGN:
+        // case AST_KIND_XOR_ASSIGN:
+        {
+            result = ir_emit_assignment(compiler, function, expr);
+        } break;
+
+        case AST_KIND_MEMBER:
+        {
+            if (ast_get(expr->left_expr)->type_id == compiler->basetype_string)
+            {
+                s32 value = ir_emit_expression(compiler, function, ast_get(expr->left_expr));
+
+                if (strings_are_equal(ast_get_name(expr), S("count")))
+                {
+                    result = value + 0;
+                }
+                else if (strings_are_equal(ast_get_name(expr), S("data")))
+                {
+                    result = value + 1;
+                }
+                else
+                {
+                    assert(!"not supported");
+                }
+            }
+            else
+            {
+                assert(!"not supported");
+            }
+        } break;
+
+        case AST_KIND_CAST:
+        {
+            result = ir_emit_expression(compiler, function, ast_get(expr->left_expr));
+            result = ir_emit_cast(compiler, function, result, ast_get(expr->left_expr)->type_id, expr->type_id);
+        } break;
+
+        default:
+        {
+            printf("kind = %u\n", expr->kind);
+            assert(!"expression not supported");
+        } break;
+    }
+
+    return result;
+}
+
+static void
+ir_emit_statement(Compiler *compiler, IrFunction *function, Ast *statement)
+{
+    switch (statement->kind)
+    {
+        case AST_KIND_VARIABLE_DECLARATION:
+        {
+            Datatype *datatype = get_datatype(&compiler->datatypes, statement->type_id);
+            s32 count = ir_value_count(datatype);
+
+            s32 value = 0;
+
+            if (statement->right_expr)
+            {
+                value = ir_emit_expression(compiler, function, ast_get(statement->right_expr));
+                value = ir_emit_cast(compiler, function, value, ast_get(statement->right_expr)->type_id, statement->type_id);
+            }
+
+            statement->ir_value = ir_new_values(function, datatype);
+
+            for (s32 i = 0; i < count; i += 1)
+            {
+                if (value)
+                {
+                    ir_emit_copy(function, statement->ir_value + i, value + i, 1);
+                }
+                else
+                {
+                    ir_emit(function, (IrInstruction) { .opcode = IR_OP_CONSTANT, .size = 8, .dst = statement->ir_value + i, .immediate = 0 });
+                }
+            }
+        } break;
+
+        case AST_KIND_IF:
+        {
+            Ast *if_code = ast_get(statement->children.first);
+            Ast *else_code = ast_get(if_code->next);
+
+            s32 else_label = ir_new_label(function);
+
+            ir_emit_branch(compiler, function, ast_get(statement->left_expr), false, else_label);
+
+            ir_emit_statement(compiler, function, if_code);
+
+            if (else_code)
+            {
+                s32 end_label = ir_new_label(function);
+
+                ir_emit(function, (IrInstruction) { .opcode = IR_OP_JUMP, .label = end_label });
+                ir_emit(function, (IrInstruction) { .opcode = IR_OP_LABEL, .label = else_label });
+
+                ir_emit_statement(compiler, function, else_code);
+
+                ir_emit(function, (IrInstruction) { .opcode = IR_OP_LABEL, .label = end_label });
+            }
+            else
+            {
+                ir_emit(function, (IrInstruction) { .opcode = IR_OP_LABEL, .label = else_label });
+            }
+        } break;
+
+        case AST_KIND_FOR:
+        {
+            s32 condition_label = ir_new_label(function);
+            s32 end_label = ir_new_label(function);
+
+            ir_emit_statement(compiler, function, ast_get(statement->decl));
+
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_LABEL, .label = condition_label });
+
+            ir_emit_branch(compiler, function, ast_get(statement->left_expr), false, end_label);
+
+            For(stmt, statement->children.first)
+            {
+                ir_emit_statement(compiler, function, stmt);
+            }
+
+            ir_emit_expression(compiler, function, ast_get(statement->right_expr));
+
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_JUMP, .label = condition_label });
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_LABEL, .label = end_label });
+        } break;
+
+        case AST_KIND_RETURN:
+        {
+            assert(statement->left_expr);
+
+            Datatype *return_type = get_datatype(&compiler->datatypes, function->decl->type_id);
+
+            s32 value = ir_emit_expression(compiler, function, ast_get(statement->left_expr));
+            value = ir_emit_cast(compiler, function, value, ast_get(statement->left_expr)->type_id, function->decl->type_id);
+
+            IrInstruction instruction = { .opcode = IR_OP_RETURN };
+
+            instruction.first_operand = function->operands.count;
+            instruction.argument_count = ir_value_count(return_type);
+
+            for (s32 i = 0; i < instruction.argument_count; i += 1)
+            {
+                array_append(&function->operands, value + i);
+            }
+
+            ir_emit(function, instruction);
+        } break;
+
+        case AST_KIND_BLOCK:
+        {
+            For(stmt, statement->children.first)
+            {
+                ir_emit_statement(compiler, function, stmt);
+            }
+        } break;
+
+        default:
+        {
+            ir_emit_expression(compiler, function, statement);
+        } break;
+    }
+}
+
+static void
+ir_build_function(Compiler *compiler, IrFunction *function, Ast *func)
+{
+    assert(func->kind == AST_KIND_FUNCTION_DECLARATION);
+
+    function->decl = func;
+
+    // value 0 is the invalid value
+    ir_new_value(function, 0);
+
+    For(parameter, ast_get_function(func)->parameters.first)
+    {
+        Datatype *datatype = get_datatype(&compiler->datatypes, parameter->type_id);
+
+        parameter->ir_value = ir_new_values(function, datatype);
+
+        for (s32 i = 0; i < ir_value_count(datatype); i += 1)
+        {
+            array_append(&function->parameters, parameter->ir_value + i);
+        }
+    }
+
+    For(statement, func->children.first)
+    {
+        ir_emit_statement(compiler, function, statement);
+    }
+
+    if (!function->instructions.count ||
+        (function->instructions.items[function->instructions.count - 1].opcode != IR_OP_RETURN))
+    {
+        ir_emit(function, (IrInstruction) { .opcode = IR_OP_RETURN, .first_operand = function->operands.count });
+    }
+}
+
+static void
+build_ir(Compiler *compiler, IrProgram *program)
+{
+    // The entry point comes first if there is one.
+    for (s32 i = 0; i < compiler->reachable_functions.count; i += 1)
+    {
+        Ast *decl = compiler->reachable_functions.items[i];
+        IrIntrinsic intrinsic;
+
+        if (!ir_find_intrinsic(decl, &intrinsic))
+        {
+            array_append(program, ((IrFunction) { 0 }));
+            ast_get_function(decl)->ir_index = program->count - 1;
+            ir_build_function(compiler, program->items + program->count - 1, decl);
+        }
+    }
+}
+
+// The most values a single instruction of the function reads or writes, the size of the
+// buffers for ir_get_uses and ir_get_definitions.
+static s32
+ir_get_max_operand_count(IrFunction *function)
+{
+    s32 result = 2;
+
+    for (s32 i = 0; i < function->instructions.count; i += 1)
+    {
+        IrInstruction *instruction = function->instructions.items + i;
+
+        if (instruction->argument_count > result) result = instruction->argument_count;
+        if (instruction->result_count > result)   result = instruction->result_count;
+    }
+
+    return result;
+}
+
+// Collects the values an instruction reads and writes, returns the number of values.
+static s32
+ir_get_uses(IrFunction *function, IrInstruction *instruction, s32 *uses, s32 max_count)
+{
+    s32 count = 0;
+
+    switch (instruction->opcode)
+    {
+        case IR_OP_COPY:
+        case IR_OP_EXTEND:
+        {
+            uses[count++] = instruction->a;
+        } break;
+
+        case IR_OP_ADD:
+        case IR_OP_SUB:
+        case IR_OP_COMPARE:
+        case IR_OP_BRANCH:
+        {
+            uses[count++] = instruction->a;
+
+            if (!instruction->has_immediate)
+            {
+                uses[count++] = instruction->b;
+            }
+        } break;
+
+        case IR_OP_CALL:
+        case IR_OP_INTRINSIC:
+        case IR_OP_RETURN:
+        case IR_OP_TAIL_CALL:
+        {
+            s32 *arguments = function->operands.items + instruction->first_operand + instruction->result_count;
+
+            for (s32 i = 0; i < instruction->argument_count; i += 1)
+            {
+                assert(count < max_count);
+                uses[count++] = arguments[i];
+            }
+        } break;
+
+        default:
+        {
+        } break;
+    }
+
+    return count;
+}
+
+static s32
+ir_get_definitions(IrFunction *function, IrInstruction *instruction, s32 *definitions, s32 max_count)
+{
+    s32 count = 0;
+
+    switch (instruction->opcode)
+    {
+        case IR_OP_CONSTANT:
+        case IR_OP_STRING_ADDRESS:
+        case IR_OP_COPY:
+        case IR_OP_EXTEND:
+        case IR_OP_ADD:
+        case IR_OP_SUB:
+        case IR_OP_COMPARE:
+        {
+            definitions[count++] = instruction->dst;
+        } break;
+
+        case IR_OP_CALL:
+        case IR_OP_INTRINSIC:
+        {
+            for (s32 i = 0; i < instruction->result_count; i += 1)
+            {
+                assert(count < max_count);
+                definitions[count++] = function->operands.items[instruction->first_operand + i];
+            }
+        } break;
+
+        default:
+        {
+        } break;
+    }
+
+    return count;
+}
+
+static inline bool
+ir_is_call(IrInstruction *instruction)
+{
+    return (instruction->opcode == IR_OP_CALL) || (instruction->opcode == IR_OP_INTRINSIC);
+}
+
+static inline void
+ir_extend_interval(IrValue *value, s32 position)
+{
+    if (position < value->start) value->start = position;
+    if (position > value->end)   value->end = position;
+}
+
+typedef struct
+{
+    s32 first;
+    s32 last;
+    s32 successors[2];
+    s32 successor_count;
+} IrBlock;
+
+// The basic blocks of a function and the values that are live at their boundaries,
+// one bitset of words u64s per block.
+typedef struct
+{
+    IrBlock *blocks;
+    s32 block_count;
+    s32 block_capacity;
+
+    s32 words;
+    u64 *live_in;
+    u64 *live_out;
+} IrLiveness;
+
+static inline bool
+ir_bitset_contains(u64 *bitset, s32 value)
+{
+    return (bitset[value / 64] & ((u64) 1 << (value % 64))) != 0;
+}
+
+static inline void
+ir_bitset_add(u64 *bitset, s32 value)
+{
+    bitset[value / 64] |= (u64) 1 << (value % 64);
+}
+
+static inline void
+ir_bitset_remove(u64 *bitset, s32 value)
+{
+    bitset[value / 64] &= ~((u64) 1 << (value % 64));
+}
+
+// Splits the instructions into basic blocks and connects them.
+static void
+ir_build_blocks(IrFunction *function, IrLiveness *liveness)
+{
+    s32 instruction_count = function->instructions.count;
+
+    IrBlock *blocks = alloc_array(&default_allocator, IrBlock, instruction_count + 1, 8, false);
+    s32 *label_blocks = alloc_array(&default_allocator, s32, function->label_count + 1, 8, false);
+    s32 block_count = 0;
+
+    for (s32 i = 0; i < instruction_count; i += 1)
+    {
+        IrInstruction *instruction = function->instructions.items + i;
+
+        bool is_leader = (i == 0) || (instruction->opcode == IR_OP_LABEL);
+
+        if (i > 0)
+        {
+            IrOpcode previous = function->instructions.items[i - 1].opcode;
+
+            if ((previous == IR_OP_JUMP) || (previous == IR_OP_BRANCH) ||
+                (previous == IR_OP_RETURN) || (previous == IR_OP_TAIL_CALL))
+            {
+                is_leader = true;
+            }
+        }
+
+        if (is_leader)
+        {
+            blocks[block_count].first = i;
+            block_count += 1;
+        }
+
+        blocks[block_count - 1].last = i;
+
+        if (instruction->opcode == IR_OP_LABEL)
+        {
+            label_blocks[instruction->label] = block_count - 1;
+        }
+    }
+
+    for (s32 b = 0; b < block_count; b += 1)
+    {
+        IrBlock *block = blocks + b;
+        IrInstruction *last = function->instructions.items + block->last;
+
+        block->successor_count = 0;
+
+        if ((last->opcode == IR_OP_JUMP) || (last->opcode == IR_OP_BRANCH))
+        {
+            block->successors[block->successor_count++] = label_blocks[last->label];
+        }
+
+        if ((last->opcode != IR_OP_JUMP) && (last->opcode != IR_OP_RETURN) &&
+            (last->opcode != IR_OP_TAIL_CALL) && ((b + 1) < block_count))
+        {
+            block->successors[block->successor_count++] = b + 1;
+        }
+    }
+
+    free_block(&default_allocator, label_blocks, (function->label_count + 1) * sizeof(s32));
+
+    liveness->blocks = blocks;
+    liveness->block_count = block_count;
+    liveness->block_capacity = instruction_count + 1;
+    liveness->words = 0;
+    liveness->live_in = 0;
+    liveness->live_out = 0;
+}
+
+// Solves the liveness of all values per basic block.
+static void
+ir_compute_liveness(IrFunction *function, IrLiveness *liveness)
+{
+    ir_build_blocks(function, liveness);
+
+    IrBlock *blocks = liveness->blocks;
+    s32 block_count = liveness->block_count;
+
+    s32 words = (function->values.count + 63) / 64;
+
+    u64 *live_in   = alloc_array(&default_allocator, u64, block_count * words, 8, true);
+    u64 *live_out  = alloc_array(&default_allocator, u64, block_count * words, 8, true);
+    u64 *use_sets  = alloc_array(&default_allocator, u64, block_count * words, 8, true);
+    u64 *def_sets  = alloc_array(&default_allocator, u64, block_count * words, 8, true);
+
+    s32 max_count = ir_get_max_operand_count(function);
+    s32 *values = alloc_array(&default_allocator, s32, max_count, 8, false);
+
+    for (s32 b = 0; b < block_count; b += 1)
+    {
+        u64 *use_set = use_sets + b * words;
+        u64 *def_set = def_sets + b * words;
+
+        for (s32 i = blocks[b].first; i <= blocks[b].last; i += 1)
+        {
+            IrInstruction *instruction = function->instructions.items + i;
+
+            s32 count = ir_get_uses(function, instruction, values, max_count);
+
+            for (s32 k = 0; k < count; k += 1)
+            {
+                if (!ir_bitset_contains(def_set, values[k]))
+                {
+                    ir_bitset_add(use_set, values[k]);
+                }
+            }
+
+            count = ir_get_definitions(function, instruction, values, max_count);
+
+            for (s32 k = 0; k < count; k += 1)
+            {
+                ir_bitset_add(def_set, values[k]);
+            }
+        }
+    }
+
+    bool changed = true;
+
+    while (changed)
+    {
+        changed = false;
+
+        for (s32 b = block_count - 1; b >= 0; b -= 1)
+        {
+            u64 *out = live_out + b * words;
+            u64 *in = live_in + b * words;
+            u64 *use_set = use_sets + b * words;
+            u64 *def_set = def_sets + b * words;
+
+            for (s32 s = 0; s < blocks[b].successor_count; s += 1)
+            {
+                u64 *successor_in = live_in + blocks[b].successors[s] * words;
+
+                for (s32 w = 0; w < words; w += 1)
+                {
+                    out[w] |= successor_in[w];
+                }
+            }
+
+            for (s32 w = 0; w < words; w += 1)
+            {
+                u64 new_in = use_set[w] | (out[w] & ~def_set[w]);
+
+                if (new_in != in[w])
+                {
+                    in[w] = new_in;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    free_block(&default_allocator, values, max_count * sizeof(s32));
+    free_block(&default_allocator, def_sets, block_count * words * sizeof(u64));
+    free_block(&default_allocator, use_sets, block_count * words * sizeof(u64));
+
+    liveness->words = words;
+    liveness->live_in = live_in;
+    liveness->live_out = live_out;
+}
+
+// Gives the blocks and bitsets back in the reverse order of their allocation, so the next
+// pass gets the same memory again.
+static void
+ir_free_liveness(IrLiveness *liveness)
+{
+    u64 set_size = liveness->block_count * liveness->words * sizeof(u64);
+
+    if (liveness->live_out) free_block(&default_allocator, liveness->live_out, set_size);
+    if (liveness->live_in)  free_block(&default_allocator, liveness->live_in, set_size);
+
+    free_block(&default_allocator, liveness->blocks, liveness->block_capacity * sizeof(IrBlock));
+}
+
+// Computes the live interval of every value. The liveness is solved per basic block and
+// each value gets a single interval from its first to its last live position.
+static void
+ir_compute_live_intervals(IrFunction *function)
+{
+    s32 instruction_count = function->instructions.count;
+    s32 value_count = function->values.count;
+
+    for (s32 i = 0; i < value_count; i += 1)
+    {
+        IrValue *value = function->values.items + i;
+
+        value->start = S32MAX;
+        value->end = -1;
+        value->crosses_call = false;
+    }
+
+    IrLiveness liveness;
+    ir_compute_liveness(function, &liveness);
+
+    IrBlock *blocks = liveness.blocks;
+    s32 words = liveness.words;
+
+    s32 max_count = ir_get_max_operand_count(function);
+    s32 *values = alloc_array(&default_allocator, s32, max_count, 8, false);
+
+    // build the intervals
+    for (s32 b = 0; b < liveness.block_count; b += 1)
+    {
+        u64 *in = liveness.live_in + b * words;
+        u64 *out = liveness.live_out + b * words;
+
+        for (s32 v = 1; v < value_count; v += 1)
+        {
+            if (ir_bitset_contains(in, v))
+            {
+                ir_extend_interval(function->values.items + v, 2 * blocks[b].first);
+            }
+
+            if (ir_bitset_contains(out, v))
+            {
+                ir_extend_interval(function->values.items + v, 2 * blocks[b].last + 1);
+            }
+        }
+    }
+
+    for (s32 i = 0; i < instruction_count; i += 1)
+    {
+        IrInstruction *instruction = function->instructions.items + i;
+
+        s32 count = ir_get_uses(function, instruction, values, max_count);
+
+        for (s32 k = 0; k < count; k += 1)
+        {
+            ir_extend_interval(function->values.items + values[k], 2 * i);
+        }
+
+        count = ir_get_definitions(function, instruction, values, max_count);
+
+        for (s32 k = 0; k < count; k += 1)
+        {
+            ir_extend_interval(function->values.items + values[k], 2 * i + 1);
+        }
+    }
+
+    free_block(&default_allocator, values, max_count * sizeof(s32));
+    ir_free_liveness(&liveness);
+
+    // parameters are defined before the first instruction
+    for (s32 i = 0; i < function->parameters.count; i += 1)
+    {
+        IrValue *value = function->values.items + function->parameters.items[i];
+
+        if (value->end >= 0)
+        {
+            value->start = -1;
+        }
+    }
+
+    function->has_calls = false;
+
+    for (s32 i = 0; i < instruction_count; i += 1)
+    {
+        IrInstruction *instruction = function->instructions.items + i;
+
+        if (ir_is_call(instruction))
+        {
+            // system calls leave the stack and the return address alone
+            if (instruction->opcode == IR_OP_CALL)
+            {
+                function->has_calls = true;
+            }
+
+            for (s32 v = 1; v < value_count; v += 1)
+            {
+                IrValue *value = function->values.items + v;
+
+                if ((value->start < 2 * i) && (value->end > 2 * i + 1))
+                {
+                    value->crosses_call = true;
+                }
+            }
+        }
+    }
+}
+
+static void
+ir_set_hints(IrFunction *function, IrRegisterInfo *info)
+{
+    for (s32 i = 0; i < function->parameters.count; i += 1)
+    {
+        if (i < info->argument_register_count)
+        {
+            function->values.items[function->parameters.items[i]].hint_register = info->argument_registers[i];
+        }
+    }
+
+    for (s32 i = 0; i < function->instructions.count; i += 1)
+    {
+        IrInstruction *instruction = function->instructions.items + i;
+
+        switch (instruction->opcode)
+        {
+            case IR_OP_COPY:
+            case IR_OP_EXTEND:
+            case IR_OP_ADD:
+            case IR_OP_SUB:
+            {
+                function->values.items[instruction->dst].hint_value = instruction->a;
+            } break;
+
+            case IR_OP_CALL:
+            case IR_OP_INTRINSIC:
+            case IR_OP_RETURN:
+            case IR_OP_TAIL_CALL:
+            {
+                s32 *results = function->operands.items + instruction->first_operand;
+                s32 *arguments = results + instruction->result_count;
+
+                for (s32 k = 0; (k < instruction->result_count) && (k < info->return_register_count); k += 1)
+                {
+                    function->values.items[results[k]].hint_register = info->return_registers[k];
+                }
+
+                s32 *registers = (instruction->opcode == IR_OP_RETURN) ? info->return_registers : info->argument_registers;
+                s32 register_count = (instruction->opcode == IR_OP_RETURN) ? info->return_register_count : info->argument_register_count;
+
+                for (s32 k = 0; (k < instruction->argument_count) && (k < register_count); k += 1)
+                {
+                    IrValue *value = function->values.items + arguments[k];
+
+                    if (value->hint_register < 0)
+                    {
+                        value->hint_register = registers[k];
+                    }
+                }
+
+                if ((instruction->opcode == IR_OP_CALL) && (instruction->argument_count > info->argument_register_count))
+                {
+                    s32 stack_argument_count = instruction->argument_count - info->argument_register_count;
+
+                    if (stack_argument_count > function->stack_argument_count)
+                    {
+                        function->stack_argument_count = stack_argument_count;
+                    }
+                }
+            } break;
+
+            default:
+            {
+            } break;
+        }
+    }
+}
+
+static inline bool
+ir_register_is_free(s32 *register_owners, u64 allowed_registers, s32 reg)
+{
+    return (reg >= 0) && (allowed_registers & ((u64) 1 << reg)) && !register_owners[reg];
+}
+
+// Linear scan register allocation over the live intervals. Values that live across a call
+// only get callee-saved registers. When we run out of registers the value whose interval
+// ends last goes to the stack.
+static void
+ir_allocate_registers(IrFunction *function, IrRegisterInfo *info)
+{
+    ir_compute_live_intervals(function);
+
+    function->stack_argument_count = 0;
+    function->spill_slot_count = 0;
+    function->used_callee_saved_registers = 0;
+
+    ir_set_hints(function, info);
+
+    u64 caller_saved_registers = 0;
+    u64 callee_saved_registers = 0;
+
+    for (s32 i = 0; i < info->caller_saved_count; i += 1)
+    {
+        caller_saved_registers |= (u64) 1 << info->caller_saved[i];
+    }
+
+    for (s32 i = 0; i < info->callee_saved_count; i += 1)
+    {
+        callee_saved_registers |= (u64) 1 << info->callee_saved[i];
+    }
+
+    s32 value_count = function->values.count;
+
+    // sort the live values by the start of their interval
+    s32 *order = alloc_array(&default_allocator, s32, value_count, 8, false);
+    s32 order_count = 0;
+
+    for (s32 v = 1; v < value_count; v += 1)
+    {
+        IrValue *value = function->values.items + v;
+
+        value->location = IR_LOCATION_NONE;
+
+        if (value->end < 0)
+        {
+            continue;
+        }
+
+        s32 j = order_count;
+
+        while ((j > 0) && (function->values.items[order[j - 1]].start > value->start))
+        {
+            order[j] = order[j - 1];
+            j -= 1;
+        }
+
+        order[j] = v;
+        order_count += 1;
+    }
+
+    s32 register_owners[64] = { 0 };
+
+    s32 *active = alloc_array(&default_allocator, s32, value_count, 8, false);
+    s32 active_count = 0;
+
+    for (s32 i = 0; i < order_count; i += 1)
+    {
+        s32 v = order[i];
+        IrValue *value = function->values.items + v;
+
+        // release the registers of all intervals that ended
+        s32 new_active_count = 0;
+
+        for (s32 k = 0; k < active_count; k += 1)
+        {
+            IrValue *other = function->values.items + active[k];
+
+            if (other->end < value->start)
+            {
+                register_owners[other->reg] = 0;
+            }
+            else
+            {
+                active[new_active_count++] = active[k];
+            }
+        }
+
+        active_count = new_active_count;
+
+        u64 allowed_registers = callee_saved_registers;
+
+        if (!value->crosses_call)
+        {
+            allowed_registers |= caller_saved_registers;
+        }
+
+        s32 reg = -1;
+
+        if (value->hint_value)
+        {
+            IrValue *hint = function->values.items + value->hint_value;
+
+            if ((hint->location == IR_LOCATION_REGISTER) && ir_register_is_free(register_owners, allowed_registers, hint->reg))
+            {
+                reg = hint->reg;
+            }
+        }
+
+        if ((reg < 0) && ir_register_is_free(register_owners, allowed_registers, value->hint_register))
+        {
+            reg = value->hint_register;
+        }
+
+        for (s32 k = 0; (reg < 0) && (k < info->caller_saved_count); k += 1)
+        {
+            if (ir_register_is_free(register_owners, allowed_registers, info->caller_saved[k]))
+            {
+                reg = info->caller_saved[k];
+            }
+        }
+
+        for (s32 k = 0; (reg < 0) && (k < info->callee_saved_count); k += 1)
+        {
+            if (ir_register_is_free(register_owners, allowed_registers, info->callee_saved[k]))
+            {
+                reg = info->callee_saved[k];
+            }
+        }
+
+        if (reg < 0)
+        {
+            // steal the register of the active interval that ends last, if it ends after this one
+            s32 victim = -1;
+
+            for (s32 k = 0; k < active_count; k += 1)
+            {
+                IrValue *other = function->values.items + active[k];
+
+                if ((allowed_registers & ((u64) 1 << other->reg)) &&
+                    ((victim < 0) || (other->end > function->values.items[active[victim]].end)))
+                {
+                    victim = k;
+                }
+            }
+
+            if ((victim >= 0) && (function->values.items[active[victim]].end > value->end))
+            {
+                IrValue *other = function->values.items + active[victim];
+
+                reg = other->reg;
+
+                other->location = IR_LOCATION_STACK;
+
+                active[victim] = active[active_count - 1];
+                active_count -= 1;
+            }
+            else
+            {
+                value->location = IR_LOCATION_STACK;
+                continue;
+            }
+        }
+
+        value->location = IR_LOCATION_REGISTER;
+        value->reg = reg;
+        register_owners[reg] = v;
+        active[active_count++] = v;
+
+        if (callee_saved_registers & ((u64) 1 << reg))
+        {
+            function->used_callee_saved_registers |= (u64) 1 << reg;
+        }
+    }
+
+    // Spilled values share a stack slot if their intervals don't overlap. The order is still sorted
+    // by interval start, so this is the same linear scan over the spilled values only.
+    s32 *slot_ends = active;
+
+    for (s32 i = 0; i < order_count; i += 1)
+    {
+        IrValue *value = function->values.items + order[i];
+
+        if (value->location != IR_LOCATION_STACK)
+        {
+            continue;
+        }
+
+        s32 slot = 0;
+
+        while ((slot < function->spill_slot_count) && (slot_ends[slot] >= value->start))
+        {
+            slot += 1;
+        }
+
+        if (slot == function->spill_slot_count)
+        {
+            function->spill_slot_count += 1;
+        }
+
+        value->spill_slot = slot;
+        slot_ends[slot] = value->end;
+    }
+}
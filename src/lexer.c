@@ -1,3 +1,13 @@
+#if JULS_ARCHITECTURE_X86_64
+#  include <emmintrin.h>
+#elif JULS_ARCHITECTURE_ARM64
+#  include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
 typedef enum
 {
     TOKEN_END_OF_INPUT      =           0,
@@ -50,6 +60,8 @@ typedef enum
     TOKEN_BINOP_DIV         = '/', //  47
     TOKEN_DIRECTIVE_LOAD    =          48,
     TOKEN_DIRECTIVE_IMPORT  =          49,
+    TOKEN_DIRECTIVE_INLINE  =          50,
+    TOKEN_DIRECTIVE_NO_INLINE =        51,
     TOKEN_COLON             = ':', //  58
     TOKEN_SEMICOLON         = ';', //  59
     TOKEN_LESS              = '<', //  60
@@ -69,6 +81,10 @@ typedef struct
 {
     u8 type;
     u16 file_index;
+
+    // interned lexeme of identifiers and keywords, 0 otherwise
+    Atom atom;
+
     String lexeme;
 } Token;
 
@@ -82,10 +98,50 @@ typedef struct
     String input;
 } Lexer;
 
+#define LEXER_MAX_KEYWORDS 16
+
+// indexed by atom, valid for atoms below keyword_count
+static u8 keyword_token_types[LEXER_MAX_KEYWORDS];
+static Atom keyword_count;
+
+static void
+add_keyword(String name, u8 token_type)
+{
+    Atom atom = intern_string(name);
+
+    assert(atom == keyword_count);
+    assert(atom < ArrayCount(keyword_token_types));
+
+    keyword_token_types[atom] = token_type;
+    keyword_count = atom + 1;
+}
+
+// Has to run before anything else is interned.
+static void
+init_keywords(void)
+{
+    assert(atom_table.count == 0);
+
+    keyword_count = 1;
+
+    add_keyword(S("if"), TOKEN_KEYWORD_IF);
+    add_keyword(S("else"), TOKEN_KEYWORD_ELSE);
+    add_keyword(S("struct"), TOKEN_KEYWORD_STRUCT);
+    add_keyword(S("for"), TOKEN_KEYWORD_FOR);
+    add_keyword(S("while"), TOKEN_KEYWORD_WHILE);
+    add_keyword(S("null"), TOKEN_KEYWORD_NULL);
+    add_keyword(S("true"), TOKEN_KEYWORD_TRUE);
+    add_keyword(S("false"), TOKEN_KEYWORD_FALSE);
+    add_keyword(S("return"), TOKEN_KEYWORD_RETURN);
+    add_keyword(S("size_of"), TOKEN_KEYWORD_SIZE_OF);
+    add_keyword(S("type_of"), TOKEN_KEYWORD_TYPE_OF);
+    add_keyword(S("cast"), TOKEN_KEYWORD_CAST);
+}
+
 static inline bool
-is_at_end(Lexer lexer)
+is_at_end(Lexer *lexer)
 {
-    return (lexer.current >= lexer.input.count);
+    return (lexer->current >= lexer->input.count);
 }
 
 static inline u8
@@ -95,17 +151,17 @@ eat_character(Lexer *lexer)
 }
 
 static inline u8
-peek_character(Lexer lexer)
+peek_character(Lexer *lexer)
 {
-    return lexer.input.data[lexer.current];
+    return lexer->input.data[lexer->current];
 }
 
 static inline u8
-peek_next_character(Lexer lexer)
+peek_next_character(Lexer *lexer)
 {
-    if ((lexer.current + 1) < lexer.input.count)
+    if ((lexer->current + 1) < lexer->input.count)
     {
-        return lexer.input.data[lexer.current + 1];
+        return lexer->input.data[lexer->current + 1];
     }
 
     return 0;
@@ -114,7 +170,7 @@ peek_next_character(Lexer lexer)
 static inline bool
 matches_character(Lexer *lexer, u8 c)
 {
-    if (is_at_end(*lexer) || (lexer->input.data[lexer->current] != c))
+    if (is_at_end(lexer) || (lexer->input.data[lexer->current] != c))
     {
         return false;
     }
@@ -144,62 +200,212 @@ is_alpha(u8 c)
             (c == '_')) ? true : false;
 }
 
+// The scan_* functions return the index of the first byte at or after index that ends the run,
+// or the length of the input. They look at 16 bytes at once where the host has vector
+// instructions and finish the last few bytes one at a time.
+#if JULS_ARCHITECTURE_X86_64 && !defined(LEXER_NO_SIMD)
+#  define LEXER_SIMD 1
+#  define LEXER_MASK_BITS_PER_BYTE 1
+#  define LEXER_MASK_ALL 0xFFFF
+
+typedef __m128i LexerVector;
+
+static inline LexerVector lexer_load(u8 *data) { return _mm_loadu_si128((__m128i *) data); }
+static inline LexerVector lexer_splat(u8 c) { return _mm_set1_epi8((char) c); }
+static inline LexerVector lexer_equal(LexerVector a, u8 c) { return _mm_cmpeq_epi8(a, lexer_splat(c)); }
+static inline LexerVector lexer_or(LexerVector a, LexerVector b) { return _mm_or_si128(a, b); }
+static inline u64 lexer_mask(LexerVector a) { return (u64) _mm_movemask_epi8(a); }
+
+// bytes in [first, last], the bias moves the range to the bottom of the signed bytes
+static inline LexerVector
+lexer_in_range(LexerVector a, u8 first, u8 last)
+{
+    LexerVector biased = _mm_add_epi8(a, lexer_splat((u8) (0x80 - first)));
+    return _mm_cmplt_epi8(biased, lexer_splat((u8) (0x80 + (last - first + 1))));
+}
+#elif JULS_ARCHITECTURE_ARM64 && !defined(LEXER_NO_SIMD)
+#  define LEXER_SIMD 1
+#  define LEXER_MASK_BITS_PER_BYTE 4
+#  define LEXER_MASK_ALL 0xFFFFFFFFFFFFFFFF
+
+typedef uint8x16_t LexerVector;
+
+static inline LexerVector lexer_load(u8 *data) { return vld1q_u8(data); }
+static inline LexerVector lexer_splat(u8 c) { return vdupq_n_u8(c); }
+static inline LexerVector lexer_equal(LexerVector a, u8 c) { return vceqq_u8(a, lexer_splat(c)); }
+static inline LexerVector lexer_or(LexerVector a, LexerVector b) { return vorrq_u8(a, b); }
+
+// neon has no movemask, narrowing keeps 4 bits of every byte
+static inline u64
+lexer_mask(LexerVector a)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(a), 4)), 0);
+}
+
+static inline LexerVector
+lexer_in_range(LexerVector a, u8 first, u8 last)
+{
+    return vcleq_u8(vsubq_u8(a, lexer_splat(first)), lexer_splat((u8) (last - first)));
+}
+#else
+#  define LEXER_SIMD 0
+#endif
+
+#if LEXER_SIMD
+#  define LEXER_VECTOR_SIZE 16
+
+// index of the first byte whose mask bits are set
+static inline s64
+lexer_first_byte(u64 mask)
+{
+#  if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (s64) index / LEXER_MASK_BITS_PER_BYTE;
+#  else
+    return (s64) __builtin_ctzll(mask) / LEXER_MASK_BITS_PER_BYTE;
+#  endif
+}
+#endif
+
+static inline s64
+scan_whitespace(String input, s64 index)
+{
+#if LEXER_SIMD
+    while ((index + LEXER_VECTOR_SIZE) <= input.count)
+    {
+        LexerVector v = lexer_load(input.data + index);
+        LexerVector matches = lexer_or(lexer_or(lexer_equal(v, ' '), lexer_equal(v, '\n')),
+                                       lexer_or(lexer_equal(v, '\t'), lexer_equal(v, '\r')));
+        u64 mask = lexer_mask(matches) ^ LEXER_MASK_ALL;
+
+        if (mask)
+        {
+            return index + lexer_first_byte(mask);
+        }
+
+        index += LEXER_VECTOR_SIZE;
+    }
+#endif
+
+    while ((index < input.count) && is_whitespace(input.data[index]))
+    {
+        index += 1;
+    }
+
+    return index;
+}
+
+static inline s64
+scan_identifier(String input, s64 index)
+{
+#if LEXER_SIMD
+    while ((index + LEXER_VECTOR_SIZE) <= input.count)
+    {
+        LexerVector v = lexer_load(input.data + index);
+        LexerVector matches = lexer_or(lexer_or(lexer_in_range(v, 'a', 'z'), lexer_in_range(v, 'A', 'Z')),
+                                       lexer_or(lexer_in_range(v, '0', '9'), lexer_equal(v, '_')));
+        u64 mask = lexer_mask(matches) ^ LEXER_MASK_ALL;
+
+        if (mask)
+        {
+            return index + lexer_first_byte(mask);
+        }
+
+        index += LEXER_VECTOR_SIZE;
+    }
+#endif
+
+    while ((index < input.count) && (is_alpha(input.data[index]) || is_digit(input.data[index])))
+    {
+        index += 1;
+    }
+
+    return index;
+}
+
+static inline s64
+scan_until_character(String input, s64 index, u8 c)
+{
+#if LEXER_SIMD
+    while ((index + LEXER_VECTOR_SIZE) <= input.count)
+    {
+        u64 mask = lexer_mask(lexer_equal(lexer_load(input.data + index), c));
+
+        if (mask)
+        {
+            return index + lexer_first_byte(mask);
+        }
+
+        index += LEXER_VECTOR_SIZE;
+    }
+#endif
+
+    while ((index < input.count) && (input.data[index] != c))
+    {
+        index += 1;
+    }
+
+    return index;
+}
+
 static inline void
 skip_whitespace(Lexer *lexer)
 {
-    while (!is_at_end(*lexer))
+    for (;;)
     {
-        u8 c = peek_character(*lexer);
+        lexer->current = scan_whitespace(lexer->input, lexer->current);
 
-        if (is_whitespace(c))
+        if (is_at_end(lexer) || (peek_character(lexer) != '/'))
         {
+            break;
         }
-        else if (c == '/')
+
+        if (peek_next_character(lexer) == '/')
         {
-            if (peek_next_character(*lexer) == '/')
+            lexer->current = scan_until_character(lexer->input, lexer->current + 2, '\n');
+        }
+        else if (peek_next_character(lexer) == '*')
+        {
+            s64 index = lexer->current + 1;
+
+            for (;;)
             {
-                while (!is_at_end(*lexer) && (peek_character(*lexer) != '\n'))
+                index = scan_until_character(lexer->input, index, '*');
+
+                if ((index + 1) >= lexer->input.count)
                 {
-                    eat_character(lexer);
+                    index = lexer->input.count;
+                    break;
                 }
-            }
-            else if (peek_next_character(*lexer) == '*')
-            {
-                while (!is_at_end(*lexer))
+
+                if (lexer->input.data[index + 1] == '/')
                 {
-                    if ((peek_character(*lexer) == '*') &&
-                        (peek_next_character(*lexer) == '/'))
-                    {
-                        eat_character(lexer);
-                        eat_character(lexer);
-                        break;
-                    }
-
-                    eat_character(lexer);
+                    index += 2;
+                    break;
                 }
+
+                index += 1;
             }
-            else
-            {
-                break;
-            }
+
+            lexer->current = index;
         }
         else
         {
             break;
         }
-
-        eat_character(lexer);
     }
 }
 
 static inline Token
-make_token(Lexer lexer, u8 token_type)
+make_token(Lexer *lexer, u8 token_type)
 {
     Token token;
 
     token.type = token_type;
-    token.file_index = lexer.current_file_index;
-    token.lexeme = make_string(lexer.current - lexer.start, lexer.input.data + lexer.start);
+    token.file_index = lexer->current_file_index;
+    token.atom = 0;
+    token.lexeme = make_string(lexer->current - lexer->start, lexer->input.data + lexer->start);
 
     return token;
 }
@@ -207,64 +413,20 @@ make_token(Lexer lexer, u8 token_type)
 static Token
 identifier(Lexer *lexer)
 {
-    while (!is_at_end(*lexer) && (is_alpha(peek_character(*lexer)) || is_digit(peek_character(*lexer))))
-    {
-        eat_character(lexer);
-    }
+    lexer->current = scan_identifier(lexer->input, lexer->current);
 
     String ident = make_string(lexer->current - lexer->start, lexer->input.data + lexer->start);
 
-    // TODO: group by count
-    if (strings_are_equal(ident, S("if")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_IF);
-    }
-    else if (strings_are_equal(ident, S("else")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_ELSE);
-    }
-    else if (strings_are_equal(ident, S("struct")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_STRUCT);
-    }
-    else if (strings_are_equal(ident, S("for")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_FOR);
-    }
-    else if (strings_are_equal(ident, S("while")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_WHILE);
-    }
-    else if (strings_are_equal(ident, S("null")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_NULL);
-    }
-    else if (strings_are_equal(ident, S("true")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_TRUE);
-    }
-    else if (strings_are_equal(ident, S("false")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_FALSE);
-    }
-    else if (strings_are_equal(ident, S("return")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_RETURN);
-    }
-    else if (strings_are_equal(ident, S("size_of")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_SIZE_OF);
-    }
-    else if (strings_are_equal(ident, S("type_of")))
-    {
-        return make_token(*lexer, TOKEN_KEYWORD_TYPE_OF);
-    }
-    else if (strings_are_equal(ident, S("cast")))
+    Token token = make_token(lexer, TOKEN_IDENTIFIER);
+    token.atom = intern_string(ident);
+
+    // the keywords are interned first, so their atoms are the smallest ones
+    if (token.atom < keyword_count)
     {
-        return make_token(*lexer, TOKEN_KEYWORD_CAST);
+        token.type = keyword_token_types[token.atom];
     }
 
-    return make_token(*lexer, TOKEN_IDENTIFIER);
+    return token;
 }
 
 static Token
@@ -272,48 +434,45 @@ number(Lexer *lexer)
 {
     u8 token_type = TOKEN_LITERAL_INTEGER;
 
-    while (!is_at_end(*lexer) && is_digit(peek_character(*lexer)))
+    while (!is_at_end(lexer) && is_digit(peek_character(lexer)))
     {
         eat_character(lexer);
     }
 
-    if (!is_at_end(*lexer) && is_digit(peek_next_character(*lexer)))
+    if (!is_at_end(lexer) && is_digit(peek_next_character(lexer)))
     {
         eat_character(lexer);
         token_type = TOKEN_LITERAL_FLOAT;
 
-        while (!is_at_end(*lexer) && is_digit(peek_character(*lexer)))
+        while (!is_at_end(lexer) && is_digit(peek_character(lexer)))
         {
             eat_character(lexer);
         }
     }
 
-    return make_token(*lexer, token_type);
+    return make_token(lexer, token_type);
 }
 
 static Token
 string(Lexer *lexer)
 {
-    while (!is_at_end(*lexer) && (peek_character(*lexer) != '"'))
-    {
-        eat_character(lexer);
-    }
+    lexer->current = scan_until_character(lexer->input, lexer->current, '"');
 
-    if (is_at_end(*lexer))
+    if (is_at_end(lexer))
     {
         // TODO: error token
-        return make_token(*lexer, TOKEN_END_OF_INPUT);
+        return make_token(lexer, TOKEN_END_OF_INPUT);
     }
 
     eat_character(lexer);
 
-    return make_token(*lexer, TOKEN_LITERAL_STRING);
+    return make_token(lexer, TOKEN_LITERAL_STRING);
 }
 
 static Token
 directive(Lexer *lexer)
 {
-    while (!is_at_end(*lexer) && is_alpha(peek_character(*lexer)))
+    while (!is_at_end(lexer) && is_alpha(peek_character(lexer)))
     {
         eat_character(lexer);
     }
@@ -322,15 +481,23 @@ directive(Lexer *lexer)
 
     if (strings_are_equal(ident, S("#load")))
     {
-        return make_token(*lexer, TOKEN_DIRECTIVE_LOAD);
+        return make_token(lexer, TOKEN_DIRECTIVE_LOAD);
     }
     else if (strings_are_equal(ident, S("#import")))
     {
-        return make_token(*lexer, TOKEN_DIRECTIVE_IMPORT);
+        return make_token(lexer, TOKEN_DIRECTIVE_IMPORT);
+    }
+    else if (strings_are_equal(ident, S("#inline")))
+    {
+        return make_token(lexer, TOKEN_DIRECTIVE_INLINE);
+    }
+    else if (strings_are_equal(ident, S("#no_inline")))
+    {
+        return make_token(lexer, TOKEN_DIRECTIVE_NO_INLINE);
     }
 
     // TODO: error message
-    return make_token(*lexer, TOKEN_ERROR);
+    return make_token(lexer, TOKEN_ERROR);
 }
 
 static Token
@@ -340,9 +507,9 @@ get_next_token(Lexer *lexer)
 
     lexer->start = lexer->current;
 
-    if (is_at_end(*lexer))
+    if (is_at_end(lexer))
     {
-        return make_token(*lexer, TOKEN_END_OF_INPUT);
+        return make_token(lexer, TOKEN_END_OF_INPUT);
     }
 
     u8 c = eat_character(lexer);
@@ -359,34 +526,119 @@ get_next_token(Lexer *lexer)
 
     switch (c)
     {
-        case '!': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_NOT_EQUAL : TOKEN_UNARY_NOT);
+        case '!': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_NOT_EQUAL : TOKEN_UNARY_NOT);
         case '"': return string(lexer);
         case '#': return directive(lexer);
-        case '%': return make_token(*lexer, TOKEN_BINOP_MOD);
-        case '&': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_AND_EQUAL : TOKEN_BINOP_AND);
-        case '(': return make_token(*lexer, TOKEN_LEFT_PAREN);
-        case ')': return make_token(*lexer, TOKEN_RIGHT_PAREN);
-        case '*': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_MUL_EQUAL : TOKEN_BINOP_MUL);
-        case '+': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_PLUS_EQUAL : TOKEN_BINOP_PLUS);
-        case ',': return make_token(*lexer, TOKEN_COMMA);
-        case '-': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_MINUS_EQUAL : matches_character(lexer, '>') ? TOKEN_RIGHT_ARROW : TOKEN_BINOP_MINUS);
-        case '.': return make_token(*lexer, TOKEN_DOT);
-        case '/': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_DIV_EQUAL : TOKEN_BINOP_DIV);
-        case ':': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_COLON_EQUAL : matches_character(lexer, ':') ? TOKEN_COLON_COLON : TOKEN_COLON);
-        case ';': return make_token(*lexer, TOKEN_SEMICOLON);
-        case '<': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-        case '=': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_EQUAL : TOKEN_ASSIGN);
-        case '>': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-        case '?': return make_token(*lexer, TOKEN_QUESTIONMARK);
-        case '[': return make_token(*lexer, TOKEN_LEFT_BRACKET);
-        case ']': return make_token(*lexer, TOKEN_RIGHT_BRACKET);
-        case '^': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_XOR_EQUAL : TOKEN_BINOP_XOR);
-        case '{': return make_token(*lexer, TOKEN_LEFT_BRACE);
-        case '|': return make_token(*lexer, matches_character(lexer, '=') ? TOKEN_OR_EQUAL : TOKEN_BINOP_OR);
-        case '}': return make_token(*lexer, TOKEN_RIGHT_BRACE);
-        case '~': return make_token(*lexer, TOKEN_UNARY_NEG);
+        case '%': return make_token(lexer, TOKEN_BINOP_MOD);
+        case '&': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_AND_EQUAL : matches_character(lexer, '&') ? TOKEN_LOGICAL_AND : TOKEN_BINOP_AND);
+        case '(': return make_token(lexer, TOKEN_LEFT_PAREN);
+        case ')': return make_token(lexer, TOKEN_RIGHT_PAREN);
+        case '*': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_MUL_EQUAL : TOKEN_BINOP_MUL);
+        case '+': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_PLUS_EQUAL : TOKEN_BINOP_PLUS);
+        case ',': return make_token(lexer, TOKEN_COMMA);
+        case '-': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_MINUS_EQUAL : matches_character(lexer, '>') ? TOKEN_RIGHT_ARROW : TOKEN_BINOP_MINUS);
+        case '.': return make_token(lexer, TOKEN_DOT);
+        case '/': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_DIV_EQUAL : TOKEN_BINOP_DIV);
+        case ':': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_COLON_EQUAL : matches_character(lexer, ':') ? TOKEN_COLON_COLON : TOKEN_COLON);
+        case ';': return make_token(lexer, TOKEN_SEMICOLON);
+        case '<': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_LESS_EQUAL : matches_character(lexer, '<') ? TOKEN_SHIFT_LEFT : TOKEN_LESS);
+        case '=': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_EQUAL : TOKEN_ASSIGN);
+        case '>': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_GREATER_EQUAL : matches_character(lexer, '>') ? TOKEN_SHIFT_RIGHT : TOKEN_GREATER);
+        case '?': return make_token(lexer, TOKEN_QUESTIONMARK);
+        case '[': return make_token(lexer, TOKEN_LEFT_BRACKET);
+        case ']': return make_token(lexer, TOKEN_RIGHT_BRACKET);
+        case '^': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_XOR_EQUAL : TOKEN_BINOP_XOR);
+        case '{': return make_token(lexer, TOKEN_LEFT_BRACE);
+        case '|': return make_token(lexer, matches_character(lexer, '=') ? TOKEN_OR_EQUAL : matches_character(lexer, '|') ? TOKEN_LOGICAL_OR : TOKEN_BINOP_OR);
+        case '}': return make_token(lexer, TOKEN_RIGHT_BRACE);
+        case '~': return make_token(lexer, TOKEN_UNARY_NEG);
     }
 
     // TODO: error message
-    return make_token(*lexer, TOKEN_ERROR);
+    return make_token(lexer, TOKEN_ERROR);
+}
+
+// All tokens of one file in lexing order, the last one is always TOKEN_END_OF_INPUT. The lexeme
+// of token i is input[offsets[i], offsets[i] + lengths[i]).
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+
+    u8 *types;
+    u32 *offsets;
+    u32 *lengths;
+
+    // interned lexeme of identifiers and keywords, 0 otherwise
+    Atom *atoms;
+
+    u16 file_index;
+    String input;
+} TokenBuffer;
+
+static void
+token_buffer_grow(TokenBuffer *buffer)
+{
+    s32 allocated = (buffer->allocated == 0) ? 1024 : 2 * buffer->allocated;
+
+    buffer->types   = reallocate(&default_allocator, buffer->types, buffer->allocated * sizeof(*buffer->types), allocated * sizeof(*buffer->types), 8, false);
+    buffer->offsets = reallocate(&default_allocator, buffer->offsets, buffer->allocated * sizeof(*buffer->offsets), allocated * sizeof(*buffer->offsets), 8, false);
+    buffer->lengths = reallocate(&default_allocator, buffer->lengths, buffer->allocated * sizeof(*buffer->lengths), allocated * sizeof(*buffer->lengths), 8, false);
+    buffer->atoms   = reallocate(&default_allocator, buffer->atoms, buffer->allocated * sizeof(*buffer->atoms), allocated * sizeof(*buffer->atoms), 8, false);
+
+    buffer->allocated = allocated;
+}
+
+// Replaces the tokens in the buffer with the ones of input.
+static void
+lex_file(TokenBuffer *buffer, String input, u16 file_index)
+{
+    assert(input.count <= U32MAX);
+
+    Lexer lexer = { 0 };
+
+    lexer.current_file_index = file_index;
+    lexer.input = input;
+
+    buffer->count = 0;
+    buffer->file_index = file_index;
+    buffer->input = input;
+
+    for (;;)
+    {
+        Token token = get_next_token(&lexer);
+
+        if (buffer->count >= buffer->allocated)
+        {
+            token_buffer_grow(buffer);
+        }
+
+        s32 index = buffer->count;
+        buffer->count += 1;
+
+        buffer->types[index] = token.type;
+        buffer->offsets[index] = (u32) (token.lexeme.data - input.data);
+        buffer->lengths[index] = (u32) token.lexeme.count;
+        buffer->atoms[index] = token.atom;
+
+        if (token.type == TOKEN_END_OF_INPUT)
+        {
+            break;
+        }
+    }
+}
+
+static inline Token
+get_token(TokenBuffer *buffer, s32 index)
+{
+    assert((index >= 0) && (index < buffer->count));
+
+    Token token;
+
+    token.type = buffer->types[index];
+    token.file_index = buffer->file_index;
+    token.atom = buffer->atoms[index];
+    token.lexeme = make_string(buffer->lengths[index], buffer->input.data + buffer->offsets[index]);
+
+    return token;
 }
@@ -296,26 +296,13 @@ generate_macho(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table
         {
             Patch *patch = codegen.patches.items + i;
 
+            // the text section got copied into the file already
+            void *patch_addr = string_builder_get_pointer(builder, text_start + patch->patch_offset);
+
             u64 instruction_address = vm_base + text_start + patch->instruction_offset;
             u64 string_address = vm_base + cstring_start + patch->string_offset;
 
-            if (target_architecture == JulsArchitectureArm64)
-            {
-                u64 string_page = string_address / 4096;
-                u64 instruction_page = instruction_address / 4096;
-
-                s64 page_count = string_page - instruction_page;
-                u64 offset = string_address & 0xFFF;
-
-                // ADRP
-                *((u32 *) patch->patch + 0) = 0x90000000 | ((page_count & 0x3) << 29) | ((page_count & 0x1FFFFC) << 3) | ARM64_R1;
-                // ADD (immediate)
-                *((u32 *) patch->patch + 1) = 0x91000000 | ((u32) offset << 10) | (ARM64_R1 << 5) | ARM64_R1;
-            }
-            else if (target_architecture == JulsArchitectureX86_64)
-            {
-                *(s32 *) patch->patch = (s32) ((s64) string_address - (s64) instruction_address);
-            }
+            codegen_patch_string_reference(patch_addr, instruction_address, string_address, target_architecture);
         }
     }
 
@@ -323,7 +310,7 @@ generate_macho(StringBuilder *builder, Codegen codegen, SymbolTable symbol_table
     u64 linkedit_start = string_builder_get_size(builder);
 
     StringBuilder string_table;
-    initialize_string_builder(&string_table, &default_allocator);
+    initialize_string_builder(&string_table);
 
     u64 symbol_table_start = string_builder_get_size(builder);
 
@@ -48,6 +48,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
@@ -67,6 +69,7 @@ typedef uint64_t u64;
 #define S64MIN ((s64) 0x8000000000000000)
 #define S64MAX ((s64) 0x7FFFFFFFFFFFFFFF)
 
+#define U32MAX ((u32) 0xFFFFFFFF)
 #define U64MAX ((u64) 0xFFFFFFFFFFFFFFFF)
 
 #define Align(value, alignment) (((value) + (alignment) - (s64) 1) & ~((alignment) - (s64) 1))
@@ -121,11 +124,11 @@ typedef struct
     SourceFile *items;
 } SourceFileArray;
 
+// The length of the marked source is the length of the token at index.
 typedef struct
 {
+    u32 index;
     u16 file_index;
-    s64 index;
-    s64 count;
 } SourceLocation;
 
 static void
@@ -147,6 +150,9 @@ add_file_to_load(StringArray *files, String full_path)
 #include "ast.c"
 #include "parser.c"
 #include "type_checking.c"
+#include "ir.c"
+#include "optimize.c"
+#include "peephole.c"
 
 #if JULS_PLATFORM_ANDROID
 #  include "unix.c"
@@ -209,120 +215,106 @@ static JulsArchitecture default_architecture = JulsArchitectureArm64;
 static JulsArchitecture default_architecture = JulsArchitectureX86_64;
 #endif
 
-#define MAX_STRING_BUFFER_COUNT 1024
-
-typedef struct StringBuffer
-{
-    struct StringBuffer *next;
-    s64 count;
-    u8 data[MAX_STRING_BUFFER_COUNT];
-} StringBuffer;
+// A builder reserves STRING_BUILDER_RESERVE_SIZE bytes of address space and commits memory as
+// it grows. The data never moves, so pointers into it stay valid, but the code generation keeps
+// offsets to be independent of where the bytes end up.
+// string_builder_flush writes the bytes out and drops them, the offsets keep counting from the
+// start of the builder and only the bytes after flushed_size are still accessible.
+#define STRING_BUILDER_RESERVE_SIZE ((s64) 1 << 32)
+#define STRING_BUILDER_MIN_COMMIT_SIZE (64 * 1024)
 
 typedef struct
 {
-    StringBuffer *first_buffer;
-    StringBuffer *current_buffer;
-    Allocator *allocator;
+    u8 *data;
+    s64 size;
+    s64 committed;
+    s64 flushed_size;
 } StringBuilder;
 
+// The output is written to this file and renamed once it is complete, a fatal error removes it.
+static String temporary_output_filename;
+
+// The builders are written to from everywhere in the code generation, so running out of memory
+// ends the compilation right away.
 static void
-initialize_string_builder(StringBuilder *builder, Allocator *allocator)
+report_out_of_memory(void)
 {
-    builder->allocator = allocator;
+    fprintf(stderr, "error: out of memory.\n");
 
-    StringBuffer *buffer = alloc_type(builder->allocator, StringBuffer, 16, false);
-
-    buffer->next = 0;
-    buffer->count = 0;
+    if (temporary_output_filename.count)
+    {
+        delete_file(&default_allocator, temporary_output_filename);
+    }
 
-    builder->first_buffer = buffer;
-    builder->current_buffer = buffer;
+    exit(1);
 }
 
-static s64
-string_builder_get_size(StringBuilder *builder)
+static void
+initialize_string_builder(StringBuilder *builder)
 {
-    s64 result = 0;
-
-    StringBuffer *buffer = builder->first_buffer;
+    builder->data = (u8 *) reserve_memory(STRING_BUILDER_RESERVE_SIZE);
+    builder->size = 0;
+    builder->committed = 0;
+    builder->flushed_size = 0;
 
-    while (buffer)
+    if (!builder->data)
     {
-        result += buffer->count;
-        buffer = buffer->next;
+        report_out_of_memory();
     }
+}
 
-    return result;
+static inline s64
+string_builder_get_size(StringBuilder *builder)
+{
+    return builder->flushed_size + builder->size;
 }
 
-static void
+static inline void *
+string_builder_get_pointer(StringBuilder *builder, s64 offset)
+{
+    assert((offset >= builder->flushed_size) && (offset <= (builder->flushed_size + builder->size)));
+    return builder->data + (offset - builder->flushed_size);
+}
+
+static inline void
 string_builder_ensure_space(StringBuilder *builder, s64 size)
 {
-    if (!builder->first_buffer || ((builder->current_buffer->count + size) > MAX_STRING_BUFFER_COUNT))
+    if ((builder->size + size) > builder->committed)
     {
-        StringBuffer *buffer = alloc_type(builder->allocator, StringBuffer, 16, false);
+        s64 committed = builder->committed ? builder->committed : STRING_BUILDER_MIN_COMMIT_SIZE;
 
-        buffer->next = 0;
-        buffer->count = 0;
+        while (committed < (builder->size + size))
+        {
+            committed *= 2;
+        }
 
-        if (builder->first_buffer)
+        if (committed > STRING_BUILDER_RESERVE_SIZE)
         {
-            builder->current_buffer->next = buffer;
+            committed = STRING_BUILDER_RESERVE_SIZE;
         }
-        else
+
+        if (((builder->size + size) > committed) ||
+            !commit_memory(builder->data + builder->committed, committed - builder->committed))
         {
-            builder->first_buffer = buffer;
+            report_out_of_memory();
         }
 
-        builder->current_buffer = buffer;
+        builder->committed = committed;
     }
 }
 
 static void
 string_builder_append_string(StringBuilder *builder, String str)
 {
-    string_builder_ensure_space(builder, 1);
-
-    u8 *bytes = str.data;
-    s64 bytes_to_write = str.count;
+    string_builder_ensure_space(builder, str.count);
 
-    int64_t count = MAX_STRING_BUFFER_COUNT - builder->current_buffer->count;
-
-    if (count > bytes_to_write)
+    // empty strings may have no data, memcpy wants a valid pointer even for zero bytes
+    if (str.count > 0)
     {
-        count = bytes_to_write;
+        memcpy(builder->data + builder->size, str.data, str.count);
     }
 
-    bytes_to_write -= count;
-    u8 *dst = builder->current_buffer->data + builder->current_buffer->count;
-    builder->current_buffer->count += count;
-
-    while (count--)
-    {
-        *dst++ = *bytes++;
-    }
-
-    while (bytes_to_write)
-    {
-        // TODO: just add a new string buffer
-        string_builder_ensure_space(builder, 1);
-
-        count = MAX_STRING_BUFFER_COUNT;
-
-        if (count > bytes_to_write)
-        {
-            count = bytes_to_write;
-        }
-
-        bytes_to_write -= count;
-        dst = builder->current_buffer->data;
-        builder->current_buffer->count = count;
-
-        while (count--)
-        {
-            *dst++ = *bytes++;
-        }
-    }
+    builder->size += str.count;
 }
 
 static void
@@ -330,9 +322,8 @@ string_builder_append_u8(StringBuilder *builder, u8 value)
 {
     string_builder_ensure_space(builder, 1);
 
-    StringBuffer *buffer = builder->current_buffer;
-    buffer->data[buffer->count] = value;
-    buffer->count += 1;
+    builder->data[builder->size] = value;
+    builder->size += 1;
 }
 
 static void
@@ -352,61 +343,50 @@ string_builder_append_size(StringBuilder *builder, s64 size)
 {
     string_builder_ensure_space(builder, size);
 
-    StringBuffer *buffer = builder->current_buffer;
-    void *result = buffer->data + buffer->count;
-    buffer->count += size;
+    void *result = builder->data + builder->size;
+    builder->size += size;
 
     return result;
 }
 
-// TODO: @Speed
-static void
+// The hosts we run on are little endian, so the value gets copied as is. The position in the
+// builder is not aligned, memcpy becomes a single unaligned store.
+static inline void
 string_builder_append_u16le(StringBuilder *builder, u16 value)
 {
-    string_builder_append_u8(builder, (u8) (value >>  0));
-    string_builder_append_u8(builder, (u8) (value >>  8));
+    memcpy(string_builder_append_size(builder, 2), &value, 2);
 }
 
-// TODO: @Speed
-static void
+static inline void
 string_builder_append_u32le(StringBuilder *builder, u32 value)
 {
-    string_builder_append_u8(builder, (u8) (value >>  0));
-    string_builder_append_u8(builder, (u8) (value >>  8));
-    string_builder_append_u8(builder, (u8) (value >> 16));
-    string_builder_append_u8(builder, (u8) (value >> 24));
+    memcpy(string_builder_append_size(builder, 4), &value, 4);
 }
 
-// TODO: @Speed
-static void
+static inline void
 string_builder_append_u64le(StringBuilder *builder, u64 value)
 {
-    string_builder_append_u8(builder, (u8) (value >>  0));
-    string_builder_append_u8(builder, (u8) (value >>  8));
-    string_builder_append_u8(builder, (u8) (value >> 16));
-    string_builder_append_u8(builder, (u8) (value >> 24));
-    string_builder_append_u8(builder, (u8) (value >> 32));
-    string_builder_append_u8(builder, (u8) (value >> 40));
-    string_builder_append_u8(builder, (u8) (value >> 48));
-    string_builder_append_u8(builder, (u8) (value >> 56));
+    memcpy(string_builder_append_size(builder, 8), &value, 8);
 }
 
 static void
 string_builder_append_builder(StringBuilder *builder, StringBuilder append)
 {
-    if (append.first_buffer)
-    {
-        if (builder->first_buffer)
-        {
-            builder->current_buffer->next = append.first_buffer;
-            builder->current_buffer = append.current_buffer;
-        }
-        else
-        {
-            builder->first_buffer = append.first_buffer;
-            builder->current_buffer = append.current_buffer;
-        }
-    }
+    assert(!append.flushed_size);
+    string_builder_append_string(builder, make_string(append.size, append.data));
+}
+
+// Writes the bytes that are still in memory to file, offset 0 of the builder goes to file_offset.
+// The memory gets reused for the following appends.
+static bool
+string_builder_flush(StringBuilder *builder, File *file, u64 file_offset)
+{
+    bool result = write_file(file, builder->data, file_offset + builder->flushed_size, builder->size);
+
+    builder->flushed_size += builder->size;
+    builder->size = 0;
+
+    return result;
 }
 
 static String
@@ -466,11 +446,13 @@ typedef struct
     SymbolEntry *items;
 } SymbolTable;
 
+// patch_offset is the offset of the bytes to patch in the text section
 typedef struct
 {
-    void *patch;
+    u64 patch_offset;
     u64 instruction_offset;
     Ast *function_decl;
+    bool is_jump;
 } FunctionCallPatch;
 
 typedef struct
@@ -482,7 +464,7 @@ typedef struct
 
 typedef struct
 {
-    void *patch;
+    u64 patch_offset;
     u64 instruction_offset;
     u64 string_offset;
 } Patch;
@@ -494,6 +476,27 @@ typedef struct
     Patch *items;
 } PatchArray;
 
+typedef struct
+{
+    u64 patch_offset;
+    u64 instruction_offset;
+    s32 label;
+} LabelPatch;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    LabelPatch *items;
+} LabelPatchArray;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    s64 *items;
+} OffsetArray;
+
 typedef struct
 {
     StringBuilder section_text;
@@ -502,53 +505,98 @@ typedef struct
     PatchArray patches;
 
     // TODO: put this into its own struct as this should not get passed to file generation
-    s64 stack_allocated;
-    s64 stack_committed;
-    s64 stack_scopes[64];
-    s32 stack_scope_index;
+    // offsets of the labels of the current function, -1 if not emitted yet
+    OffsetArray label_offsets;
+    LabelPatchArray label_patches;
+    s64 frame_size;
+    s64 spill_area_offset;
+
+    // data movement that is held back for the peephole optimizer, buffered_text_size is the size
+    // of section_text when the first of them got buffered
+    MachineInstructionArray buffered_instructions;
+    u64 buffered_text_size;
+    bool print_peephole_stats;
+
+    // If output_file is set, every finished function gets written to text_file_offset in the
+    // output file and dropped from section_text. The addresses of both sections have to be known
+    // up front for that, only the calls to functions that come later stay in memory as patches.
+    File *output_file;
+    u64 text_file_offset;
+    u64 text_vaddr;
+    u64 cstring_vaddr;
+    bool output_failed;
 } Codegen;
 
-static inline void
-push_scope(Codegen *codegen)
+// patch_addr points to the instruction(s) that load the address of the string.
+static void
+codegen_patch_string_reference(void *patch_addr, u64 instruction_address, u64 string_address, JulsArchitecture target_architecture)
 {
-    assert(codegen->stack_scope_index >= 0);
-    assert((codegen->stack_scope_index + 1) < ArrayCount(codegen->stack_scopes));
-    codegen->stack_scope_index += 1;
-    codegen->stack_scopes[codegen->stack_scope_index] = codegen->stack_scopes[codegen->stack_scope_index - 1];
-}
+    if (target_architecture == JulsArchitectureArm64)
+    {
+        u64 string_page = string_address / 4096;
+        u64 instruction_page = instruction_address / 4096;
 
-static inline void
-pop_scope(Codegen *codegen)
-{
-    assert(codegen->stack_scope_index > 0);
-    assert(codegen->stack_allocated == codegen->stack_scopes[codegen->stack_scope_index]);
-    codegen->stack_allocated = codegen->stack_scopes[codegen->stack_scope_index - 1];
-    codegen->stack_scope_index -= 1;
-}
+        s64 page_count = string_page - instruction_page;
+        u64 offset = string_address & 0xFFF;
 
-static inline s64
-allocate_stack(Codegen *codegen, s64 size)
-{
-    assert(codegen->stack_scope_index > 0);
-    assert(codegen->stack_allocated == codegen->stack_scopes[codegen->stack_scope_index]);
-    codegen->stack_scopes[codegen->stack_scope_index] += size;
-    codegen->stack_allocated += size;
-    return codegen->stack_allocated;
+        // the code generation leaves the destination register in the instructions
+        u32 reg = *(u32 *) patch_addr & 0x1F;
+
+        // ADRP
+        *((u32 *) patch_addr + 0) = 0x90000000 | ((page_count & 0x3) << 29) | ((page_count & 0x1FFFFC) << 3) | reg;
+        // ADD (immediate)
+        *((u32 *) patch_addr + 1) = 0x91000000 | ((u32) offset << 10) | (reg << 5) | reg;
+    }
+    else if (target_architecture == JulsArchitectureX86_64)
+    {
+        // x64 instructions have no alignment
+        s32 displacement = (s32) ((s64) string_address - (s64) instruction_address);
+        memcpy(patch_addr, &displacement, 4);
+    }
 }
 
-static inline s64
-push_stack(Codegen *codegen, s64 size)
+// Patches text that might already be written to the output file.
+static void
+codegen_patch_text_u32(Codegen *codegen, u64 offset, u32 value)
 {
-    assert(codegen->stack_scope_index > 0);
-    codegen->stack_allocated += size;
-    return codegen->stack_allocated;
+    if (offset >= (u64) codegen->section_text.flushed_size)
+    {
+        memcpy(string_builder_get_pointer(&codegen->section_text, offset), &value, 4);
+    }
+    else if (!write_file(codegen->output_file, &value, codegen->text_file_offset + offset, 4))
+    {
+        codegen->output_failed = true;
+    }
 }
 
-static inline void
-pop_stack(Codegen *codegen, s64 size)
+// Called after each function. Does nothing unless the text gets streamed to the output file.
+static void
+codegen_flush_text(Codegen *codegen, JulsArchitecture target_architecture)
 {
-    assert(codegen->stack_scope_index > 0);
-    codegen->stack_allocated -= size;
+    if (!codegen->output_file)
+    {
+        return;
+    }
+
+    // all strings of the functions in memory can be resolved now
+    for (s32 i = 0; i < codegen->patches.count; i += 1)
+    {
+        Patch *patch = codegen->patches.items + i;
+
+        void *patch_addr = string_builder_get_pointer(&codegen->section_text, patch->patch_offset);
+
+        u64 instruction_address = codegen->text_vaddr + patch->instruction_offset;
+        u64 string_address = codegen->cstring_vaddr + patch->string_offset;
+
+        codegen_patch_string_reference(patch_addr, instruction_address, string_address, target_architecture);
+    }
+
+    codegen->patches.count = 0;
+
+    if (!string_builder_flush(&codegen->section_text, codegen->output_file, codegen->text_file_offset))
+    {
+        codegen->output_failed = true;
+    }
 }
 
 #include "arm64.c"
@@ -558,20 +606,38 @@ pop_stack(Codegen *codegen, s64 size)
 #include "macho.c"
 
 static void
-generate_code(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table, JulsPlatform target_platform, JulsArchitecture target_architecture)
+generate_code(IrProgram *program, Codegen *codegen, SymbolTable *symbol_table, JulsPlatform target_platform, JulsArchitecture target_architecture)
 {
     if (target_architecture == JulsArchitectureArm64)
     {
-        generate_arm64(compiler, codegen, symbol_table, target_platform);
+        generate_arm64(program, codegen, symbol_table, target_platform);
     }
     else
     {
         assert(target_architecture == JulsArchitectureX86_64);
 
-        generate_x64(compiler, codegen, symbol_table, target_platform);
+        generate_x64(program, codegen, symbol_table, target_platform);
     }
 }
 
+static File *
+create_temporary_output_file(String filename)
+{
+    File *result = create_file(&default_allocator, filename,
+                               FILE_PERMISSION_READABLE | FILE_PERMISSION_WRITEABLE | FILE_PERMISSION_EXECUTABLE);
+
+    if (result)
+    {
+        temporary_output_filename = filename;
+    }
+    else
+    {
+        fprintf(stderr, "error: could not create '%.*s'.\n", (int) filename.count, filename.data);
+    }
+
+    return result;
+}
+
 int main(s32 argument_count, char **arguments)
 {
     String input_filename = { 0 };
@@ -580,6 +646,10 @@ int main(s32 argument_count, char **arguments)
     JulsPlatform target_platform = default_platform;
     JulsArchitecture target_architecture = default_architecture;
 
+    bool print_peephole_stats = false;
+    bool parse_bodies_lazily = false;
+    bool stream_output = false;
+
     for (s32 i = 1; i < argument_count; i += 1)
     {
         String argument = C(arguments[i]);
@@ -605,14 +675,30 @@ int main(s32 argument_count, char **arguments)
             fprintf(stderr, "  --architecture <name>   Set the target architecture. Valid architecture names are:\n");
             fprintf(stderr, "                            arm64, aarch64, amd64, x86_64, x86-64, x64\n");
             fprintf(stderr, "  -h, --help              List all available options\n");
+            fprintf(stderr, "  --lazy-parsing          Parse only the function bodies that are reachable from main\n");
             fprintf(stderr, "  -o <file>               Write output binary to <file>\n");
+            fprintf(stderr, "  --peephole-stats        Print how often each peephole rule rewrote the code\n");
             fprintf(stderr, "  --platform <name>       Set the target platform. Valid platform names are:\n");
             fprintf(stderr, "                            android, windows, linux, macos\n");
+            fprintf(stderr, "  --stream-output         Write each function to the output file as soon as it is generated,\n");
+            fprintf(stderr, "                            only for android and linux\n");
             fprintf(stderr, "  --version               Print the compiler version\n");
             fprintf(stderr, "\n");
 
             return 0;
         }
+        else if (strings_are_equal(argument, S("--lazy-parsing")))
+        {
+            parse_bodies_lazily = true;
+        }
+        else if (strings_are_equal(argument, S("--peephole-stats")))
+        {
+            print_peephole_stats = true;
+        }
+        else if (strings_are_equal(argument, S("--stream-output")))
+        {
+            stream_output = true;
+        }
         else if (strings_are_equal(argument, S("--version")))
         {
             String platform_name = platform_names[default_platform];
@@ -696,6 +782,13 @@ int main(s32 argument_count, char **arguments)
         return 0;
     }
 
+    if (stream_output &&
+        (target_platform != JulsPlatformAndroid) && (target_platform != JulsPlatformLinux))
+    {
+        fprintf(stderr, "error: --stream-output is only supported for android and linux.\n");
+        return 0;
+    }
+
     if (!output_filename.count)
     {
         // TODO: derive from input_filename
@@ -709,56 +802,61 @@ int main(s32 argument_count, char **arguments)
         }
     }
 
+    init_keywords();
+
     Compiler compiler;
 
     compiler.parser.has_error = false;
-    compiler.parser.lexer.start = 0;
-    compiler.parser.lexer.current = 0;
-    compiler.parser.lexer.input = make_string(0, 0);
-    compiler.ast_nodes.first_bucket = 0;
-    compiler.ast_nodes.last_bucket = 0;
+    compiler.has_type_error = false;
+    compiler.parser.tokens.count = 0;
+    compiler.parser.tokens.allocated = 0;
+    compiler.parser.tokens.types = 0;
+    compiler.parser.tokens.offsets = 0;
+    compiler.parser.tokens.lengths = 0;
+    compiler.parser.tokens.atoms = 0;
+    compiler.parser.token_index = 0;
+    compiler.parser.parse_bodies_lazily = parse_bodies_lazily;
+    compiler.parser.file_tokens.count = 0;
+    compiler.parser.file_tokens.allocated = 0;
+    compiler.parser.file_tokens.items = 0;
     compiler.global_declarations.kind = AST_KIND_GLOBAL_SCOPE;
-    compiler.global_declarations.parent = 0;
     compiler.global_declarations.children.first = 0;
     compiler.global_declarations.children.last = 0;
 
+    compiler.reachable_functions.count = 0;
+    compiler.reachable_functions.allocated = 0;
+    compiler.reachable_functions.items = 0;
+
+    compiler.scopes.bindings.count = 0;
+    compiler.scopes.bindings.allocated = 0;
+    compiler.scopes.bindings.items = 0;
+    compiler.scopes.head_count = 0;
+    compiler.scopes.heads = 0;
+
     compiler.datatypes.count = 0;
     compiler.datatypes.allocated = 0;
     compiler.datatypes.items = 0;
+    compiler.datatypes.slot_count = 0;
+    compiler.datatypes.name_slots = 0;
+    compiler.datatypes.structure_slots = 0;
+
+    compiler.basetype_void = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_VOID, .flags = 0, .ref = 0, .name = S("void"), .name_atom = intern_string(S("void")), .size = 0 }));
+
+    compiler.basetype_bool = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_BOOLEAN, .flags = 0, .ref = 0, .name = S("bool"), .name_atom = intern_string(S("bool")), .size = 1 }));
+
+    compiler.basetype_s8 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = 0, .ref = 0, .name = S("s8"), .name_atom = intern_string(S("s8")), .size = 1 }));
+    compiler.basetype_s16 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = 0, .ref = 0, .name = S("s16"), .name_atom = intern_string(S("s16")), .size = 2 }));
+    compiler.basetype_s32 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = 0, .ref = 0, .name = S("s32"), .name_atom = intern_string(S("s32")), .size = 4 }));
+    compiler.basetype_s64 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = 0, .ref = 0, .name = S("s64"), .name_atom = intern_string(S("s64")), .size = 8 }));
 
-    // index 0 is the invalid datatype
-    array_append(&compiler.datatypes, ((Datatype) { 0 }));
-
-    compiler.basetype_void = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_VOID, .flags = 0, .ref = 0, .name = S("void"), .size = 0 }));
-
-    compiler.basetype_bool = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_BOOLEAN, .flags = 0, .ref = 0, .name = S("bool"), .size = 1 }));
-
-    compiler.basetype_s8 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = 0, .ref = 0, .name = S("s8"), .size = 1 }));
-    compiler.basetype_s16 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = 0, .ref = 0, .name = S("s16"), .size = 2 }));
-    compiler.basetype_s32 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = 0, .ref = 0, .name = S("s32"), .size = 4 }));
-    compiler.basetype_s64 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = 0, .ref = 0, .name = S("s64"), .size = 8 }));
-
-    compiler.basetype_u8 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = DATATYPE_FLAG_UNSIGNED, .ref = 0, .name = S("u8"), .size = 1 }));
-    compiler.basetype_u16 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = DATATYPE_FLAG_UNSIGNED, .ref = 0, .name = S("u16"), .size = 2 }));
-    compiler.basetype_u32 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = DATATYPE_FLAG_UNSIGNED, .ref = 0, .name = S("u32"), .size = 4 }));
-    compiler.basetype_u64 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = DATATYPE_FLAG_UNSIGNED, .ref = 0, .name = S("u64"), .size = 8 }));
-
-    compiler.basetype_f32 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_FLOAT, .flags = 0, .ref = 0, .name = S("f32"), .size = 4 }));
-    compiler.basetype_f64 = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_FLOAT, .flags = 0, .ref = 0, .name = S("f64"), .size = 8 }));
-    compiler.basetype_string = compiler.datatypes.count;
-    array_append(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_STRING, .flags = 0, .ref = 0, .name = S("string"), .size = 16 }));
+    compiler.basetype_u8 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = DATATYPE_FLAG_UNSIGNED, .ref = 0, .name = S("u8"), .name_atom = intern_string(S("u8")), .size = 1 }));
+    compiler.basetype_u16 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = DATATYPE_FLAG_UNSIGNED, .ref = 0, .name = S("u16"), .name_atom = intern_string(S("u16")), .size = 2 }));
+    compiler.basetype_u32 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = DATATYPE_FLAG_UNSIGNED, .ref = 0, .name = S("u32"), .name_atom = intern_string(S("u32")), .size = 4 }));
+    compiler.basetype_u64 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_INTEGER, .flags = DATATYPE_FLAG_UNSIGNED, .ref = 0, .name = S("u64"), .name_atom = intern_string(S("u64")), .size = 8 }));
+
+    compiler.basetype_f32 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_FLOAT, .flags = 0, .ref = 0, .name = S("f32"), .name_atom = intern_string(S("f32")), .size = 4 }));
+    compiler.basetype_f64 = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_FLOAT, .flags = 0, .ref = 0, .name = S("f64"), .name_atom = intern_string(S("f64")), .size = 8 }));
+    compiler.basetype_string = add_datatype(&compiler.datatypes, ((Datatype) { .kind = DATATYPE_STRING, .flags = 0, .ref = 0, .name = S("string"), .name_atom = intern_string(S("string")), .size = 16 }));
 
     compiler.source_files.count = 0;
     compiler.source_files.allocated = 0;
@@ -777,70 +875,124 @@ int main(s32 argument_count, char **arguments)
 
         SourceFile *source_file = compiler.source_files.items + file_index;
 
-        compiler.parser.lexer.start = 0;
-        compiler.parser.lexer.current = 0;
-        compiler.parser.lexer.input = source_file->content;
-        compiler.parser.lexer.current_file_index = file_index;
+        if (compiler.parser.parse_bodies_lazily)
+        {
+            // the buffer of the previous file is still needed
+            compiler.parser.tokens = (TokenBuffer) { 0 };
+        }
+
+        lex_file(&compiler.parser.tokens, source_file->content, file_index);
+        compiler.parser.token_index = -1;
         compiler.current_directory = get_base_path(source_file->full_path);
 
         if (!parse(&compiler, &files_to_load))
         {
             return 0;
         }
+
+        if (compiler.parser.parse_bodies_lazily)
+        {
+            assert(compiler.parser.file_tokens.count == file_index);
+            array_append(&compiler.parser.file_tokens, compiler.parser.tokens);
+        }
     }
 
     type_checking(&compiler);
 
-    Codegen codegen;
+    // lazily parsed bodies can have syntax errors, and the ir can only be built for well typed programs
+    if (compiler.parser.has_error || compiler.has_type_error)
+    {
+        return 0;
+    }
+
+    IrProgram program = { 0 };
+    build_ir(&compiler, &program);
+    optimize_ir(&program);
 
-    initialize_string_builder(&codegen.section_text, &default_allocator);
-    initialize_string_builder(&codegen.section_cstring, &default_allocator);
+    Codegen codegen = { 0 };
+
+    initialize_string_builder(&codegen.section_text);
+    initialize_string_builder(&codegen.section_cstring);
     codegen.patches.count = 0;
     codegen.patches.allocated = 0;
     codegen.patches.items = 0;
     codegen.function_call_patches.count = 0;
     codegen.function_call_patches.allocated = 0;
     codegen.function_call_patches.items = 0;
+    codegen.print_peephole_stats = print_peephole_stats;
 
-    SymbolTable symbol_table = { 0 };
+    // The image is written next to the output and renamed over it, so nobody ever sees
+    // (or runs) a half written executable. Only streaming needs the file before the image
+    // is complete.
+    String temporary_filename = concat(&default_allocator, output_filename, S(".tmp"));
+    File *output_file = 0;
 
-    generate_code(&compiler, &codegen, &symbol_table, target_platform, target_architecture);
+    if (stream_output)
+    {
+        output_file = create_temporary_output_file(temporary_filename);
 
-    StringBuilder builder;
-    initialize_string_builder(&builder, &default_allocator);
+        if (!output_file)
+        {
+            return 1;
+        }
 
-    if ((target_platform == JulsPlatformAndroid) ||
-        (target_platform == JulsPlatformLinux))
-    {
-        generate_elf(&builder, codegen, symbol_table, target_architecture);
+        elf_begin_streaming(&codegen, output_file);
     }
-    else if (target_platform == JulsPlatformWindows)
+
+    SymbolTable symbol_table = { 0 };
+
+    generate_code(&program, &codegen, &symbol_table, target_platform, target_architecture);
+
+    // the symbol names point into the source files, not into the tree
+    free_ast_storage();
+
+    bool written = false;
+
+    if (stream_output)
     {
-        generate_pe(&builder, codegen, symbol_table, target_architecture);
+        written = !codegen.output_failed &&
+                  generate_elf_streamed(codegen, symbol_table, target_architecture, output_file);
     }
-    else if (target_platform == JulsPlatformMacOs)
+    else
     {
-        generate_macho(&builder, codegen, symbol_table, target_architecture);
-    }
+        StringBuilder builder;
+        initialize_string_builder(&builder);
 
-    File *output_file = create_file(&default_allocator, output_filename,
-                                    FILE_PERMISSION_READABLE | FILE_PERMISSION_WRITEABLE | FILE_PERMISSION_EXECUTABLE);
+        if ((target_platform == JulsPlatformAndroid) ||
+            (target_platform == JulsPlatformLinux))
+        {
+            generate_elf(&builder, codegen, symbol_table, target_architecture);
+        }
+        else if (target_platform == JulsPlatformWindows)
+        {
+            generate_pe(&builder, codegen, symbol_table, target_architecture);
+        }
+        else if (target_platform == JulsPlatformMacOs)
+        {
+            generate_macho(&builder, codegen, symbol_table, target_architecture);
+        }
 
-    if (output_file)
-    {
-        u64 offset = 0;
-        StringBuffer *buffer = builder.first_buffer;
+        output_file = create_temporary_output_file(temporary_filename);
 
-        while (buffer)
+        if (!output_file)
         {
-            write_file(output_file, buffer->data, offset, buffer->count);
-            offset += buffer->count;
-            buffer = buffer->next;
+            return 1;
         }
 
-        close_file(output_file);
+        written = write_file(output_file, builder.data, 0, builder.size);
     }
 
+    close_file(output_file);
+
+    if (!written || !rename_file(&default_allocator, temporary_filename, output_filename))
+    {
+        fprintf(stderr, "error: could not write '%.*s'.\n", (int) output_filename.count, output_filename.data);
+        delete_file(&default_allocator, temporary_filename);
+        return 1;
+    }
+
+    temporary_output_filename = (String) { 0 };
+
 #if JULS_PLATFORM_MACOS
     if (target_platform == JulsPlatformMacOs)
     {
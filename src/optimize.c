@@ -0,0 +1,820 @@
+// Optimizations on the IR, they run after build_ir and before the backends.
+//
+// Values that only ever get a single constant assigned are replaced by that constant,
+// instructions with constant operands get folded, branches with a known outcome become
+// jumps or disappear, and unreachable code and dead stores get removed. The passes run
+// until none of them changes anything anymore. After that small functions get inlined
+// into their callers, calls in tail position become jumps, the changed functions are
+// optimized again, and functions that are no longer called get dropped.
+
+typedef struct
+{
+    s32 definition_count;
+    bool is_constant;
+    s64 constant;
+} IrConstant;
+
+static inline s64
+ir_extend_constant(s64 value, u8 size, bool is_signed)
+{
+    s64 result = value;
+
+    switch (size)
+    {
+        case 1: result = is_signed ? (s64) (s8)  value : (s64) (u8)  value; break;
+        case 2: result = is_signed ? (s64) (s16) value : (s64) (u16) value; break;
+        case 4: result = is_signed ? (s64) (s32) value : (s64) (u32) value; break;
+    }
+
+    return result;
+}
+
+static bool
+ir_evaluate_condition(IrCondition condition, u8 size, bool is_signed, s64 a, s64 b)
+{
+    a = ir_extend_constant(a, size, is_signed);
+    b = ir_extend_constant(b, size, is_signed);
+
+    bool result = false;
+
+    switch (condition)
+    {
+        case IR_CONDITION_EQUAL:         result = (a == b); break;
+        case IR_CONDITION_NOT_EQUAL:     result = (a != b); break;
+        case IR_CONDITION_LESS:          result = is_signed ? (a <  b) : ((u64) a <  (u64) b); break;
+        case IR_CONDITION_GREATER:       result = is_signed ? (a >  b) : ((u64) a >  (u64) b); break;
+        case IR_CONDITION_LESS_EQUAL:    result = is_signed ? (a <= b) : ((u64) a <= (u64) b); break;
+        case IR_CONDITION_GREATER_EQUAL: result = is_signed ? (a >= b) : ((u64) a >= (u64) b); break;
+    }
+
+    return result;
+}
+
+// The condition that holds if the operands are swapped.
+static inline IrCondition
+ir_mirror_condition(IrCondition condition)
+{
+    IrCondition result = condition;
+
+    switch (condition)
+    {
+        case IR_CONDITION_LESS:          result = IR_CONDITION_GREATER;       break;
+        case IR_CONDITION_GREATER:       result = IR_CONDITION_LESS;          break;
+        case IR_CONDITION_LESS_EQUAL:    result = IR_CONDITION_GREATER_EQUAL; break;
+        case IR_CONDITION_GREATER_EQUAL: result = IR_CONDITION_LESS_EQUAL;    break;
+        default:                                                              break;
+    }
+
+    return result;
+}
+
+// A value is constant if all of its definitions assign the same constant. Every use of a local
+// comes after its declaration, so the definition always happens before the use.
+static void
+ir_find_constants(IrFunction *function, IrConstant *constants)
+{
+    for (s32 v = 0; v < function->values.count; v += 1)
+    {
+        constants[v] = (IrConstant) { 0 };
+    }
+
+    // parameters come with a value from the caller
+    for (s32 i = 0; i < function->parameters.count; i += 1)
+    {
+        constants[function->parameters.items[i]].definition_count = 1;
+    }
+
+    s32 max_count = ir_get_max_operand_count(function);
+    s32 *values = alloc_array(&default_allocator, s32, max_count, 8, false);
+
+    for (s32 i = 0; i < function->instructions.count; i += 1)
+    {
+        IrInstruction *instruction = function->instructions.items + i;
+
+        s32 count = ir_get_definitions(function, instruction, values, max_count);
+
+        for (s32 k = 0; k < count; k += 1)
+        {
+            IrConstant *constant = constants + values[k];
+
+            if (instruction->opcode != IR_OP_CONSTANT)
+            {
+                constant->is_constant = false;
+            }
+            else if (!constant->definition_count)
+            {
+                constant->is_constant = true;
+                constant->constant = instruction->immediate;
+            }
+            else if (constant->constant != instruction->immediate)
+            {
+                constant->is_constant = false;
+            }
+
+            constant->definition_count += 1;
+        }
+    }
+
+    free_block(&default_allocator, values, max_count * sizeof(s32));
+}
+
+// A value with a single definition is constant from here on, so the instructions further down
+// fold in the same pass and a chain of values doesn't take one pass per link.
+static inline void
+ir_make_constant(IrFunction *function, IrConstant *constants, IrInstruction *instruction, s64 value)
+{
+    s32 dst = instruction->dst;
+    *instruction = (IrInstruction) { .opcode = IR_OP_CONSTANT, .size = function->values.items[dst].size, .dst = dst, .immediate = value };
+
+    if (constants[dst].definition_count == 1)
+    {
+        constants[dst].is_constant = true;
+        constants[dst].constant = value;
+    }
+}
+
+static bool
+ir_fold_constants(IrFunction *function)
+{
+    IrConstant *constants = alloc_array(&default_allocator, IrConstant, function->values.count, 8, false);
+
+    ir_find_constants(function, constants);
+
+    bool changed = false;
+
+    for (s32 i = 0; i < function->instructions.count; i += 1)
+    {
+        IrInstruction *instruction = function->instructions.items + i;
+
+        IrConstant *a = constants + instruction->a;
+        IrConstant *b = constants + instruction->b;
+
+        switch (instruction->opcode)
+        {
+            case IR_OP_COPY:
+            {
+                if (instruction->dst == instruction->a)
+                {
+                    instruction->opcode = IR_OP_NOP;
+                    changed = true;
+                }
+                else if (a->is_constant)
+                {
+                    ir_make_constant(function, constants, instruction, a->constant);
+                    changed = true;
+                }
+            } break;
+
+            case IR_OP_EXTEND:
+            {
+                if (a->is_constant)
+                {
+                    ir_make_constant(function, constants, instruction, ir_extend_constant(a->constant, instruction->size, instruction->is_signed));
+                    changed = true;
+                }
+            } break;
+
+            case IR_OP_ADD:
+            case IR_OP_SUB:
+            case IR_OP_COMPARE:
+            case IR_OP_BRANCH:
+            {
+                if (!instruction->has_immediate && b->is_constant)
+                {
+                    instruction->has_immediate = true;
+                    instruction->immediate = b->constant;
+                    instruction->b = 0;
+                    changed = true;
+                }
+                else if (!instruction->has_immediate && a->is_constant && (instruction->opcode != IR_OP_SUB))
+                {
+                    instruction->has_immediate = true;
+                    instruction->immediate = a->constant;
+                    instruction->a = instruction->b;
+                    instruction->b = 0;
+                    instruction->condition = ir_mirror_condition(instruction->condition);
+                    changed = true;
+                }
+
+                a = constants + instruction->a;
+
+                if (!instruction->has_immediate || !a->is_constant)
+                {
+                    if ((instruction->opcode == IR_OP_ADD) || (instruction->opcode == IR_OP_SUB))
+                    {
+                        if (instruction->has_immediate && (instruction->immediate == 0))
+                        {
+                            // x + 0 and x - 0
+                            *instruction = (IrInstruction) { .opcode = IR_OP_COPY, .size = 8, .dst = instruction->dst, .a = instruction->a };
+                            changed = true;
+                        }
+                    }
+
+                    break;
+                }
+
+                s64 left = a->constant;
+                s64 right = instruction->immediate;
+
+                changed = true;
+
+                switch (instruction->opcode)
+                {
+                    case IR_OP_ADD:
+                    {
+                        ir_make_constant(function, constants, instruction, (s64) ((u64) left + (u64) right));
+                    } break;
+
+                    case IR_OP_SUB:
+                    {
+                        ir_make_constant(function, constants, instruction, (s64) ((u64) left - (u64) right));
+                    } break;
+
+                    case IR_OP_COMPARE:
+                    {
+                        bool result = ir_evaluate_condition(instruction->condition, instruction->size, instruction->is_signed, left, right);
+                        ir_make_constant(function, constants, instruction, result ? 1 : 0);
+                    } break;
+
+                    case IR_OP_BRANCH:
+                    {
+                        if (ir_evaluate_condition(instruction->condition, instruction->size, instruction->is_signed, left, right))
+                        {
+                            *instruction = (IrInstruction) { .opcode = IR_OP_JUMP, .label = instruction->label };
+                        }
+                        else
+                        {
+                            *instruction = (IrInstruction) { .opcode = IR_OP_NOP };
+                        }
+                    } break;
+
+                    default:
+                    {
+                    } break;
+                }
+            } break;
+
+            default:
+            {
+            } break;
+        }
+    }
+
+    free_block(&default_allocator, constants, function->values.count * sizeof(IrConstant));
+
+    return changed;
+}
+
+// Removes the NOPs from the instruction list.
+static void
+ir_compact_instructions(IrFunction *function)
+{
+    s32 count = 0;
+
+    for (s32 i = 0; i < function->instructions.count; i += 1)
+    {
+        if (function->instructions.items[i].opcode != IR_OP_NOP)
+        {
+            function->instructions.items[count] = function->instructions.items[i];
+            count += 1;
+        }
+    }
+
+    function->instructions.count = count;
+}
+
+// Removes the basic blocks that can't be reached from the function entry and
+// jumps to the directly following instruction.
+static bool
+ir_remove_unreachable_code(IrFunction *function)
+{
+    bool changed = false;
+
+    IrLiveness liveness;
+    ir_build_blocks(function, &liveness);
+
+    bool *reachable = alloc_array(&default_allocator, bool, liveness.block_count, 8, true);
+    s32 *work_list = alloc_array(&default_allocator, s32, liveness.block_count, 8, false);
+    s32 work_count = 0;
+
+    reachable[0] = true;
+    work_list[work_count++] = 0;
+
+    while (work_count > 0)
+    {
+        IrBlock *block = liveness.blocks + work_list[--work_count];
+
+        for (s32 s = 0; s < block->successor_count; s += 1)
+        {
+            s32 successor = block->successors[s];
+
+            if (!reachable[successor])
+            {
+                reachable[successor] = true;
+                work_list[work_count++] = successor;
+            }
+        }
+    }
+
+    for (s32 b = 0; b < liveness.block_count; b += 1)
+    {
+        if (!reachable[b])
+        {
+            IrBlock *block = liveness.blocks + b;
+
+            for (s32 i = block->first; i <= block->last; i += 1)
+            {
+                function->instructions.items[i].opcode = IR_OP_NOP;
+            }
+
+            changed = true;
+        }
+    }
+
+    ir_compact_instructions(function);
+
+    for (s32 i = 0; i < function->instructions.count; i += 1)
+    {
+        IrInstruction *instruction = function->instructions.items + i;
+
+        if ((instruction->opcode != IR_OP_JUMP) && (instruction->opcode != IR_OP_BRANCH))
+        {
+            continue;
+        }
+
+        for (s32 k = i + 1; k < function->instructions.count; k += 1)
+        {
+            IrInstruction *next = function->instructions.items + k;
+
+            if (next->opcode != IR_OP_LABEL)
+            {
+                break;
+            }
+
+            if (next->label == instruction->label)
+            {
+                instruction->opcode = IR_OP_NOP;
+                changed = true;
+                break;
+            }
+        }
+    }
+
+    ir_compact_instructions(function);
+
+    free_block(&default_allocator, work_list, liveness.block_count * sizeof(s32));
+    free_block(&default_allocator, reachable, liveness.block_count * sizeof(bool));
+    ir_free_liveness(&liveness);
+
+    return changed;
+}
+
+static inline bool
+ir_has_side_effects(IrInstruction *instruction)
+{
+    bool result = true;
+
+    switch (instruction->opcode)
+    {
+        case IR_OP_CONSTANT:
+        case IR_OP_STRING_ADDRESS:
+        case IR_OP_COPY:
+        case IR_OP_EXTEND:
+        case IR_OP_ADD:
+        case IR_OP_SUB:
+        case IR_OP_COMPARE:
+        {
+            result = false;
+        } break;
+
+        default:
+        {
+        } break;
+    }
+
+    return result;
+}
+
+// Removes the instructions without side effects whose result is never used.
+static bool
+ir_remove_dead_stores(IrFunction *function)
+{
+    bool changed = false;
+
+    IrLiveness liveness;
+    ir_compute_liveness(function, &liveness);
+
+    u64 *live = alloc_array(&default_allocator, u64, liveness.words, 8, false);
+
+    s32 max_count = ir_get_max_operand_count(function);
+    s32 *values = alloc_array(&default_allocator, s32, max_count, 8, false);
+
+    for (s32 b = 0; b < liveness.block_count; b += 1)
+    {
+        IrBlock *block = liveness.blocks + b;
+        u64 *live_out = liveness.live_out + b * liveness.words;
+
+        for (s32 w = 0; w < liveness.words; w += 1)
+        {
+            live[w] = live_out[w];
+        }
+
+        for (s32 i = block->last; i >= block->first; i -= 1)
+        {
+            IrInstruction *instruction = function->instructions.items + i;
+
+            if (!ir_has_side_effects(instruction) && !ir_bitset_contains(live, instruction->dst))
+            {
+                instruction->opcode = IR_OP_NOP;
+                changed = true;
+                continue;
+            }
+
+            s32 count = ir_get_definitions(function, instruction, values, max_count);
+
+            for (s32 k = 0; k < count; k += 1)
+            {
+                ir_bitset_remove(live, values[k]);
+            }
+
+            count = ir_get_uses(function, instruction, values, max_count);
+
+            for (s32 k = 0; k < count; k += 1)
+            {
+                ir_bitset_add(live, values[k]);
+            }
+        }
+    }
+
+    ir_compact_instructions(function);
+
+    free_block(&default_allocator, values, max_count * sizeof(s32));
+    free_block(&default_allocator, live, liveness.words * sizeof(u64));
+    ir_free_liveness(&liveness);
+
+    return changed;
+}
+
+// Removes the functions whose calls all got folded away. The entry point is the first
+// function, without an entry point all functions are kept.
+static void
+ir_remove_unused_functions(IrProgram *program)
+{
+    if ((program->count == 0) || (program->items[0].decl->name_atom != intern_string(S("main"))))
+    {
+        return;
+    }
+
+    bool *reachable = alloc_array(&default_allocator, bool, program->count, 8, true);
+    s32 *work_list = alloc_array(&default_allocator, s32, program->count, 8, false);
+    s32 work_count = 0;
+
+    reachable[0] = true;
+    work_list[work_count++] = 0;
+
+    while (work_count > 0)
+    {
+        IrFunction *function = program->items + work_list[--work_count];
+
+        for (s32 i = 0; i < function->instructions.count; i += 1)
+        {
+            IrInstruction *instruction = function->instructions.items + i;
+
+            if ((instruction->opcode != IR_OP_CALL) && (instruction->opcode != IR_OP_TAIL_CALL))
+            {
+                continue;
+            }
+
+            s32 callee_index = ast_get_function(instruction->function)->ir_index;
+
+            if ((callee_index >= 0) && !reachable[callee_index])
+            {
+                reachable[callee_index] = true;
+                work_list[work_count++] = callee_index;
+            }
+        }
+    }
+
+    s32 count = 0;
+
+    for (s32 i = 0; i < program->count; i += 1)
+    {
+        if (reachable[i])
+        {
+            program->items[count] = program->items[i];
+            ast_get_function(program->items[count].decl)->ir_index = count;
+            count += 1;
+        }
+        else
+        {
+            ast_get_function(program->items[i].decl)->ir_index = -1;
+        }
+    }
+
+    program->count = count;
+}
+
+// Functions up to this many instructions get inlined without #inline.
+#define IR_INLINE_MAX_COST 12
+
+static IrFunction *
+ir_find_function(IrProgram *program, Ast *decl)
+{
+    IrFunction *result = 0;
+    s32 index = ast_get_function(decl)->ir_index;
+
+    if (index >= 0)
+    {
+        assert((index < program->count) && (program->items[index].decl == decl));
+        result = program->items + index;
+    }
+
+    return result;
+}
+
+// Small leaf functions get inlined, #inline and #no_inline override that. A function is
+// never inlined into itself, so recursion stops after one level.
+static bool
+ir_should_inline(IrFunction *caller, IrFunction *callee)
+{
+    if (!callee || (callee == caller) || (ast_get_function(callee->decl)->inlining == AST_INLINE_NEVER))
+    {
+        return false;
+    }
+
+    if (ast_get_function(callee->decl)->inlining == AST_INLINE_ALWAYS)
+    {
+        return true;
+    }
+
+    s32 cost = 0;
+
+    for (s32 i = 0; i < callee->instructions.count; i += 1)
+    {
+        IrInstruction *instruction = callee->instructions.items + i;
+
+        if (instruction->opcode == IR_OP_CALL)
+        {
+            return false;
+        }
+
+        if (instruction->opcode != IR_OP_LABEL)
+        {
+            cost += 1;
+        }
+    }
+
+    return (cost <= IR_INLINE_MAX_COST);
+}
+
+// Copies the body of the callee in place of the call. The callee gets fresh values and labels,
+// the parameters are copied from the arguments and every return becomes a copy into the results
+// of the call and a jump behind the inlined body.
+static void
+ir_inline_call(IrFunction *caller, IrInstruction *call, IrFunction *callee)
+{
+    s32 value_offset = caller->values.count - 1;
+    s32 label_offset = caller->label_count;
+    s32 end_label = label_offset + callee->label_count;
+
+    caller->label_count = end_label + 1;
+
+    for (s32 v = 1; v < callee->values.count; v += 1)
+    {
+        ir_new_value(caller, callee->values.items[v].size);
+    }
+
+    assert(call->argument_count == callee->parameters.count);
+
+    for (s32 i = 0; i < call->argument_count; i += 1)
+    {
+        s32 argument = caller->operands.items[call->first_operand + call->result_count + i];
+        s32 parameter = callee->parameters.items[i] + value_offset;
+
+        ir_emit(caller, (IrInstruction) { .opcode = IR_OP_COPY, .size = 8, .dst = parameter, .a = argument });
+    }
+
+    for (s32 i = 0; i < callee->instructions.count; i += 1)
+    {
+        IrInstruction instruction = callee->instructions.items[i];
+
+        if (instruction.dst) instruction.dst += value_offset;
+        if (instruction.a)   instruction.a += value_offset;
+        if (instruction.b)   instruction.b += value_offset;
+
+        switch (instruction.opcode)
+        {
+            case IR_OP_LABEL:
+            case IR_OP_JUMP:
+            case IR_OP_BRANCH:
+            {
+                instruction.label += label_offset;
+                ir_emit(caller, instruction);
+            } break;
+
+            case IR_OP_CALL:
+            case IR_OP_INTRINSIC:
+            {
+                s32 first_operand = caller->operands.count;
+                s32 operand_count = instruction.result_count + instruction.argument_count;
+
+                for (s32 k = 0; k < operand_count; k += 1)
+                {
+                    array_append(&caller->operands, callee->operands.items[instruction.first_operand + k] + value_offset);
+                }
+
+                instruction.first_operand = first_operand;
+                ir_emit(caller, instruction);
+            } break;
+
+            case IR_OP_RETURN:
+            {
+                // a function without a return statement leaves its results undefined
+                s32 count = (instruction.argument_count < call->result_count) ? instruction.argument_count : call->result_count;
+
+                for (s32 k = 0; k < count; k += 1)
+                {
+                    s32 result = caller->operands.items[call->first_operand + k];
+                    s32 value = callee->operands.items[instruction.first_operand + k] + value_offset;
+
+                    ir_emit(caller, (IrInstruction) { .opcode = IR_OP_COPY, .size = 8, .dst = result, .a = value });
+                }
+
+                ir_emit(caller, (IrInstruction) { .opcode = IR_OP_JUMP, .label = end_label });
+            } break;
+
+            default:
+            {
+                ir_emit(caller, instruction);
+            } break;
+        }
+    }
+
+    ir_emit(caller, (IrInstruction) { .opcode = IR_OP_LABEL, .label = end_label });
+}
+
+static bool
+ir_inline_calls(IrProgram *program)
+{
+    bool changed = false;
+
+    for (s32 f = 0; f < program->count; f += 1)
+    {
+        IrFunction *function = program->items + f;
+
+        // the inlined code gets emitted into a fresh instruction list, it is not looked at again
+        IrInstructionArray instructions = function->instructions;
+        function->instructions = (IrInstructionArray) { 0 };
+
+        for (s32 i = 0; i < instructions.count; i += 1)
+        {
+            IrInstruction *instruction = instructions.items + i;
+
+            IrFunction *callee = 0;
+
+            if (instruction->opcode == IR_OP_CALL)
+            {
+                callee = ir_find_function(program, instruction->function);
+            }
+
+            if (ir_should_inline(function, callee))
+            {
+                ir_inline_call(function, instruction, callee);
+                changed = true;
+            }
+            else
+            {
+                ir_emit(function, *instruction);
+            }
+        }
+    }
+
+    return changed;
+}
+
+// A call is in tail position if the function returns its results right away. Calls of the
+// function itself become a jump back to the start, the arguments are copied into the parameters
+// through temporaries because they may read the parameters. Other calls become tail calls.
+static bool
+ir_eliminate_tail_calls(IrFunction *function)
+{
+    bool changed = false;
+
+    IrInstructionArray instructions = function->instructions;
+    function->instructions = (IrInstructionArray) { 0 };
+
+    s32 start_label = ir_new_label(function);
+    ir_emit(function, (IrInstruction) { .opcode = IR_OP_LABEL, .label = start_label });
+
+    for (s32 i = 0; i < instructions.count; i += 1)
+    {
+        IrInstruction *instruction = instructions.items + i;
+
+        bool is_tail_call = false;
+
+        if (instruction->opcode == IR_OP_CALL)
+        {
+            s32 k = i + 1;
+
+            while ((k < instructions.count) && (instructions.items[k].opcode == IR_OP_LABEL))
+            {
+                k += 1;
+            }
+
+            IrInstruction *next = instructions.items + k;
+
+            if ((k < instructions.count) && (next->opcode == IR_OP_RETURN) &&
+                (next->argument_count == instruction->result_count))
+            {
+                is_tail_call = true;
+
+                for (s32 r = 0; r < instruction->result_count; r += 1)
+                {
+                    if (function->operands.items[instruction->first_operand + r] != function->operands.items[next->first_operand + r])
+                    {
+                        is_tail_call = false;
+                    }
+                }
+            }
+        }
+
+        if (is_tail_call && (instruction->function == function->decl))
+        {
+            s32 *arguments = function->operands.items + instruction->first_operand + instruction->result_count;
+
+            assert(instruction->argument_count == function->parameters.count);
+
+            s32 first_temporary = function->values.count;
+
+            for (s32 k = 0; k < instruction->argument_count; k += 1)
+            {
+                s32 temporary = ir_new_value(function, function->values.items[function->parameters.items[k]].size);
+                ir_emit(function, (IrInstruction) { .opcode = IR_OP_COPY, .size = 8, .dst = temporary, .a = arguments[k] });
+            }
+
+            for (s32 k = 0; k < instruction->argument_count; k += 1)
+            {
+                ir_emit(function, (IrInstruction) { .opcode = IR_OP_COPY, .size = 8, .dst = function->parameters.items[k], .a = first_temporary + k });
+            }
+
+            ir_emit(function, (IrInstruction) { .opcode = IR_OP_JUMP, .label = start_label });
+            changed = true;
+        }
+        else if (is_tail_call && (instruction->argument_count <= IR_MAX_TAIL_CALL_ARGUMENTS))
+        {
+            IrInstruction tail_call = *instruction;
+
+            tail_call.opcode = IR_OP_TAIL_CALL;
+            tail_call.first_operand += tail_call.result_count;
+            tail_call.result_count = 0;
+
+            ir_emit(function, tail_call);
+            changed = true;
+        }
+        else
+        {
+            ir_emit(function, *instruction);
+        }
+    }
+
+    return changed;
+}
+
+static void
+ir_optimize_function(IrFunction *function)
+{
+    bool changed = true;
+
+    while (changed)
+    {
+        changed = false;
+
+        if (ir_fold_constants(function))          changed = true;
+        if (ir_remove_unreachable_code(function)) changed = true;
+        if (ir_remove_dead_stores(function))      changed = true;
+    }
+}
+
+static void
+optimize_ir(IrProgram *program)
+{
+    for (s32 i = 0; i < program->count; i += 1)
+    {
+        ir_optimize_function(program->items + i);
+    }
+
+    // the callees are already optimized, so the cost model sees their final size
+    bool inlined = ir_inline_calls(program);
+
+    for (s32 i = 0; i < program->count; i += 1)
+    {
+        IrFunction *function = program->items + i;
+
+        if (ir_eliminate_tail_calls(function) || inlined)
+        {
+            ir_optimize_function(function);
+        }
+    }
+
+    ir_remove_unused_functions(program);
+}
@@ -1,10 +1,25 @@
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    TokenBuffer *items;
+} TokenBufferArray;
+
 typedef struct
 {
     bool has_error;
 
     Token previous;
     Token current;
-    Lexer lexer;
+
+    // the lexed file, current is the token at token_index
+    TokenBuffer tokens;
+    s32 token_index;
+
+    // When parsing lazily the function bodies are only skipped over, the tokens of every file
+    // are kept to parse them later. Indexed by file index.
+    bool parse_bodies_lazily;
+    TokenBufferArray file_tokens;
 } Parser;
 
 typedef struct
@@ -14,10 +29,17 @@ typedef struct
     String current_directory;
     SourceFileArray source_files;
 
-    AstBucketArray ast_nodes;
-
     Ast global_declarations;
 
+    // function declarations in the order they are discovered from the entry point
+    AstArray reachable_functions;
+
+    // declarations visible while type checking
+    ScopeTable scopes;
+
+    // set by the type checker after it reported an error
+    bool has_type_error;
+
     DatatypeTable datatypes;
 
     DatatypeId basetype_void;
@@ -41,16 +63,16 @@ typedef struct
 static inline SourceLocation
 make_source_location(Parser *parser, String location)
 {
-    String source = parser->lexer.input;
+    String source = parser->tokens.input;
 
     assert(location.data >= source.data);
     assert((location.data + location.count) <= (source.data + source.count));
+    assert((location.data - source.data) <= U32MAX);
 
     SourceLocation source_location;
 
-    source_location.file_index = parser->lexer.current_file_index;
-    source_location.index = location.data - source.data;
-    source_location.count = location.count;
+    source_location.index = (u32) (location.data - source.data);
+    source_location.file_index = parser->tokens.file_index;
 
     return source_location;
 }
@@ -58,8 +80,38 @@ make_source_location(Parser *parser, String location)
 static inline void
 advance_token(Parser *parser)
 {
+    // stays on the end of the input once it got there
+    if ((parser->token_index + 1) < parser->tokens.count)
+    {
+        parser->token_index += 1;
+    }
+
     parser->previous = parser->current;
-    parser->current = get_next_token(&parser->lexer);
+    parser->current = get_token(&parser->tokens, parser->token_index);
+}
+
+static inline void
+seek_token(Parser *parser, s32 index)
+{
+    assert((index > 0) && (index < parser->tokens.count));
+
+    parser->token_index = index;
+    parser->previous = get_token(&parser->tokens, index - 1);
+    parser->current = get_token(&parser->tokens, index);
+}
+
+// Type of the token offset tokens after the current one.
+static inline TokenType
+peek_token_type(Parser *parser, s32 offset)
+{
+    s32 index = parser->token_index + offset;
+
+    if (index >= parser->tokens.count)
+    {
+        index = parser->tokens.count - 1;
+    }
+
+    return (TokenType) parser->tokens.types[index];
 }
 
 static inline bool
@@ -89,6 +141,16 @@ report_error_valist(Compiler compiler, SourceLocation location, const char *mess
 
     String source = source_file.content;
 
+    // the nodes don't store the length of their source, lex the token again
+    Lexer lexer = { 0 };
+
+    lexer.start = location.index;
+    lexer.current = location.index;
+    lexer.current_file_index = location.file_index;
+    lexer.input = source;
+
+    s64 marked_count = get_next_token(&lexer).lexeme.count;
+
     while (index < location.index)
     {
         if (source.data[index] == '\n')
@@ -158,7 +220,7 @@ report_error_valist(Compiler compiler, SourceLocation location, const char *mess
         index += 1;
     }
 
-    for (s64 i = 0; i < location.count; i += 1)
+    for (s64 i = 0; i < marked_count; i += 1)
     {
         fprintf(stderr, "^");
     }
@@ -211,12 +273,12 @@ parse_type_definition(Compiler *compiler)
             {
                 assert(current_def);
 
-                ast_set_left_expr(current_def, append_ast(&compiler->ast_nodes, AST_KIND_POINTER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme)));
-                current_def = current_def->left_expr;
+                ast_set_left_expr(current_def, append_ast(AST_KIND_POINTER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme)));
+                current_def = ast_get(current_def->left_expr);
             }
             else
             {
-                type_def = append_ast(&compiler->ast_nodes, AST_KIND_POINTER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+                type_def = append_ast(AST_KIND_POINTER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
                 current_def = type_def;
             }
         }
@@ -240,13 +302,13 @@ parse_type_definition(Compiler *compiler)
         {
             assert(current_def);
 
-            ast_set_left_expr(current_def, append_ast(&compiler->ast_nodes, AST_KIND_QUERY_TYPE_OF, source_location));
-            current_def = current_def->left_expr;
+            ast_set_left_expr(current_def, append_ast(AST_KIND_QUERY_TYPE_OF, source_location));
+            current_def = ast_get(current_def->left_expr);
             ast_set_left_expr(current_def, parse_expression(compiler));
         }
         else
         {
-            type_def = append_ast(&compiler->ast_nodes, AST_KIND_QUERY_TYPE_OF, source_location);
+            type_def = append_ast(AST_KIND_QUERY_TYPE_OF, source_location);
             ast_set_left_expr(type_def, parse_expression(compiler));
             current_def = type_def;
         }
@@ -261,16 +323,16 @@ parse_type_definition(Compiler *compiler)
         {
             assert(current_def);
 
-            ast_set_left_expr(current_def, append_ast(&compiler->ast_nodes, AST_KIND_IDENTIFIER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme)));
-            current_def = current_def->left_expr;
+            ast_set_left_expr(current_def, append_ast(AST_KIND_IDENTIFIER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme)));
+            current_def = ast_get(current_def->left_expr);
         }
         else
         {
-            type_def = append_ast(&compiler->ast_nodes, AST_KIND_IDENTIFIER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            type_def = append_ast(AST_KIND_IDENTIFIER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
             current_def = type_def;
         }
 
-        current_def->name = compiler->parser.previous.lexeme;
+        current_def->name_atom = compiler->parser.previous.atom;
     }
 
     return type_def;
@@ -301,15 +363,15 @@ parse_primary(Compiler *compiler)
         case TOKEN_IDENTIFIER:
         {
             expect_token(compiler, TOKEN_IDENTIFIER);
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_IDENTIFIER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            expr = append_ast(AST_KIND_IDENTIFIER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
-            expr->name = compiler->parser.previous.lexeme;
+            expr->name_atom = compiler->parser.previous.atom;
         } break;
 
         case TOKEN_LITERAL_STRING:
         {
             expect_token(compiler, TOKEN_LITERAL_STRING);
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_LITERAL_STRING, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            expr = append_ast(AST_KIND_LITERAL_STRING, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
             expr->type_id = compiler->basetype_string;
 
             String value = compiler->parser.previous.lexeme;
@@ -319,8 +381,10 @@ parse_primary(Compiler *compiler)
             value.data += 1;
             value.count -= 2;
 
-            expr->name.count = 0;
-            expr->name.data = alloc(&default_allocator, value.count, 8, false);
+            String str;
+
+            str.count = 0;
+            str.data = alloc(&default_allocator, value.count, 8, false);
 
             bool escaped = false;
 
@@ -334,8 +398,8 @@ parse_primary(Compiler *compiler)
                     {
                         case 'n':
                         {
-                            expr->name.data[expr->name.count] = '\n';
-                            expr->name.count += 1;
+                            str.data[str.count] = '\n';
+                            str.count += 1;
                         } break;
                     }
 
@@ -349,17 +413,19 @@ parse_primary(Compiler *compiler)
                     }
                     else
                     {
-                        expr->name.data[expr->name.count] = value.data[i];
-                        expr->name.count += 1;
+                        str.data[str.count] = value.data[i];
+                        str.count += 1;
                     }
                 }
             }
+
+            expr->string_index = append_ast_string(str);
         } break;
 
         case TOKEN_LITERAL_INTEGER:
         {
             expect_token(compiler, TOKEN_LITERAL_INTEGER);
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_LITERAL_INTEGER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            expr = append_ast(AST_KIND_LITERAL_INTEGER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
             expr->type_id = compiler->basetype_s64;
 
             expr->_s64 = parse_integer(compiler->parser.previous.lexeme);
@@ -368,7 +434,7 @@ parse_primary(Compiler *compiler)
         case TOKEN_KEYWORD_TRUE:
         {
             expect_token(compiler, TOKEN_KEYWORD_TRUE);
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_LITERAL_BOOLEAN, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            expr = append_ast(AST_KIND_LITERAL_BOOLEAN, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
             expr->type_id = compiler->basetype_bool;
 
             expr->_bool = true;
@@ -377,7 +443,7 @@ parse_primary(Compiler *compiler)
         case TOKEN_KEYWORD_FALSE:
         {
             expect_token(compiler, TOKEN_KEYWORD_FALSE);
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_LITERAL_BOOLEAN, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            expr = append_ast(AST_KIND_LITERAL_BOOLEAN, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
             expr->type_id = compiler->basetype_bool;
 
             expr->_bool = false;
@@ -386,7 +452,7 @@ parse_primary(Compiler *compiler)
         case TOKEN_LITERAL_FLOAT:
         {
             expect_token(compiler, TOKEN_LITERAL_FLOAT);
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_LITERAL_FLOAT, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            expr = append_ast(AST_KIND_LITERAL_FLOAT, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
             // TODO: choose correct type
             expr->type_id = compiler->basetype_f32;
             // TODO: store value
@@ -415,56 +481,62 @@ parse_primary(Compiler *compiler)
     return expr;
 }
 
-static Ast *
-parse_postfix_expression(Compiler *compiler)
+// How strongly an operator that follows an operand binds, tokens that can't follow an operand
+// have PRECEDENCE_NONE and end the expression. All binary operators are left associative,
+// assignments can't be chained and take only an identifier on their left.
+typedef enum
 {
-    Ast *expr = parse_primary(compiler);
-
-    for (;;)
-    {
-        if (match_token(&compiler->parser, '('))
-        {
-            Ast *function_call = append_ast(&compiler->ast_nodes, AST_KIND_FUNCTION_CALL, expr->source_location);
-
-            ast_set_left_expr(function_call, expr);
-            expr = function_call;
-
-            for (;;)
-            {
-                Ast *argument = parse_expression(compiler);
-
-                if (!argument) return 0;
-
-                ast_list_append(&function_call->children, argument);
-                argument->parent = function_call;
-
-                if (!match_token(&compiler->parser, ','))
-                {
-                    break;
-                }
-            }
-
-            expect_token(compiler, ')');
-        }
-        else if (match_token(&compiler->parser, '.'))
-        {
-            expect_token(compiler, TOKEN_IDENTIFIER);
-
-            Ast *member = append_ast(&compiler->ast_nodes, AST_KIND_MEMBER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+    PRECEDENCE_NONE         = 0,
+    PRECEDENCE_ASSIGNMENT   = 1,
+    PRECEDENCE_LOGIC_OR     = 2,
+    PRECEDENCE_LOGIC_AND    = 3,
+    PRECEDENCE_EQUALITY     = 4,
+    PRECEDENCE_COMPARISON   = 5,
+    PRECEDENCE_TERM         = 6,
+    PRECEDENCE_FACTOR       = 7,
+    PRECEDENCE_UNARY        = 8,
+    PRECEDENCE_POSTFIX      = 9,
+} Precedence;
 
-            member->name = compiler->parser.previous.lexeme;
-
-            ast_set_left_expr(member, expr);
-            expr = member;
-        }
-        else
-        {
-            break;
-        }
-    }
+typedef struct
+{
+    u8 precedence;
+    u8 ast_kind;
+} InfixOperator;
 
-    return expr;
-}
+static const InfixOperator infix_operators[256] =
+{
+    [TOKEN_ASSIGN]          = { PRECEDENCE_ASSIGNMENT,  AST_KIND_ASSIGN                             },
+    [TOKEN_PLUS_EQUAL]      = { PRECEDENCE_ASSIGNMENT,  AST_KIND_PLUS_ASSIGN                        },
+    [TOKEN_MINUS_EQUAL]     = { PRECEDENCE_ASSIGNMENT,  AST_KIND_MINUS_ASSIGN                       },
+    [TOKEN_MUL_EQUAL]       = { PRECEDENCE_ASSIGNMENT,  AST_KIND_MUL_ASSIGN                         },
+    [TOKEN_DIV_EQUAL]       = { PRECEDENCE_ASSIGNMENT,  AST_KIND_DIV_ASSIGN                         },
+    [TOKEN_OR_EQUAL]        = { PRECEDENCE_ASSIGNMENT,  AST_KIND_OR_ASSIGN                          },
+    [TOKEN_AND_EQUAL]       = { PRECEDENCE_ASSIGNMENT,  AST_KIND_AND_ASSIGN                         },
+    [TOKEN_XOR_EQUAL]       = { PRECEDENCE_ASSIGNMENT,  AST_KIND_XOR_ASSIGN                         },
+    [TOKEN_LOGICAL_OR]      = { PRECEDENCE_LOGIC_OR,    AST_KIND_EXPRESSION_LOGIC_OR                },
+    [TOKEN_LOGICAL_AND]     = { PRECEDENCE_LOGIC_AND,   AST_KIND_EXPRESSION_LOGIC_AND               },
+    [TOKEN_EQUAL]           = { PRECEDENCE_EQUALITY,    AST_KIND_EXPRESSION_EQUAL                   },
+    [TOKEN_NOT_EQUAL]       = { PRECEDENCE_EQUALITY,    AST_KIND_EXPRESSION_NOT_EQUAL               },
+    [TOKEN_LESS]            = { PRECEDENCE_COMPARISON,  AST_KIND_EXPRESSION_COMPARE_LESS            },
+    [TOKEN_GREATER]         = { PRECEDENCE_COMPARISON,  AST_KIND_EXPRESSION_COMPARE_GREATER         },
+    [TOKEN_LESS_EQUAL]      = { PRECEDENCE_COMPARISON,  AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL      },
+    [TOKEN_GREATER_EQUAL]   = { PRECEDENCE_COMPARISON,  AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL   },
+    [TOKEN_BINOP_PLUS]      = { PRECEDENCE_TERM,        AST_KIND_EXPRESSION_BINOP_ADD               },
+    [TOKEN_BINOP_MINUS]     = { PRECEDENCE_TERM,        AST_KIND_EXPRESSION_BINOP_MINUS             },
+    [TOKEN_BINOP_OR]        = { PRECEDENCE_TERM,        AST_KIND_EXPRESSION_BINOP_OR                },
+    [TOKEN_BINOP_XOR]       = { PRECEDENCE_TERM,        AST_KIND_EXPRESSION_BINOP_XOR               },
+    [TOKEN_BINOP_MUL]       = { PRECEDENCE_FACTOR,      AST_KIND_EXPRESSION_BINOP_MUL               },
+    [TOKEN_BINOP_DIV]       = { PRECEDENCE_FACTOR,      AST_KIND_EXPRESSION_BINOP_DIV               },
+    [TOKEN_BINOP_MOD]       = { PRECEDENCE_FACTOR,      AST_KIND_EXPRESSION_BINOP_MOD               },
+    [TOKEN_BINOP_AND]       = { PRECEDENCE_FACTOR,      AST_KIND_EXPRESSION_BINOP_AND               },
+    [TOKEN_SHIFT_LEFT]      = { PRECEDENCE_FACTOR,      AST_KIND_EXPRESSION_SHIFT_LEFT              },
+    [TOKEN_SHIFT_RIGHT]     = { PRECEDENCE_FACTOR,      AST_KIND_EXPRESSION_SHIFT_RIGHT             },
+    [TOKEN_LEFT_PAREN]      = { PRECEDENCE_POSTFIX,     AST_KIND_FUNCTION_CALL                      },
+    [TOKEN_DOT]             = { PRECEDENCE_POSTFIX,     AST_KIND_MEMBER                             },
+};
+
+static Ast *parse_expression_with_precedence(Compiler *compiler, Precedence min_precedence);
 
 static Ast *
 parse_unary(Compiler *compiler)
@@ -483,15 +555,15 @@ parse_unary(Compiler *compiler)
             ast_kind = AST_KIND_EXPRESSION_UNARY_MINUS;
         }
 
-        Ast *expr = append_ast(&compiler->ast_nodes, ast_kind, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+        Ast *expr = append_ast(ast_kind, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
-        ast_set_left_expr(expr, parse_unary(compiler));
+        ast_set_left_expr(expr, parse_expression_with_precedence(compiler, PRECEDENCE_UNARY));
 
         return expr;
     }
     else if (match_token(&compiler->parser, TOKEN_KEYWORD_CAST))
     {
-        Ast *expr = append_ast(&compiler->ast_nodes, AST_KIND_CAST, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+        Ast *expr = append_ast(AST_KIND_CAST, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
         expect_token(compiler, '(');
 
@@ -499,13 +571,13 @@ parse_unary(Compiler *compiler)
 
         expect_token(compiler, ')');
 
-        ast_set_left_expr(expr, parse_unary(compiler));
+        ast_set_left_expr(expr, parse_expression_with_precedence(compiler, PRECEDENCE_UNARY));
 
         return expr;
     }
     else if (match_token(&compiler->parser, TOKEN_KEYWORD_SIZE_OF))
     {
-        Ast *expr = append_ast(&compiler->ast_nodes, AST_KIND_QUERY_SIZE_OF, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+        Ast *expr = append_ast(AST_KIND_QUERY_SIZE_OF, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
         expect_token(compiler, '(');
 
@@ -517,311 +589,107 @@ parse_unary(Compiler *compiler)
     }
     else
     {
-        return parse_postfix_expression(compiler);
+        return parse_primary(compiler);
     }
 }
 
+// Parses an operand and every operator after it that binds at least as strong as
+// min_precedence.
 static Ast *
-parse_factor(Compiler *compiler)
+parse_expression_with_precedence(Compiler *compiler, Precedence min_precedence)
 {
     Ast *expr = parse_unary(compiler);
 
-    while (match_token(&compiler->parser, TOKEN_BINOP_MUL) || match_token(&compiler->parser, TOKEN_BINOP_DIV))
-    {
-        SourceLocation source_location = make_source_location(&compiler->parser, compiler->parser.previous.lexeme);
-
-        AstKind ast_kind;
-
-        if (compiler->parser.previous.type == TOKEN_BINOP_MUL)
-        {
-            ast_kind = AST_KIND_EXPRESSION_BINOP_MUL;
-        }
-        else
-        {
-            assert(compiler->parser.previous.type == TOKEN_BINOP_DIV);
-            ast_kind = AST_KIND_EXPRESSION_BINOP_DIV;
-        }
+    if (!expr) return 0;
 
-        Ast *left_expr = expr;
-        Ast *right_expr = parse_unary(compiler);
-
-        expr = append_ast(&compiler->ast_nodes, ast_kind, source_location);
-
-        ast_set_left_expr(expr, left_expr);
-        ast_set_right_expr(expr, right_expr);
-    }
-
-    return expr;
-}
-
-static Ast *
-parse_term(Compiler *compiler)
-{
-    Ast *expr = parse_factor(compiler);
-
-    while (match_token(&compiler->parser, TOKEN_BINOP_PLUS) || match_token(&compiler->parser, TOKEN_BINOP_MINUS))
+    for (;;)
     {
-        SourceLocation source_location = make_source_location(&compiler->parser, compiler->parser.previous.lexeme);
-
-        AstKind ast_kind;
+        TokenType token_type = compiler->parser.current.type;
+        InfixOperator infix_operator = infix_operators[token_type];
 
-        if (compiler->parser.previous.type == TOKEN_BINOP_PLUS)
+        if ((infix_operator.precedence == PRECEDENCE_NONE) || (infix_operator.precedence < min_precedence))
         {
-            ast_kind = AST_KIND_EXPRESSION_BINOP_ADD;
-        }
-        else
-        {
-            assert(compiler->parser.previous.type == TOKEN_BINOP_MINUS);
-            ast_kind = AST_KIND_EXPRESSION_BINOP_MINUS;
+            break;
         }
 
-        Ast *left_expr = expr;
-        Ast *right_expr = parse_factor(compiler);
-
-        expr = append_ast(&compiler->ast_nodes, ast_kind, source_location);
-
-        ast_set_left_expr(expr, left_expr);
-        ast_set_right_expr(expr, right_expr);
-    }
-
-    return expr;
-}
-
-static Ast *
-parse_comparison(Compiler *compiler)
-{
-    Ast *expr = parse_term(compiler);
+        advance_token(&compiler->parser);
 
-    while (match_token(&compiler->parser, TOKEN_LESS) || match_token(&compiler->parser, TOKEN_GREATER) ||
-           match_token(&compiler->parser, TOKEN_LESS_EQUAL) || match_token(&compiler->parser, TOKEN_GREATER_EQUAL))
-    {
         SourceLocation source_location = make_source_location(&compiler->parser, compiler->parser.previous.lexeme);
 
-        AstKind ast_kind;
-
-        switch (compiler->parser.previous.type)
+        if (token_type == TOKEN_LEFT_PAREN)
         {
-            case TOKEN_LESS:            ast_kind = AST_KIND_EXPRESSION_COMPARE_LESS;            break;
-            case TOKEN_GREATER:         ast_kind = AST_KIND_EXPRESSION_COMPARE_GREATER;         break;
-            case TOKEN_LESS_EQUAL:      ast_kind = AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL;      break;
-            case TOKEN_GREATER_EQUAL:   ast_kind = AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL;   break;
-            default: assert(!"");
-        }
-
-        Ast *left_expr = expr;
-        Ast *right_expr = parse_term(compiler);
-
-        expr = append_ast(&compiler->ast_nodes, ast_kind, source_location);
+            Ast *function_call = append_ast(AST_KIND_FUNCTION_CALL, ast_get_source_location(expr));
 
-        ast_set_left_expr(expr, left_expr);
-        ast_set_right_expr(expr, right_expr);
-    }
+            ast_set_left_expr(function_call, expr);
+            expr = function_call;
 
-    return expr;
-}
+            for (;;)
+            {
+                Ast *argument = parse_expression(compiler);
 
-static Ast *
-parse_equality(Compiler *compiler)
-{
-    Ast *expr = parse_comparison(compiler);
+                if (!argument) return 0;
 
-    while (match_token(&compiler->parser, TOKEN_EQUAL) || match_token(&compiler->parser, TOKEN_NOT_EQUAL))
-    {
-        SourceLocation source_location = make_source_location(&compiler->parser, compiler->parser.previous.lexeme);
+                ast_list_append(&function_call->children, argument);
 
-        AstKind ast_kind;
+                if (!match_token(&compiler->parser, ','))
+                {
+                    break;
+                }
+            }
 
-        if (compiler->parser.previous.type == TOKEN_EQUAL)
-        {
-            ast_kind = AST_KIND_EXPRESSION_EQUAL;
+            expect_token(compiler, ')');
         }
-        else
+        else if (token_type == TOKEN_DOT)
         {
-            assert(compiler->parser.previous.type == TOKEN_NOT_EQUAL);
-            ast_kind = AST_KIND_EXPRESSION_NOT_EQUAL;
-        }
-
-        Ast *left_expr = expr;
-        Ast *right_expr = parse_comparison(compiler);
-
-        expr = append_ast(&compiler->ast_nodes, ast_kind, source_location);
-
-        ast_set_left_expr(expr, left_expr);
-        ast_set_right_expr(expr, right_expr);
-    }
-
-    return expr;
-}
-
-static Ast *
-parse_logic_and(Compiler *compiler)
-{
-    Ast *expr = parse_equality(compiler);
-
-    while (match_token(&compiler->parser, TOKEN_LOGICAL_AND))
-    {
-        SourceLocation source_location = make_source_location(&compiler->parser, compiler->parser.previous.lexeme);
-
-        Ast *left_expr = expr;
-        Ast *right_expr = parse_equality(compiler);
-
-        expr = append_ast(&compiler->ast_nodes, AST_KIND_EXPRESSION_LOGIC_AND, source_location);
-
-        ast_set_left_expr(expr, left_expr);
-        ast_set_right_expr(expr, right_expr);
-    }
-
-    return expr;
-}
-
-static Ast *
-parse_logic_or(Compiler *compiler)
-{
-    Ast *expr = parse_logic_and(compiler);
-
-    while (match_token(&compiler->parser, TOKEN_LOGICAL_OR))
-    {
-        SourceLocation source_location = make_source_location(&compiler->parser, compiler->parser.previous.lexeme);
-
-        Ast *left_expr = expr;
-        Ast *right_expr = parse_logic_and(compiler);
-
-        expr = append_ast(&compiler->ast_nodes, AST_KIND_EXPRESSION_LOGIC_OR, source_location);
-
-        ast_set_left_expr(expr, left_expr);
-        ast_set_right_expr(expr, right_expr);
-    }
-
-    return expr;
-}
-
-static Ast *
-parse_assignment(Compiler *compiler)
-{
-    Ast *expr = 0;
-
-    expect_token(compiler, TOKEN_IDENTIFIER);
-
-    switch (compiler->parser.current.type)
-    {
-        case TOKEN_PLUS_EQUAL:
-        {
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_PLUS_ASSIGN, make_source_location(&compiler->parser, compiler->parser.current.lexeme));
-            expr->name = compiler->parser.previous.lexeme;
-
-            expect_token(compiler, TOKEN_PLUS_EQUAL);
-        } break;
-
-        case TOKEN_MINUS_EQUAL:
-        {
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_MINUS_ASSIGN, make_source_location(&compiler->parser, compiler->parser.current.lexeme));
-            expr->name = compiler->parser.previous.lexeme;
-
-            expect_token(compiler, TOKEN_MINUS_EQUAL);
-        } break;
-
-        case TOKEN_MUL_EQUAL:
-        {
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_MUL_ASSIGN, make_source_location(&compiler->parser, compiler->parser.current.lexeme));
-            expr->name = compiler->parser.previous.lexeme;
-
-            expect_token(compiler, TOKEN_MUL_EQUAL);
-        } break;
+            expect_token(compiler, TOKEN_IDENTIFIER);
 
-        case TOKEN_DIV_EQUAL:
-        {
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_DIV_ASSIGN, make_source_location(&compiler->parser, compiler->parser.current.lexeme));
-            expr->name = compiler->parser.previous.lexeme;
+            Ast *member = append_ast(AST_KIND_MEMBER, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
-            expect_token(compiler, TOKEN_DIV_EQUAL);
-        } break;
+            member->name_atom = compiler->parser.previous.atom;
 
-        case TOKEN_OR_EQUAL:
+            ast_set_left_expr(member, expr);
+            expr = member;
+        }
+        else if (infix_operator.precedence == PRECEDENCE_ASSIGNMENT)
         {
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_OR_ASSIGN, make_source_location(&compiler->parser, compiler->parser.current.lexeme));
-            expr->name = compiler->parser.previous.lexeme;
+            if (expr->kind != AST_KIND_IDENTIFIER)
+            {
+                report_error(*compiler, source_location, "expected an identifier on the left of an assignment");
+                compiler->parser.has_error = true;
+                return 0;
+            }
 
-            expect_token(compiler, TOKEN_OR_EQUAL);
-        } break;
+            Ast *assignment = append_ast(infix_operator.ast_kind, source_location);
 
-        case TOKEN_AND_EQUAL:
-        {
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_AND_ASSIGN, make_source_location(&compiler->parser, compiler->parser.current.lexeme));
-            expr->name = compiler->parser.previous.lexeme;
+            assignment->name_atom = expr->name_atom;
 
-            expect_token(compiler, TOKEN_AND_EQUAL);
-        } break;
+            ast_set_right_expr(assignment, parse_expression_with_precedence(compiler, PRECEDENCE_ASSIGNMENT + 1));
 
-        case TOKEN_XOR_EQUAL:
-        {
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_XOR_ASSIGN, make_source_location(&compiler->parser, compiler->parser.current.lexeme));
-            expr->name = compiler->parser.previous.lexeme;
-
-            expect_token(compiler, TOKEN_XOR_EQUAL);
-        } break;
+            if (!assignment->right_expr) return 0;
 
-        case TOKEN_ASSIGN:
+            expr = assignment;
+        }
+        else
         {
-            expr = append_ast(&compiler->ast_nodes, AST_KIND_ASSIGN, make_source_location(&compiler->parser, compiler->parser.current.lexeme));
-            expr->name = compiler->parser.previous.lexeme;
-
-            expect_token(compiler, TOKEN_ASSIGN);
-        } break;
+            Ast *left_expr = expr;
+            Ast *right_expr = parse_expression_with_precedence(compiler, infix_operator.precedence + 1);
 
-        default:
-        {
-            report_error(*compiler, make_source_location(&compiler->parser, compiler->parser.current.lexeme), "expected an assignment operator after an identifier");
-        } break;
-    }
+            if (!right_expr) return 0;
 
-    if (expr)
-    {
-        ast_set_right_expr(expr, parse_logic_or(compiler));
+            expr = append_ast(infix_operator.ast_kind, source_location);
 
-        if (!expr->right_expr) return 0;
+            ast_set_left_expr(expr, left_expr);
+            ast_set_right_expr(expr, right_expr);
+        }
     }
 
     return expr;
 }
 
-static inline void
-rollback_one_token(Parser *parser)
-{
-    parser->lexer.current = parser->current.lexeme.data - parser->lexer.input.data;
-    parser->current = parser->previous;
-}
-
 static Ast *
 parse_expression(Compiler *compiler)
 {
-    Ast *ast = 0;
-
-    if (compiler->parser.current.type == TOKEN_IDENTIFIER)
-    {
-        expect_token(compiler, TOKEN_IDENTIFIER);
-
-        TokenType token_type = compiler->parser.current.type;
-
-        rollback_one_token(&compiler->parser);
-
-        if ((token_type == TOKEN_ASSIGN) || (token_type == TOKEN_PLUS_EQUAL) ||
-            (token_type == TOKEN_MINUS_EQUAL) || (token_type == TOKEN_MUL_EQUAL) ||
-            (token_type == TOKEN_DIV_EQUAL) || (token_type == TOKEN_OR_EQUAL) ||
-            (token_type == TOKEN_AND_EQUAL) || (token_type == TOKEN_XOR_EQUAL))
-        {
-            ast = parse_assignment(compiler);
-        }
-        else
-        {
-            ast = parse_logic_or(compiler);
-        }
-    }
-    else
-    {
-        ast = parse_logic_or(compiler);
-    }
-
-    return ast;
+    return parse_expression_with_precedence(compiler, PRECEDENCE_ASSIGNMENT);
 }
 
 static Ast *
@@ -829,11 +697,9 @@ parse_variable_declaration(Compiler *compiler)
 {
     expect_token(compiler, TOKEN_IDENTIFIER);
 
-    Ast *ast = append_ast(&compiler->ast_nodes, AST_KIND_VARIABLE_DECLARATION, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
-
-    ast->name = compiler->parser.previous.lexeme;
-    ast->right_expr = 0;
+    Ast *ast = append_ast(AST_KIND_VARIABLE_DECLARATION, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
+    ast->name_atom = compiler->parser.previous.atom;
     if (match_token(&compiler->parser, TOKEN_COLON_EQUAL))
     {
         ast_set_right_expr(ast, parse_expression(compiler));
@@ -862,11 +728,7 @@ parse_statement(Compiler *compiler)
     {
         case TOKEN_IDENTIFIER:
         {
-            expect_token(compiler, TOKEN_IDENTIFIER);
-
-            TokenType token_type = compiler->parser.current.type;
-
-            rollback_one_token(&compiler->parser);
+            TokenType token_type = peek_token_type(&compiler->parser, 1);
 
             if ((token_type == TOKEN_COLON) || (token_type == TOKEN_COLON_EQUAL))
             {
@@ -884,7 +746,7 @@ parse_statement(Compiler *compiler)
         {
             expect_token(compiler, TOKEN_KEYWORD_IF);
 
-            ast = append_ast(&compiler->ast_nodes, AST_KIND_IF, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            ast = append_ast(AST_KIND_IF, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
             expect_token(compiler, '(');
 
@@ -897,14 +759,13 @@ parse_statement(Compiler *compiler)
             if (!statement) return 0;
 
             ast_list_append(&ast->children, statement);
-            statement->parent = ast;
         } break;
 
         case TOKEN_KEYWORD_FOR:
         {
             expect_token(compiler, TOKEN_KEYWORD_FOR);
 
-            ast = append_ast(&compiler->ast_nodes, AST_KIND_FOR, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            ast = append_ast(AST_KIND_FOR, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
             expect_token(compiler, '(');
 
@@ -925,7 +786,6 @@ parse_statement(Compiler *compiler)
             if (!statement) return 0;
 
             ast_list_append(&ast->children, statement);
-            statement->parent = ast;
         } break;
 
         case TOKEN_KEYWORD_WHILE:
@@ -937,7 +797,7 @@ parse_statement(Compiler *compiler)
         {
             expect_token(compiler, TOKEN_KEYWORD_RETURN);
 
-            ast = append_ast(&compiler->ast_nodes, AST_KIND_RETURN, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            ast = append_ast(AST_KIND_RETURN, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
             ast_set_left_expr(ast, parse_expression(compiler));
 
@@ -948,7 +808,7 @@ parse_statement(Compiler *compiler)
         {
             expect_token(compiler, '{');
 
-            ast = append_ast(&compiler->ast_nodes, AST_KIND_BLOCK, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+            ast = append_ast(AST_KIND_BLOCK, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
             while (compiler->parser.current.type != '}')
             {
@@ -957,7 +817,6 @@ parse_statement(Compiler *compiler)
                 if (!statement) return 0;
 
                 ast_list_append(&ast->children, statement);
-                statement->parent = ast;
             }
 
             expect_token(compiler, '}');
@@ -977,9 +836,9 @@ parse_parameter(Compiler *compiler)
 {
     expect_token(compiler, TOKEN_IDENTIFIER);
 
-    Ast *ast = append_ast(&compiler->ast_nodes, AST_KIND_VARIABLE_DECLARATION, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
+    Ast *ast = append_ast(AST_KIND_VARIABLE_DECLARATION, make_source_location(&compiler->parser, compiler->parser.previous.lexeme));
 
-    ast->name = compiler->parser.previous.lexeme;
+    ast->name_atom = compiler->parser.previous.atom;
 
     expect_token(compiler, ':');
 
@@ -988,12 +847,93 @@ parse_parameter(Compiler *compiler)
     return ast;
 }
 
+// Parses statements up to the closing brace of the function body.
+static bool
+parse_function_statements(Compiler *compiler, Ast *decl)
+{
+    while ((compiler->parser.current.type != '}') && !compiler->parser.has_error)
+    {
+        Ast *statement = parse_statement(compiler);
+
+        if (!statement) return false;
+
+        ast_list_append(&decl->children, statement);
+    }
+
+    return !compiler->parser.has_error;
+}
+
+// Moves to the brace that closes the function body without building any nodes.
+static bool
+skip_function_body(Compiler *compiler)
+{
+    Parser *parser = &compiler->parser;
+
+    s32 index = parser->token_index;
+    s32 depth = 0;
+
+    for (;;)
+    {
+        u8 token_type = parser->tokens.types[index];
+
+        if (token_type == TOKEN_END_OF_INPUT)
+        {
+            report_error(*compiler, make_source_location(parser, parser->previous.lexeme), "missing '}' at the end of the function body");
+            parser->has_error = true;
+            return false;
+        }
+        else if (token_type == '{')
+        {
+            depth += 1;
+        }
+        else if (token_type == '}')
+        {
+            if (depth == 0) break;
+
+            depth -= 1;
+        }
+
+        index += 1;
+    }
+
+    seek_token(parser, index);
+
+    return true;
+}
+
+// Parses the body of a function that was skipped, does nothing if it is parsed already.
+static bool
+parse_function_body(Compiler *compiler, Ast *decl)
+{
+    AstFunction *function = ast_get_function(decl);
+
+    if (function->body_is_parsed)
+    {
+        return true;
+    }
+
+    function->body_is_parsed = true;
+
+    Parser saved_parser = compiler->parser;
+
+    compiler->parser.tokens = compiler->parser.file_tokens.items[function->file_index];
+    seek_token(&compiler->parser, function->body_first_token);
+
+    bool result = parse_function_statements(compiler, decl);
+
+    saved_parser.has_error = compiler->parser.has_error;
+    compiler->parser = saved_parser;
+
+    return result;
+}
+
 static Ast *
 parse_declaration(Compiler *compiler)
 {
     expect_token(compiler, TOKEN_IDENTIFIER);
 
     String name = compiler->parser.previous.lexeme;
+    Atom name_atom = compiler->parser.previous.atom;
 
     expect_token(compiler, TOKEN_COLON_COLON);
 
@@ -1001,16 +941,16 @@ parse_declaration(Compiler *compiler)
 
     if (match_token(&compiler->parser, TOKEN_KEYWORD_STRUCT))
     {
-        declaration = append_ast(&compiler->ast_nodes, AST_KIND_STRUCT_DECLARATION, make_source_location(&compiler->parser, name));
+        declaration = append_ast(AST_KIND_STRUCT_DECLARATION, make_source_location(&compiler->parser, name));
 
-        declaration->name = name;
+        declaration->name_atom = name_atom;
     }
     else if (match_token(&compiler->parser, '('))
     {
-        declaration = append_ast(&compiler->ast_nodes, AST_KIND_FUNCTION_DECLARATION, make_source_location(&compiler->parser, name));
+        declaration = append_ast(AST_KIND_FUNCTION_DECLARATION, make_source_location(&compiler->parser, name));
 
-        declaration->name = name;
-        declaration->address = S64MAX;
+        declaration->name_atom = name_atom;
+        declaration->function_index = append_ast_function();
 
         if (!match_token(&compiler->parser, ')'))
         {
@@ -1020,8 +960,7 @@ parse_declaration(Compiler *compiler)
 
                 if (!parameter) return 0;
 
-                ast_list_append(&declaration->parameters, parameter);
-                parameter->parent = declaration;
+                ast_list_append(&ast_get_function(declaration)->parameters, parameter);
 
                 if (!match_token(&compiler->parser, ','))
                 {
@@ -1037,16 +976,29 @@ parse_declaration(Compiler *compiler)
             ast_set_type_def(declaration, parse_type_definition(compiler));
         }
 
+        if (match_token(&compiler->parser, TOKEN_DIRECTIVE_INLINE))
+        {
+            ast_get_function(declaration)->inlining = AST_INLINE_ALWAYS;
+        }
+        else if (match_token(&compiler->parser, TOKEN_DIRECTIVE_NO_INLINE))
+        {
+            ast_get_function(declaration)->inlining = AST_INLINE_NEVER;
+        }
+
         expect_token(compiler, '{');
 
-        while (compiler->parser.current.type != '}')
-        {
-            Ast *statement = parse_statement(compiler);
+        ast_get_function(declaration)->file_index = compiler->parser.tokens.file_index;
+        ast_get_function(declaration)->body_first_token = compiler->parser.token_index;
 
-            if (!statement) return 0;
+        if (compiler->parser.parse_bodies_lazily)
+        {
+            if (!skip_function_body(compiler)) return 0;
+        }
+        else
+        {
+            ast_get_function(declaration)->body_is_parsed = true;
 
-            ast_list_append(&declaration->children, statement);
-            statement->parent = declaration;
+            if (!parse_function_statements(compiler, declaration)) return 0;
         }
 
         expect_token(compiler, '}');
@@ -1106,7 +1058,6 @@ parse(Compiler *compiler, StringArray *files_to_load)
             if (!decl) return false;
 
             ast_list_append(&compiler->global_declarations.children, decl);
-            decl->parent = &compiler->global_declarations;
         }
     }
 
@@ -0,0 +1,231 @@
+// Peephole optimizations on the machine code of the backends.
+//
+// The backends don't write the data movement of the lowering (register moves, immediates,
+// spill loads and stores and stack pointer adjustments) right away. These instructions are
+// collected in a buffer and every other instruction flushes the buffer first. A flush runs the
+// rules of the architecture over the buffer until none of them applies anymore and encodes
+// what is left. The flags are never live across buffered instructions, the lowering emits
+// the consumer of a compare right after it.
+
+typedef enum
+{
+    MACHINE_NOP             = 0,
+    MACHINE_MOVE            = 1,
+    MACHINE_MOVE_IMMEDIATE  = 2,
+    MACHINE_ZERO            = 3,
+    MACHINE_LOAD            = 4,
+    MACHINE_STORE           = 5,
+    MACHINE_ADJUST_STACK    = 6,
+} MachineOpcode;
+
+//  MOVE            dst = src
+//  MOVE_IMMEDIATE  dst = immediate
+//  ZERO            dst = 0, may change the flags
+//  LOAD            dst = [stack pointer + offset]
+//  STORE           [stack pointer + offset] = src
+//  ADJUST_STACK    stack pointer += immediate
+typedef struct
+{
+    MachineOpcode opcode;
+
+    s32 dst;
+    s32 src;
+    s64 offset;
+    s64 immediate;
+
+    // size of loads and stores in bytes
+    u8 size;
+} MachineInstruction;
+
+typedef struct
+{
+    s32 count;
+    s32 allocated;
+    MachineInstruction *items;
+} MachineInstructionArray;
+
+// Tries to rewrite the instructions starting at index, returns true if it did.
+typedef bool (*PeepholeRuleFunction)(MachineInstructionArray *instructions, s32 index);
+
+typedef struct
+{
+    const char *name;
+    PeepholeRuleFunction apply;
+
+    u64 rewrite_count;
+} PeepholeRule;
+
+static inline bool
+machine_writes_register(MachineInstruction *instruction, s32 reg)
+{
+    switch (instruction->opcode)
+    {
+        case MACHINE_MOVE:
+        case MACHINE_MOVE_IMMEDIATE:
+        case MACHINE_ZERO:
+        case MACHINE_LOAD:
+        {
+            return (instruction->dst == reg);
+        } break;
+
+        default:
+        {
+        } break;
+    }
+
+    return false;
+}
+
+// mov r, r
+static bool
+peephole_remove_self_move(MachineInstructionArray *instructions, s32 index)
+{
+    MachineInstruction *instruction = instructions->items + index;
+
+    if ((instruction->opcode == MACHINE_MOVE) && (instruction->dst == instruction->src))
+    {
+        instruction->opcode = MACHINE_NOP;
+        return true;
+    }
+
+    return false;
+}
+
+// A load of a slot that was just stored becomes a move from the stored register.
+static bool
+peephole_forward_store(MachineInstructionArray *instructions, s32 index)
+{
+    MachineInstruction *store = instructions->items + index;
+
+    if ((store->opcode != MACHINE_STORE) || (store->size != 8))
+    {
+        return false;
+    }
+
+    for (s32 i = index + 1; i < instructions->count; i += 1)
+    {
+        MachineInstruction *instruction = instructions->items + i;
+
+        if ((instruction->opcode == MACHINE_LOAD) && (instruction->offset == store->offset) && (instruction->size == store->size))
+        {
+            *instruction = (MachineInstruction) { .opcode = MACHINE_MOVE, .dst = instruction->dst, .src = store->src };
+            return true;
+        }
+
+        if (machine_writes_register(instruction, store->src) ||
+            ((instruction->opcode == MACHINE_STORE) && (instruction->offset == store->offset)) ||
+            (instruction->opcode == MACHINE_ADJUST_STACK))
+        {
+            break;
+        }
+    }
+
+    return false;
+}
+
+// A store that gets overwritten before anything loads the slot.
+static bool
+peephole_remove_dead_store(MachineInstructionArray *instructions, s32 index)
+{
+    MachineInstruction *store = instructions->items + index;
+
+    if ((store->opcode != MACHINE_STORE) || (store->size != 8))
+    {
+        return false;
+    }
+
+    for (s32 i = index + 1; i < instructions->count; i += 1)
+    {
+        MachineInstruction *instruction = instructions->items + i;
+
+        if ((instruction->opcode == MACHINE_STORE) && (instruction->offset == store->offset) && (instruction->size == store->size))
+        {
+            store->opcode = MACHINE_NOP;
+            return true;
+        }
+
+        if ((instruction->opcode == MACHINE_LOAD) || (instruction->opcode == MACHINE_ADJUST_STACK))
+        {
+            break;
+        }
+    }
+
+    return false;
+}
+
+// add sp, n followed by sub sp, n and the like
+static bool
+peephole_merge_stack_adjustments(MachineInstructionArray *instructions, s32 index)
+{
+    MachineInstruction *instruction = instructions->items + index;
+
+    if (instruction->opcode != MACHINE_ADJUST_STACK)
+    {
+        return false;
+    }
+
+    if (instruction->immediate == 0)
+    {
+        instruction->opcode = MACHINE_NOP;
+        return true;
+    }
+
+    if (((index + 1) < instructions->count) && (instructions->items[index + 1].opcode == MACHINE_ADJUST_STACK))
+    {
+        instructions->items[index + 1].immediate += instruction->immediate;
+        instruction->opcode = MACHINE_NOP;
+        return true;
+    }
+
+    return false;
+}
+
+// Applies the rules until none of them changes anything and removes the NOPs.
+static void
+peephole_optimize(MachineInstructionArray *instructions, PeepholeRule *rules, s32 rule_count)
+{
+    bool changed = true;
+
+    while (changed)
+    {
+        changed = false;
+
+        for (s32 r = 0; r < rule_count; r += 1)
+        {
+            PeepholeRule *rule = rules + r;
+
+            for (s32 i = 0; i < instructions->count; i += 1)
+            {
+                if ((instructions->items[i].opcode != MACHINE_NOP) && rule->apply(instructions, i))
+                {
+                    rule->rewrite_count += 1;
+                    changed = true;
+                }
+            }
+        }
+
+        s32 count = 0;
+
+        for (s32 i = 0; i < instructions->count; i += 1)
+        {
+            if (instructions->items[i].opcode != MACHINE_NOP)
+            {
+                instructions->items[count] = instructions->items[i];
+                count += 1;
+            }
+        }
+
+        instructions->count = count;
+    }
+}
+
+static void
+peephole_print_stats(PeepholeRule *rules, s32 rule_count)
+{
+    fprintf(stderr, "peephole rewrites:\n");
+
+    for (s32 r = 0; r < rule_count; r += 1)
+    {
+        fprintf(stderr, "  %-24s %" PRIu64 "\n", rules[r].name, rules[r].rewrite_count);
+    }
+}
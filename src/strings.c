@@ -151,3 +151,103 @@ get_base_path(String path)
 
     return path;
 }
+
+// Every identifier is interned once by the lexer, after that names are compared by their atom.
+// Atom 0 is never handed out and stands for "no name".
+typedef u32 Atom;
+
+typedef struct
+{
+    u32 hash;
+    String string;
+} AtomEntry;
+
+typedef struct
+{
+    // indexed by atom
+    s32 count;
+    s32 allocated;
+    AtomEntry *items;
+
+    // open addressing with linear probing, 0 is an empty slot, slot_count is a power of two
+    u32 slot_count;
+    Atom *slots;
+} AtomTable;
+
+static AtomTable atom_table;
+
+static inline u32
+hash_string(String str)
+{
+    // FNV-1a
+    u32 hash = 2166136261u;
+
+    for (s64 i = 0; i < str.count; i += 1)
+    {
+        hash = (hash ^ str.data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static void
+atom_table_grow(AtomTable *table)
+{
+    u32 slot_count = (table->slot_count == 0) ? 256 : 2 * table->slot_count;
+    Atom *slots = alloc_array(&default_allocator, Atom, slot_count, 8, true);
+
+    for (s32 atom = 1; atom < table->count; atom += 1)
+    {
+        u32 index = table->items[atom].hash & (slot_count - 1);
+
+        while (slots[index])
+        {
+            index = (index + 1) & (slot_count - 1);
+        }
+
+        slots[index] = (Atom) atom;
+    }
+
+    table->slot_count = slot_count;
+    table->slots = slots;
+}
+
+// The string has to stay alive as long as the atom is in use, source files are never freed.
+static Atom
+intern_string(String str)
+{
+    AtomTable *table = &atom_table;
+
+    if (table->count == 0)
+    {
+        array_append(table, ((AtomEntry) { 0 }));
+    }
+
+    // keep the load factor below 3/4
+    if ((4 * (u32) table->count) >= (3 * table->slot_count))
+    {
+        atom_table_grow(table);
+    }
+
+    u32 hash = hash_string(str);
+    u32 index = hash & (table->slot_count - 1);
+
+    while (table->slots[index])
+    {
+        AtomEntry *entry = table->items + table->slots[index];
+
+        if ((entry->hash == hash) && strings_are_equal(entry->string, str))
+        {
+            return table->slots[index];
+        }
+
+        index = (index + 1) & (table->slot_count - 1);
+    }
+
+    Atom atom = (Atom) table->count;
+
+    array_append(table, ((AtomEntry) { .hash = hash, .string = str }));
+    table->slots[index] = atom;
+
+    return atom;
+}
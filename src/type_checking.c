@@ -71,13 +71,13 @@ resolve_type(Compiler *compiler, Ast *type_def)
     {
         case AST_KIND_QUERY_TYPE_OF:
         {
-            type_check_expression(compiler, type_def->left_expr, 0);
-            type_def->type_id = type_def->left_expr->type_id;
+            type_check_expression(compiler, ast_get(type_def->left_expr), 0);
+            type_def->type_id = ast_get(type_def->left_expr)->type_id;
         } break;
 
         case AST_KIND_IDENTIFIER:
         {
-            DatatypeId type_id = find_datatype_by_name(&compiler->datatypes, type_def->name);
+            DatatypeId type_id = find_datatype_by_name(&compiler->datatypes, type_def->name_atom);
 
             if (type_id)
             {
@@ -92,19 +92,11 @@ resolve_type(Compiler *compiler, Ast *type_def)
 
         case AST_KIND_POINTER:
         {
-            resolve_type(compiler, type_def->left_expr);
+            resolve_type(compiler, ast_get(type_def->left_expr));
 
-            assert(type_def->left_expr->type_id);
+            assert(ast_get(type_def->left_expr)->type_id);
 
-            DatatypeId type_id = find_datatype_by_kind_and_reference(&compiler->datatypes, DATATYPE_POINTER, type_def->left_expr->type_id);
-
-            if (!type_id)
-            {
-                type_id = compiler->datatypes.count;
-                array_append(&compiler->datatypes, ((Datatype) { .kind = DATATYPE_POINTER, .flags = 0, .ref = type_def->left_expr->type_id, .name = S("*"), .size = 8 }));
-            }
-
-            type_def->type_id = type_id;
+            type_def->type_id = get_pointer_datatype(&compiler->datatypes, ast_get(type_def->left_expr)->type_id);
         } break;
 
         default:
@@ -118,6 +110,16 @@ resolve_type(Compiler *compiler, Ast *type_def)
 
 static void type_check_function_signature(Compiler *compiler, Ast *decl);
 
+static inline void
+mark_function_reachable(Compiler *compiler, Ast *decl)
+{
+    if (!ast_get_function(decl)->is_reachable)
+    {
+        ast_get_function(decl)->is_reachable = true;
+        array_append(&compiler->reachable_functions, decl);
+    }
+}
+
 static void
 type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_id)
 {
@@ -125,9 +127,9 @@ type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_i
     {
         case AST_KIND_QUERY_SIZE_OF:
         {
-            resolve_type(compiler, expr->type_def);
+            resolve_type(compiler, ast_get(expr->type_def));
 
-            Datatype *type = get_datatype(&compiler->datatypes, expr->type_def->type_id);
+            Datatype *type = get_datatype(&compiler->datatypes, ast_get(expr->type_def)->type_id);
 
             expr->kind = AST_KIND_LITERAL_INTEGER;
             expr->type_id = compiler->basetype_u64;
@@ -136,15 +138,16 @@ type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_i
 
         case AST_KIND_IDENTIFIER:
         {
-            expr->decl = find_declaration_by_name(expr, expr->name);
+            expr->decl = ast_get_id(find_declaration_by_name(&compiler->scopes, expr->name_atom));
 
             if (expr->decl)
             {
-                expr->type_id = expr->decl->type_id;
+                expr->type_id = ast_get(expr->decl)->type_id;
             }
             else
             {
-                report_error(*compiler, expr->source_location, "undeclared identifier '%.*s'", (int) expr->name.count, expr->name.data);
+                report_error(*compiler, ast_get_source_location(expr), "undeclared identifier '%.*s'", (int) ast_get_name(expr).count, ast_get_name(expr).data);
+                compiler->has_type_error = true;
             }
         } break;
 
@@ -274,19 +277,19 @@ type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_i
         case AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL:
         case AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL:
         {
-            if (expr->left_expr->kind == AST_KIND_LITERAL_INTEGER)
+            if (ast_get(expr->left_expr)->kind == AST_KIND_LITERAL_INTEGER)
             {
-                type_check_expression(compiler, expr->right_expr, 0);
-                type_check_expression(compiler, expr->left_expr, expr->right_expr->type_id);
+                type_check_expression(compiler, ast_get(expr->right_expr), 0);
+                type_check_expression(compiler, ast_get(expr->left_expr), ast_get(expr->right_expr)->type_id);
             }
             else
             {
-                type_check_expression(compiler, expr->left_expr, 0);
-                type_check_expression(compiler, expr->right_expr, expr->left_expr->type_id);
+                type_check_expression(compiler, ast_get(expr->left_expr), 0);
+                type_check_expression(compiler, ast_get(expr->right_expr), ast_get(expr->left_expr)->type_id);
             }
 
-            if (can_implicitly_cast_to(&compiler->datatypes, expr->left_expr->type_id, expr->right_expr->type_id) ||
-                can_implicitly_cast_to(&compiler->datatypes, expr->right_expr->type_id, expr->left_expr->type_id))
+            if (can_implicitly_cast_to(&compiler->datatypes, ast_get(expr->left_expr)->type_id, ast_get(expr->right_expr)->type_id) ||
+                can_implicitly_cast_to(&compiler->datatypes, ast_get(expr->right_expr)->type_id, ast_get(expr->left_expr)->type_id))
             {
             }
             else
@@ -298,33 +301,50 @@ type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_i
             expr->type_id = compiler->basetype_bool;
         } break;
 
+        case AST_KIND_EXPRESSION_LOGIC_AND:
+        case AST_KIND_EXPRESSION_LOGIC_OR:
+        {
+            type_check_expression(compiler, ast_get(expr->left_expr), compiler->basetype_bool);
+            type_check_expression(compiler, ast_get(expr->right_expr), compiler->basetype_bool);
+
+            if ((ast_get(expr->left_expr)->type_id != compiler->basetype_bool) ||
+                (ast_get(expr->right_expr)->type_id != compiler->basetype_bool))
+            {
+                report_error(*compiler, ast_get_source_location(expr), "operands of '%s' have to be of type bool",
+                             (expr->kind == AST_KIND_EXPRESSION_LOGIC_AND) ? "&&" : "||");
+                compiler->has_type_error = true;
+            }
+
+            expr->type_id = compiler->basetype_bool;
+        } break;
+
         case AST_KIND_EXPRESSION_BINOP_ADD:
         case AST_KIND_EXPRESSION_BINOP_MINUS:
         {
-            if (expr->left_expr->kind == AST_KIND_LITERAL_INTEGER)
+            if (ast_get(expr->left_expr)->kind == AST_KIND_LITERAL_INTEGER)
             {
-                type_check_expression(compiler, expr->right_expr, 0);
-                type_check_expression(compiler, expr->left_expr, expr->right_expr->type_id);
+                type_check_expression(compiler, ast_get(expr->right_expr), 0);
+                type_check_expression(compiler, ast_get(expr->left_expr), ast_get(expr->right_expr)->type_id);
             }
             else
             {
-                type_check_expression(compiler, expr->left_expr, 0);
-                type_check_expression(compiler, expr->right_expr, expr->left_expr->type_id);
+                type_check_expression(compiler, ast_get(expr->left_expr), 0);
+                type_check_expression(compiler, ast_get(expr->right_expr), ast_get(expr->left_expr)->type_id);
             }
 
-            if (can_implicitly_cast_to(&compiler->datatypes, expr->left_expr->type_id, expr->right_expr->type_id) ||
-                can_implicitly_cast_to(&compiler->datatypes, expr->right_expr->type_id, expr->left_expr->type_id))
+            if (can_implicitly_cast_to(&compiler->datatypes, ast_get(expr->left_expr)->type_id, ast_get(expr->right_expr)->type_id) ||
+                can_implicitly_cast_to(&compiler->datatypes, ast_get(expr->right_expr)->type_id, ast_get(expr->left_expr)->type_id))
             {
-                Datatype *left_type  = get_datatype(&compiler->datatypes, expr->left_expr->type_id);
-                Datatype *right_type = get_datatype(&compiler->datatypes, expr->right_expr->type_id);
+                Datatype *left_type  = get_datatype(&compiler->datatypes, ast_get(expr->left_expr)->type_id);
+                Datatype *right_type = get_datatype(&compiler->datatypes, ast_get(expr->right_expr)->type_id);
 
                 if (left_type->size > right_type->size)
                 {
-                    expr->type_id = expr->left_expr->type_id;
+                    expr->type_id = ast_get(expr->left_expr)->type_id;
                 }
                 else
                 {
-                    expr->type_id = expr->right_expr->type_id;
+                    expr->type_id = ast_get(expr->right_expr)->type_id;
                 }
             }
             else
@@ -349,16 +369,16 @@ type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_i
                 }
             }
 
-            type_check_expression(compiler, expr->left_expr, type_id);
+            type_check_expression(compiler, ast_get(expr->left_expr), type_id);
 
-            if (expr->left_expr->kind == AST_KIND_LITERAL_INTEGER)
+            if (ast_get(expr->left_expr)->kind == AST_KIND_LITERAL_INTEGER)
             {
                 Datatype *datatype = get_datatype(&compiler->datatypes, type_id);
 
                 // TODO: does fit into type?
 
                 expr->kind = AST_KIND_LITERAL_INTEGER;
-                expr->_s64 = -expr->left_expr->_s64;
+                expr->_s64 = -ast_get(expr->left_expr)->_s64;
             }
 
             expr->type_id = type_id;
@@ -368,28 +388,27 @@ type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_i
         {
             assert(expr->left_expr);
 
-            Ast *left_expr = expr->left_expr;
+            Ast *left_expr = ast_get(expr->left_expr);
 
             if (left_expr->kind == AST_KIND_IDENTIFIER)
             {
-                expr->decl = find_function_declaration_by_name(compiler->global_declarations.children.first, left_expr->name);
+                Ast *decl = find_function_declaration_by_name(&compiler->scopes, left_expr->name_atom);
 
-                if (expr->decl)
+                expr->decl = ast_get_id(decl);
+
+                if (decl)
                 {
-                    if (!expr->decl->type_id)
-                    {
-                        type_check_function_signature(compiler, expr->decl);
-                    }
+                    mark_function_reachable(compiler, decl);
 
-                    assert(expr->decl->type_id);
+                    assert(decl->type_id);
 
-                    s32 parameter_count = ast_list_count(&expr->decl->parameters);
+                    s32 parameter_count = ast_list_count(&ast_get_function(decl)->parameters);
                     s32 argument_count = ast_list_count(&expr->children);
 
                     if (argument_count == parameter_count)
                     {
-                        Ast *parameter = expr->decl->parameters.first;
-                        Ast *argument = expr->children.first;
+                        Ast *parameter = ast_get(ast_get_function(decl)->parameters.first);
+                        Ast *argument = ast_get(expr->children.first);
 
                         s32 parameter_position = 1;
 
@@ -402,34 +421,37 @@ type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_i
                                 Datatype *argument_type = get_datatype(&compiler->datatypes, argument->type_id);
                                 Datatype *parameter_type = get_datatype(&compiler->datatypes, parameter->type_id);
 
-                                report_error(*compiler, argument->source_location,
+                                report_error(*compiler, ast_get_source_location(argument),
                                              "function '%.*s' expects type %.*s for parameter %d ('%.*s') but got %.*s",
-                                             (int) left_expr->name.count, left_expr->name.data,
+                                             (int) ast_get_name(left_expr).count, ast_get_name(left_expr).data,
                                              (int) parameter_type->name.count, parameter_type->name.data,
                                              parameter_position,
-                                             (int) parameter->name.count, parameter->name.data,
+                                             (int) ast_get_name(parameter).count, ast_get_name(parameter).data,
                                              (int) argument_type->name.count, argument_type->name.data);
+                                compiler->has_type_error = true;
                             }
 
-                            parameter = parameter->next;
-                            argument = argument->next;
+                            parameter = ast_get(parameter->next);
+                            argument = ast_get(argument->next);
 
                             parameter_position += 1;
                         }
                     }
                     else
                     {
-                        report_error(*compiler, left_expr->source_location,
+                        report_error(*compiler, ast_get_source_location(left_expr),
                                      "function '%.*s' expects %d arguments, but was given %d",
-                                     (int) left_expr->name.count, left_expr->name.data,
+                                     (int) ast_get_name(left_expr).count, ast_get_name(left_expr).data,
                                      parameter_count, argument_count);
+                        compiler->has_type_error = true;
                     }
 
-                    expr->type_id = expr->decl->type_id;
+                    expr->type_id = decl->type_id;
                 }
                 else
                 {
-                    report_error(*compiler, left_expr->source_location, "undeclared identifier '%.*s'", (int) left_expr->name.count, left_expr->name.data);
+                    report_error(*compiler, ast_get_source_location(left_expr), "undeclared identifier '%.*s'", (int) ast_get_name(left_expr).count, ast_get_name(left_expr).data);
+                    compiler->has_type_error = true;
                 }
             }
             else
@@ -447,81 +469,77 @@ type_check_expression(Compiler *compiler, Ast *expr, DatatypeId preferred_type_i
         case AST_KIND_AND_ASSIGN:
         case AST_KIND_XOR_ASSIGN:
         {
-            expr->decl = find_declaration_by_name(expr, expr->name);
+            expr->decl = ast_get_id(find_declaration_by_name(&compiler->scopes, expr->name_atom));
 
             if (expr->decl)
             {
-                expr->type_id = expr->decl->type_id;
+                expr->type_id = ast_get(expr->decl)->type_id;
             }
             else
             {
-                report_error(*compiler, expr->source_location, "undeclared identifier '%.*s'", (int) expr->name.count, expr->name.data);
+                report_error(*compiler, ast_get_source_location(expr), "undeclared identifier '%.*s'", (int) ast_get_name(expr).count, ast_get_name(expr).data);
+                compiler->has_type_error = true;
             }
 
-            type_check_expression(compiler, expr->right_expr, expr->type_id);
+            type_check_expression(compiler, ast_get(expr->right_expr), expr->type_id);
 
-            if (!can_implicitly_cast_to(&compiler->datatypes, expr->right_expr->type_id, expr->type_id))
+            if (!can_implicitly_cast_to(&compiler->datatypes, ast_get(expr->right_expr)->type_id, expr->type_id))
             {
                 Datatype *left_datatype  = get_datatype(&compiler->datatypes, expr->type_id);
-                Datatype *right_datatype = get_datatype(&compiler->datatypes, expr->right_expr->type_id);
+                Datatype *right_datatype = get_datatype(&compiler->datatypes, ast_get(expr->right_expr)->type_id);
 
-                report_error(*compiler, expr->source_location,
+                report_error(*compiler, ast_get_source_location(expr),
                              "can not assign type %.*s to type %.*s",
                              (int) right_datatype->name.count, right_datatype->name.data,
                              (int) left_datatype->name.count, left_datatype->name.data);
+                compiler->has_type_error = true;
             }
         } break;
 
         case AST_KIND_MEMBER:
         {
-            type_check_expression(compiler, expr->left_expr, 0);
+            type_check_expression(compiler, ast_get(expr->left_expr), 0);
 
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->left_expr->type_id);
+            Datatype *datatype = get_datatype(&compiler->datatypes, ast_get(expr->left_expr)->type_id);
 
-            if (expr->left_expr->type_id == compiler->basetype_string)
+            if (ast_get(expr->left_expr)->type_id == compiler->basetype_string)
             {
-                if (strings_are_equal(expr->name, S("count")))
+                if (strings_are_equal(ast_get_name(expr), S("count")))
                 {
                     expr->type_id = compiler->basetype_s64;
                 }
-                else if (strings_are_equal(expr->name, S("data")))
+                else if (strings_are_equal(ast_get_name(expr), S("data")))
                 {
-                    DatatypeId type_id = find_datatype_by_kind_and_reference(&compiler->datatypes, DATATYPE_POINTER, compiler->basetype_u8);
-
-                    if (!type_id)
-                    {
-                        type_id = compiler->datatypes.count;
-                        array_append(&compiler->datatypes, ((Datatype) { .kind = DATATYPE_POINTER, .flags = 0, .ref = compiler->basetype_u8, .name = S("*"), .size = 8 }));
-                    }
-
-                    expr->type_id = type_id;
+                    expr->type_id = get_pointer_datatype(&compiler->datatypes, compiler->basetype_u8);
                 }
                 else
                 {
-                    report_error(*compiler, expr->source_location,
+                    report_error(*compiler, ast_get_source_location(expr),
                                  "type string has no member '%.*s'",
-                                 (int) expr->name.count, expr->name.data);
+                                 (int) ast_get_name(expr).count, ast_get_name(expr).data);
+                    compiler->has_type_error = true;
                 }
             }
             else
             {
-                report_error(*compiler, expr->source_location,
+                report_error(*compiler, ast_get_source_location(expr),
                              "type %.*s has no member '%.*s'",
                              (int) datatype->name.count, datatype->name.data,
-                             (int) expr->name.count, expr->name.data);
+                             (int) ast_get_name(expr).count, ast_get_name(expr).data);
+                compiler->has_type_error = true;
             }
         } break;
 
         case AST_KIND_CAST:
         {
-            resolve_type(compiler, expr->type_def);
+            resolve_type(compiler, ast_get(expr->type_def));
 
-            expr->type_id = expr->type_def->type_id;
+            expr->type_id = ast_get(expr->type_def)->type_id;
 
             // TODO: should we give the cast type as a hint to the expression?
-            type_check_expression(compiler, expr->left_expr, 0);
+            type_check_expression(compiler, ast_get(expr->left_expr), 0);
 
-            if (!can_cast_to(&compiler->datatypes, expr->left_expr->type_id, expr->type_id))
+            if (!can_cast_to(&compiler->datatypes, ast_get(expr->left_expr)->type_id, expr->type_id))
             {
                 // TODO: error
                 fprintf(stderr, "error: cannot cast to type\n");
@@ -547,12 +565,12 @@ type_check_statement(Compiler *compiler, Ast *statement)
         {
             if (statement->type_def)
             {
-                resolve_type(compiler, statement->type_def);
-                statement->type_id = statement->type_def->type_id;
+                resolve_type(compiler, ast_get(statement->type_def));
+                statement->type_id = ast_get(statement->type_def)->type_id;
 
                 if (statement->right_expr)
                 {
-                    type_check_expression(compiler, statement->right_expr, statement->type_id);
+                    type_check_expression(compiler, ast_get(statement->right_expr), statement->type_id);
                 }
 
                 // TODO: declaration type and expression type compatible?
@@ -561,67 +579,81 @@ type_check_statement(Compiler *compiler, Ast *statement)
             {
                 assert(statement->right_expr);
 
-                type_check_expression(compiler, statement->right_expr, 0);
+                type_check_expression(compiler, ast_get(statement->right_expr), 0);
 
-                assert(statement->right_expr->type_id);
+                assert(ast_get(statement->right_expr)->type_id);
 
-                statement->type_id = statement->right_expr->type_id;
+                statement->type_id = ast_get(statement->right_expr)->type_id;
             }
+
+            // only visible after its own initializer
+            scope_declare(&compiler->scopes, statement);
         } break;
 
         case AST_KIND_IF:
         {
-            type_check_expression(compiler, statement->left_expr, 0);
+            type_check_expression(compiler, ast_get(statement->left_expr), 0);
 
-            if (statement->left_expr->type_id != compiler->basetype_bool)
+            if (ast_get(statement->left_expr)->type_id != compiler->basetype_bool)
             {
-                report_error(*compiler, statement->left_expr->source_location, "expression in if statement has to be of type bool");
+                report_error(*compiler, ast_get_source_location(ast_get(statement->left_expr)), "expression in if statement has to be of type bool");
+                compiler->has_type_error = true;
             }
 
             assert(statement->children.first && statement->children.last);
             assert((statement->children.first == statement->children.last) ||
-                   ((statement->children.first->next == statement->children.last) &&
-                    (statement->children.first == statement->children.last->prev)));
+                   (ast_get(statement->children.first)->next == statement->children.last));
 
             For(stmt, statement->children.first)
             {
+                s32 scope = scope_begin(&compiler->scopes);
                 type_check_statement(compiler, stmt);
+                scope_end(&compiler->scopes, scope);
             }
         } break;
 
         case AST_KIND_RETURN:
         {
             // TODO: pass the return type of the function as a hint
-            type_check_expression(compiler, statement->left_expr, 0);
-            statement->type_id = statement->left_expr->type_id;
+            type_check_expression(compiler, ast_get(statement->left_expr), 0);
+            statement->type_id = ast_get(statement->left_expr)->type_id;
 
             // TODO: compare to return type of the function
         } break;
 
         case AST_KIND_FOR:
         {
-            type_check_statement(compiler, statement->decl);
-            type_check_expression(compiler, statement->left_expr, 0);
+            s32 scope = scope_begin(&compiler->scopes);
 
-            if (statement->left_expr->type_id != compiler->basetype_bool)
+            type_check_statement(compiler, ast_get(statement->decl));
+            type_check_expression(compiler, ast_get(statement->left_expr), 0);
+
+            if (ast_get(statement->left_expr)->type_id != compiler->basetype_bool)
             {
-                report_error(*compiler, statement->left_expr->source_location, "expression in for statement has to be of type bool");
+                report_error(*compiler, ast_get_source_location(ast_get(statement->left_expr)), "expression in for statement has to be of type bool");
+                compiler->has_type_error = true;
             }
 
-            type_check_expression(compiler, statement->right_expr, 0);
+            type_check_expression(compiler, ast_get(statement->right_expr), 0);
 
             For(stmt, statement->children.first)
             {
                 type_check_statement(compiler, stmt);
             }
+
+            scope_end(&compiler->scopes, scope);
         } break;
 
         case AST_KIND_BLOCK:
         {
+            s32 scope = scope_begin(&compiler->scopes);
+
             For(stmt, statement->children.first)
             {
                 type_check_statement(compiler, stmt);
             }
+
+            scope_end(&compiler->scopes, scope);
         } break;
 
         default:
@@ -638,17 +670,21 @@ type_check_function_signature(Compiler *compiler, Ast *decl)
 
     if (decl->type_def)
     {
-        resolve_type(compiler, decl->type_def);
-        decl->type_id = decl->type_def->type_id;
+        resolve_type(compiler, ast_get(decl->type_def));
+        decl->type_id = ast_get(decl->type_def)->type_id;
     }
     else
     {
         decl->type_id = compiler->basetype_void;
     }
 
-    For(parameter, decl->parameters.first)
+    // the parameters are declared when the body gets checked
+    For(parameter, ast_get_function(decl)->parameters.first)
     {
-        type_check_statement(compiler, parameter);
+        assert(parameter->type_def && !parameter->right_expr);
+
+        resolve_type(compiler, ast_get(parameter->type_def));
+        parameter->type_id = ast_get(parameter->type_def)->type_id;
     }
 }
 
@@ -665,12 +701,15 @@ type_checking(Compiler *compiler)
         {
             case AST_KIND_FUNCTION_DECLARATION:
             {
-                type_check_function_signature(compiler, decl);
-
-                For(statement, decl->children.first)
+                // the first declaration wins
+                if (!find_function_declaration_by_name(&compiler->scopes, decl->name_atom))
                 {
-                    type_check_statement(compiler, statement);
+                    scope_declare(&compiler->scopes, decl);
                 }
+
+                // the signatures are cheap and every call needs them, the bodies are only
+                // checked once they are reachable
+                type_check_function_signature(compiler, decl);
             } break;
 
             case AST_KIND_STRUCT_DECLARATION:
@@ -685,4 +724,48 @@ type_checking(Compiler *compiler)
 
         // print_ast(decl, 0);
     }
+
+    // Only the functions reachable from the entry point get checked and end up in the
+    // executable. Without an entry point everything is checked so that errors still show up.
+    Ast *entry_point = find_function_declaration_by_name(&compiler->scopes, intern_string(S("main")));
+
+    if (entry_point)
+    {
+        mark_function_reachable(compiler, entry_point);
+    }
+    else
+    {
+        For(decl, compiler->global_declarations.children.first)
+        {
+            if (decl->kind == AST_KIND_FUNCTION_DECLARATION)
+            {
+                mark_function_reachable(compiler, decl);
+            }
+        }
+    }
+
+    // The list grows while the bodies get checked.
+    for (s32 i = 0; i < compiler->reachable_functions.count; i += 1)
+    {
+        Ast *decl = compiler->reachable_functions.items[i];
+
+        if (!parse_function_body(compiler, decl))
+        {
+            continue;
+        }
+
+        s32 scope = scope_begin(&compiler->scopes);
+
+        For(parameter, ast_get_function(decl)->parameters.first)
+        {
+            scope_declare(&compiler->scopes, parameter);
+        }
+
+        For(statement, decl->children.first)
+        {
+            type_check_statement(compiler, statement);
+        }
+
+        scope_end(&compiler->scopes, scope);
+    }
 }
@@ -7,6 +7,10 @@
 #  define MAP_ANONYMOUS 0x20
 #endif
 
+#ifndef MAP_NORESERVE
+#  define MAP_NORESERVE 0
+#endif
+
 static inline void *
 allocate(u64 size)
 {
@@ -20,6 +24,21 @@ deallocate(void *ptr, u64 size)
     munmap(ptr, size);
 }
 
+// Only reserves the address space, commit_memory makes parts of it usable. deallocate
+// releases it.
+static inline void *
+reserve_memory(u64 size)
+{
+    void *result = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (result == MAP_FAILED) ? 0 : result;
+}
+
+static inline bool
+commit_memory(void *ptr, u64 size)
+{
+    return (mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0);
+}
+
 static File *
 open_file(Allocator *allocator, String filename, u32 mode)
 {
@@ -108,14 +127,34 @@ read_file(File *file, void *buffer, u64 offset, u64 size)
     read(*(s32 *) &file - 1, buffer, size);
 }
 
-static void
+// Seeks once, the loop only runs again if the kernel writes less than was asked for.
+static bool
 write_file(File *file, void *buffer, u64 offset, u64 size)
 {
     assert(file);
     assert((u64) file <= 0x80000000);
 
-    lseek(*(s32 *) &file - 1, offset, SEEK_SET);
-    write(*(s32 *) &file - 1, buffer, size);
+    if (lseek(*(s32 *) &file - 1, offset, SEEK_SET) < 0)
+    {
+        return false;
+    }
+
+    u8 *data = (u8 *) buffer;
+
+    while (size > 0)
+    {
+        ssize_t bytes_written = write(*(s32 *) &file - 1, data, size);
+
+        if (bytes_written <= 0)
+        {
+            return false;
+        }
+
+        data += bytes_written;
+        size -= bytes_written;
+    }
+
+    return true;
 }
 
 static void
@@ -125,3 +164,16 @@ close_file(File *file)
     assert((u64) file <= 0x80000000);
     close(*(s32 *) &file - 1);
 }
+
+// Replaces new_filename if it exists. Both have to be on the same file system.
+static bool
+rename_file(Allocator *allocator, String old_filename, String new_filename)
+{
+    return (rename(to_c_string(allocator, old_filename), to_c_string(allocator, new_filename)) == 0);
+}
+
+static void
+delete_file(Allocator *allocator, String filename)
+{
+    unlink(to_c_string(allocator, filename));
+}
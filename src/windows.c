@@ -19,6 +19,20 @@ deallocate(void *ptr, uint64_t size)
     VirtualFree(ptr, 0, MEM_RELEASE);
 }
 
+// Only reserves the address space, commit_memory makes parts of it usable. deallocate
+// releases it.
+static inline void *
+reserve_memory(u64 size)
+{
+    return VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+static inline bool
+commit_memory(void *ptr, u64 size)
+{
+    return (VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != 0);
+}
+
 static File *
 open_file(Allocator *allocator, String filename, u32 mode)
 {
@@ -107,13 +121,33 @@ read_file(File *file, void *buffer, u64 offset, u64 size)
     ReadFile((HANDLE) file, buffer, size, &bytes_read, 0);
 }
 
-static void
+static bool
 write_file(File *file, void *buffer, u64 offset, u64 size)
 {
     assert(file);
 
-    DWORD bytes_written = 0;
-    WriteFile((HANDLE) file, buffer, size, &bytes_written, 0);
+    u8 *data = (u8 *) buffer;
+
+    while (size > 0)
+    {
+        DWORD bytes_to_write = (size > 0x40000000) ? 0x40000000 : (DWORD) size;
+        DWORD bytes_written = 0;
+
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset     = (DWORD) offset;
+        overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+        if (!WriteFile((HANDLE) file, data, bytes_to_write, &bytes_written, &overlapped) || !bytes_written)
+        {
+            return false;
+        }
+
+        data   += bytes_written;
+        offset += bytes_written;
+        size   -= bytes_written;
+    }
+
+    return true;
 }
 
 static void
@@ -122,3 +156,45 @@ close_file(File *file)
     assert(file);
     CloseHandle((HANDLE) file);
 }
+
+static wchar_t *
+to_wide_c_string(Allocator *allocator, String str)
+{
+    wchar_t *result = 0;
+
+    int size = MultiByteToWideChar(CP_UTF8, 0, (const char *) str.data, str.count, 0, 0);
+
+    if (size > 0)
+    {
+        result = alloc_array(allocator, wchar_t, size + 1, 8, true);
+        MultiByteToWideChar(CP_UTF8, 0, (const char *) str.data, str.count, result, size);
+    }
+
+    return result;
+}
+
+// Replaces new_filename if it exists. Both have to be on the same volume.
+static bool
+rename_file(Allocator *allocator, String old_filename, String new_filename)
+{
+    wchar_t *old_filename_wide = to_wide_c_string(allocator, old_filename);
+    wchar_t *new_filename_wide = to_wide_c_string(allocator, new_filename);
+
+    if (!old_filename_wide || !new_filename_wide)
+    {
+        return false;
+    }
+
+    return MoveFileEx(old_filename_wide, new_filename_wide, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static void
+delete_file(Allocator *allocator, String filename)
+{
+    wchar_t *filename_wide = to_wide_c_string(allocator, filename);
+
+    if (filename_wide)
+    {
+        DeleteFile(filename_wide);
+    }
+}
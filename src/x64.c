@@ -1,19 +1,145 @@
-#define REX_W 0x48
 #define ModRM(mode, reg, rm) ((((mode) & 0x3) << 6) | (((reg) & 0x7) << 3) | ((rm) & 0x7))
 #define SIB(scale, index, base) ((((scale) & 0x3) << 6) | (((index) & 0x7) << 3) | ((base) & 0x7))
 
 typedef enum
 {
-    X64_RAX = 0,
-    X64_RCX = 1,
-    X64_RDX = 2,
-    X64_RBX = 3,
-    X64_RSP = 4,
-    X64_RBP = 5,
-    X64_RSI = 6,
-    X64_RDI = 7,
+    X64_RAX =  0,
+    X64_RCX =  1,
+    X64_RDX =  2,
+    X64_RBX =  3,
+    X64_RSP =  4,
+    X64_RBP =  5,
+    X64_RSI =  6,
+    X64_RDI =  7,
+    X64_R8  =  8,
+    X64_R9  =  9,
+    X64_R10 = 10,
+    X64_R11 = 11,
+    X64_R12 = 12,
+    X64_R13 = 13,
+    X64_R14 = 14,
+    X64_R15 = 15,
 } X64Register;
 
+// The value is the /digit of the immediate forms and selects the opcode of the register forms.
+typedef enum
+{
+    X64_ALU_ADD = 0,
+    X64_ALU_OR  = 1,
+    X64_ALU_AND = 4,
+    X64_ALU_SUB = 5,
+    X64_ALU_XOR = 6,
+    X64_ALU_CMP = 7,
+} X64AluOperation;
+
+typedef enum
+{
+    X64_CONDITION_B  = 0x2,
+    X64_CONDITION_AE = 0x3,
+    X64_CONDITION_E  = 0x4,
+    X64_CONDITION_NE = 0x5,
+    X64_CONDITION_BE = 0x6,
+    X64_CONDITION_A  = 0x7,
+    X64_CONDITION_L  = 0xC,
+    X64_CONDITION_GE = 0xD,
+    X64_CONDITION_LE = 0xE,
+    X64_CONDITION_G  = 0xF,
+} X64Condition;
+
+// Values get allocated to these registers. r10 and r11 are never allocated, they are the
+// scratch registers for values that live on the stack.
+static const X64Register x64_caller_saved_registers[] =
+{
+    X64_RAX, X64_RCX, X64_RDX, X64_RSI, X64_RDI, X64_R8, X64_R9,
+};
+
+static const X64Register x64_callee_saved_registers[] =
+{
+    X64_RBX, X64_R12, X64_R13, X64_R14, X64_R15, X64_RBP,
+};
+
+// Arguments of calls between juls functions, the result is returned in rax (and rdx).
+static const X64Register x64_argument_registers[] =
+{
+    X64_RDI, X64_RSI, X64_RDX, X64_RCX, X64_R8, X64_R9,
+};
+
+static const X64Register x64_return_registers[] =
+{
+    X64_RAX, X64_RDX,
+};
+
+static inline void
+x64_rex(StringBuilder *builder, bool wide, X64Register reg, X64Register rm, bool byte_registers)
+{
+    u8 rex = 0x40;
+
+    if (wide)
+    {
+        rex |= 0x08;
+    }
+
+    if (reg & 8)
+    {
+        rex |= 0x04;
+    }
+
+    if (rm & 8)
+    {
+        rex |= 0x01;
+    }
+
+    // spl, bpl, sil and dil can only be encoded with a rex prefix,
+    // without one the same encoding selects ah, ch, dh and bh
+    if ((rex != 0x40) ||
+        (byte_registers && (((reg >= X64_RSP) && (reg <= X64_RDI)) || ((rm >= X64_RSP) && (rm <= X64_RDI)))))
+    {
+        string_builder_append_u8(builder, rex);
+    }
+}
+
+static inline void
+x64_stack_operand(StringBuilder *builder, X64Register reg, s64 stack_offset)
+{
+    if ((stack_offset >= INT8_MIN) && (stack_offset <= INT8_MAX))
+    {
+        string_builder_append_u8(builder, ModRM(1, reg, X64_RSP));
+        string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
+        string_builder_append_u8(builder, (u8) stack_offset);
+    }
+    else
+    {
+        assert((stack_offset >= INT32_MIN) && (stack_offset <= INT32_MAX));
+
+        string_builder_append_u8(builder, ModRM(2, reg, X64_RSP));
+        string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
+        string_builder_append_u32le(builder, (u32) stack_offset);
+    }
+}
+
+static inline s64
+x64_sign_extend(u64 value, u64 size)
+{
+    s64 result = (s64) value;
+
+    switch (size)
+    {
+        case 1: result = (s8)  value; break;
+        case 2: result = (s16) value; break;
+        case 4: result = (s32) value; break;
+    }
+
+    return result;
+}
+
+static inline bool
+x64_fits_immediate(u64 value, u64 size)
+{
+    s64 sign_extended = x64_sign_extend(value, size);
+
+    return (sign_extended >= S32MIN) && (sign_extended <= S32MAX);
+}
+
 static inline void
 x64_syscall(StringBuilder *builder)
 {
@@ -29,7 +155,7 @@ x64_ret(StringBuilder *builder)
 static inline void
 x64_move_immediate32_signed_into_register(StringBuilder *builder, X64Register reg, u32 value)
 {
-    string_builder_append_u8(builder, REX_W);
+    x64_rex(builder, true, 0, reg, false);
     string_builder_append_u8(builder, 0xC7);
     string_builder_append_u8(builder, ModRM(3, 0, reg));
     string_builder_append_u32le(builder, value);
@@ -38,142 +164,151 @@ x64_move_immediate32_signed_into_register(StringBuilder *builder, X64Register re
 static inline void
 x64_move_immediate32_unsigned_into_register(StringBuilder *builder, X64Register reg, u32 value)
 {
-    string_builder_append_u8(builder, 0xB8 | reg);
+    x64_rex(builder, false, 0, reg, false);
+    string_builder_append_u8(builder, 0xB8 | (reg & 7));
     string_builder_append_u32le(builder, value);
 }
 
+static inline void
+x64_move_immediate64_into_register(StringBuilder *builder, X64Register reg, u64 value)
+{
+    x64_rex(builder, true, 0, reg, false);
+    string_builder_append_u8(builder, 0xB8 | (reg & 7));
+    string_builder_append_u64le(builder, value);
+}
+
+static inline void
+x64_move_immediate_into_register(StringBuilder *builder, X64Register reg, u64 value)
+{
+    if (value <= 0xFFFFFFFF)
+    {
+        x64_move_immediate32_unsigned_into_register(builder, reg, (u32) value);
+    }
+    else if (((s64) value < 0) && ((s64) value >= S32MIN))
+    {
+        x64_move_immediate32_signed_into_register(builder, reg, (u32) value);
+    }
+    else
+    {
+        x64_move_immediate64_into_register(builder, reg, value);
+    }
+}
+
 static inline void
 x64_push_register(StringBuilder *builder, X64Register reg)
 {
-    string_builder_append_u8(builder, 0x50 | reg);
+    x64_rex(builder, false, 0, reg, false);
+    string_builder_append_u8(builder, 0x50 | (reg & 7));
 }
 
 static inline void
 x64_pop_register(StringBuilder *builder, X64Register reg)
 {
-    string_builder_append_u8(builder, 0x58 | reg);
+    x64_rex(builder, false, 0, reg, false);
+    string_builder_append_u8(builder, 0x58 | (reg & 7));
 }
 
 static inline void
 x64_move_registers(StringBuilder *builder, X64Register dst_reg, X64Register src_reg)
 {
-    string_builder_append_u8(builder, REX_W);
+    x64_rex(builder, true, src_reg, dst_reg, false);
     string_builder_append_u8(builder, 0x89);
     string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
 }
 
 static inline void
-x64_add_immediate32_unsigned_to_register(StringBuilder *builder, X64Register reg, u32 value)
+x64_exchange_registers(StringBuilder *builder, X64Register a_reg, X64Register b_reg)
 {
-    if (value <= 0xFF)
-    {
-        // TODO: do we need this 64bit extension here?
-        // are the high bits set to zero if this is omitted?
-        string_builder_append_u8(builder, REX_W);
-        string_builder_append_u8(builder, 0x83);
-        string_builder_append_u8(builder, ModRM(3, 0, reg));
-        string_builder_append_u8(builder, (u8) value);
-    }
-    else
+    x64_rex(builder, true, b_reg, a_reg, false);
+    string_builder_append_u8(builder, 0x87);
+    string_builder_append_u8(builder, ModRM(3, b_reg, a_reg));
+}
+
+static inline void
+x64_alu_registers(StringBuilder *builder, X64AluOperation operation, X64Register dst_reg, X64Register src_reg, u64 size)
+{
+    if (size == 2)
     {
-        // TODO: do we need this 64bit extension here?
-        // are the high 32bit set to zero if this is omitted?
-        string_builder_append_u8(builder, REX_W);
-        string_builder_append_u8(builder, 0x81);
-        string_builder_append_u8(builder, ModRM(3, 0, reg));
-        string_builder_append_u32le(builder, value);
+        string_builder_append_u8(builder, 0x66);
     }
+
+    x64_rex(builder, size == 8, src_reg, dst_reg, size == 1);
+    string_builder_append_u8(builder, (operation << 3) | ((size == 1) ? 0x00 : 0x01));
+    string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
 }
 
+// value has to be sign extended from size already, see x64_sign_extend
 static inline void
-x64_subtract_immediate32_unsigned_from_register(StringBuilder *builder, X64Register reg, u32 value)
+x64_alu_immediate(StringBuilder *builder, X64AluOperation operation, X64Register reg, s64 value, u64 size)
 {
-    if (value <= 0xFF)
+    if (size == 2)
+    {
+        string_builder_append_u8(builder, 0x66);
+    }
+
+    x64_rex(builder, size == 8, 0, reg, size == 1);
+
+    if (size == 1)
+    {
+        string_builder_append_u8(builder, 0x80);
+        string_builder_append_u8(builder, ModRM(3, operation, reg));
+        string_builder_append_u8(builder, (u8) value);
+    }
+    else if ((value >= INT8_MIN) && (value <= INT8_MAX))
     {
-        // TODO: do we need this 64bit extension here?
-        // are the high bits set to zero if this is omitted?
-        string_builder_append_u8(builder, REX_W);
         string_builder_append_u8(builder, 0x83);
-        string_builder_append_u8(builder, ModRM(3, 5, reg));
+        string_builder_append_u8(builder, ModRM(3, operation, reg));
         string_builder_append_u8(builder, (u8) value);
     }
+    else if (size == 2)
+    {
+        string_builder_append_u8(builder, 0x81);
+        string_builder_append_u8(builder, ModRM(3, operation, reg));
+        string_builder_append_u16le(builder, (u16) value);
+    }
     else
     {
-        // TODO: do we need this 64bit extension here?
-        // are the high 32bit set to zero if this is omitted?
-        string_builder_append_u8(builder, REX_W);
+        assert((value >= S32MIN) && (value <= S32MAX));
+
         string_builder_append_u8(builder, 0x81);
-        string_builder_append_u8(builder, ModRM(3, 5, reg));
-        string_builder_append_u32le(builder, value);
+        string_builder_append_u8(builder, ModRM(3, operation, reg));
+        string_builder_append_u32le(builder, (u32) value);
     }
 }
 
 static inline void
-x64_add_registers(StringBuilder *builder, X64Register dst_reg, X64Register src_reg, u64 size)
+x64_add_immediate32_unsigned_to_register(StringBuilder *builder, X64Register reg, u32 value)
 {
-    switch (size)
-    {
-        case 1:
-        {
-            string_builder_append_u8(builder, 0x00);
-            string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
-        } break;
-
-        case 2:
-        {
-            string_builder_append_u8(builder, 0x66);
-            string_builder_append_u8(builder, 0x01);
-            string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
-        } break;
+    assert(value <= S32MAX);
+    x64_alu_immediate(builder, X64_ALU_ADD, reg, value, 8);
+}
 
-        case 4:
-        {
-            string_builder_append_u8(builder, 0x01);
-            string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
-        } break;
+static inline void
+x64_subtract_immediate32_unsigned_from_register(StringBuilder *builder, X64Register reg, u32 value)
+{
+    assert(value <= S32MAX);
+    x64_alu_immediate(builder, X64_ALU_SUB, reg, value, 8);
+}
 
-        case 8:
-        {
-            string_builder_append_u8(builder, REX_W);
-            string_builder_append_u8(builder, 0x01);
-            string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
-        } break;
-    }
+static inline void
+x64_add_registers(StringBuilder *builder, X64Register dst_reg, X64Register src_reg, u64 size)
+{
+    x64_alu_registers(builder, X64_ALU_ADD, dst_reg, src_reg, size);
 }
 
 static inline void
 x64_subtract_registers(StringBuilder *builder, X64Register dst_reg, X64Register src_reg, u64 size)
 {
-    switch (size)
-    {
-        case 1:
-        {
-            string_builder_append_u8(builder, 0x28);
-            string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
-        } break;
-
-        case 2:
-        {
-            string_builder_append_u8(builder, 0x66);
-            string_builder_append_u8(builder, 0x29);
-            string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
-        } break;
-
-        case 4:
-        {
-            string_builder_append_u8(builder, 0x29);
-            string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
-        } break;
+    x64_alu_registers(builder, X64_ALU_SUB, dst_reg, src_reg, size);
+}
 
-        case 8:
-        {
-            string_builder_append_u8(builder, REX_W);
-            string_builder_append_u8(builder, 0x29);
-            string_builder_append_u8(builder, ModRM(3, src_reg, dst_reg));
-        } break;
-    }
+static inline void
+x64_compare_registers(StringBuilder *builder, X64Register a_reg, X64Register b_reg, u64 size)
+{
+    x64_alu_registers(builder, X64_ALU_CMP, a_reg, b_reg, size);
 }
 
+// Loads of 1 and 2 bytes are zero extended to 32 bit, so all loads clear the upper half of the register.
 static inline void
 x64_copy_from_stack_to_register(StringBuilder *builder, X64Register dst_reg, s64 src_stack_offset, u64 size)
 {
@@ -181,86 +316,28 @@ x64_copy_from_stack_to_register(StringBuilder *builder, X64Register dst_reg, s64
     {
         case 1:
         {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x8A);
-                string_builder_append_u8(builder, ModRM(1, dst_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
-            {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, 0x8A);
-                string_builder_append_u8(builder, ModRM(2, dst_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+            x64_rex(builder, false, dst_reg, X64_RAX, false);
+            string_builder_append_u8(builder, 0x0F);
+            string_builder_append_u8(builder, 0xB6);
         } break;
 
         case 2:
         {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x66);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(1, dst_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
-            {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, 0x66);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(2, dst_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+            x64_rex(builder, false, dst_reg, X64_RAX, false);
+            string_builder_append_u8(builder, 0x0F);
+            string_builder_append_u8(builder, 0xB7);
         } break;
 
         case 4:
         {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(1, dst_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
-            {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(2, dst_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+            x64_rex(builder, false, dst_reg, X64_RAX, false);
+            string_builder_append_u8(builder, 0x8B);
         } break;
 
         case 8:
         {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(1, dst_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
-            {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(2, dst_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+            x64_rex(builder, true, dst_reg, X64_RAX, false);
+            string_builder_append_u8(builder, 0x8B);
         } break;
 
         default:
@@ -268,6 +345,8 @@ x64_copy_from_stack_to_register(StringBuilder *builder, X64Register dst_reg, s64
             assert(!"not allowed");
         } break;
     }
+
+    x64_stack_operand(builder, dst_reg, src_stack_offset);
 }
 
 static inline void
@@ -277,86 +356,27 @@ x64_copy_from_register_to_stack(StringBuilder *builder, s64 dst_stack_offset, X6
     {
         case 1:
         {
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x88);
-                string_builder_append_u8(builder, ModRM(1, src_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
-            {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, 0x88);
-                string_builder_append_u8(builder, ModRM(2, src_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
+            x64_rex(builder, false, src_reg, X64_RAX, true);
+            string_builder_append_u8(builder, 0x88);
         } break;
 
         case 2:
         {
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x66);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(1, src_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
-            {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, 0x66);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(2, src_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
+            string_builder_append_u8(builder, 0x66);
+            x64_rex(builder, false, src_reg, X64_RAX, false);
+            string_builder_append_u8(builder, 0x89);
         } break;
 
         case 4:
         {
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(1, src_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
-            {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(2, src_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
+            x64_rex(builder, false, src_reg, X64_RAX, false);
+            string_builder_append_u8(builder, 0x89);
         } break;
 
         case 8:
         {
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(1, src_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
-            {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(2, src_reg, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
+            x64_rex(builder, true, src_reg, X64_RAX, false);
+            string_builder_append_u8(builder, 0x89);
         } break;
 
         default:
@@ -364,1100 +384,942 @@ x64_copy_from_register_to_stack(StringBuilder *builder, s64 dst_stack_offset, X6
             assert(!"not allowed");
         } break;
     }
+
+    x64_stack_operand(builder, src_reg, dst_stack_offset);
 }
 
+// Sign or zero extends the lower size bytes of reg to the whole register.
 static inline void
-x64_copy_from_stack_to_stack(StringBuilder *builder, s64 dst_stack_offset, s64 src_stack_offset, u64 size)
+x64_extend_register(StringBuilder *builder, X64Register reg, u64 size, bool is_signed)
 {
-    switch (size)
+    if (is_signed)
     {
-        case 1:
+        switch (size)
         {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x8A);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
+            case 1:
             {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, 0x8A);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+                x64_rex(builder, true, reg, reg, false);
+                string_builder_append_u8(builder, 0x0F);
+                string_builder_append_u8(builder, 0xBE);
+            } break;
 
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x88);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
+            case 2:
             {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
+                x64_rex(builder, true, reg, reg, false);
+                string_builder_append_u8(builder, 0x0F);
+                string_builder_append_u8(builder, 0xBF);
+            } break;
 
-                string_builder_append_u8(builder, 0x88);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
-        } break;
+            case 4:
+            {
+                x64_rex(builder, true, reg, reg, false);
+                string_builder_append_u8(builder, 0x63);
+            } break;
 
-        case 2:
-        {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
+            default:
             {
-                string_builder_append_u8(builder, 0x66);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
+                return;
+            } break;
+        }
+    }
+    else
+    {
+        switch (size)
+        {
+            case 1:
             {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, 0x66);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+                x64_rex(builder, false, reg, reg, true);
+                string_builder_append_u8(builder, 0x0F);
+                string_builder_append_u8(builder, 0xB6);
+            } break;
 
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
+            case 2:
             {
-                string_builder_append_u8(builder, 0x66);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
-            {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
+                x64_rex(builder, false, reg, reg, false);
+                string_builder_append_u8(builder, 0x0F);
+                string_builder_append_u8(builder, 0xB7);
+            } break;
 
-                string_builder_append_u8(builder, 0x66);
+            case 4:
+            {
+                x64_rex(builder, false, reg, reg, false);
                 string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
-        } break;
+            } break;
 
-        case 4:
-        {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
+            default:
             {
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
-            {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
+                return;
+            } break;
+        }
+    }
 
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+    string_builder_append_u8(builder, ModRM(3, reg, reg));
+}
 
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
-            {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
+static inline void
+x64_setcc(StringBuilder *builder, X64Condition condition, X64Register dst_reg)
+{
+    x64_rex(builder, false, 0, dst_reg, true);
+    string_builder_append_u8(builder, 0x0F);
+    string_builder_append_u8(builder, 0x90 | condition);
+    string_builder_append_u8(builder, ModRM(3, 0, dst_reg));
 
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
-        } break;
+    x64_extend_register(builder, dst_reg, 1, false);
+}
 
-        case 8:
-        {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
-            {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
+static inline void
+x64_test_byte_register(StringBuilder *builder, X64Register reg)
+{
+    x64_rex(builder, false, reg, reg, true);
+    string_builder_append_u8(builder, 0x84);
+    string_builder_append_u8(builder, ModRM(3, reg, reg));
+}
 
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+// Returns the offset of the 32 bit displacement that has to be patched.
+static inline u64
+x64_load_rip_relative_address(StringBuilder *builder, X64Register dst_reg)
+{
+    x64_rex(builder, true, dst_reg, 0, false);
+    string_builder_append_u8(builder, 0x8D);
+    string_builder_append_u8(builder, ModRM(0, dst_reg, X64_RBP /* RIP */));
 
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
-            {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
+    u64 result = string_builder_get_size(builder);
+    string_builder_append_u32le(builder, 0);
 
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
+    return result;
+}
+
+static void
+x64_encode_machine_instruction(StringBuilder *builder, MachineInstruction *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case MACHINE_NOP:
+        {
         } break;
 
-        case 16:
+        case MACHINE_MOVE:
         {
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
-            {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
+            x64_move_registers(builder, (X64Register) instruction->dst, (X64Register) instruction->src);
+        } break;
 
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+        case MACHINE_MOVE_IMMEDIATE:
+        {
+            x64_move_immediate_into_register(builder, (X64Register) instruction->dst, (u64) instruction->immediate);
+        } break;
 
-            src_stack_offset += 8;
+        case MACHINE_ZERO:
+        {
+            // writing the lower 32 bits clears the upper half
+            x64_alu_registers(builder, X64_ALU_XOR, (X64Register) instruction->dst, (X64Register) instruction->dst, 4);
+        } break;
 
-            if ((src_stack_offset >= INT8_MIN) && (src_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(1, X64_RBX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) src_stack_offset);
-            }
-            else
-            {
-                assert((src_stack_offset >= INT32_MIN) && (src_stack_offset <= INT32_MAX));
+        case MACHINE_LOAD:
+        {
+            x64_copy_from_stack_to_register(builder, (X64Register) instruction->dst, instruction->offset, instruction->size);
+        } break;
 
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x8B);
-                string_builder_append_u8(builder, ModRM(2, X64_RBX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) src_stack_offset);
-            }
+        case MACHINE_STORE:
+        {
+            x64_copy_from_register_to_stack(builder, instruction->offset, (X64Register) instruction->src, instruction->size);
+        } break;
 
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
+        case MACHINE_ADJUST_STACK:
+        {
+            if (instruction->immediate > 0)
             {
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(1, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
+                x64_add_immediate32_unsigned_to_register(builder, X64_RSP, (u32) instruction->immediate);
             }
             else
             {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
-
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
+                x64_subtract_immediate32_unsigned_from_register(builder, X64_RSP, (u32) -instruction->immediate);
             }
+        } break;
+    }
+}
 
-            dst_stack_offset += 8;
+// mov r, 0 becomes xor r, r, which is shorter
+static bool
+x64_peephole_zero_register(MachineInstructionArray *instructions, s32 index)
+{
+    MachineInstruction *instruction = instructions->items + index;
 
-            if ((dst_stack_offset >= INT8_MIN) && (dst_stack_offset <= INT8_MAX))
-            {
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(1, X64_RBX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u8(builder, (u8) dst_stack_offset);
-            }
-            else
-            {
-                assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
+    if ((instruction->opcode == MACHINE_MOVE_IMMEDIATE) && (instruction->immediate == 0))
+    {
+        instruction->opcode = MACHINE_ZERO;
+        return true;
+    }
 
-                string_builder_append_u8(builder, REX_W);
-                string_builder_append_u8(builder, 0x89);
-                string_builder_append_u8(builder, ModRM(2, X64_RBX, X64_RSP));
-                string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-                string_builder_append_u32le(builder, (u32) dst_stack_offset);
-            }
-        } break;
+    return false;
+}
 
-        default:
-        {
-            assert(!"not implemented");
-        } break;
+static PeepholeRule x64_peephole_rules[] =
+{
+    { .name = "remove self move",           .apply = peephole_remove_self_move },
+    { .name = "forward store to load",      .apply = peephole_forward_store },
+    { .name = "remove dead store",          .apply = peephole_remove_dead_store },
+    { .name = "merge stack adjustments",    .apply = peephole_merge_stack_adjustments },
+    { .name = "zero register with xor",     .apply = x64_peephole_zero_register },
+};
+
+static inline void
+x64_buffer_instruction(Codegen *codegen, MachineInstruction instruction)
+{
+    if (!codegen->buffered_instructions.count)
+    {
+        codegen->buffered_text_size = string_builder_get_size(&codegen->section_text);
     }
+
+    array_append(&codegen->buffered_instructions, instruction);
 }
 
-static inline void
-x64_compare_registers(StringBuilder *builder, X64Register a_reg, X64Register b_reg, u64 size)
+// Has to be called before anything gets written to section_text directly.
+static void
+x64_flush(Codegen *codegen)
 {
-    switch (size)
+    MachineInstructionArray *instructions = &codegen->buffered_instructions;
+
+    if (!instructions->count)
     {
-        case 1:
-        {
-            string_builder_append_u8(builder, 0x38);
-            string_builder_append_u8(builder, ModRM(3, b_reg, a_reg));
-        } break;
+        return;
+    }
 
-        case 2:
-        {
-            string_builder_append_u8(builder, 0x66);
-            string_builder_append_u8(builder, 0x39);
-            string_builder_append_u8(builder, ModRM(3, b_reg, a_reg));
-        } break;
+    assert(string_builder_get_size(&codegen->section_text) == codegen->buffered_text_size);
 
-        case 4:
-        {
-            string_builder_append_u8(builder, 0x39);
-            string_builder_append_u8(builder, ModRM(3, b_reg, a_reg));
-        } break;
+    peephole_optimize(instructions, x64_peephole_rules, ArrayCount(x64_peephole_rules));
 
-        case 8:
-        {
-            string_builder_append_u8(builder, REX_W);
-            string_builder_append_u8(builder, 0x39);
-            string_builder_append_u8(builder, ModRM(3, b_reg, a_reg));
-        } break;
+    for (s32 i = 0; i < instructions->count; i += 1)
+    {
+        x64_encode_machine_instruction(&codegen->section_text, instructions->items + i);
     }
+
+    instructions->count = 0;
 }
 
 static inline void
-x64_setcc(StringBuilder *builder, u8 compare_func, s64 dst_stack_offset)
+x64_buffer_move(Codegen *codegen, X64Register dst_reg, X64Register src_reg)
 {
-    assert((dst_stack_offset >= INT32_MIN) && (dst_stack_offset <= INT32_MAX));
+    x64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_MOVE, .dst = dst_reg, .src = src_reg });
+}
 
-    string_builder_append_u8(builder, 0x0F);
-    string_builder_append_u8(builder, compare_func);
-    string_builder_append_u8(builder, ModRM(2, X64_RAX, X64_RSP));
-    string_builder_append_u8(builder, SIB(0, X64_RSP, X64_RSP));
-    string_builder_append_u32le(builder, (u32) dst_stack_offset);
+static inline void
+x64_buffer_move_immediate(Codegen *codegen, X64Register dst_reg, u64 value)
+{
+    x64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_MOVE_IMMEDIATE, .dst = dst_reg, .immediate = (s64) value });
 }
 
 static inline void
-x64_compare_al_to_zero(StringBuilder *builder, X64Register reg)
+x64_buffer_load(Codegen *codegen, X64Register dst_reg, s64 stack_offset)
 {
-    string_builder_append_u8(builder, 0x3C);
-    string_builder_append_u8(builder, 0x00);
+    x64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_LOAD, .dst = dst_reg, .offset = stack_offset, .size = 8 });
 }
 
 static inline void
-x64_commit_stack(Codegen *codegen, StringBuilder *builder)
+x64_buffer_store(Codegen *codegen, s64 stack_offset, X64Register src_reg)
 {
-    if (codegen->stack_allocated < codegen->stack_committed)
-    {
-        s64 size = codegen->stack_committed - codegen->stack_allocated;
-        assert(size <= 0xFFFFFFFF);
-        x64_add_immediate32_unsigned_to_register(builder, X64_RSP, (u32) size);
-        codegen->stack_committed = codegen->stack_allocated;
-    }
-    else if (codegen->stack_allocated > codegen->stack_committed)
-    {
-        s64 size = codegen->stack_allocated - codegen->stack_committed;
-        assert(size <= 0xFFFFFFFF);
-        x64_subtract_immediate32_unsigned_from_register(builder, X64_RSP, (u32) size);
-        codegen->stack_committed = codegen->stack_allocated;
-    }
+    x64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_STORE, .src = src_reg, .offset = stack_offset, .size = 8 });
+}
+
+static inline void
+x64_buffer_adjust_stack(Codegen *codegen, s64 value)
+{
+    assert((value >= -S32MAX) && (value <= S32MAX));
+    x64_buffer_instruction(codegen, (MachineInstruction) { .opcode = MACHINE_ADJUST_STACK, .immediate = value });
 }
 
+// Moves src_regs[i] into dst_regs[i] for all i, as if all moves happened at the same time.
 static void
-x64_emit_cast(Compiler *compiler, Codegen *codegen, DatatypeId from_type_id, DatatypeId to_type_id)
+x64_parallel_move(Codegen *codegen, const X64Register *dst_regs, const X64Register *src_regs, s32 count)
 {
-    if (from_type_id == to_type_id)
-    {
-        return;
-    }
+    X64Register sources[16];
+    bool done[16];
 
-    Datatype *from_type = get_datatype(&compiler->datatypes, from_type_id);
-    Datatype *to_type   = get_datatype(&compiler->datatypes, to_type_id);
+    assert(count <= ArrayCount(sources));
 
-    u64 from_type_stack_size = from_type->size;
-    u64 to_type_stack_size = to_type->size;
+    s32 remaining = 0;
 
-    if ((from_type->kind == DATATYPE_INTEGER) && (to_type->kind == DATATYPE_INTEGER))
+    for (s32 i = 0; i < count; i += 1)
     {
-        if (from_type->size > to_type->size)
+        sources[i] = src_regs[i];
+        done[i] = (dst_regs[i] == src_regs[i]);
+
+        if (!done[i])
         {
-            s64 from_type_stack_offset = codegen->stack_allocated;
+            remaining += 1;
+        }
+    }
 
-            x64_copy_from_stack_to_register(&codegen->section_text, X64_RAX, codegen->stack_committed - from_type_stack_offset, from_type->size);
+    while (remaining > 0)
+    {
+        bool progress = false;
 
-            pop_stack(codegen, from_type_stack_size);
-            s64 to_type_stack_offset = push_stack(codegen, to_type_stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+        for (s32 i = 0; i < count; i += 1)
+        {
+            if (done[i]) continue;
+
+            bool blocked = false;
+
+            for (s32 j = 0; j < count; j += 1)
+            {
+                if (!done[j] && (j != i) && (sources[j] == dst_regs[i]))
+                {
+                    blocked = true;
+                    break;
+                }
+            }
 
-            x64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - to_type_stack_offset, X64_RAX, to_type->size);
+            if (!blocked)
+            {
+                x64_buffer_move(codegen, dst_regs[i], sources[i]);
+                done[i] = true;
+                remaining -= 1;
+                progress = true;
+            }
         }
-        else if (from_type->size < to_type->size)
+
+        if (!progress)
         {
-            assert(!"not implemented");
+            // only cycles are left, break one of them with an exchange
+            for (s32 i = 0; i < count; i += 1)
+            {
+                if (done[i]) continue;
+
+                x64_flush(codegen);
+                x64_exchange_registers(&codegen->section_text, dst_regs[i], sources[i]);
+                done[i] = true;
+                remaining -= 1;
+
+                for (s32 j = 0; j < count; j += 1)
+                {
+                    if (!done[j] && (sources[j] == dst_regs[i]))
+                    {
+                        sources[j] = sources[i];
+                    }
+                }
+
+                break;
+            }
         }
     }
+}
+
+
+static inline void
+x64_negate_register(StringBuilder *builder, X64Register reg)
+{
+    x64_rex(builder, true, 0, reg, false);
+    string_builder_append_u8(builder, 0xF7);
+    string_builder_append_u8(builder, ModRM(3, 3, reg));
+}
+
+// Emits a call or, for tail calls, a jmp to a function.
+static inline void
+x64_call(Codegen *codegen, Ast *function_decl, bool is_jump)
+{
+    StringBuilder *builder = &codegen->section_text;
+
+    x64_flush(codegen);
+
+    string_builder_append_u8(builder, is_jump ? 0xE9 : 0xE8);
+
+    if (ast_get_function(function_decl)->address == S64MAX)
+    {
+        u64 patch_offset = string_builder_get_size(builder);
+        string_builder_append_u32le(builder, 0);
+        u64 instruction_offset = string_builder_get_size(builder);
+
+        array_append(&codegen->function_call_patches,
+                     ((FunctionCallPatch) { .patch_offset = patch_offset,
+                                            .instruction_offset = instruction_offset,
+                                            .function_decl = function_decl,
+                                            .is_jump = is_jump }));
+    }
     else
     {
-        assert(!"not implemented");
+        s64 jump_offset = string_builder_get_size(builder) + 4;
+        string_builder_append_u32le(builder, (u32) (ast_get_function(function_decl)->address - jump_offset));
     }
 }
 
+// Emits a jmp or a jcc to a label of the current function. Labels behind us are resolved
+// right away, the others get patched at the end of the function.
 static void
-x64_emit_expression(Compiler *compiler, Codegen *codegen, Ast *expr, JulsPlatform target_platform)
+x64_jump_to_label(Codegen *codegen, X64Condition condition, bool is_conditional, s32 label)
 {
-    switch (expr->kind)
-    {
-        case AST_KIND_LITERAL_BOOLEAN:
-        {
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+    StringBuilder *builder = &codegen->section_text;
 
-            u64 stack_size = datatype->size;
+    x64_flush(codegen);
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+    if (is_conditional)
+    {
+        string_builder_append_u8(builder, 0x0F);
+        string_builder_append_u8(builder, 0x80 | condition);
+    }
+    else
+    {
+        string_builder_append_u8(builder, 0xE9);
+    }
 
-            x64_move_immediate32_unsigned_into_register(&codegen->section_text, X64_RAX, expr->_bool ? 1 : 0);
-            x64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, X64_RAX, datatype->size);
-        } break;
+    s64 label_offset = codegen->label_offsets.items[label];
 
-        case AST_KIND_LITERAL_INTEGER:
-        {
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+    if (label_offset >= 0)
+    {
+        s64 jump_offset = string_builder_get_size(builder) + 4;
+        string_builder_append_u32le(builder, (u32) (label_offset - jump_offset));
+    }
+    else
+    {
+        u64 patch_offset = string_builder_get_size(builder);
+        string_builder_append_u32le(builder, 0);
+        u64 instruction_offset = string_builder_get_size(builder);
 
-            u64 stack_size = datatype->size;
+        array_append(&codegen->label_patches, ((LabelPatch) { .patch_offset = patch_offset,
+                                                              .instruction_offset = instruction_offset,
+                                                              .label = label }));
+    }
+}
 
-            if ((datatype->flags & DATATYPE_FLAG_UNSIGNED) ||
-                (expr->_s64 >= 0))
-            {
-                if (expr->_u64 <= 0xFFFFFFFF)
-                {
-                    x64_move_immediate32_unsigned_into_register(&codegen->section_text, X64_RAX, expr->_u32);
-                }
-                else
-                {
-                    assert(!"not implemented");
-                }
-            }
-            else
-            {
-                if ((expr->_s64 >= S32MIN) && (expr->_s64 <= S32MAX))
-                {
-                    x64_move_immediate32_signed_into_register(&codegen->section_text, X64_RAX, expr->_u32);
-                }
-                else
-                {
-                    assert(!"not implemented");
-                }
-            }
+static X64Condition
+x64_get_condition(IrCondition condition, bool is_signed)
+{
+    X64Condition result = X64_CONDITION_E;
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+    switch (condition)
+    {
+        case IR_CONDITION_EQUAL:         result = X64_CONDITION_E;                               break;
+        case IR_CONDITION_NOT_EQUAL:     result = X64_CONDITION_NE;                              break;
+        case IR_CONDITION_LESS:          result = is_signed ? X64_CONDITION_L  : X64_CONDITION_B;  break;
+        case IR_CONDITION_GREATER:       result = is_signed ? X64_CONDITION_G  : X64_CONDITION_A;  break;
+        case IR_CONDITION_LESS_EQUAL:    result = is_signed ? X64_CONDITION_LE : X64_CONDITION_BE; break;
+        case IR_CONDITION_GREATER_EQUAL: result = is_signed ? X64_CONDITION_GE : X64_CONDITION_AE; break;
+    }
 
-            x64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, X64_RAX, datatype->size);
-        } break;
+    return result;
+}
 
-        case AST_KIND_LITERAL_STRING:
-        {
-            u64 string_offset = string_builder_get_size(&codegen->section_cstring);
-            string_builder_append_string(&codegen->section_cstring, expr->name);
+// Frame layout, from rsp upwards: the stack arguments of outgoing calls, the spill slots,
+// the saved callee-saved registers, the return address and the stack arguments of this function.
+// Leaf functions put the spill slots below rsp instead.
+static inline s64
+x64_spill_offset(Codegen *codegen, IrValue *value)
+{
+    assert(value->location == IR_LOCATION_STACK);
+    return codegen->spill_area_offset + 8 * value->spill_slot;
+}
 
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+// Returns the register that holds the value, a value on the stack gets loaded into scratch_reg.
+static X64Register
+x64_get_value(Codegen *codegen, IrFunction *function, s32 index, X64Register scratch_reg)
+{
+    IrValue *value = function->values.items + index;
 
-            u64 stack_size = datatype->size;
+    if (value->location == IR_LOCATION_REGISTER)
+    {
+        return (X64Register) value->reg;
+    }
+
+    x64_buffer_load(codegen, scratch_reg, x64_spill_offset(codegen, value));
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+    return scratch_reg;
+}
 
-            x64_move_immediate32_unsigned_into_register(&codegen->section_text, X64_RAX, expr->name.count);
+// Returns the register a result should be computed into.
+static inline X64Register
+x64_get_result_register(IrFunction *function, s32 index, X64Register scratch_reg)
+{
+    IrValue *value = function->values.items + index;
+    return (value->location == IR_LOCATION_REGISTER) ? (X64Register) value->reg : scratch_reg;
+}
 
-            // lea
-            string_builder_append_u8(&codegen->section_text, REX_W);
-            string_builder_append_u8(&codegen->section_text, 0x8D);
-            string_builder_append_u8(&codegen->section_text, ModRM(0, X64_RBX, X64_RBP /* RIP */));
+static void
+x64_set_value(Codegen *codegen, IrFunction *function, s32 index, X64Register reg)
+{
+    IrValue *value = function->values.items + index;
 
-            void *patch_addr = string_builder_append_size(&codegen->section_text, 4);
-            u64 instruction_offset = string_builder_get_size(&codegen->section_text);
+    if (value->location == IR_LOCATION_STACK)
+    {
+        x64_buffer_store(codegen, x64_spill_offset(codegen, value), reg);
+    }
+    else if (value->location == IR_LOCATION_REGISTER)
+    {
+        assert(value->reg == reg);
+    }
+}
 
-            x64_copy_from_register_to_stack(&codegen->section_text, (codegen->stack_committed - expr->stack_offset) + 0, X64_RAX, 8);
-            x64_copy_from_register_to_stack(&codegen->section_text, (codegen->stack_committed - expr->stack_offset) + 8, X64_RBX, 8);
+// Moves the values into the given registers, values on the stack are loaded after
+// the register moves so that they don't clobber any source.
+static void
+x64_move_values_to_registers(Codegen *codegen, IrFunction *function, s32 *values, const X64Register *dst_regs, s32 count)
+{
+    X64Register move_dst_regs[16];
+    X64Register move_src_regs[16];
+    s32 move_count = 0;
 
-            array_append(&codegen->patches, ((Patch) { .patch = patch_addr,
-                                                       .instruction_offset = instruction_offset,
-                                                       .string_offset = string_offset }));
-        } break;
+    for (s32 i = 0; i < count; i += 1)
+    {
+        IrValue *value = function->values.items + values[i];
 
-        case AST_KIND_IDENTIFIER:
+        if (value->location == IR_LOCATION_REGISTER)
         {
-            assert(expr->decl);
+            move_dst_regs[move_count] = dst_regs[i];
+            move_src_regs[move_count] = (X64Register) value->reg;
+            move_count += 1;
+        }
+    }
 
-            Ast *decl = expr->decl;
+    x64_parallel_move(codegen, move_dst_regs, move_src_regs, move_count);
 
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+    for (s32 i = 0; i < count; i += 1)
+    {
+        IrValue *value = function->values.items + values[i];
 
-            u64 stack_size = datatype->size;
+        if (value->location == IR_LOCATION_STACK)
+        {
+            x64_buffer_load(codegen, dst_regs[i], x64_spill_offset(codegen, value));
+        }
+    }
+}
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+// The opposite of x64_move_values_to_registers, values on the stack are stored first.
+static void
+x64_move_registers_to_values(Codegen *codegen, IrFunction *function, s32 *values, const X64Register *src_regs, s32 count)
+{
+    X64Register move_dst_regs[16];
+    X64Register move_src_regs[16];
+    s32 move_count = 0;
 
-            x64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset,
-                                         codegen->stack_committed - decl->stack_offset, datatype->size);
-        } break;
+    for (s32 i = 0; i < count; i += 1)
+    {
+        IrValue *value = function->values.items + values[i];
 
-        case AST_KIND_EXPRESSION_EQUAL:
-        case AST_KIND_EXPRESSION_NOT_EQUAL:
-        case AST_KIND_EXPRESSION_COMPARE_LESS:
-        case AST_KIND_EXPRESSION_COMPARE_GREATER:
-        case AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL:
-        case AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL:
+        if (value->location == IR_LOCATION_STACK)
         {
-            x64_emit_expression(compiler, codegen, expr->left_expr, target_platform);
-            x64_emit_expression(compiler, codegen, expr->right_expr, target_platform);
+            x64_buffer_store(codegen, x64_spill_offset(codegen, value), src_regs[i]);
+        }
+        else if (value->location == IR_LOCATION_REGISTER)
+        {
+            move_dst_regs[move_count] = (X64Register) value->reg;
+            move_src_regs[move_count] = src_regs[i];
+            move_count += 1;
+        }
+    }
 
-            Datatype *left_datatype  = get_datatype(&compiler->datatypes, expr->left_expr->type_id);
-            Datatype *right_datatype = get_datatype(&compiler->datatypes, expr->right_expr->type_id);
+    x64_parallel_move(codegen, move_dst_regs, move_src_regs, move_count);
+}
 
-            u64 max_datatype_size = left_datatype->size;
+// Frees the frame and restores the callee-saved registers.
+static void
+x64_emit_epilogue(Codegen *codegen, IrFunction *function)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            if (right_datatype->size > max_datatype_size)
-            {
-                max_datatype_size = right_datatype->size;
-            }
+    if (codegen->frame_size > 0)
+    {
+        x64_buffer_adjust_stack(codegen, codegen->frame_size);
+    }
 
-            u64 left_stack_size = left_datatype->size;
-            u64 right_stack_size = right_datatype->size;
+    x64_flush(codegen);
 
-            assert(expr->type_id == compiler->basetype_bool);
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+    for (s32 i = ArrayCount(x64_callee_saved_registers) - 1; i >= 0; i -= 1)
+    {
+        X64Register reg = x64_callee_saved_registers[i];
 
-            u64 stack_size = datatype->size;
+        if (function->used_callee_saved_registers & ((u64) 1 << reg))
+        {
+            x64_pop_register(builder, reg);
+        }
+    }
+}
 
-            assert(expr->right_expr->stack_offset == codegen->stack_allocated);
-            assert(expr->left_expr->stack_offset == (codegen->stack_allocated - right_datatype->size));
-            x64_copy_from_stack_to_register(&codegen->section_text, X64_RBX, codegen->stack_committed - expr->right_expr->stack_offset, right_datatype->size);
-            x64_copy_from_stack_to_register(&codegen->section_text, X64_RAX, codegen->stack_committed - expr->left_expr->stack_offset, left_datatype->size);
+// Sets the flags for the condition of a compare or a branch instruction.
+static void
+x64_emit_compare(Codegen *codegen, IrFunction *function, IrInstruction *instruction)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            pop_stack(codegen, right_stack_size);
-            pop_stack(codegen, left_stack_size);
+    X64Register a_reg = x64_get_value(codegen, function, instruction->a, X64_R10);
 
-            // TODO: maybe sign extend arguments
+    if (instruction->has_immediate)
+    {
+        s64 immediate = x64_sign_extend(instruction->immediate, instruction->size);
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+        x64_flush(codegen);
 
-            s64 dst_stack_offset = codegen->stack_committed - expr->stack_offset;
+        if ((immediate == 0) && (instruction->size == 1) &&
+            ((instruction->condition == IR_CONDITION_EQUAL) || (instruction->condition == IR_CONDITION_NOT_EQUAL)))
+        {
+            x64_test_byte_register(builder, a_reg);
+        }
+        else if (x64_fits_immediate(immediate, 8))
+        {
+            x64_alu_immediate(builder, X64_ALU_CMP, a_reg, immediate, instruction->size);
+        }
+        else
+        {
+            x64_move_immediate_into_register(builder, X64_R11, immediate);
+            x64_compare_registers(builder, a_reg, X64_R11, instruction->size);
+        }
+    }
+    else
+    {
+        X64Register b_reg = x64_get_value(codegen, function, instruction->b, X64_R11);
 
-            x64_compare_registers(&codegen->section_text, X64_RAX, X64_RBX, max_datatype_size);
+        x64_flush(codegen);
+        x64_compare_registers(builder, a_reg, b_reg, instruction->size);
+    }
+}
 
-            bool is_signed = true; // TODO:
+static void
+x64_emit_instruction(Codegen *codegen, IrFunction *function, IrInstruction *instruction, JulsPlatform target_platform)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            if (is_signed)
-            {
-                if (expr->kind == AST_KIND_EXPRESSION_EQUAL)
-                {
-                    x64_setcc(&codegen->section_text, 0x94, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_NOT_EQUAL)
-                {
-                    x64_setcc(&codegen->section_text, 0x95, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_LESS)
-                {
-                    x64_setcc(&codegen->section_text, 0x9C, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_GREATER)
-                {
-                    x64_setcc(&codegen->section_text, 0x9F, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL)
-                {
-                    x64_setcc(&codegen->section_text, 0x9E, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL)
-                {
-                    x64_setcc(&codegen->section_text, 0x9D, dst_stack_offset);
-                }
-            }
-            else
-            {
-                if (expr->kind == AST_KIND_EXPRESSION_EQUAL)
-                {
-                    x64_setcc(&codegen->section_text, 0x94, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_NOT_EQUAL)
-                {
-                    x64_setcc(&codegen->section_text, 0x95, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_LESS)
-                {
-                    x64_setcc(&codegen->section_text, 0x92, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_GREATER)
-                {
-                    x64_setcc(&codegen->section_text, 0x97, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_LESS_EQUAL)
-                {
-                    x64_setcc(&codegen->section_text, 0x96, dst_stack_offset);
-                }
-                else if (expr->kind == AST_KIND_EXPRESSION_COMPARE_GREATER_EQUAL)
-                {
-                    x64_setcc(&codegen->section_text, 0x93, dst_stack_offset);
-                }
-            }
+    switch (instruction->opcode)
+    {
+        case IR_OP_NOP:
+        {
         } break;
 
-        case AST_KIND_EXPRESSION_BINOP_ADD:
-        case AST_KIND_EXPRESSION_BINOP_MINUS:
+        case IR_OP_CONSTANT:
         {
-            x64_emit_expression(compiler, codegen, expr->left_expr, target_platform);
-            x64_emit_expression(compiler, codegen, expr->right_expr, target_platform);
-
-            Datatype *left_datatype  = get_datatype(&compiler->datatypes, expr->left_expr->type_id);
-            Datatype *right_datatype = get_datatype(&compiler->datatypes, expr->right_expr->type_id);
+            X64Register dst_reg = x64_get_result_register(function, instruction->dst, X64_R10);
+            x64_buffer_move_immediate(codegen, dst_reg, (u64) instruction->immediate);
+            x64_set_value(codegen, function, instruction->dst, dst_reg);
+        } break;
 
-            u64 left_stack_size = left_datatype->size;
-            u64 right_stack_size = right_datatype->size;
+        case IR_OP_STRING_ADDRESS:
+        {
+            u64 string_offset = string_builder_get_size(&codegen->section_cstring);
+            string_builder_append_string(&codegen->section_cstring, instruction->string);
 
-            assert(expr->type_id);
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
+            X64Register dst_reg = x64_get_result_register(function, instruction->dst, X64_R10);
 
-            u64 stack_size = datatype->size;
+            x64_flush(codegen);
 
-            assert(expr->right_expr->stack_offset == codegen->stack_allocated);
-            assert(expr->left_expr->stack_offset == (codegen->stack_allocated - right_datatype->size));
-            x64_copy_from_stack_to_register(&codegen->section_text, X64_RBX, codegen->stack_committed - expr->right_expr->stack_offset, right_datatype->size);
-            x64_copy_from_stack_to_register(&codegen->section_text, X64_RAX, codegen->stack_committed - expr->left_expr->stack_offset, left_datatype->size);
+            u64 patch_offset = x64_load_rip_relative_address(builder, dst_reg);
+            u64 instruction_offset = string_builder_get_size(builder);
 
-            pop_stack(codegen, right_stack_size);
-            pop_stack(codegen, left_stack_size);
+            array_append(&codegen->patches, ((Patch) { .patch_offset = patch_offset,
+                                                       .instruction_offset = instruction_offset,
+                                                       .string_offset = string_offset }));
 
-            // TODO: maybe sign extend arguments
+            x64_set_value(codegen, function, instruction->dst, dst_reg);
+        } break;
 
-            expr->stack_offset = push_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+        case IR_OP_COPY:
+        case IR_OP_EXTEND:
+        {
+            X64Register dst_reg = x64_get_result_register(function, instruction->dst, X64_R10);
+            X64Register a_reg = x64_get_value(codegen, function, instruction->a, dst_reg);
 
-            if (expr->kind == AST_KIND_EXPRESSION_BINOP_ADD)
+            if (a_reg != dst_reg)
             {
-                x64_add_registers(&codegen->section_text, X64_RAX, X64_RBX, datatype->size);
+                x64_buffer_move(codegen, dst_reg, a_reg);
             }
-            else
+
+            if (instruction->opcode == IR_OP_EXTEND)
             {
-                assert(expr->kind == AST_KIND_EXPRESSION_BINOP_MINUS);
-                x64_subtract_registers(&codegen->section_text, X64_RAX, X64_RBX, datatype->size);
+                x64_flush(codegen);
+                x64_extend_register(builder, dst_reg, instruction->size, instruction->is_signed);
             }
 
-            x64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, X64_RAX, datatype->size);
+            x64_set_value(codegen, function, instruction->dst, dst_reg);
         } break;
 
-        case AST_KIND_FUNCTION_CALL:
+        case IR_OP_ADD:
+        case IR_OP_SUB:
         {
-            assert(expr->left_expr);
+            X64AluOperation operation = (instruction->opcode == IR_OP_ADD) ? X64_ALU_ADD : X64_ALU_SUB;
+
+            // only the lower bytes matter, so small operations are done with 32 bits
+            u64 size = (instruction->size == 8) ? 8 : 4;
 
-            Ast *left = expr->left_expr;
+            X64Register dst_reg = x64_get_result_register(function, instruction->dst, X64_R10);
 
-            if (left->kind == AST_KIND_IDENTIFIER)
+            if (instruction->has_immediate)
             {
-                assert(expr->decl);
+                X64Register a_reg = x64_get_value(codegen, function, instruction->a, dst_reg);
 
-                Datatype *return_type = get_datatype(&compiler->datatypes, expr->decl->type_id);
+                if (a_reg != dst_reg)
+                {
+                    x64_buffer_move(codegen, dst_reg, a_reg);
+                }
 
-                u64 return_type_stack_size = return_type->size;
+                s64 immediate = x64_sign_extend(instruction->immediate, instruction->size);
 
-                expr->stack_offset = push_stack(codegen, return_type_stack_size);
+                if (x64_fits_immediate(immediate, 8))
+                {
+                    x64_flush(codegen);
+                    x64_alu_immediate(builder, operation, dst_reg, immediate, size);
+                }
+                else
+                {
+                    x64_buffer_move_immediate(codegen, X64_R11, immediate);
+                    x64_flush(codegen);
+                    x64_alu_registers(builder, operation, dst_reg, X64_R11, size);
+                }
             }
             else
             {
-                assert(!"not implemented");
-            }
-
-            u64 arguments_stack_size = 0;
-
-            For(argument, expr->children.first)
-            {
-                // TODO: does the size match the expression?
-                x64_emit_expression(compiler, codegen, argument, target_platform);
-
-                Datatype *datatype = get_datatype(&compiler->datatypes, argument->type_id);
-
-                u64 stack_size = datatype->size;
-                arguments_stack_size += stack_size;
-            }
+                X64Register b_reg = x64_get_value(codegen, function, instruction->b, X64_R11);
+                X64Register a_reg = x64_get_value(codegen, function, instruction->a, (b_reg == dst_reg) ? X64_R10 : dst_reg);
 
-            if (left->kind == AST_KIND_IDENTIFIER)
-            {
-                if (strings_are_equal(left->name, S("exit")))
+                if ((b_reg == dst_reg) && (a_reg != dst_reg))
                 {
-                    assert(ast_list_count(&expr->children) == 1);
-
-                    Ast *first_argument = expr->children.first;
+                    x64_flush(codegen);
 
-                    if ((target_platform == JulsPlatformAndroid) ||
-                        (target_platform == JulsPlatformLinux))
-                    {
-                        x64_move_immediate32_unsigned_into_register(&codegen->section_text, X64_RAX, 60);
-                        x64_copy_from_stack_to_register(&codegen->section_text, X64_RDI, codegen->stack_committed - first_argument->stack_offset, 4);
-                        x64_syscall(&codegen->section_text);
-                    }
-                    else if (target_platform == JulsPlatformMacOs)
+                    // dst = a - dst is the same as dst = -dst + a
+                    if (operation == X64_ALU_SUB)
                     {
-                        x64_move_immediate32_unsigned_into_register(&codegen->section_text, X64_RAX, 0x02000001);
-                        x64_copy_from_stack_to_register(&codegen->section_text, X64_RDI, codegen->stack_committed - first_argument->stack_offset, 4);
-                        x64_syscall(&codegen->section_text);
+                        x64_negate_register(builder, dst_reg);
                     }
-                }
-                else if (strings_are_equal(left->name, S("write")))
-                {
-                    assert(ast_list_count(&expr->children) == 3);
 
-                    Ast *first_argument  = expr->children.first;
-                    Ast *second_argument = first_argument->next;
-                    Ast *third_argument  = second_argument->next;
-
-                    if ((target_platform == JulsPlatformAndroid) ||
-                        (target_platform == JulsPlatformLinux))
-                    {
-                        x64_move_immediate32_unsigned_into_register(&codegen->section_text, X64_RAX, 1);
-                        x64_copy_from_stack_to_register(&codegen->section_text, X64_RDI, codegen->stack_committed -  first_argument->stack_offset, 4);
-                        x64_copy_from_stack_to_register(&codegen->section_text, X64_RSI, codegen->stack_committed - second_argument->stack_offset, 8);
-                        x64_copy_from_stack_to_register(&codegen->section_text, X64_RDX, codegen->stack_committed -  third_argument->stack_offset, 8);
-                        x64_syscall(&codegen->section_text);
-                    }
-                    else if (target_platform == JulsPlatformMacOs)
-                    {
-                        x64_move_immediate32_unsigned_into_register(&codegen->section_text, X64_RAX, 0x02000004);
-                        x64_copy_from_stack_to_register(&codegen->section_text, X64_RDI, codegen->stack_committed -  first_argument->stack_offset, 4);
-                        x64_copy_from_stack_to_register(&codegen->section_text, X64_RSI, codegen->stack_committed - second_argument->stack_offset, 8);
-                        x64_copy_from_stack_to_register(&codegen->section_text, X64_RDX, codegen->stack_committed -  third_argument->stack_offset, 8);
-                        x64_syscall(&codegen->section_text);
-                    }
+                    x64_alu_registers(builder, X64_ALU_ADD, dst_reg, a_reg, size);
                 }
                 else
                 {
-                    assert(expr->decl);
-
-                    string_builder_append_u8(&codegen->section_text, 0xE8);
-
-                    if (expr->decl->address == S64MAX)
-                    {
-                        void *patch_addr = string_builder_append_size(&codegen->section_text, 4);
-                        u64 instruction_offset = string_builder_get_size(&codegen->section_text);
-
-                        array_append(&codegen->function_call_patches,
-                                     ((FunctionCallPatch) { .patch = patch_addr,
-                                                            .instruction_offset = instruction_offset,
-                                                            .function_decl = expr->decl }));
-                    }
-                    else
+                    if (a_reg != dst_reg)
                     {
-                        s64 jump_offset = string_builder_get_size(&codegen->section_text) + 4;
-                        string_builder_append_u32le(&codegen->section_text, (u32) (expr->decl->address - jump_offset));
+                        x64_buffer_move(codegen, dst_reg, a_reg);
                     }
 
+                    x64_flush(codegen);
+                    x64_alu_registers(builder, operation, dst_reg, b_reg, size);
                 }
             }
-            else
-            {
-                assert(!"not implemented");
-            }
 
-            pop_stack(codegen, arguments_stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+            x64_set_value(codegen, function, instruction->dst, dst_reg);
         } break;
 
-        case AST_KIND_ASSIGN:
-        case AST_KIND_PLUS_ASSIGN:
-        case AST_KIND_MINUS_ASSIGN:
-        // case AST_KIND_MUL_ASSIGN:
-        // case AST_KIND_DIV_ASSIGN:
-        // case AST_KIND_OR_ASSIGN:
-        // case AST_KIND_AND_ASSIGN:
-        // case AST_KIND_XOR_ASSIGN:
+        case IR_OP_COMPARE:
         {
-            assert(expr->decl);
-
-            Ast *decl = expr->decl;
-
-            assert(decl->stack_offset > 0);
-
-            Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
-            Datatype *right_datatype = get_datatype(&compiler->datatypes, expr->right_expr->type_id);
-
-            if (expr->kind == AST_KIND_ASSIGN)
-            {
-                x64_emit_expression(compiler, codegen, expr->right_expr, target_platform);
-                assert(expr->right_expr->stack_offset == codegen->stack_allocated);
-                x64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - decl->stack_offset,
-                                             codegen->stack_committed - expr->right_expr->stack_offset, datatype->size);
-
-                expr->stack_offset = expr->right_expr->stack_offset;
-            }
-            else
-            {
-                x64_emit_expression(compiler, codegen, expr->right_expr, target_platform);
-                assert(expr->right_expr->stack_offset == codegen->stack_allocated);
-                x64_copy_from_stack_to_register(&codegen->section_text, X64_RBX, codegen->stack_committed - expr->right_expr->stack_offset, right_datatype->size);
-                x64_copy_from_stack_to_register(&codegen->section_text, X64_RAX, codegen->stack_committed - decl->stack_offset, datatype->size);
-
-                expr->stack_offset = expr->right_expr->stack_offset;
-
-                // TODO: maybe sign extend arguments
-
-                if (expr->kind == AST_KIND_PLUS_ASSIGN)
-                {
-                    x64_add_registers(&codegen->section_text, X64_RAX, X64_RBX, datatype->size);
-                }
-                else
-                {
-                    assert(expr->kind == AST_KIND_MINUS_ASSIGN);
-                    x64_subtract_registers(&codegen->section_text, X64_RAX, X64_RBX, datatype->size);
-                }
+            x64_emit_compare(codegen, function, instruction);
 
-                x64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - decl->stack_offset, X64_RAX, datatype->size);
-                x64_copy_from_register_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset, X64_RAX, datatype->size);
-            }
+            X64Register dst_reg = x64_get_result_register(function, instruction->dst, X64_R10);
+            x64_setcc(builder, x64_get_condition(instruction->condition, instruction->is_signed), dst_reg);
+            x64_set_value(codegen, function, instruction->dst, dst_reg);
         } break;
 
-        case AST_KIND_MEMBER:
+        case IR_OP_LABEL:
         {
-            if (expr->left_expr->type_id == compiler->basetype_string)
-            {
-                if (strings_are_equal(expr->name, S("count")) ||
-                    strings_are_equal(expr->name, S("data")))
-                {
-                    Datatype *left_datatype = get_datatype(&compiler->datatypes, expr->left_expr->type_id);
-                    Datatype *datatype = get_datatype(&compiler->datatypes, expr->type_id);
-
-                    u64 left_stack_size = left_datatype->size;
-                    u64 stack_size = datatype->size;
-
-                    expr->stack_offset = push_stack(codegen, stack_size);
-                    x64_commit_stack(codegen, &codegen->section_text);
-
-                    x64_emit_expression(compiler, codegen, expr->left_expr, target_platform);
-
-                    if (strings_are_equal(expr->name, S("count")))
-                    {
-                        x64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset,
-                                                     (codegen->stack_committed - expr->left_expr->stack_offset) + 0, datatype->size);
-                    }
-                    else if (strings_are_equal(expr->name, S("data")))
-                    {
-                        x64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - expr->stack_offset,
-                                                     (codegen->stack_committed - expr->left_expr->stack_offset) + 8, datatype->size);
-                    }
-
-                    pop_stack(codegen, left_stack_size);
-                    x64_commit_stack(codegen, &codegen->section_text);
-                }
-                else
-                {
-                    assert(!"not supported");
-                }
-            }
-            else
-            {
-                assert(!"not supported");
-            }
+            x64_flush(codegen);
+            codegen->label_offsets.items[instruction->label] = string_builder_get_size(builder);
         } break;
 
-        case AST_KIND_CAST:
+        case IR_OP_JUMP:
         {
-            x64_emit_expression(compiler, codegen, expr->left_expr, target_platform);
-            x64_emit_cast(compiler, codegen, expr->left_expr->type_id, expr->type_id);
-
-            // TODO: hack
-            expr->stack_offset = codegen->stack_allocated;
+            x64_jump_to_label(codegen, X64_CONDITION_E, false, instruction->label);
         } break;
 
-        default:
+        case IR_OP_BRANCH:
         {
-            printf("kind = %u\n", expr->kind);
-            assert(!"expression not supported");
+            x64_emit_compare(codegen, function, instruction);
+            x64_jump_to_label(codegen, x64_get_condition(instruction->condition, instruction->is_signed), true, instruction->label);
         } break;
-    }
-}
 
-static void
-x64_emit_statement(Compiler *compiler, Codegen *codegen, Ast *statement, JulsPlatform target_platform,
-                   Datatype *return_type, s64 return_value_stack_offset)
-{
-    switch (statement->kind)
-    {
-        case AST_KIND_VARIABLE_DECLARATION:
+        case IR_OP_CALL:
         {
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->type_id);
+            s32 *results = function->operands.items + instruction->first_operand;
+            s32 *arguments = results + instruction->result_count;
 
-            statement->stack_offset = allocate_stack(codegen, datatype->size);
+            s32 register_count = instruction->argument_count;
 
-            if (statement->right_expr)
+            if (register_count > ArrayCount(x64_argument_registers))
             {
-                Datatype *right_datatype = get_datatype(&compiler->datatypes, statement->right_expr->type_id);
+                register_count = ArrayCount(x64_argument_registers);
+            }
 
-                u64 right_stack_size = right_datatype->size;
+            for (s32 i = register_count; i < instruction->argument_count; i += 1)
+            {
+                X64Register reg = x64_get_value(codegen, function, arguments[i], X64_R10);
+                x64_buffer_store(codegen, 8 * (i - register_count), reg);
+            }
 
-                x64_emit_expression(compiler, codegen, statement->right_expr, target_platform);
+            x64_move_values_to_registers(codegen, function, arguments, x64_argument_registers, register_count);
 
-                assert(statement->right_expr->stack_offset == codegen->stack_allocated);
-                // TODO: does the size match the expression?
-                x64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - statement->stack_offset,
-                                             codegen->stack_committed - statement->right_expr->stack_offset, datatype->size);
+            x64_call(codegen, instruction->function, false);
 
-                pop_stack(codegen, right_stack_size);
-                x64_commit_stack(codegen, &codegen->section_text);
-            }
+            x64_move_registers_to_values(codegen, function, results, x64_return_registers, instruction->result_count);
         } break;
 
-        case AST_KIND_IF:
+        case IR_OP_INTRINSIC:
         {
-            x64_emit_expression(compiler, codegen, statement->left_expr, target_platform);
-
-            assert(statement->left_expr->type_id == compiler->basetype_bool);
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->left_expr->type_id);
-
-            u64 stack_size = datatype->size;
-
-            assert(statement->left_expr->stack_offset == codegen->stack_allocated);
-            x64_copy_from_stack_to_register(&codegen->section_text, X64_RAX, codegen->stack_committed - statement->left_expr->stack_offset, datatype->size);
-
-            pop_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
-
-            x64_compare_al_to_zero(&codegen->section_text, X64_RAX);
+            s32 *results = function->operands.items + instruction->first_operand;
+            s32 *arguments = results + instruction->result_count;
 
-            // JE
-            string_builder_append_u8(&codegen->section_text, 0x0F);
-            string_builder_append_u8(&codegen->section_text, 0x84);
-            s32 *else_patch = string_builder_append_size(&codegen->section_text, 4);
-            s64 else_offset = string_builder_get_size(&codegen->section_text);
+            static const X64Register syscall_registers[] = { X64_RDI, X64_RSI, X64_RDX };
 
-            Ast *if_code = statement->children.first;
-            Ast *else_code = 0;
+            u32 syscall_number = 0;
 
-            if (statement->children.first != statement->children.last)
+            if ((target_platform == JulsPlatformAndroid) ||
+                (target_platform == JulsPlatformLinux))
             {
-                else_code = statement->children.last;
+                syscall_number = (instruction->intrinsic == IR_INTRINSIC_EXIT) ? 60 : 1;
             }
-
-            push_scope(codegen);
-
-            x64_emit_statement(compiler, codegen, if_code, target_platform, return_type, return_value_stack_offset);
-
-            pop_scope(codegen);
-            x64_commit_stack(codegen, &codegen->section_text);
-
-            s32 *end_patch = 0;
-
-            if (else_code)
+            else if (target_platform == JulsPlatformMacOs)
             {
-                // JMP
-                string_builder_append_u8(&codegen->section_text, 0xE9);
-                end_patch = string_builder_append_size(&codegen->section_text, 4);
+                syscall_number = (instruction->intrinsic == IR_INTRINSIC_EXIT) ? 0x02000001 : 0x02000004;
             }
 
-            s64 else_target = string_builder_get_size(&codegen->section_text);
-            *else_patch = (s32) (else_target - else_offset);
-
-            s64 end_offset = else_target;
-
-            if (else_code)
+            if (syscall_number)
             {
-                push_scope(codegen);
-
-                x64_emit_statement(compiler, codegen, else_code, target_platform, return_type, return_value_stack_offset);
+                assert(instruction->argument_count <= ArrayCount(syscall_registers));
 
-                pop_scope(codegen);
-                x64_commit_stack(codegen, &codegen->section_text);
+                x64_move_values_to_registers(codegen, function, arguments, syscall_registers, instruction->argument_count);
+                x64_buffer_move_immediate(codegen, X64_RAX, syscall_number);
+                x64_flush(codegen);
+                x64_syscall(builder);
 
-                s64 end_target = string_builder_get_size(&codegen->section_text);
-                *end_patch = (s32) (end_target - end_offset);
+                x64_move_registers_to_values(codegen, function, results, x64_return_registers, instruction->result_count);
             }
         } break;
 
-        case AST_KIND_FOR:
+        case IR_OP_RETURN:
         {
-            push_scope(codegen);
+            s32 *values = function->operands.items + instruction->first_operand;
 
-            x64_emit_statement(compiler, codegen, statement->decl, target_platform, return_type, return_value_stack_offset);
+            assert(instruction->argument_count <= ArrayCount(x64_return_registers));
 
-            s64 start_target = string_builder_get_size(&codegen->section_text);
-
-            x64_emit_expression(compiler, codegen, statement->left_expr, target_platform);
-
-            assert(statement->left_expr->type_id == compiler->basetype_bool);
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->left_expr->type_id);
-
-            u64 stack_size = datatype->size;
-
-            assert(statement->left_expr->stack_offset == codegen->stack_allocated);
-            x64_copy_from_stack_to_register(&codegen->section_text, X64_RAX, codegen->stack_committed - statement->left_expr->stack_offset, datatype->size);
+            x64_move_values_to_registers(codegen, function, values, x64_return_registers, instruction->argument_count);
+            x64_emit_epilogue(codegen, function);
+            x64_ret(builder);
+        } break;
 
-            pop_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+        case IR_OP_TAIL_CALL:
+        {
+            s32 *arguments = function->operands.items + instruction->first_operand;
 
-            x64_compare_al_to_zero(&codegen->section_text, X64_RAX);
+            assert(instruction->argument_count <= ArrayCount(x64_argument_registers));
 
-            // JE
-            string_builder_append_u8(&codegen->section_text, 0x0F);
-            string_builder_append_u8(&codegen->section_text, 0x84);
-            s32 *end_patch = string_builder_append_size(&codegen->section_text, 4);
-            s64 end_offset = string_builder_get_size(&codegen->section_text);
+            // the argument registers are caller-saved, so the epilogue leaves them alone
+            x64_move_values_to_registers(codegen, function, arguments, x64_argument_registers, instruction->argument_count);
+            x64_emit_epilogue(codegen, function);
+            x64_call(codegen, instruction->function, true);
+        } break;
+    }
+}
 
-            x64_emit_statement(compiler, codegen, statement->children.first, target_platform, return_type, return_value_stack_offset);
-            x64_emit_expression(compiler, codegen, statement->right_expr, target_platform);
+static void
+x64_get_register_info(IrRegisterInfo *info)
+{
+    info->caller_saved_count = ArrayCount(x64_caller_saved_registers);
+    info->callee_saved_count = ArrayCount(x64_callee_saved_registers);
+    info->argument_register_count = ArrayCount(x64_argument_registers);
+    info->return_register_count = ArrayCount(x64_return_registers);
+
+    for (s32 i = 0; i < info->caller_saved_count; i += 1)     info->caller_saved[i] = x64_caller_saved_registers[i];
+    for (s32 i = 0; i < info->callee_saved_count; i += 1)     info->callee_saved[i] = x64_callee_saved_registers[i];
+    for (s32 i = 0; i < info->argument_register_count; i += 1) info->argument_registers[i] = x64_argument_registers[i];
+    for (s32 i = 0; i < info->return_register_count; i += 1)   info->return_registers[i] = x64_return_registers[i];
+}
 
-            Datatype *right_datatype = get_datatype(&compiler->datatypes, statement->right_expr->type_id);
+static void
+x64_emit_function(Codegen *codegen, IrFunction *function, JulsPlatform target_platform)
+{
+    StringBuilder *builder = &codegen->section_text;
 
-            u64 right_stack_size = right_datatype->size;
+    Ast *func = function->decl;
+    ast_get_function(func)->address = string_builder_get_size(builder);
 
-            pop_stack(codegen, right_stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+    IrRegisterInfo register_info;
+    x64_get_register_info(&register_info);
 
-            string_builder_append_u8(&codegen->section_text, 0xE9);
-            s32 *start_patch = string_builder_append_size(&codegen->section_text, 4);
-            s64 start_offset = string_builder_get_size(&codegen->section_text);
-            *start_patch = (start_target - start_offset);
+    ir_allocate_registers(function, &register_info);
 
-            s64 end_target = string_builder_get_size(&codegen->section_text);
-            *end_patch = (s32) (end_target - end_offset);
+    s64 saved_registers_size = 0;
 
-            pop_scope(codegen);
-            x64_commit_stack(codegen, &codegen->section_text);
-        } break;
+    for (s32 i = 0; i < ArrayCount(x64_callee_saved_registers); i += 1)
+    {
+        X64Register reg = x64_callee_saved_registers[i];
 
-        case AST_KIND_RETURN:
+        if (function->used_callee_saved_registers & ((u64) 1 << reg))
         {
-            assert(statement->left_expr);
-
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->left_expr->type_id);
-
-            u64 stack_size = datatype->size;
+            x64_push_register(builder, reg);
+            saved_registers_size += 8;
+        }
+    }
 
-            x64_emit_expression(compiler, codegen, statement->left_expr, target_platform);
+    s64 frame_size = 8 * (function->stack_argument_count + function->spill_slot_count);
 
-            assert(statement->left_expr->stack_offset == codegen->stack_allocated);
-            x64_copy_from_stack_to_stack(&codegen->section_text, codegen->stack_committed - return_value_stack_offset,
-                                         codegen->stack_committed - statement->left_expr->stack_offset, return_type->size);
+    codegen->spill_area_offset = 8 * function->stack_argument_count;
 
-            pop_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
+    if (function->has_calls)
+    {
+        // keep the stack aligned to 16 bytes at every call
+        frame_size = Align(frame_size + saved_registers_size + 8, 16) - (saved_registers_size + 8);
+    }
+    else if ((target_platform != JulsPlatformWindows) && (frame_size <= 128))
+    {
+        // leaf functions keep their spill slots in the 128 bytes below rsp, the red zone of the system v abi
+        codegen->spill_area_offset = -frame_size;
+        frame_size = 0;
+    }
 
-            assert(codegen->stack_scope_index > 0);
-            assert(codegen->stack_allocated == codegen->stack_scopes[codegen->stack_scope_index]);
+    codegen->frame_size = frame_size;
 
-            if (codegen->stack_committed > 0)
-            {
-                assert(codegen->stack_committed <= 0xFFFFFFFF);
-                x64_add_immediate32_unsigned_to_register(&codegen->section_text, X64_RSP, (u32) codegen->stack_committed);
-            }
+    if (frame_size > 0)
+    {
+        x64_buffer_adjust_stack(codegen, -frame_size);
+    }
 
-            x64_ret(&codegen->section_text);
-        } break;
+    // move the parameters from the argument registers and the stack to where they were allocated
+    s32 register_count = function->parameters.count;
 
-        case AST_KIND_BLOCK:
-        {
-            push_scope(codegen);
+    if (register_count > ArrayCount(x64_argument_registers))
+    {
+        register_count = ArrayCount(x64_argument_registers);
+    }
 
-            For(stmt, statement->children.first)
-            {
-                x64_emit_statement(compiler, codegen, stmt, target_platform, return_type, return_value_stack_offset);
-            }
+    x64_move_registers_to_values(codegen, function, function->parameters.items, x64_argument_registers, register_count);
 
-            pop_scope(codegen);
-            x64_commit_stack(codegen, &codegen->section_text);
-        } break;
+    for (s32 i = register_count; i < function->parameters.count; i += 1)
+    {
+        IrValue *value = function->values.items + function->parameters.items[i];
 
-        default:
+        if (value->location != IR_LOCATION_NONE)
         {
-            x64_emit_expression(compiler, codegen, statement, target_platform);
-
-            Datatype *datatype = get_datatype(&compiler->datatypes, statement->type_id);
-            u64 stack_size = datatype->size;
+            s64 stack_offset = frame_size + saved_registers_size + 8 + 8 * (i - register_count);
 
-            pop_stack(codegen, stack_size);
-            x64_commit_stack(codegen, &codegen->section_text);
-        } break;
+            X64Register reg = x64_get_result_register(function, function->parameters.items[i], X64_R10);
+            x64_buffer_load(codegen, reg, stack_offset);
+            x64_set_value(codegen, function, function->parameters.items[i], reg);
+        }
     }
-}
-
-static void
-x64_emit_function(Compiler *compiler, Codegen *codegen, Ast *func, JulsPlatform target_platform)
-{
-    assert(func->kind == AST_KIND_FUNCTION_DECLARATION);
 
-    func->address = string_builder_get_size(&codegen->section_text);
+    codegen->label_offsets.count = 0;
+    codegen->label_patches.count = 0;
 
-    codegen->stack_allocated = 0;
-    codegen->stack_committed = 0;
-    codegen->stack_scopes[0] = 0;
-    codegen->stack_scope_index = 0;
-
-    s64 stack_offset = 0;
-
-    // that's the return address
-    stack_offset -= 8;
-
-    ForReversed(parameter, func->parameters.last)
+    for (s32 i = 0; i < function->label_count; i += 1)
     {
-        Datatype *datatype = get_datatype(&compiler->datatypes, parameter->type_id);
-        u64 stack_size = datatype->size;
-
-        parameter->stack_offset = stack_offset;
-        stack_offset -= stack_size;
+        array_append(&codegen->label_offsets, -1);
     }
 
-    Datatype *return_type = get_datatype(&compiler->datatypes, func->type_id);
-
-    s64 return_value_stack_offset = stack_offset;
-
-    push_scope(codegen);
-
-    For(statement, func->children.first)
+    for (s32 i = 0; i < function->instructions.count; i += 1)
     {
-        x64_emit_statement(compiler, codegen, statement, target_platform, return_type, return_value_stack_offset);
+        x64_emit_instruction(codegen, function, function->instructions.items + i, target_platform);
     }
 
-    pop_scope(codegen);
-    assert(codegen->stack_scope_index == 0);
+    x64_flush(codegen);
 
-    if (!func->type_def)
+    for (s32 i = 0; i < codegen->label_patches.count; i += 1)
     {
-        x64_commit_stack(codegen, &codegen->section_text);
-        x64_ret(&codegen->section_text);
+        LabelPatch *patch = codegen->label_patches.items + i;
+        s64 label_offset = codegen->label_offsets.items[patch->label];
+
+        assert(label_offset >= 0);
+
+        s32 displacement = (s32) (label_offset - patch->instruction_offset);
+        memcpy(string_builder_get_pointer(&codegen->section_text, patch->patch_offset), &displacement, 4);
     }
 }
 
 static void
-generate_x64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table, JulsPlatform target_platform)
+generate_x64(IrProgram *program, Codegen *codegen, SymbolTable *symbol_table, JulsPlatform target_platform)
 {
     String entry_point_name = S("main");
 
     u64 jump_location = 0;
-    s32 *jump_patch = 0;
+    u64 jump_patch_offset = 0;
 
     u64 _start_offset = string_builder_get_size(&codegen->section_text);
 
@@ -1466,7 +1328,8 @@ generate_x64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table, Ju
     {
         // call main
         string_builder_append_u8(&codegen->section_text, 0xE8);
-        jump_patch = string_builder_append_size(&codegen->section_text, 4);
+        jump_patch_offset = string_builder_get_size(&codegen->section_text);
+        string_builder_append_u32le(&codegen->section_text, 0);
         jump_location = string_builder_get_size(&codegen->section_text);
 
         // mov rax, 231
@@ -1482,7 +1345,8 @@ generate_x64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table, Ju
     {
         // call main
         string_builder_append_u8(&codegen->section_text, 0xE8);
-        jump_patch = string_builder_append_size(&codegen->section_text, 4);
+        jump_patch_offset = string_builder_get_size(&codegen->section_text);
+        string_builder_append_u32le(&codegen->section_text, 0);
         jump_location = string_builder_get_size(&codegen->section_text);
 
         // mov rax, 42
@@ -1495,7 +1359,8 @@ generate_x64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table, Ju
     {
         // call main
         string_builder_append_u8(&codegen->section_text, 0xE8);
-        jump_patch = string_builder_append_size(&codegen->section_text, 4);
+        jump_patch_offset = string_builder_get_size(&codegen->section_text);
+        string_builder_append_u32le(&codegen->section_text, 0);
         jump_location = string_builder_get_size(&codegen->section_text);
 
         // mov rax, 0x02000001
@@ -1514,28 +1379,35 @@ generate_x64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table, Ju
 
     u64 jump_target = 0;
 
-    For(decl, compiler->global_declarations.children.first)
+    for (s32 i = 0; i < program->count; i += 1)
     {
-        if (decl->kind == AST_KIND_FUNCTION_DECLARATION)
+        IrFunction *function = program->items + i;
+        Ast *decl = function->decl;
+
+        u64 offset = string_builder_get_size(&codegen->section_text);
+
+        if (strings_are_equal(entry_point_name, ast_get_name(decl)))
         {
-            u64 offset = string_builder_get_size(&codegen->section_text);
+            jump_target = offset;
+        }
 
-            if (strings_are_equal(entry_point_name, decl->name))
-            {
-                jump_target = offset;
-            }
+        x64_emit_function(codegen, function, target_platform);
 
-            x64_emit_function(compiler, codegen, decl, target_platform);
+        u64 size = string_builder_get_size(&codegen->section_text) - offset;
 
-            u64 size = string_builder_get_size(&codegen->section_text) - offset;
+        array_append(symbol_table, ((SymbolEntry) { .name = ast_get_name(decl), .offset = offset, .size = size }));
 
-            array_append(symbol_table, ((SymbolEntry) { .name = decl->name, .offset = offset, .size = size }));
-        }
+        codegen_flush_text(codegen, JulsArchitectureX86_64);
+    }
+
+    if (codegen->print_peephole_stats)
+    {
+        peephole_print_stats(x64_peephole_rules, ArrayCount(x64_peephole_rules));
     }
 
     if (jump_target > 0)
     {
-        *jump_patch = (s32) (jump_target - jump_location);
+        codegen_patch_text_u32(codegen, jump_patch_offset, (u32) (jump_target - jump_location));
     }
     else
     {
@@ -1547,8 +1419,10 @@ generate_x64(Compiler *compiler, Codegen *codegen, SymbolTable *symbol_table, Ju
         FunctionCallPatch *patch = codegen->function_call_patches.items + i;
         Ast *function_decl = patch->function_decl;
 
-        assert(function_decl->address != S64MAX);
+        assert(ast_get_function(function_decl)->address != S64MAX);
 
-        *(s32 *) patch->patch = (s32) (function_decl->address - patch->instruction_offset);
+        codegen_patch_text_u32(codegen, patch->patch_offset, (u32) (ast_get_function(function_decl)->address - patch->instruction_offset));
     }
+
+    codegen_flush_text(codegen, JulsArchitectureX86_64);
 }